@@ -0,0 +1,248 @@
+"""Benchmark of the fwd / bwd / block-sparse kernels against a PyTorch reference.
+
+Each configuration prints one JSON line with the sizes, the latency (median over the repeats),
+the achieved TFLOP/s and the HBM GB/s of the compulsory traffic (reading the inputs and writing
+the outputs once), plus the GPU, CUDA and driver versions, so the results of several runs can be
+compared to track regressions. E.g.
+
+    python benchmarks/benchmark_stream_attn.py --headdim 64 128 --seqlen 512 2048 --causal 0 1 \
+        --output results.jsonl
+
+Kernels (--kernel):
+    stream:    stream_attn_func, the num_v values share one softmax.
+    separate:  num_v calls of stream_attn_func with a single value each, the cost of not sharing.
+    block:     stream_blocksparse_attn_func with a random blockmask of the given --density.
+    reference: the same attention written with PyTorch matmuls on the padded batch.
+
+The launchers pick between several kernel configs (e.g. V in registers or in shared memory) with
+STREAM_ATTN_AUTOTUNE=1, --autotune sets it. The autotuner appends the winner of each problem to
+STREAM_ATTN_AUTOTUNE_CACHE, a config can be pinned by editing that file (see fmha_autotune.h).
+"""
+
+import argparse
+import itertools
+import json
+import math
+import os
+import subprocess
+import sys
+
+import torch
+import torch.nn.functional as F
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+
+def seqlens_with_skew(batch_size, seqlen, skew):
+    """The lengths of the sequences go down linearly from seqlen to seqlen * (1 - skew)."""
+    if batch_size == 1:
+        return [seqlen]
+    return [max(1, round(seqlen * (1 - skew * i / (batch_size - 1)))) for i in range(batch_size)]
+
+
+def attention_flops(seqlens, nheads, headdim, num_v, causal, mode, density=1.0):
+    """The MMA flops: Q K^T and P V_i in the forward pass, and in the backward pass the
+    recomputation of Q K^T, dV_i = P^T dO_i, dP = sum_i dO_i V_i^T, dQ = dS K and dK = dS^T Q."""
+    pairs = sum(s * (s + 1) / 2 if causal else s * s for s in seqlens) * density
+    flops_fwd = 2 * (1 + num_v) * pairs * nheads * headdim
+    flops_bwd = 2 * (3 + 2 * num_v) * pairs * nheads * headdim
+    return {'fwd': flops_fwd, 'bwd': flops_bwd, 'fwd_bwd': flops_fwd + flops_bwd}[mode]
+
+
+def attention_bytes(total, nheads, headdim, num_v, mode, elem_size):
+    """The compulsory HBM traffic: Q, K and the V_i in, O_i and the fp32 log-sum-exp out for the
+    forward pass. The backward pass also reads O_i and dO_i, and writes dQ, dK and the dV_i."""
+    tensor = total * nheads * headdim * elem_size
+    lse = total * nheads * 4
+    bytes_fwd = (2 + 2 * num_v) * tensor + lse
+    bytes_bwd = (2 + 3 * num_v) * tensor + lse + (2 + num_v) * tensor
+    return {'fwd': bytes_fwd, 'bwd': bytes_bwd, 'fwd_bwd': bytes_fwd + bytes_bwd}[mode]
+
+
+def benchmark(fn, warmup, repeats):
+    """The median of the time of fn in ms, with CUDA events."""
+    for _ in range(warmup):
+        fn()
+    times = []
+    for _ in range(repeats):
+        start = torch.cuda.Event(enable_timing=True)
+        end = torch.cuda.Event(enable_timing=True)
+        start.record()
+        fn()
+        end.record()
+        torch.cuda.synchronize()
+        times.append(start.elapsed_time(end))
+    times.sort()
+    return times[len(times) // 2]
+
+
+def reference_attention(qkvv, seqlens, dropout_p, causal):
+    """qkvv: (batch_size, seqlen, 2 + num_v, nheads, headdim), padded. Returns the num_v outputs
+    (batch_size, seqlen, nheads, headdim), the padding keys are masked out."""
+    q, k, vs = qkvv[:, :, 0], qkvv[:, :, 1], qkvv[:, :, 2:].unbind(2)
+    seqlen = qkvv.shape[1]
+    scores = torch.einsum('bthd,bshd->bhts', q, k / math.sqrt(q.shape[-1]))
+    lengths = torch.tensor(seqlens, device=qkvv.device)
+    mask = torch.arange(seqlen, device=qkvv.device)[None, :] >= lengths[:, None]
+    scores.masked_fill_(mask[:, None, None, :], float('-inf'))
+    if causal:
+        causal_mask = torch.triu(torch.ones(seqlen, seqlen, dtype=torch.bool, device=qkvv.device), 1)
+        scores.masked_fill_(causal_mask, float('-inf'))
+    attn = torch.softmax(scores.float(), dim=-1).to(qkvv.dtype)
+    attn = F.dropout(attn, dropout_p)
+    return tuple(torch.einsum('bhts,bshd->bthd', attn, v) for v in vs)
+
+
+def environment():
+    props = torch.cuda.get_device_properties(torch.cuda.current_device())
+    try:
+        driver = subprocess.run(['nvidia-smi', '--query-gpu=driver_version', '--format=csv,noheader'],
+                                capture_output=True, text=True, check=True).stdout.split('\n')[0].strip()
+    except (OSError, subprocess.CalledProcessError):
+        driver = None
+    return {'gpu': props.name, 'sm': props.major * 10 + props.minor, 'cuda': torch.version.cuda,
+            'torch': torch.__version__, 'driver': driver}
+
+
+def make_inputs(batch_size, seqlens, seqlen, nheads, headdim, num_v, dtype, requires_grad):
+    """The packed (total, 2 + num_v, nheads, headdim) qkvv of the varlen kernels, its cu_seqlens
+    and the same values as a padded batch for the reference."""
+    device = 'cuda'
+    total = sum(seqlens)
+    qkvv = torch.randn(total, 2 + num_v, nheads, headdim, device=device, dtype=dtype,
+                       requires_grad=requires_grad)
+    cu_seqlens = torch.zeros(batch_size + 1, device=device, dtype=torch.int32)
+    cu_seqlens[1:] = torch.cumsum(torch.tensor(seqlens, device=device, dtype=torch.int32), 0)
+    qkvv_padded = torch.zeros(batch_size, seqlen, 2 + num_v, nheads, headdim, device=device,
+                              dtype=dtype)
+    for i, s in enumerate(seqlens):
+        qkvv_padded[i, :s] = qkvv.detach()[cu_seqlens[i]:cu_seqlens[i] + s]
+    qkvv_padded.requires_grad_(requires_grad)
+    return qkvv, cu_seqlens, qkvv_padded
+
+
+def run_config(args, kernel, mode, batch_size, seqlen, headdim, causal, dropout_p, skew, density):
+    from stream_attn_interface import stream_attn_func
+    from stream_blocksparse_attn_interface import convert_blockmask, stream_blocksparse_attn_func
+
+    dtype = torch.bfloat16 if args.dtype == 'bf16' else torch.float16
+    num_v, nheads = args.num_v, args.nheads
+    seqlens = seqlens_with_skew(batch_size, seqlen, skew)
+    requires_grad = mode != 'fwd'
+    qkvv, cu_seqlens, qkvv_padded = make_inputs(batch_size, seqlens, seqlen, nheads, headdim,
+                                                num_v, dtype, requires_grad)
+    max_s = max(seqlens)
+
+    if kernel == 'stream':
+        def forward():
+            return stream_attn_func(qkvv, cu_seqlens, dropout_p, max_s, causal=causal)
+    elif kernel == 'separate':
+        # The same Q K^T and softmax recomputed for each value.
+        qkvs = [torch.cat([qkvv[:, :2], qkvv[:, 2 + vi:3 + vi]], dim=1) for vi in range(num_v)]
+
+        def forward():
+            return tuple(stream_attn_func(qkv, cu_seqlens, dropout_p, max_s, causal=causal)[0]
+                         for qkv in qkvs)
+    elif kernel == 'block':
+        seqlen_rounded = ((max_s + 256 - 1) // 256) * 256
+        blockmask = (torch.rand(seqlen_rounded // 16, seqlen_rounded // 256, device='cuda')
+                     < density).to(torch.uint8)
+        blockmask = convert_blockmask(blockmask, causal=causal)
+
+        def forward():
+            return stream_blocksparse_attn_func(qkvv, cu_seqlens, blockmask, dropout_p, max_s,
+                                                causal=causal, convert_mask=False)
+    else:
+        def forward():
+            return reference_attention(qkvv_padded, seqlens, dropout_p, causal)
+
+    if mode == 'fwd':
+        with torch.no_grad():
+            ms = benchmark(forward, args.warmup, args.repeats)
+    else:
+        outs = forward()
+        grads = [torch.randn_like(o) for o in outs]
+        if mode == 'bwd':
+            def step():
+                torch.autograd.backward(outs, grads, retain_graph=True)
+        else:
+            def step():
+                torch.autograd.backward(forward(), grads)
+        ms = benchmark(step, args.warmup, args.repeats)
+
+    result = {'kernel': kernel, 'mode': mode, 'dtype': args.dtype, 'batch_size': batch_size,
+              'seqlen': seqlen, 'nheads': nheads, 'headdim': headdim, 'num_v': num_v,
+              'causal': causal, 'dropout_p': dropout_p, 'skew': skew,
+              'density': density if kernel == 'block' else 1.0, 'ms': ms}
+    # The reference computes the padded batch, but the useful work is the same.
+    flops = attention_flops(seqlens, nheads, headdim, num_v, causal, mode, result['density'])
+    result['tflops'] = flops / ms / 1e9
+    result['hbm_gbps'] = attention_bytes(sum(seqlens), nheads, headdim, num_v, mode,
+                                         qkvv.element_size()) / ms / 1e6
+
+    if args.check and kernel in ('stream', 'separate') and dropout_p == 0.0:
+        with torch.no_grad():
+            outs = forward()
+            outs_ref = reference_attention(qkvv_padded, seqlens, 0.0, causal)
+            max_diff = 0.0
+            for out, out_ref in zip(outs, outs_ref):
+                for i, s in enumerate(seqlens):
+                    diff = (out[cu_seqlens[i]:cu_seqlens[i] + s] - out_ref[i, :s]).abs().max()
+                    max_diff = max(max_diff, diff.item())
+        result['max_diff'] = max_diff
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--kernel', nargs='+', default=['stream', 'separate', 'reference'],
+                        choices=['stream', 'separate', 'block', 'reference'])
+    parser.add_argument('--mode', nargs='+', default=['fwd', 'fwd_bwd'],
+                        choices=['fwd', 'bwd', 'fwd_bwd'])
+    parser.add_argument('--batch-size', nargs='+', type=int, default=[8])
+    parser.add_argument('--seqlen', nargs='+', type=int, default=[512, 1024, 2048])
+    parser.add_argument('--headdim', nargs='+', type=int, default=[64])
+    parser.add_argument('--nheads', type=int, default=16)
+    parser.add_argument('--num-v', type=int, default=2)
+    parser.add_argument('--causal', nargs='+', type=int, default=[0], choices=[0, 1])
+    parser.add_argument('--dropout', nargs='+', type=float, default=[0.0])
+    parser.add_argument('--skew', nargs='+', type=float, default=[0.0],
+                        help='the sequences of a batch go from seqlen down to seqlen * (1 - skew)')
+    parser.add_argument('--density', nargs='+', type=float, default=[0.25],
+                        help='the fraction of the blocks kept for --kernel block')
+    parser.add_argument('--dtype', default='fp16', choices=['fp16', 'bf16'])
+    parser.add_argument('--warmup', type=int, default=5)
+    parser.add_argument('--repeats', type=int, default=30)
+    parser.add_argument('--check', action='store_true',
+                        help='also report the largest difference of the outputs with the reference')
+    parser.add_argument('--autotune', action='store_true', help='set STREAM_ATTN_AUTOTUNE=1')
+    parser.add_argument('--output', default=None, help='append the JSON lines to this file')
+    args = parser.parse_args()
+
+    if args.autotune:
+        os.environ['STREAM_ATTN_AUTOTUNE'] = '1'
+    env = environment()
+    output = open(args.output, 'a') if args.output is not None else None
+    for (kernel, mode, batch_size, seqlen, headdim, causal, dropout_p,
+         skew) in itertools.product(args.kernel, args.mode, args.batch_size, args.seqlen,
+                                    args.headdim, args.causal, args.dropout, args.skew):
+        for density in (args.density if kernel == 'block' else [1.0]):
+            config = dict(kernel=kernel, mode=mode, batch_size=batch_size, seqlen=seqlen,
+                          headdim=headdim, causal=bool(causal), dropout_p=dropout_p, skew=skew,
+                          density=density)
+            try:
+                result = run_config(args, **config)
+            except (RuntimeError, AssertionError) as e:
+                # E.g. the sizes the kernel doesn't support, or out of memory for the reference.
+                result = {**config, 'error': str(e).split('\n')[0]}
+                torch.cuda.empty_cache()
+            line = json.dumps({**result, **env})
+            print(line, flush=True)
+            if output is not None:
+                output.write(line + '\n')
+    if output is not None:
+        output.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -25,55 +25,257 @@
  *
  ******************************************************************************/
 
+#include <cstdlib>
+#include <cstring>
+
 #include <torch/extension.h>
 #include <ATen/cuda/CUDAContext.h>
 
 #include "fmha.h"
+#include "fmha_nvtx.h"
+
+// The kernels use the sm80 instructions (mma.sync for bf16, cp.async), they run as is on sm86, sm89
+// and sm90. The autotuner only picks the configs that fit in the shared memory of the device, the
+// others fail with the error of fmha::check_smem_size.
+void check_device(const cudaDeviceProp *dprops) {
+    TORCH_CHECK(dprops->major >= 8, "stream_attn needs an sm80 or newer GPU");
+}
+
+// Q, K and V_i can have any row and head strides, as long as the rows of each head are contiguous
+// and the 16B loads of the kernels stay aligned.
+void check_qkv(const std::vector<at::Tensor> &qkvv, const caffe2::TypeMeta q_dtype,
+               const int total_q, const int total_k, const int num_heads, const int head_size) {
+    for (size_t i = 0; i < qkvv.size(); ++i) {
+        const auto &t = qkvv[i];
+        TORCH_CHECK(t.dtype() == q_dtype);
+        TORCH_CHECK(t.is_cuda())
+        TORCH_CHECK(t.dim() == 3);
+        // Q has the rows of the query sequences, K and the V_i the rows of the key sequences.
+        TORCH_CHECK(t.size(0) == (i == 0 ? total_q : total_k));
+        TORCH_CHECK(t.size(1) == num_heads && t.size(2) == head_size);
+        TORCH_CHECK(t.stride(2) == 1, "The last dimension of Q, K and V must be contiguous");
+        TORCH_CHECK(t.stride(0) % 8 == 0 && t.stride(1) % 8 == 0,
+                    "The row and head strides of Q, K and V must be multiples of 8");
+        TORCH_CHECK(reinterpret_cast<uintptr_t>(t.data_ptr()) % 16 == 0,
+                    "Q, K and V must be 16B aligned");
+    }
+}
+
+void set_qkv_ptrs(void **ptrs, uint32_t *row_stride_in_elts, uint32_t *head_stride_in_elts,
+                  const std::vector<at::Tensor> &qkvv) {
+    for (size_t i = 0; i < qkvv.size(); ++i) {
+        ptrs[i] = qkvv[i].data_ptr();
+        row_stride_in_elts[i] = qkvv[i].stride(0);
+        head_stride_in_elts[i] = qkvv[i].stride(1);
+    }
+}
+
+// The kernels compute the offsets in 32 bits unless one of the tensors they access spans more
+// than 2GB (from its first to its last element).
+bool needs_64bit_index(const std::vector<at::Tensor> &tensors) {
+    for (const auto &t : tensors) {
+        if (!t.defined() || t.numel() == 0) { continue; }
+        int64_t last_elt = 0;
+        for (int i = 0; i < t.dim(); ++i) { last_elt += (t.size(i) - 1) * t.stride(i); }
+        if ((last_elt + 1) * int64_t(t.element_size()) > std::numeric_limits<int32_t>::max()) { return true; }
+    }
+    return false;
+}
+
+// setup.py can leave some of the configs out of the build, see static_switch.h.
+void check_build(const int head_size, const int num_v, const bool is_bf16, const bool is_dropout,
+                 const bool return_softmax) {
+    TORCH_CHECK(fmha_build_head_dim(fmha_round_head_dim(head_size)), "head_size ", head_size,
+                " is not built, see STREAM_ATTN_HEADDIMS");
+    TORCH_CHECK(fmha_build_num_v(num_v), "num_v ", num_v, " is not built, see STREAM_ATTN_NUM_V");
+    TORCH_CHECK(FMHA_BUILD_BF16 || !is_bf16, "bf16 is not built, see STREAM_ATTN_DISABLE_BF16");
+    TORCH_CHECK(FMHA_BUILD_DROPOUT || !is_dropout, "Dropout is not built, see STREAM_ATTN_DISABLE_DROPOUT");
+    TORCH_CHECK(FMHA_BUILD_RETURN_SOFTMAX || !return_softmax,
+                "return_softmax is not built, see STREAM_ATTN_DISABLE_RETURN_SOFTMAX");
+}
+
+// The ALiBi slopes are fp32, one per head and optionally per sequence.
+void set_alibi_slopes(Fused_multihead_attention_fprop_params &params,
+                      const c10::optional<at::Tensor> &alibi_slopes_,
+                      const int batch_size, const int num_heads) {
+    if (!alibi_slopes_.has_value()) {
+        params.alibi_slopes_ptr = nullptr;
+        return;
+    }
+    const auto &alibi_slopes = alibi_slopes_.value();
+    TORCH_CHECK(alibi_slopes.dtype() == torch::kFloat32, "ALiBi slopes must be fp32");
+    TORCH_CHECK(alibi_slopes.is_cuda())
+    TORCH_CHECK(alibi_slopes.is_contiguous())
+    TORCH_CHECK((alibi_slopes.dim() == 1 && alibi_slopes.size(0) == num_heads)
+                || (alibi_slopes.dim() == 2 && alibi_slopes.size(0) == batch_size && alibi_slopes.size(1) == num_heads),
+                "ALiBi slopes must be of shape (num_heads,) or (batch_size, num_heads)");
+    params.alibi_slopes_ptr = alibi_slopes.data_ptr();
+    params.alibi_slopes_batch_stride = alibi_slopes.dim() == 2 ? num_heads : 0;
+}
+
+void set_rotary(Fused_multihead_attention_fprop_params &params,
+                const c10::optional<at::Tensor> &rotary_cos_,
+                const c10::optional<at::Tensor> &rotary_sin_,
+                const int max_seqlen, const int head_size) {
+    TORCH_CHECK(rotary_cos_.has_value() == rotary_sin_.has_value(),
+                "rotary_cos and rotary_sin must be given together");
+    if (!rotary_cos_.has_value()) {
+        params.rotary_cos_ptr = nullptr;
+        params.rotary_sin_ptr = nullptr;
+        params.rotary_dim = 0;
+        return;
+    }
+    const auto &rotary_cos = rotary_cos_.value();
+    const auto &rotary_sin = rotary_sin_.value();
+    TORCH_CHECK(rotary_cos.dtype() == torch::kFloat32 && rotary_sin.dtype() == torch::kFloat32,
+                "rotary_cos and rotary_sin must be fp32");
+    TORCH_CHECK(rotary_cos.is_cuda() && rotary_sin.is_cuda())
+    TORCH_CHECK(rotary_cos.is_contiguous() && rotary_sin.is_contiguous())
+    TORCH_CHECK(rotary_cos.dim() == 2 && rotary_cos.sizes() == rotary_sin.sizes(),
+                "rotary_cos and rotary_sin must be of shape (seqlen_ro, rotary_dim / 2)");
+    TORCH_CHECK(rotary_cos.size(0) >= max_seqlen, "rotary_cos must have a row for each position");
+    const int rotary_dim = rotary_cos.size(1) * 2;
+    // An LDG of Q or K holds 8 elements, i.e. 4 complete pairs, so it is rotated entirely or not at all.
+    TORCH_CHECK(rotary_dim % 8 == 0 && rotary_dim <= head_size,
+                "rotary_dim must be a multiple of 8 and at most head_size");
+    params.rotary_cos_ptr = rotary_cos.data_ptr();
+    params.rotary_sin_ptr = rotary_sin.data_ptr();
+    params.rotary_dim = rotary_dim;
+}
+
+// With several sequences of different lengths, the fwd kernel runs about one CTA per SM that take
+// the (query block, head) pairs of the longest sequences first, instead of a CTA per (head, batch)
+// that leaves the SMs of the short sequences idle. STREAM_ATTN_PERSISTENT=0 turns it off.
+bool use_persistent_fwd() {
+    const char *env = std::getenv("STREAM_ATTN_PERSISTENT");
+    return env == nullptr || std::strcmp(env, "0") != 0;
+}
+
+// The width of the K/V blocks of fwd and bwd, the dropout masks depend on it.
+int fwd_base_N(const int head_size, const int num_v) {
+    return (fmha_round_head_dim(head_size) == 128 || num_v > 2) ? 128 : 256;
+}
+
+// The scratch buffers of fwd, carved out of one byte buffer so they can be preallocated (see
+// fwd_workspace_size): the fp32 partial outputs o_tmp, only with return_softmax over several K/V
+// blocks, and the work queue of the persistent kernel.
+struct Fwd_workspace_layout {
+    bool use_o_tmp;
+    bool use_work_queue;
+    size_t o_tmp_bytes;  // Per value tensor.
+    size_t work_queue_offset;
+    size_t size;
+};
+
+Fwd_workspace_layout fwd_workspace_layout(const int batch_size, const int total_q, const int num_heads,
+                                          const int head_size, const int num_v, const bool loop,
+                                          const bool return_softmax) {
+    constexpr size_t ALIGNMENT = 256;
+    auto align = [](const size_t bytes) { return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT; };
+    Fwd_workspace_layout layout;
+    layout.use_o_tmp = loop && return_softmax;
+    layout.use_work_queue = loop && !return_softmax && batch_size > 1 && use_persistent_fwd();
+    layout.o_tmp_bytes = layout.use_o_tmp ? align(size_t(total_q) * num_heads * head_size * sizeof(float)) : 0;
+    layout.work_queue_offset = num_v * layout.o_tmp_bytes;
+    layout.size = layout.work_queue_offset
+        + (layout.use_work_queue ? align((2 * batch_size + 2) * sizeof(int)) : 0);
+    return layout;
+}
+
+// The sequences are either packed, with the offsets of the sequences in cu_seqlens_q / cu_seqlens_k
+// (b+1), or padded to the same number of rows, with their lengths in seqlens_q / seqlens_k (b).
+// Returns the batch size.
+int check_seqlens(const c10::optional<at::Tensor> &cu_seqlens_q_,
+                  const c10::optional<at::Tensor> &cu_seqlens_k_,
+                  const c10::optional<at::Tensor> &seqlens_q_,
+                  const c10::optional<at::Tensor> &seqlens_k_,
+                  const int total_q, const int total_k) {
+    const bool is_padded = seqlens_q_.has_value();
+    TORCH_CHECK(seqlens_k_.has_value() == is_padded
+                && cu_seqlens_q_.has_value() != is_padded && cu_seqlens_k_.has_value() != is_padded,
+                "Either cu_seqlens_q and cu_seqlens_k or seqlens_q and seqlens_k must be given");
+    const auto &seqlens_q = is_padded ? seqlens_q_.value() : cu_seqlens_q_.value();
+    const auto &seqlens_k = is_padded ? seqlens_k_.value() : cu_seqlens_k_.value();
+    TORCH_CHECK(seqlens_q.dtype() == torch::kInt32 && seqlens_k.dtype() == torch::kInt32);
+    TORCH_CHECK(seqlens_q.is_cuda() && seqlens_k.is_cuda())
+    TORCH_CHECK(seqlens_q.is_contiguous() && seqlens_k.is_contiguous())
+    TORCH_CHECK(seqlens_q.dim() == 1 && seqlens_k.dim() == 1);
+    TORCH_CHECK(seqlens_k.numel() == seqlens_q.numel());
+    const int batch_size = seqlens_q.numel() - (is_padded ? 0 : 1);
+    TORCH_CHECK(batch_size > 0);
+    TORCH_CHECK(!is_padded || (total_q % batch_size == 0 && total_k % batch_size == 0),
+                "The padded sequences must all have the same number of rows");
+    return batch_size;
+}
+
+void set_seqlens(Fused_multihead_attention_fprop_params &params,
+                 const c10::optional<at::Tensor> &cu_seqlens_q_,
+                 const c10::optional<at::Tensor> &cu_seqlens_k_,
+                 const c10::optional<at::Tensor> &seqlens_q_,
+                 const c10::optional<at::Tensor> &seqlens_k_,
+                 const int total_q, const int total_k) {
+    if (!seqlens_q_.has_value()) {
+        params.cu_seqlens_q = static_cast<int *>(cu_seqlens_q_.value().data_ptr());
+        params.cu_seqlens_k = static_cast<int *>(cu_seqlens_k_.value().data_ptr());
+        return;
+    }
+    params.cu_seqlens_q = nullptr;
+    params.cu_seqlens_k = nullptr;
+    params.seqlens_q = static_cast<int *>(seqlens_q_.value().data_ptr());
+    params.seqlens_k = static_cast<int *>(seqlens_k_.value().data_ptr());
+    params.padded_seqlen_q = total_q / params.b;
+    params.padded_seqlen_k = total_k / params.b;
+}
 
 void set_params(Fused_multihead_attention_fprop_params &params,
                 // sizes
                 const size_t b,
-                const size_t s,
+                const size_t seqlen_q,
+                const size_t seqlen_k,
                 const size_t h,
                 const size_t d,
+                const int num_v,
+                // Q, K, V_0, ..., V_{num_v - 1}
+                const std::vector<at::Tensor> &qkvv,
                 // device pointers
-                void *qkv_packed_d,
-                void *cu_seqlens_d,
-                void *o_packed_d,
-                void *o_tmp_d,
-                void *do_packed_d,
+                void *cu_seqlens_q_d,
+                void *cu_seqlens_k_d,
+                // num_v pointers each, or nullptr
+                void * const *o_packed_d,
+                void * const *o_tmp_d,
+                void * const *do_packed_d,
                 void *s_d,
                 void *softmax_lse_d,
                 void *dsoftmax_sum_d,
                 float p_dropout,
                 float softmax_scale,
                 bool is_causal,
-                void *o2_tmp_d,
-                void *o2_packed_d) {
+                int window_left,
+                int window_right,
+                bool is_bf16) {
 
     Data_type acc_type = DATA_TYPE_FP32;
-    Data_type data_type = DATA_TYPE_FP16;
+    Data_type data_type = is_bf16 ? DATA_TYPE_BF16 : DATA_TYPE_FP16;
 
     // Reset the parameters
     memset(&params, 0, sizeof(params));
 
     // Set the pointers and strides.
-    params.qkv_ptr = qkv_packed_d;
-    params.qkv_stride_in_elts = h * 4 * d;
-    params.qkv_stride_in_bytes = get_size_in_bytes(h * 4 * d, data_type);
-    params.o_ptr = o_packed_d;
-    params.o2_ptr = o2_packed_d;
+    set_qkv_ptrs(params.qkv_ptrs, params.qkv_row_stride_in_elts, params.qkv_head_stride_in_elts, qkvv);
+    for (int vi = 0; vi < num_v; ++vi) {
+        params.o_ptrs[vi] = o_packed_d == nullptr ? nullptr : o_packed_d[vi];
+        params.o_tmp_ptrs[vi] = o_tmp_d == nullptr ? nullptr : o_tmp_d[vi];
+        params.do_ptrs[vi] = do_packed_d == nullptr ? nullptr : do_packed_d[vi];
+    }
     params.o_stride_in_elts = h * d;
     params.o_stride_in_bytes = get_size_in_bytes(h * d, data_type);
-    params.do_ptr = do_packed_d;
-    params.o_tmp_ptr = o_tmp_d;
-    params.o2_tmp_ptr = o2_tmp_d;
 
-    params.cu_seqlens = static_cast<int *>(cu_seqlens_d);
+    params.cu_seqlens_q = static_cast<int *>(cu_seqlens_q_d);
+    params.cu_seqlens_k = static_cast<int *>(cu_seqlens_k_d);
 
     // S = softmax(P)
     params.s_ptr = s_d;
-    params.s_stride_in_bytes = get_size_in_bytes(b * h * s, data_type);
+    params.s_stride_in_bytes = get_size_in_bytes(b * h * seqlen_k, data_type);
 
     // Softmax sum
     params.softmax_lse_ptr = softmax_lse_d;
@@ -82,8 +284,11 @@ void set_params(Fused_multihead_attention_fprop_params &params,
     // Set the dimensions.
     params.b = b;
     params.h = h;
-    params.s = s;
+    params.seqlen_q = seqlen_q;
+    params.seqlen_k = seqlen_k;
     params.d = d;
+    params.total_q = qkvv[0].size(0);
+    params.num_v = num_v;
 
     // Set the different scale values.
     // const float scale_bmm1 = 1.f / sqrtf(d);
@@ -106,86 +311,173 @@ void set_params(Fused_multihead_attention_fprop_params &params,
     TORCH_CHECK(p_dropout < 1.f);
     set_alpha(params.scale_dropout, params.rp_dropout, data_type);
 
-    params.is_causal = is_causal;
+    // A negative window is unbounded. The bounds stay far enough from INT_MAX for the tile
+    // computations of the kernels not to overflow.
+    constexpr int kNoWindow = std::numeric_limits<int>::max() / 2;
+    if (is_causal) { window_right = 0; }
+    params.is_causal = is_causal || window_left >= 0 || window_right >= 0;
+    params.window_left = window_left < 0 ? kNoWindow : window_left;
+    params.window_right = window_right < 0 ? kNoWindow : window_right;
+    params.is_bf16 = is_bf16;
 }
 
 std::vector<at::Tensor> 
-mha_fwd(const at::Tensor &qkvv,         // total x num_heads x 4 x head_size, total := \sum_{i=0}^{b} s_i
-        const at::Tensor &cu_seqlens,  // b+1
+mha_fwd(const std::vector<at::Tensor> &qkvv,  // Q: total_q x num_heads x head_size, K and the V_i: total_k x num_heads x head_size
+        const c10::optional<at::Tensor> &cu_seqlens_q_,  // b+1, or nullopt for padded batches
+        const c10::optional<at::Tensor> &cu_seqlens_k_,  // b+1
         const float p_dropout,
-        const int max_seq_len,
+        const int max_seqlen_q_,
+        const int max_seqlen_k_,
         const float softmax_scale,
         const bool zero_tensors,
         const bool is_causal,
+        const int window_left,          // query i sees the keys [i - window_left, i + window_right],
+        const int window_right,         // -1 for no bound
+        const c10::optional<at::Tensor> &alibi_slopes_,  // num_heads or batch_size x num_heads, fp32
+        const c10::optional<at::Tensor> &rotary_cos_,    // seqlen_ro x rotary_dim / 2, fp32
+        const c10::optional<at::Tensor> &rotary_sin_,    // seqlen_ro x rotary_dim / 2, fp32
+        const c10::optional<at::Tensor> &seqlens_q_,     // b, with total_q = b x padded seqlen_q
+        const c10::optional<at::Tensor> &seqlens_k_,     // b, with total_k = b x padded seqlen_k
         const bool return_softmax,
+        const bool return_softmax_stats,  // 2 x num_heads x total_q, the entropy and the max of the rows of the softmax
+        const c10::optional<std::vector<at::Tensor>> &out_,  // num_v x (total_q x num_heads x head_size), written instead of allocating the outputs
+        const c10::optional<at::Tensor> &softmax_lse_,       // num_heads x total_q, fp32
+        const c10::optional<at::Tensor> &workspace_,         // uint8, at least fwd_workspace_size bytes
+        const c10::optional<at::Tensor> &phase_clocks_,      // int64, batch_size x num_heads x FMHA_NUM_PHASES, accumulated into
         c10::optional<at::Generator> gen_) {
 
     auto dprops = at::cuda::getCurrentDeviceProperties();
-    TORCH_CHECK(dprops->major == 8 && dprops->minor >= 0);
+    check_device(dprops);
     auto stream = at::cuda::getCurrentCUDAStream().stream();
     bool is_dropout = p_dropout > 0.0;
     Launch_params<Fused_multihead_attention_fprop_params> launch_params(dprops, stream, is_dropout, return_softmax);
 
-    TORCH_CHECK(qkvv.is_cuda())
-    TORCH_CHECK(cu_seqlens.is_cuda())
-
-    TORCH_CHECK(qkvv.is_contiguous())
-    TORCH_CHECK(cu_seqlens.is_contiguous())
+    // Q, K and then num_v value tensors that share the softmax.
+    const int num_v = int(qkvv.size()) - 2;
+    TORCH_CHECK(num_v >= 1 && num_v <= MAX_NUM_V);
 
-    TORCH_CHECK(cu_seqlens.dim() == 1);
-    TORCH_CHECK(qkvv.dim() == 4);
+    auto q_dtype = qkvv[0].dtype();
+    TORCH_CHECK(q_dtype == torch::kFloat16 || q_dtype == torch::kBFloat16);
+    const bool is_bf16 = q_dtype == torch::kBFloat16;
 
-    const auto sizes = qkvv.sizes();
+    TORCH_CHECK(qkvv[0].dim() == 3 && qkvv[1].dim() == 3);
 
-    TORCH_CHECK(sizes[THREE_DIM] == 4);
-
-    const int batch_size = cu_seqlens.numel() - 1;
-    const int total = sizes[TOTAL_DIM];
-    const int num_heads = sizes[H_DIM];
-    const int head_size = sizes[D_DIM];
-    TORCH_CHECK(batch_size > 0);
-    TORCH_CHECK(head_size == 16 || head_size == 32 || head_size == 64 || head_size == 128);
+    const int total_q = qkvv[0].size(0);
+    const int total_k = qkvv[1].size(0);
+    const int num_heads = qkvv[0].size(1);
+    const int head_size = qkvv[0].size(2);
+    check_qkv(qkvv, q_dtype, total_q, total_k, num_heads, head_size);
+    const int batch_size = check_seqlens(cu_seqlens_q_, cu_seqlens_k_, seqlens_q_, seqlens_k_, total_q, total_k);
+    // The kernel doesn't write the padding rows of the padded batches.
+    const bool is_padded = seqlens_q_.has_value();
+    // The head sizes other than 16, 32, 64 and 128 run the kernels of the next one of them.
+    TORCH_CHECK(head_size % 8 == 0 && head_size <= 128, "head_size must be a multiple of 8 and at most 128");
+    const int head_size_rounded = fmha_round_head_dim(head_size);
+    // The kernels for head_size 128 run out of shared memory with more than 2 value tensors.
+    TORCH_CHECK(head_size_rounded != 128 || num_v <= 2);
+    check_build(head_size, num_v, is_bf16, is_dropout, return_softmax);
+    TORCH_CHECK(!(return_softmax && return_softmax_stats), "Either the softmax or its stats can be returned");
 
     // int base_N = head_size == 16 ? 512 : (head_size == 128 ? 128 : 256);
-    int base_N = head_size == 128 ? 128 : 256;
+    int base_N = fwd_base_N(head_size, num_v);
     // int base_N = 256;
-    int seq_len = 512;
-    if( max_seq_len <= 128 ) {
-        seq_len = 128;
-    } else if( max_seq_len <= 256 ) {
-        seq_len = 256;
+    int max_seqlen_k = 512;
+    if( max_seqlen_k_ <= 128 ) {
+        max_seqlen_k = 128;
+    } else if( max_seqlen_k_ <= 256 ) {
+        max_seqlen_k = 256;
     } else {
-        seq_len = ((max_seq_len + base_N - 1) / base_N) * base_N;
+        max_seqlen_k = ((max_seqlen_k_ + base_N - 1) / base_N) * base_N;
     }
-    bool loop = seq_len > base_N;
+    // The query blocks are 16 rows, so short query sequences don't pay for the key length.
+    int max_seqlen_q = ((max_seqlen_q_ + 16 - 1) / 16) * 16;
+    bool loop = max_seqlen_k > base_N;
+#if FMHA_BUILD_NVTX
+    // The launcher opens a range naming the traits it runs inside this one.
+    const Fmha_nvtx_range nvtx_range(
+        "stream_attn fwd b" + std::to_string(batch_size) + " h" + std::to_string(num_heads)
+        + " d" + std::to_string(head_size) + " v" + std::to_string(num_v)
+        + " s" + std::to_string(fmha_seqlen_bucket(max_seqlen_k)) + (loop ? " loop" : ""));
+#endif
+    // Without returning the softmax, the kernel keeps the partial outputs of a query block in
+    // registers while looping over the keys, so it only needs o_tmp for return_softmax.
+    const auto layout = fwd_workspace_layout(batch_size, total_q, num_heads, head_size, num_v, loop, return_softmax);
+    bool use_o_tmp = layout.use_o_tmp;
 
-    auto opts = qkvv.options();
+    auto opts = qkvv[0].options();
 
-    auto ctx = torch::empty({ total, num_heads, head_size }, opts);
-    auto ctx2 = torch::empty({ total, num_heads, head_size }, opts);
+    // With the outputs, softmax_lse and the workspace given, nothing is allocated here (e.g. for
+    // CUDA graphs), except the returned softmax s with return_softmax and the softmax stats with
+    // return_softmax_stats, which can't be passed in.
+    at::Tensor workspace;
+    if (workspace_.has_value()) {
+        workspace = workspace_.value();
+        TORCH_CHECK(workspace.dtype() == torch::kUInt8, "workspace must be uint8");
+        TORCH_CHECK(workspace.is_cuda())
+        TORCH_CHECK(workspace.is_contiguous())
+        TORCH_CHECK(size_t(workspace.numel()) >= layout.size, "workspace must have at least fwd_workspace_size bytes");
+    } else if (layout.size > 0) {
+        workspace = torch::empty({int64_t(layout.size)}, opts.dtype(torch::kUInt8));
+    }
 
-    at::Tensor o_tmp;
-    at::Tensor o2_tmp;
-    if (loop) {
-        o_tmp = torch::empty({total, num_heads, head_size}, opts.dtype(at::kFloat));
-        o2_tmp = torch::empty({total, num_heads, head_size}, opts.dtype(at::kFloat));
+    if (out_.has_value()) {
+        TORCH_CHECK(int(out_.value().size()) == num_v, "out must have num_v tensors");
+    }
+    std::vector<at::Tensor> ctx(num_v);
+    std::vector<at::Tensor> o_tmp(num_v);
+    void *ctx_ptrs[MAX_NUM_V];
+    void *o_tmp_ptrs[MAX_NUM_V];
+    for (int vi = 0; vi < num_v; ++vi) {
+        if (out_.has_value()) {
+            ctx[vi] = out_.value()[vi];
+            TORCH_CHECK(ctx[vi].dtype() == q_dtype);
+            TORCH_CHECK(ctx[vi].is_cuda())
+            TORCH_CHECK(ctx[vi].is_contiguous())
+            TORCH_CHECK(ctx[vi].dim() == 3 && ctx[vi].size(0) == total_q && ctx[vi].size(1) == num_heads
+                        && ctx[vi].size(2) == head_size);
+        } else {
+            ctx[vi] = torch::empty({ total_q, num_heads, head_size }, opts);
+        }
+        ctx_ptrs[vi] = ctx[vi].data_ptr();
+        if (use_o_tmp) {
+            o_tmp[vi] = workspace.narrow(0, vi * layout.o_tmp_bytes, layout.o_tmp_bytes).view(at::kFloat)
+                .narrow(0, 0, int64_t(total_q) * num_heads * head_size).view({total_q, num_heads, head_size});
+        }
+        o_tmp_ptrs[vi] = use_o_tmp ? o_tmp[vi].data_ptr() : nullptr;
     }
 
-    auto softmax_lse = torch::empty({batch_size, num_heads, seq_len}, opts.dtype(at::kFloat));
-    // auto softmax_lse = torch::full({batch_size, num_heads, seq_len}, -std::numeric_limits<float>::infinity(), opts.dtype(at::kFloat));
+    // One log-sum-exp per query token and head, without the padding of the sequences.
+    at::Tensor softmax_lse;
+    if (softmax_lse_.has_value()) {
+        softmax_lse = softmax_lse_.value();
+        TORCH_CHECK(softmax_lse.dtype() == torch::kFloat32, "softmax_lse must be fp32");
+        TORCH_CHECK(softmax_lse.is_cuda())
+        TORCH_CHECK(softmax_lse.is_contiguous())
+        TORCH_CHECK(softmax_lse.dim() == 2 && softmax_lse.size(0) == num_heads && softmax_lse.size(1) == total_q);
+    } else {
+        softmax_lse = torch::empty({num_heads, total_q}, opts.dtype(at::kFloat));
+    }
 
     at::Tensor s;
     if (return_softmax) {
-        s = torch::empty({ batch_size, num_heads, seq_len, seq_len }, opts);
-        // s = torch::ones({ batch_size, num_heads, seq_len, seq_len }, opts) * 10000.0;
+        s = torch::empty({ batch_size, num_heads, max_seqlen_q, max_seqlen_k }, opts);
+        // s = torch::ones({ batch_size, num_heads, max_seqlen_q, max_seqlen_k }, opts) * 10000.0;
+    }
+
+    // The rows of the sequences without keys are not written.
+    at::Tensor softmax_stats;
+    if (return_softmax_stats) {
+        softmax_stats = torch::zeros({2, num_heads, total_q}, opts.dtype(at::kFloat));
     }
 
+    if( zero_tensors || is_padded ) {
+        for (int vi = 0; vi < num_v; ++vi) { ctx[vi].zero_(); }
+    }
     if( zero_tensors ) {
-        ctx.zero_();
-        ctx2.zero_();
+        for (int vi = 0; vi < num_v; ++vi) {
+            if (use_o_tmp) { o_tmp[vi].zero_(); }
+        }
         softmax_lse.fill_(-std::numeric_limits<float>::infinity());
-        if (loop) { o_tmp.zero_(); }
-        if (loop) { o2_tmp.zero_(); }
         if (return_softmax) {s.zero_();}
     }
 
@@ -195,13 +487,16 @@ mha_fwd(const at::Tensor &qkvv,         // total x num_heads x 4 x head_size, to
 
     set_params(launch_params.params,
                batch_size,
-               seq_len,
+               max_seqlen_q,
+               max_seqlen_k,
                num_heads,
                head_size,
-               qkvv.data_ptr(),
-               cu_seqlens.data_ptr(),
-               ctx.data_ptr(),
-               loop ? o_tmp.data_ptr() : nullptr,
+               num_v,
+               qkvv,
+               nullptr,
+               nullptr,
+               ctx_ptrs,
+               o_tmp_ptrs,
                nullptr,
                return_softmax ? s.data_ptr() : nullptr,
                softmax_lse.data_ptr(),
@@ -209,9 +504,47 @@ mha_fwd(const at::Tensor &qkvv,         // total x num_heads x 4 x head_size, to
                p_dropout,
                softmax_scale,
                is_causal,
-               loop ? o2_tmp.data_ptr() : nullptr,
-               ctx2.data_ptr());
+               window_left,
+               window_right,
+               is_bf16);
+    std::vector<at::Tensor> accessed = qkvv;
+    accessed.insert(accessed.end(), ctx.begin(), ctx.end());
+    if (use_o_tmp) { accessed.insert(accessed.end(), o_tmp.begin(), o_tmp.end()); }
+    if (return_softmax) { accessed.push_back(s); }
+    launch_params.params.is_64bit_index = needs_64bit_index(accessed);
+    TORCH_CHECK(FMHA_BUILD_64BIT_INDEX || !launch_params.params.is_64bit_index,
+                "Tensors larger than 2GB are not built, see STREAM_ATTN_DISABLE_64BIT_INDEX");
+    set_alibi_slopes(launch_params.params, alibi_slopes_, batch_size, num_heads);
+    set_rotary(launch_params.params, rotary_cos_, rotary_sin_, std::max(max_seqlen_q_, max_seqlen_k_), head_size);
+    set_seqlens(launch_params.params, cu_seqlens_q_, cu_seqlens_k_, seqlens_q_, seqlens_k_, total_q, total_k);
+    launch_params.params.softmax_stats_ptr = return_softmax_stats ? softmax_stats.data_ptr() : nullptr;
 
+    // The kernels add their cycles to it, the caller zeros it or takes the differences.
+    if (phase_clocks_.has_value()) {
+        TORCH_CHECK(FMHA_BUILD_PROFILE_PHASES, "The phase counters are not built, see STREAM_ATTN_PROFILE_PHASES");
+        const auto &phase_clocks = phase_clocks_.value();
+        TORCH_CHECK(phase_clocks.dtype() == torch::kInt64, "phase_clocks must be int64");
+        TORCH_CHECK(phase_clocks.is_cuda())
+        TORCH_CHECK(phase_clocks.is_contiguous())
+        TORCH_CHECK(phase_clocks.dim() == 3 && phase_clocks.size(0) == batch_size
+                    && phase_clocks.size(1) == num_heads && phase_clocks.size(2) == FMHA_NUM_PHASES);
+        launch_params.params.phase_clocks_ptr = reinterpret_cast<long long *>(phase_clocks.data_ptr());
+    }
+
+    // The work queue of the persistent kernel: the counter, the order and the offsets of the
+    // batches (see device_1xN_persistent).
+    // It is rebuilt by a kernel on the stream before each launch, so a replayed graph starts from
+    // a fresh queue.
+    if (layout.use_work_queue) {
+        int *queue = reinterpret_cast<int *>(static_cast<char *>(workspace.data_ptr()) + layout.work_queue_offset);
+        launch_params.params.queue_counter = queue;
+        launch_params.params.queue_order = queue + 1;
+        launch_params.params.queue_offsets = queue + 1 + batch_size;
+    }
+
+    // The configure pass only queries the occupancy and sets the shared memory attributes of the
+    // kernels, nothing is enqueued on the stream, and the autotuner doesn't time the configs while
+    // the stream is capturing. So it is safe in a CUDA graph capture.
     run_fmha_fp16_sm80(launch_params, /*configure=*/ true);
     // number of times random will be generated per thread, to offset philox counter in thc random
     // state
@@ -220,18 +553,822 @@ mha_fwd(const at::Tensor &qkvv,         // total x num_heads x 4 x head_size, to
 
     if( is_dropout ) {
         // See Note [Acquire lock when using random generators]
+        // While capturing, philox_cuda_state registers the graph with the generator and returns the
+        // pointers to its seed and offset, which at::cuda::philox::unpack reads on the device, so
+        // each replay draws a new mask.
         std::lock_guard<std::mutex> lock(gen->mutex_);
         launch_params.params.philox_args = gen->philox_cuda_state(counter_offset);
     }
 
     run_fmha_fp16_sm80(launch_params, /*configure=*/false);
 
-    std::vector<at::Tensor> result = {ctx, ctx2, softmax_lse};
+    std::vector<at::Tensor> result = ctx;
+    result.push_back(softmax_lse);
+    if (return_softmax) {result.push_back(s);}
+    if (return_softmax_stats) {result.push_back(softmax_stats);}
+    return result;
+}
+
+// The size in bytes of the workspace of fwd for these sizes and options, 0 if it needs none.
+int64_t
+mha_fwd_workspace_size(const int batch_size,
+                       const int total_q,
+                       const int num_heads,
+                       const int head_size,
+                       const int num_v,
+                       const int max_seqlen_k,
+                       const bool return_softmax) {
+    const bool loop = max_seqlen_k > fwd_base_N(head_size, num_v);
+    return fwd_workspace_layout(batch_size, total_q, num_heads, head_size, num_v, loop, return_softmax).size;
+}
+
+// Runs independent fwd problems in one launch, e.g. the experts or the query groups of a layer, so
+// that they pay for one launch and fill the GPU together. Each problem has its own heads, batch,
+// sequences (packed, with cu_seqlens) and tensors. They share the type, head_size, num_v and the
+// causal mask, without dropout, returned softmax, ALiBi, rotary or sliding windows.
+// Returns the num_v outputs and the softmax_lse of each problem.
+std::vector<std::vector<at::Tensor>>
+mha_fwd_grouped(const std::vector<std::vector<at::Tensor>> &qkvvs,  // per problem: Q, K, V_0, ..., as for fwd
+                const std::vector<at::Tensor> &cu_seqlens_qs,       // per problem: b+1
+                const std::vector<at::Tensor> &cu_seqlens_ks,       // per problem: b+1
+                const std::vector<int> &max_seqlens_q,
+                const std::vector<int> &max_seqlens_k,
+                const std::vector<double> &softmax_scales,
+                const bool is_causal) {
+
+    auto dprops = at::cuda::getCurrentDeviceProperties();
+    check_device(dprops);
+    auto stream = at::cuda::getCurrentCUDAStream().stream();
+    Launch_params<Fused_multihead_attention_grouped_params> launch_params(dprops, stream, /*is_dropout=*/false, /*return_softmax=*/false);
+    auto &group = launch_params.params;
+    memset(&group, 0, sizeof(group));
+
+    const int num_problems = qkvvs.size();
+    TORCH_CHECK(num_problems >= 1);
+    TORCH_CHECK(int(cu_seqlens_qs.size()) == num_problems && int(cu_seqlens_ks.size()) == num_problems
+                && int(max_seqlens_q.size()) == num_problems && int(max_seqlens_k.size()) == num_problems
+                && int(softmax_scales.size()) == num_problems, "Each argument must have one entry per problem");
+
+    // The kernel is picked from the first problem, the others must match it.
+    const int num_v = int(qkvvs[0].size()) - 2;
+    TORCH_CHECK(num_v >= 1 && num_v <= MAX_NUM_V);
+    TORCH_CHECK(qkvvs[0][0].dim() == 3);
+    auto q_dtype = qkvvs[0][0].dtype();
+    TORCH_CHECK(q_dtype == torch::kFloat16 || q_dtype == torch::kBFloat16);
+    const bool is_bf16 = q_dtype == torch::kBFloat16;
+    const int head_size = qkvvs[0][0].size(2);
+    TORCH_CHECK(head_size % 8 == 0 && head_size <= 128, "head_size must be a multiple of 8 and at most 128");
+    TORCH_CHECK(fmha_round_head_dim(head_size) != 128 || num_v <= 2);
+    check_build(head_size, num_v, is_bf16, /*is_dropout=*/false, /*return_softmax=*/false);
+    const int base_N = fwd_base_N(head_size, num_v);
+
+#if FMHA_BUILD_NVTX
+    const Fmha_nvtx_range nvtx_range(
+        "stream_attn fwd_grouped g" + std::to_string(num_problems) + " d" + std::to_string(head_size)
+        + " v" + std::to_string(num_v));
+#endif
+
+    auto opts = qkvvs[0][0].options();
+    std::vector<Fused_multihead_attention_fprop_params> problems(num_problems);
+    std::vector<std::vector<at::Tensor>> result(num_problems);
+    int total_bh = 0;
+    int max_q_steps = 1;
+    bool is_64bit_index = false;
+    for (int g = 0; g < num_problems; ++g) {
+        const auto &qkvv = qkvvs[g];
+        TORCH_CHECK(int(qkvv.size()) == num_v + 2, "The problems must have the same number of values");
+        TORCH_CHECK(qkvv[0].dim() == 3 && qkvv[1].dim() == 3);
+        const int total_q = qkvv[0].size(0);
+        const int total_k = qkvv[1].size(0);
+        const int num_heads = qkvv[0].size(1);
+        TORCH_CHECK(qkvv[0].size(2) == head_size, "The problems must have the same head_size");
+        check_qkv(qkvv, q_dtype, total_q, total_k, num_heads, head_size);
+        const int batch_size = check_seqlens(cu_seqlens_qs[g], cu_seqlens_ks[g], c10::nullopt, c10::nullopt, total_q, total_k);
+
+        // As in fwd. The kernel runs any number of K/V blocks, seqlen_k only sizes the shared memory.
+        const int max_seqlen_q = ((max_seqlens_q[g] + 16 - 1) / 16) * 16;
+        const int max_seqlen_k = std::max(((max_seqlens_k[g] + base_N - 1) / base_N) * base_N, base_N);
+
+        void *ctx_ptrs[MAX_NUM_V];
+        for (int vi = 0; vi < num_v; ++vi) {
+            result[g].push_back(torch::empty({ total_q, num_heads, head_size }, opts));
+            ctx_ptrs[vi] = result[g].back().data_ptr();
+        }
+        auto softmax_lse = torch::empty({num_heads, total_q}, opts.dtype(at::kFloat));
+
+        set_params(problems[g],
+                   batch_size,
+                   max_seqlen_q,
+                   max_seqlen_k,
+                   num_heads,
+                   head_size,
+                   num_v,
+                   qkvv,
+                   nullptr,
+                   nullptr,
+                   ctx_ptrs,
+                   nullptr,
+                   nullptr,
+                   nullptr,
+                   softmax_lse.data_ptr(),
+                   nullptr,
+                   /*p_dropout=*/0.f,
+                   softmax_scales[g],
+                   is_causal,
+                   /*window_left=*/-1,
+                   /*window_right=*/-1,
+                   is_bf16);
+        set_seqlens(problems[g], cu_seqlens_qs[g], cu_seqlens_ks[g], c10::nullopt, c10::nullopt, total_q, total_k);
+        std::vector<at::Tensor> accessed = qkvv;
+        accessed.insert(accessed.end(), result[g].begin(), result[g].end());
+        is_64bit_index = is_64bit_index || needs_64bit_index(accessed);
+        result[g].push_back(softmax_lse);
+
+        total_bh += batch_size * num_heads;
+        max_q_steps = std::max(max_q_steps, max_seqlen_q / 16);
+        group.seqlen_k = std::max(group.seqlen_k, max_seqlen_k);
+    }
+    TORCH_CHECK(FMHA_BUILD_64BIT_INDEX || !is_64bit_index,
+                "Tensors larger than 2GB are not built, see STREAM_ATTN_DISABLE_64BIT_INDEX");
+    // The kernels of all the problems use the same offsets.
+    for (auto &params : problems) { params.is_64bit_index = is_64bit_index; }
+
+    group.num_problems = num_problems;
+    group.d = head_size;
+    group.num_v = num_v;
+    group.is_bf16 = is_bf16;
+    group.is_64bit_index = is_64bit_index;
+    group.is_causal = problems[0].is_causal;
+
+    // Gets the occupancy of the kernel.
+    run_fmha_fp16_sm80_grouped(launch_params, /*configure=*/true);
+
+    // Split the query blocks of the (batch, head) pairs over several CTAs as in fwd, if all the
+    // problems together don't fill a wave (see fmha::num_splits_heuristic).
+    const int ctas_per_wave = dprops->multiProcessorCount * group.ctas_per_sm;
+    const int num_splits = total_bh >= ctas_per_wave
+        ? 1 : std::min((ctas_per_wave + total_bh - 1) / total_bh, max_q_steps);
+
+    // The params of the problems, the first CTA and the splits of each problem go to the device in
+    // one copy. The caching host allocator keeps the pinned buffer until the copy is done.
+    const size_t problems_bytes = num_problems * sizeof(Fused_multihead_attention_fprop_params);
+    const size_t bytes = problems_bytes + (2 * num_problems + 1) * sizeof(int);
+    auto problems_host = torch::empty({int64_t(bytes)}, torch::dtype(torch::kUInt8).pinned_memory(true));
+    char *host_ptr = static_cast<char *>(problems_host.data_ptr());
+    memcpy(host_ptr, problems.data(), problems_bytes);
+    int *cta_offsets = reinterpret_cast<int *>(host_ptr + problems_bytes);
+    int *splits = cta_offsets + num_problems + 1;
+    cta_offsets[0] = 0;
+    for (int g = 0; g < num_problems; ++g) {
+        splits[g] = std::max(std::min(num_splits, problems[g].seqlen_q / 16), 1);
+        cta_offsets[g + 1] = cta_offsets[g] + problems[g].b * problems[g].h * splits[g];
+    }
+    group.num_ctas = cta_offsets[num_problems];
+    auto problems_dev = problems_host.to(opts.device(), torch::kUInt8, /*non_blocking=*/true);
+    char *dev_ptr = static_cast<char *>(problems_dev.data_ptr());
+    group.problems = reinterpret_cast<const Fused_multihead_attention_fprop_params *>(dev_ptr);
+    group.cta_offsets = reinterpret_cast<const int *>(dev_ptr + problems_bytes);
+    group.num_splits = group.cta_offsets + num_problems + 1;
+
+    run_fmha_fp16_sm80_grouped(launch_params, /*configure=*/false);
+    return result;
+}
+
+std::vector<at::Tensor>
+mha_bwd(const std::vector<at::Tensor> &dout,  // num_v x (total_q x num_heads x head_size)
+        const std::vector<at::Tensor> &qkvv,  // Q: total_q x num_heads x head_size, K and the V_i: total_k x num_heads x head_size
+        const std::vector<at::Tensor> &out,   // num_v x (total_q x num_heads x head_size)
+        const std::vector<at::Tensor> &dqkvv,  // same shapes as qkvv, any row and head strides
+        const at::Tensor &softmax_lse,  // h x total_q softmax logsumexp
+        const c10::optional<at::Tensor> &cu_seqlens_q_, // b+1, or nullopt for padded batches
+        const c10::optional<at::Tensor> &cu_seqlens_k_, // b+1
+        const float p_dropout,          // probability to drop
+        const float softmax_scale,
+        const int max_seqlen_q_,        // max sequence lengths to choose the kernel
+        const int max_seqlen_k_,
+        const bool zero_tensors,
+        const bool is_causal,
+        const int window_left,
+        const int window_right,
+        const c10::optional<at::Tensor> &alibi_slopes_,
+        const c10::optional<at::Tensor> &rotary_cos_,
+        const c10::optional<at::Tensor> &rotary_sin_,
+        const c10::optional<at::Tensor> &seqlens_q_,  // b, with total_q = b x padded seqlen_q
+        const c10::optional<at::Tensor> &seqlens_k_,  // b, with total_k = b x padded seqlen_k
+        c10::optional<at::Generator> gen_) {
+
+    auto dprops = at::cuda::getCurrentDeviceProperties();
+    check_device(dprops);
+    bool is_dropout = p_dropout > 0.0;
+    auto stream = at::cuda::getCurrentCUDAStream().stream();
+
+    const int num_v = int(qkvv.size()) - 2;
+    TORCH_CHECK(num_v >= 1 && num_v <= MAX_NUM_V);
+    TORCH_CHECK(int(dout.size()) == num_v && int(out.size()) == num_v);
+    TORCH_CHECK(dqkvv.size() == qkvv.size());
+
+    auto q_dtype = qkvv[0].dtype();
+    TORCH_CHECK(q_dtype == torch::kFloat16 || q_dtype == torch::kBFloat16);
+    TORCH_CHECK(softmax_lse.dtype() == torch::kFloat32);
+    const bool is_bf16 = q_dtype == torch::kBFloat16;
+
+    TORCH_CHECK(softmax_lse.is_contiguous())
+
+    TORCH_CHECK(qkvv[0].dim() == 3 && qkvv[1].dim() == 3);
+
+    const int total_q = qkvv[0].size(0);
+    const int total_k = qkvv[1].size(0);
+    const int num_heads = qkvv[0].size(1);
+    const int head_size = qkvv[0].size(2);
+    check_qkv(qkvv, q_dtype, total_q, total_k, num_heads, head_size);
+    check_qkv(dqkvv, q_dtype, total_q, total_k, num_heads, head_size);
+    const int batch_size = check_seqlens(cu_seqlens_q_, cu_seqlens_k_, seqlens_q_, seqlens_k_, total_q, total_k);
+    // The kernel doesn't write the gradients of the padding rows of the padded batches.
+    const bool is_padded = seqlens_q_.has_value();
+    TORCH_CHECK(head_size % 8 == 0 && head_size <= 128, "head_size must be a multiple of 8 and at most 128");
+    const int head_size_rounded = fmha_round_head_dim(head_size);
+    TORCH_CHECK(head_size_rounded != 128 || num_v <= 2);
+    check_build(head_size, num_v, is_bf16, is_dropout, /*return_softmax=*/false);
+
+    void *dout_ptrs[MAX_NUM_V];
+    void *out_ptrs[MAX_NUM_V];
+    for (int vi = 0; vi < num_v; ++vi) {
+        TORCH_CHECK(dout[vi].dtype() == q_dtype);
+        TORCH_CHECK(out[vi].dtype() == q_dtype);
+        TORCH_CHECK(dout[vi].is_contiguous())
+        TORCH_CHECK(out[vi].is_contiguous())
+        TORCH_CHECK(dout[vi].sizes() == out[0].sizes() && out[vi].sizes() == out[0].sizes());
+        dout_ptrs[vi] = dout[vi].data_ptr();
+        out_ptrs[vi] = out[vi].data_ptr();
+    }
+    TORCH_CHECK(out[0].size(0) == total_q && out[0].size(1) == num_heads && out[0].size(2) == head_size);
+
+    // Has to match the forward pass, otherwise the dropout masks differ.
+    int base_N = fwd_base_N(head_size, num_v);
+    int max_seqlen_k = 512;
+    if( max_seqlen_k_ <= 128 ) {
+        max_seqlen_k = 128;
+    } else if( max_seqlen_k_ <= 256 ) {
+        max_seqlen_k = 256;
+    } else {
+        max_seqlen_k = ((max_seqlen_k_ + base_N - 1) / base_N) * base_N;
+    }
+    int max_seqlen_q = ((max_seqlen_q_ + 16 - 1) / 16) * 16;
+    bool loop = max_seqlen_k > base_N;
+    TORCH_CHECK(softmax_lse.dim() == 2 && softmax_lse.size(0) == num_heads && softmax_lse.size(1) == total_q);
+
+    auto opts = qkvv[0].options();
+    auto softmax_d = torch::empty({num_heads, total_q}, opts.dtype(at::kFloat));
+    at::Tensor dq_tmp;
+    if (loop) {
+        dq_tmp = torch::empty({total_q, num_heads, head_size}, opts.dtype(at::kFloat));
+    }
+
+    if( zero_tensors || is_padded ) {
+        for (const auto &t : dqkvv) { t.zero_(); }
+    }
+    if( zero_tensors ) {
+        softmax_d.zero_();
+        if (loop) { dq_tmp.zero_(); }
+    }
+
+    Fused_multihead_attention_fprop_params params;
+
+    set_params(params,
+               batch_size,
+               max_seqlen_q,
+               max_seqlen_k,
+               num_heads,
+               head_size,
+               num_v,
+               qkvv,
+               nullptr,
+               nullptr,
+               out_ptrs,
+               nullptr,
+               dout_ptrs,
+               nullptr,
+               softmax_lse.data_ptr(),
+               softmax_d.data_ptr(),
+               p_dropout,
+               softmax_scale,
+               is_causal,
+               window_left,
+               window_right,
+               is_bf16);
+    params.dq_tmp_ptr = loop ? dq_tmp.data_ptr() : nullptr;
+    set_qkv_ptrs(params.dqkv_ptrs, params.dqkv_row_stride_in_elts, params.dqkv_head_stride_in_elts, dqkvv);
+    std::vector<at::Tensor> accessed = qkvv;
+    accessed.insert(accessed.end(), dqkvv.begin(), dqkvv.end());
+    accessed.insert(accessed.end(), out.begin(), out.end());
+    accessed.insert(accessed.end(), dout.begin(), dout.end());
+    if (loop) { accessed.push_back(dq_tmp); }
+    params.is_64bit_index = needs_64bit_index(accessed);
+    TORCH_CHECK(FMHA_BUILD_64BIT_INDEX || !params.is_64bit_index,
+                "Tensors larger than 2GB are not built, see STREAM_ATTN_DISABLE_64BIT_INDEX");
+    set_alibi_slopes(params, alibi_slopes_, batch_size, num_heads);
+    set_rotary(params, rotary_cos_, rotary_sin_, std::max(max_seqlen_q_, max_seqlen_k_), head_size);
+    set_seqlens(params, cu_seqlens_q_, cu_seqlens_k_, seqlens_q_, seqlens_k_, total_q, total_k);
+
+    auto gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+        gen_, at::cuda::detail::getDefaultCUDAGenerator());
+
+    // The rng state is reset to the one of the forward pass in Python before calling this, so the
+    // counter offset here doesn't matter, we just need the same seed and offset as the forward.
+    int64_t counter_offset = 4;
+
+    if( is_dropout ) {
+        // See Note [Acquire lock when using random generators]
+        std::lock_guard<std::mutex> lock(gen->mutex_);
+        params.philox_args = gen->philox_cuda_state(counter_offset);
+    }
+
+    run_fmha_dgrad_fp16_sm80(params, stream);
+
+    return {softmax_d};
+}
+
+std::vector<at::Tensor>
+mha_fwd_decode(const at::Tensor &q,            // batch_size x num_heads x head_size, one new token per sequence
+               const at::Tensor &kvv_cache,    // num_blocks x page_size x (1 + num_v) x num_heads x head_size
+               const at::Tensor &block_table,  // batch_size x max_num_blocks_per_seq
+               const at::Tensor &seqlens_k,    // batch_size, the number of keys in the cache of each sequence
+               const int max_seqlen_k,
+               const float softmax_scale,
+               const int num_splits,           // 0 picks the number of splits of the keys with a heuristic
+               const c10::optional<at::Tensor> &kvv_scales_) {  // fp32 scales of an 8-bit cache, (1 + num_v) x num_heads or num_blocks x (1 + num_v) x num_heads
+
+    auto dprops = at::cuda::getCurrentDeviceProperties();
+    check_device(dprops);
+    auto stream = at::cuda::getCurrentCUDAStream().stream();
+    Launch_params<Fused_multihead_attention_decode_params> launch_params(dprops, stream, false, false);
+
+    auto q_dtype = q.dtype();
+    TORCH_CHECK(q_dtype == torch::kFloat16 || q_dtype == torch::kBFloat16);
+    // An 8-bit cache is int8, or uint8 holding the bits of fp8 e4m3.
+    const bool is_quantized = kvv_cache.dtype() == torch::kInt8 || kvv_cache.dtype() == torch::kUInt8;
+    TORCH_CHECK(kvv_cache.dtype() == q_dtype || is_quantized);
+    TORCH_CHECK(is_quantized == kvv_scales_.has_value(), "kvv_scales must be given with an 8-bit cache, and only then");
+    TORCH_CHECK(block_table.dtype() == torch::kInt32);
+    TORCH_CHECK(seqlens_k.dtype() == torch::kInt32);
+
+    TORCH_CHECK(q.is_cuda())
+    TORCH_CHECK(kvv_cache.is_cuda())
+    TORCH_CHECK(block_table.is_cuda())
+    TORCH_CHECK(seqlens_k.is_cuda())
+
+    TORCH_CHECK(q.is_contiguous())
+    TORCH_CHECK(kvv_cache.is_contiguous())
+    TORCH_CHECK(block_table.is_contiguous())
+    TORCH_CHECK(seqlens_k.is_contiguous())
+
+    TORCH_CHECK(q.dim() == 3);
+    TORCH_CHECK(kvv_cache.dim() == 5);
+    TORCH_CHECK(block_table.dim() == 2);
+    TORCH_CHECK(seqlens_k.dim() == 1);
+
+    const int batch_size = q.size(0);
+    const int num_heads = q.size(1);
+    const int head_size = q.size(2);
+    const int page_size = kvv_cache.size(1);
+    const int num_v = kvv_cache.size(2) - 1;
+    TORCH_CHECK(batch_size > 0);
+    TORCH_CHECK(head_size == 16 || head_size == 32 || head_size == 64 || head_size == 128);
+    TORCH_CHECK(num_v >= 1 && num_v <= MAX_NUM_V);
+    check_build(head_size, num_v, q_dtype == torch::kBFloat16, /*is_dropout=*/false, /*return_softmax=*/false);
+    TORCH_CHECK(kvv_cache.size(3) == num_heads && kvv_cache.size(4) == head_size);
+    TORCH_CHECK(block_table.size(0) == batch_size && seqlens_k.size(0) == batch_size);
+    TORCH_CHECK(int64_t(block_table.size(1)) * page_size >= max_seqlen_k);
+    TORCH_CHECK(num_splits >= 0 && num_splits <= MAX_DECODE_SPLITS);
+    if (is_quantized) {
+        const auto &kvv_scales = kvv_scales_.value();
+        TORCH_CHECK(kvv_scales.dtype() == torch::kFloat32, "kvv_scales must be fp32");
+        TORCH_CHECK(kvv_scales.is_cuda())
+        TORCH_CHECK(kvv_scales.is_contiguous())
+        TORCH_CHECK((kvv_scales.dim() == 2 && kvv_scales.size(0) == num_v + 1 && kvv_scales.size(1) == num_heads)
+                    || (kvv_scales.dim() == 3 && kvv_scales.size(0) == kvv_cache.size(0)
+                        && kvv_scales.size(1) == num_v + 1 && kvv_scales.size(2) == num_heads),
+                    "kvv_scales must be of shape (1 + num_v, num_heads) or (num_blocks, 1 + num_v, num_heads)");
+    }
+
+    auto opts = q.options();
+
+    std::vector<at::Tensor> out(num_v);
+    for (int vi = 0; vi < num_v; ++vi) {
+        out[vi] = torch::empty({ batch_size, num_heads, head_size }, opts);
+    }
+    auto softmax_lse = torch::empty({batch_size, num_heads}, opts.dtype(at::kFloat));
+
+    auto &params = launch_params.params;
+    memset(&params, 0, sizeof(params));
+    params.q_ptr = q.data_ptr();
+    params.kvv_cache_ptr = kvv_cache.data_ptr();
+    params.kvv_stride_in_elts = (1 + num_v) * num_heads * head_size;
+    if (is_quantized) {
+        const auto &kvv_scales = kvv_scales_.value();
+        params.cache_type = kvv_cache.dtype() == torch::kInt8 ? DATA_TYPE_INT8 : DATA_TYPE_FP8_E4M3;
+        params.kvv_scales_ptr = kvv_scales.data_ptr<float>();
+        params.kvv_scales_block_stride = kvv_scales.dim() == 3 ? (num_v + 1) * num_heads : 0;
+    } else {
+        params.cache_type = q_dtype == torch::kBFloat16 ? DATA_TYPE_BF16 : DATA_TYPE_FP16;
+    }
+    params.block_table = static_cast<int *>(block_table.data_ptr());
+    params.block_table_stride = block_table.size(1);
+    params.seqlens_k = static_cast<int *>(seqlens_k.data_ptr());
+    for (int vi = 0; vi < num_v; ++vi) { params.o_ptrs[vi] = out[vi].data_ptr(); }
+    params.softmax_lse_ptr = softmax_lse.data_ptr();
+    params.b = batch_size;
+    params.h = num_heads;
+    params.d = head_size;
+    params.s = max_seqlen_k;
+    params.num_v = num_v;
+    params.page_size = page_size;
+    params.scale_bmm1f = softmax_scale;
+    params.is_bf16 = q_dtype == torch::kBFloat16;
+
+    run_fmha_decode_fp16_sm80(launch_params, /*configure=*/ true);
+    params.num_splits = num_splits > 0 ? num_splits : launch_params.num_splits;
+
+    at::Tensor o_accum, lse_accum;
+    if (params.num_splits > 1) {
+        o_accum = torch::empty({params.num_splits, batch_size, num_heads, num_v, head_size}, opts.dtype(at::kFloat));
+        lse_accum = torch::empty({params.num_splits, batch_size, num_heads}, opts.dtype(at::kFloat));
+        params.o_accum_ptr = o_accum.data_ptr();
+        params.lse_accum_ptr = lse_accum.data_ptr();
+    }
+
+    run_fmha_decode_fp16_sm80(launch_params, /*configure=*/false);
+
+    std::vector<at::Tensor> result = out;
+    result.push_back(softmax_lse);
+    return result;
+}
+
+// Merges the partial results of the same queries against different keys into the first partial,
+// in place, e.g. the outputs of fwd for the K/V shards of the GPUs with ring attention. A partial
+// is the num_v normalized outputs and the log-sum-exp returned by fwd, the queries without keys in
+// a partial have lse -inf (see zero_tensors). The merge is done in fp32, the first partial can be
+// fp32 to keep the running result in fp32 across several merges.
+void
+mha_fwd_merge(const std::vector<at::Tensor> &outs,   // num_partials * num_v tensors total_q x num_heads x head_size, by partial
+              const std::vector<at::Tensor> &softmax_lses) {  // num_partials tensors num_heads x total_q, fp32
+    auto stream = at::cuda::getCurrentCUDAStream().stream();
+
+    const int num_partials = softmax_lses.size();
+    TORCH_CHECK(num_partials >= 1 && outs.size() % num_partials == 0);
+    const int num_v = outs.size() / num_partials;
+    TORCH_CHECK(num_v >= 1 && num_v <= MAX_NUM_V);
+    TORCH_CHECK(outs[0].dim() == 3);
+    const int total_q = outs[0].size(0);
+    const int num_heads = outs[0].size(1);
+    const int head_size = outs[0].size(2);
+    auto dtype = outs[0].dtype();
+    TORCH_CHECK(dtype == torch::kFloat16 || dtype == torch::kBFloat16 || dtype == torch::kFloat32);
+    for (int pi = 0; pi < num_partials; ++pi) {
+        const auto &lse = softmax_lses[pi];
+        TORCH_CHECK(lse.dtype() == torch::kFloat32);
+        TORCH_CHECK(lse.is_cuda())
+        TORCH_CHECK(lse.is_contiguous())
+        TORCH_CHECK(lse.dim() == 2 && lse.size(0) == num_heads && lse.size(1) == total_q);
+        for (int vi = 0; vi < num_v; ++vi) {
+            const auto &o = outs[pi * num_v + vi];
+            // The first partial can be fp32 while the others are in the type of fwd.
+            TORCH_CHECK(o.dtype() == (pi == 0 ? dtype : outs[num_v].dtype()));
+            TORCH_CHECK(o.is_cuda())
+            TORCH_CHECK(o.is_contiguous())
+            TORCH_CHECK(o.sizes() == outs[0].sizes());
+        }
+    }
+    if (num_partials == 1) { return; }
+    auto partial_dtype = outs[num_v].dtype();
+    TORCH_CHECK(partial_dtype == torch::kFloat16 || partial_dtype == torch::kBFloat16 || partial_dtype == torch::kFloat32);
+    TORCH_CHECK(dtype == partial_dtype || dtype == torch::kFloat32,
+                "The first partial must have the type of the others or be fp32");
+
+    auto data_type = [](const caffe2::TypeMeta t) {
+        return t == torch::kFloat16 ? DATA_TYPE_FP16 : (t == torch::kBFloat16 ? DATA_TYPE_BF16 : DATA_TYPE_FP32);
+    };
+    // The first partial holds the result of the previous launches, so up to MAX_MERGE_PARTIALS - 1
+    // new partials are merged into it by each launch.
+    for (int begin = 1; begin < num_partials; begin += MAX_MERGE_PARTIALS - 1) {
+        const int end = std::min(begin + MAX_MERGE_PARTIALS - 1, num_partials);
+        Fused_multihead_attention_merge_params params;
+        memset(&params, 0, sizeof(params));
+        params.num_partials = 1 + end - begin;
+        for (int pi = 0; pi < params.num_partials; ++pi) {
+            const int src = pi == 0 ? 0 : begin + pi - 1;
+            for (int vi = 0; vi < num_v; ++vi) { params.o_ptrs[pi][vi] = outs[src * num_v + vi].data_ptr(); }
+            params.lse_ptrs[pi] = softmax_lses[src].data_ptr<float>();
+        }
+        params.total_q = total_q;
+        params.h = num_heads;
+        params.d = head_size;
+        params.num_v = num_v;
+        params.out_type = data_type(dtype);
+        params.partial_type = data_type(partial_dtype);
+        run_fmha_merge(params, stream);
+    }
+}
+
+// The converted blockmask has a column per 256 keys and a row per 16 queries of max_seqlen.
+void check_blockmask(const at::Tensor &blockmask, const int max_seqlen) {
+    TORCH_CHECK(blockmask.dtype() == torch::kInt32);
+    TORCH_CHECK(blockmask.is_cuda())
+    TORCH_CHECK(blockmask.is_contiguous())
+    TORCH_CHECK(blockmask.dim() == 2);
+    TORCH_CHECK(blockmask.size(0) == max_seqlen / 256 && blockmask.size(1) == max_seqlen / 16,
+                "The blockmask must be converted for the sequence length rounded up to 256");
+}
+
+std::vector<at::Tensor>
+mha_fwd_block(const std::vector<at::Tensor> &qkvv,  // Q, K, V_0, ..., V_{num_v - 1}: total x num_heads x head_size
+              const at::Tensor &cu_seqlens,  // b+1
+              const at::Tensor &blockmask,   // (seqlen / 256, seqlen / 16), see convert_blockmask
+              const float p_dropout,
+              const int max_seqlen_,
+              const float softmax_scale,
+              const bool zero_tensors,
+              const bool is_causal,
+              const bool return_softmax,
+              c10::optional<at::Generator> gen_) {
+
+    auto dprops = at::cuda::getCurrentDeviceProperties();
+    check_device(dprops);
+    auto stream = at::cuda::getCurrentCUDAStream().stream();
+    bool is_dropout = p_dropout > 0.0;
+    Launch_params<Fused_multihead_attention_fprop_params> launch_params(dprops, stream, is_dropout, return_softmax);
+
+    const int num_v = int(qkvv.size()) - 2;
+    // The block-sparse kernels use N=256, more than 2 value tensors don't fit in shared memory.
+    TORCH_CHECK(num_v >= 1 && num_v <= 2);
+
+    auto q_dtype = qkvv[0].dtype();
+    TORCH_CHECK(q_dtype == torch::kFloat16 || q_dtype == torch::kBFloat16);
+    TORCH_CHECK(cu_seqlens.dtype() == torch::kInt32);
+    const bool is_bf16 = q_dtype == torch::kBFloat16;
+
+    TORCH_CHECK(cu_seqlens.is_cuda())
+    TORCH_CHECK(cu_seqlens.is_contiguous())
+    TORCH_CHECK(cu_seqlens.dim() == 1);
+    TORCH_CHECK(qkvv[0].dim() == 3);
+
+    const int batch_size = cu_seqlens.numel() - 1;
+    const int total = qkvv[0].size(0);
+    const int num_heads = qkvv[0].size(1);
+    const int head_size = qkvv[0].size(2);
+    check_qkv(qkvv, q_dtype, total, total, num_heads, head_size);
+    TORCH_CHECK(batch_size > 0);
+    TORCH_CHECK(head_size == 16 || head_size == 32 || head_size == 64);
+    check_build(head_size, num_v, is_bf16, is_dropout, return_softmax);
+
+    // The blockmask has a column per 256 keys, so the keys are always looped over in blocks of 256.
+    const int max_seqlen = ((max_seqlen_ + 256 - 1) / 256) * 256;
+    check_blockmask(blockmask, max_seqlen);
+    bool loop = max_seqlen > 256;
+
+    auto opts = qkvv[0].options();
+
+    std::vector<at::Tensor> ctx(num_v);
+    std::vector<at::Tensor> o_tmp(num_v);
+    void *ctx_ptrs[MAX_NUM_V];
+    void *o_tmp_ptrs[MAX_NUM_V];
+    for (int vi = 0; vi < num_v; ++vi) {
+        ctx[vi] = torch::empty({ total, num_heads, head_size }, opts);
+        ctx_ptrs[vi] = ctx[vi].data_ptr();
+        if (loop) { o_tmp[vi] = torch::empty({total, num_heads, head_size}, opts.dtype(at::kFloat)); }
+        o_tmp_ptrs[vi] = loop ? o_tmp[vi].data_ptr() : nullptr;
+    }
+
+    auto softmax_lse = torch::empty({num_heads, total}, opts.dtype(at::kFloat));
+
+    at::Tensor s;
+    if (return_softmax) {
+        s = torch::empty({ batch_size, num_heads, max_seqlen, max_seqlen }, opts);
+    }
+
+    // The rows without any nonzero block are not written by the kernel.
+    if( zero_tensors ) {
+        for (int vi = 0; vi < num_v; ++vi) {
+            ctx[vi].zero_();
+            if (loop) { o_tmp[vi].zero_(); }
+        }
+        softmax_lse.fill_(-std::numeric_limits<float>::infinity());
+        if (return_softmax) {s.zero_();}
+    }
+
+    auto gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+        gen_, at::cuda::detail::getDefaultCUDAGenerator());
+
+    set_params(launch_params.params,
+               batch_size,
+               max_seqlen,
+               max_seqlen,
+               num_heads,
+               head_size,
+               num_v,
+               qkvv,
+               cu_seqlens.data_ptr(),
+               cu_seqlens.data_ptr(),
+               ctx_ptrs,
+               o_tmp_ptrs,
+               nullptr,
+               return_softmax ? s.data_ptr() : nullptr,
+               softmax_lse.data_ptr(),
+               nullptr,
+               p_dropout,
+               softmax_scale,
+               is_causal,
+               /*window_left=*/-1,
+               /*window_right=*/-1,
+               is_bf16);
+    launch_params.params.blockmask = static_cast<int *>(blockmask.data_ptr());
+    std::vector<at::Tensor> accessed = qkvv;
+    accessed.insert(accessed.end(), ctx.begin(), ctx.end());
+    if (loop) { accessed.insert(accessed.end(), o_tmp.begin(), o_tmp.end()); }
+    if (return_softmax) { accessed.push_back(s); }
+    TORCH_CHECK(!needs_64bit_index(accessed), "The block-sparse kernels don't support tensors larger than 2GB");
+
+    run_fmha_block_fp16_sm80(launch_params, /*configure=*/ true);
+    // number of times random will be generated per thread, to offset philox counter in thc random
+    // state
+    int64_t counter_offset = launch_params.elts_per_thread;
+
+    if( is_dropout ) {
+        // See Note [Acquire lock when using random generators]
+        std::lock_guard<std::mutex> lock(gen->mutex_);
+        launch_params.params.philox_args = gen->philox_cuda_state(counter_offset);
+    }
+
+    run_fmha_block_fp16_sm80(launch_params, /*configure=*/false);
+
+    std::vector<at::Tensor> result = ctx;
+    result.push_back(softmax_lse);
     if (return_softmax) {result.push_back(s);}
     return result;
 }
 
+std::vector<at::Tensor>
+mha_bwd_block(const std::vector<at::Tensor> &dout,   // num_v x (total x num_heads x head_size)
+              const std::vector<at::Tensor> &qkvv,   // Q, K, V_0, ..., V_{num_v - 1}: total x num_heads x head_size
+              const std::vector<at::Tensor> &out,    // num_v x (total x num_heads x head_size)
+              const std::vector<at::Tensor> &dqkvv,  // same shapes as qkvv, any row and head strides
+              const at::Tensor &softmax_lse,  // h x total softmax logsumexp
+              const at::Tensor &cu_seqlens,   // b+1
+              const at::Tensor &blockmask,    // (seqlen / 256, seqlen / 16), see convert_blockmask
+              const float p_dropout,          // probability to drop
+              const float softmax_scale,
+              const int max_seqlen_,
+              const bool zero_tensors,
+              const bool is_causal,
+              c10::optional<at::Generator> gen_) {
+
+    auto dprops = at::cuda::getCurrentDeviceProperties();
+    check_device(dprops);
+    bool is_dropout = p_dropout > 0.0;
+    auto stream = at::cuda::getCurrentCUDAStream().stream();
+
+    const int num_v = int(qkvv.size()) - 2;
+    TORCH_CHECK(num_v >= 1 && num_v <= 2);
+    TORCH_CHECK(int(dout.size()) == num_v && int(out.size()) == num_v);
+    TORCH_CHECK(dqkvv.size() == qkvv.size());
+
+    auto q_dtype = qkvv[0].dtype();
+    TORCH_CHECK(q_dtype == torch::kFloat16 || q_dtype == torch::kBFloat16);
+    TORCH_CHECK(softmax_lse.dtype() == torch::kFloat32);
+    TORCH_CHECK(cu_seqlens.dtype() == torch::kInt32);
+    const bool is_bf16 = q_dtype == torch::kBFloat16;
+
+    TORCH_CHECK(cu_seqlens.is_cuda())
+    TORCH_CHECK(softmax_lse.is_contiguous())
+    TORCH_CHECK(cu_seqlens.is_contiguous())
+    TORCH_CHECK(cu_seqlens.dim() == 1);
+    TORCH_CHECK(qkvv[0].dim() == 3);
+
+    const int batch_size = cu_seqlens.numel() - 1;
+    const int total = qkvv[0].size(0);
+    const int num_heads = qkvv[0].size(1);
+    const int head_size = qkvv[0].size(2);
+    check_qkv(qkvv, q_dtype, total, total, num_heads, head_size);
+    check_qkv(dqkvv, q_dtype, total, total, num_heads, head_size);
+    TORCH_CHECK(batch_size > 0);
+    TORCH_CHECK(head_size == 16 || head_size == 32 || head_size == 64);
+    check_build(head_size, num_v, is_bf16, is_dropout, /*return_softmax=*/false);
+
+    void *dout_ptrs[MAX_NUM_V];
+    void *out_ptrs[MAX_NUM_V];
+    for (int vi = 0; vi < num_v; ++vi) {
+        TORCH_CHECK(dout[vi].dtype() == q_dtype);
+        TORCH_CHECK(out[vi].dtype() == q_dtype);
+        TORCH_CHECK(dout[vi].is_contiguous())
+        TORCH_CHECK(out[vi].is_contiguous())
+        TORCH_CHECK(dout[vi].sizes() == out[0].sizes() && out[vi].sizes() == out[0].sizes());
+        dout_ptrs[vi] = dout[vi].data_ptr();
+        out_ptrs[vi] = out[vi].data_ptr();
+    }
+    TORCH_CHECK(out[0].size(0) == total && out[0].size(1) == num_heads && out[0].size(2) == head_size);
+
+    const int max_seqlen = ((max_seqlen_ + 256 - 1) / 256) * 256;
+    check_blockmask(blockmask, max_seqlen);
+    bool loop = max_seqlen > 256;
+    TORCH_CHECK(softmax_lse.dim() == 2 && softmax_lse.size(0) == num_heads && softmax_lse.size(1) == total);
+
+    auto opts = qkvv[0].options();
+    auto softmax_d = torch::empty({num_heads, total}, opts.dtype(at::kFloat));
+    at::Tensor dq_tmp;
+    if (loop) {
+        dq_tmp = torch::empty({total, num_heads, head_size}, opts.dtype(at::kFloat));
+    }
+
+    // The rows and columns without any nonzero block are not written by the kernel.
+    if( zero_tensors ) {
+        for (const auto &t : dqkvv) { t.zero_(); }
+        softmax_d.zero_();
+        if (loop) { dq_tmp.zero_(); }
+    }
+
+    Fused_multihead_attention_fprop_params params;
+
+    set_params(params,
+               batch_size,
+               max_seqlen,
+               max_seqlen,
+               num_heads,
+               head_size,
+               num_v,
+               qkvv,
+               cu_seqlens.data_ptr(),
+               cu_seqlens.data_ptr(),
+               out_ptrs,
+               nullptr,
+               dout_ptrs,
+               nullptr,
+               softmax_lse.data_ptr(),
+               softmax_d.data_ptr(),
+               p_dropout,
+               softmax_scale,
+               is_causal,
+               /*window_left=*/-1,
+               /*window_right=*/-1,
+               is_bf16);
+    params.blockmask = static_cast<int *>(blockmask.data_ptr());
+    params.dq_tmp_ptr = loop ? dq_tmp.data_ptr() : nullptr;
+    set_qkv_ptrs(params.dqkv_ptrs, params.dqkv_row_stride_in_elts, params.dqkv_head_stride_in_elts, dqkvv);
+    std::vector<at::Tensor> accessed = qkvv;
+    accessed.insert(accessed.end(), dqkvv.begin(), dqkvv.end());
+    accessed.insert(accessed.end(), out.begin(), out.end());
+    accessed.insert(accessed.end(), dout.begin(), dout.end());
+    if (loop) { accessed.push_back(dq_tmp); }
+    TORCH_CHECK(!needs_64bit_index(accessed), "The block-sparse kernels don't support tensors larger than 2GB");
+
+    auto gen = at::get_generator_or_default<at::CUDAGeneratorImpl>(
+        gen_, at::cuda::detail::getDefaultCUDAGenerator());
+
+    // See mha_bwd, the rng state is the one of the forward pass.
+    int64_t counter_offset = 4;
+
+    if( is_dropout ) {
+        // See Note [Acquire lock when using random generators]
+        std::lock_guard<std::mutex> lock(gen->mutex_);
+        params.philox_args = gen->philox_cuda_state(counter_offset);
+    }
+
+    run_fmha_block_dgrad_fp16_sm80(params, stream);
+
+    return {softmax_d};
+}
+
+// Converts the (nrow, ncol) 0-1 blockmask to the format of the block-sparse kernels: for each
+// column, the rows of its nonzero blocks in order, times 8, +1 if the block is the first nonzero of
+// its row, +2 if it is the last one and +4 if it needs the causal mask, padded with -1. With causal,
+// the blocks above the diagonal are dropped. Returns a (ncol, nrow) int32 tensor.
+at::Tensor
+convert_blockmask(const at::Tensor &blockmask, const bool causal) {
+    TORCH_CHECK(blockmask.is_cuda())
+    TORCH_CHECK(blockmask.dim() == 2);
+    const int nrow = blockmask.size(0);
+    const int ncol = blockmask.size(1);
+    auto blockmask_u8 = blockmask.to(torch::kUInt8).contiguous();
+    auto out = torch::empty({ncol, nrow}, blockmask.options().dtype(torch::kInt32));
+    if (nrow > 0 && ncol > 0) {
+        run_fmha_convert_blockmask(blockmask_u8.data_ptr<uint8_t>(), out.data_ptr<int>(), nrow, ncol,
+                                   causal, at::cuda::getCurrentCUDAStream().stream());
+    }
+    return out;
+}
+
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m) {
     m.doc() = "Fused Multi-head Self-attention";
     m.def("fwd", &mha_fwd, "Forward pass");
+    // The names of the phases of the phase_clocks argument of fwd, see Fmha_phase.
+    static_assert(FMHA_NUM_PHASES == 5);
+    m.attr("fwd_phases") = py::make_tuple("load_qkv", "gemm_qk", "softmax", "gemm_pv", "store_o");
+    m.attr("profile_phases_built") = bool(FMHA_BUILD_PROFILE_PHASES);
+    m.def("fwd_workspace_size", &mha_fwd_workspace_size, "Size in bytes of the workspace of the forward pass");
+    m.def("fwd_grouped", &mha_fwd_grouped, "Forward pass of several independent problems in one launch");
+    m.def("bwd", &mha_bwd, "Backward pass");
+    m.def("fwd_decode", &mha_fwd_decode, "Forward pass of one new query token against a paged KV cache");
+    m.def("fwd_merge", &mha_fwd_merge, "Merge the partial results of fwd for different keys in place");
+    m.def("fwd_block", &mha_fwd_block, "Forward pass (blocksparse)");
+    m.def("bwd_block", &mha_bwd_block, "Backward pass (blocksparse)");
+    m.def("convert_blockmask", &convert_blockmask, "Convert a 0-1 blockmask for the block-sparse kernels");
 }
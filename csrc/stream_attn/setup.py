@@ -2,6 +2,7 @@
 import torch
 from torch.utils.cpp_extension import BuildExtension, CppExtension, CUDAExtension, CUDA_HOME
 from setuptools import setup, find_packages
+from packaging.version import Version
 import subprocess
 
 import sys
@@ -16,22 +17,21 @@ def get_cuda_bare_metal_version(cuda_dir):
     raw_output = subprocess.check_output([cuda_dir + "/bin/nvcc", "-V"], universal_newlines=True)
     output = raw_output.split()
     release_idx = output.index("release") + 1
-    release = output[release_idx].split(".")
-    bare_metal_major = release[0]
-    bare_metal_minor = release[1][0]
+    # e.g. "release 12.4, V12.4.131", the minor can have several digits.
+    release = output[release_idx].rstrip(",").split(".")[:2]
+    bare_metal_version = Version(".".join(str(int(x)) for x in release))
 
-    return raw_output, bare_metal_major, bare_metal_minor
+    return raw_output, bare_metal_version
 
 
 def check_cuda_torch_binary_vs_bare_metal(cuda_dir):
-    raw_output, bare_metal_major, bare_metal_minor = get_cuda_bare_metal_version(cuda_dir)
-    torch_binary_major = torch.version.cuda.split(".")[0]
-    torch_binary_minor = torch.version.cuda.split(".")[1]
+    raw_output, bare_metal_version = get_cuda_bare_metal_version(cuda_dir)
+    torch_binary_version = Version(".".join(torch.version.cuda.split(".")[:2]))
 
     print("\nCompiling cuda extensions with")
     print(raw_output + "from " + cuda_dir + "/bin\n")
 
-    if (bare_metal_major != torch_binary_major) or (bare_metal_minor != torch_binary_minor):
+    if bare_metal_version != torch_binary_version:
         raise RuntimeError(
             "Cuda extensions are being compiled with a version of Cuda that does "
             "not match the version used to compile Pytorch binaries.  "
@@ -53,8 +53,8 @@ def raise_if_cuda_home_none(global_option: str) -> None:
 
 
 def append_nvcc_threads(nvcc_extra_args):
-    _, bare_metal_major, bare_metal_minor = get_cuda_bare_metal_version(CUDA_HOME)
-    if int(bare_metal_major) >= 11 and int(bare_metal_minor) >= 2:
+    _, bare_metal_version = get_cuda_bare_metal_version(CUDA_HOME)
+    if bare_metal_version >= Version("11.2"):
         return nvcc_extra_args + ["--threads", "4"]
     return nvcc_extra_args
 
@@ -73,10 +73,10 @@ if not torch.cuda.is_available():
         'export TORCH_CUDA_ARCH_LIST="compute capability" before running setup.py.\n',
     )
     if os.environ.get("TORCH_CUDA_ARCH_LIST", None) is None:
-        _, bare_metal_major, bare_metal_minor = get_cuda_bare_metal_version(CUDA_HOME)
-        if int(bare_metal_major) == 11:
+        _, bare_metal_version = get_cuda_bare_metal_version(CUDA_HOME)
+        if bare_metal_version.major == 11:
             os.environ["TORCH_CUDA_ARCH_LIST"] = "6.0;6.1;6.2;7.0;7.5;8.0"
-            if int(bare_metal_minor) > 0:
+            if bare_metal_version.minor > 0:
                 os.environ["TORCH_CUDA_ARCH_LIST"] = "6.0;6.1;6.2;7.0;7.5;8.0;8.6"
         else:
             os.environ["TORCH_CUDA_ARCH_LIST"] = "6.0;6.1;6.2;7.0;7.5"
@@ -98,36 +98,86 @@ if os.path.exists(os.path.join(torch_dir, "include", "ATen", "CUDAGeneratorImpl.
 raise_if_cuda_home_none("--streamattn")
 # Check, if CUDA11 is installed for compute capability 8.0
 cc_flag = []
-_, bare_metal_major, _ = get_cuda_bare_metal_version(CUDA_HOME)
-if int(bare_metal_major) < 11:
+_, bare_metal_version = get_cuda_bare_metal_version(CUDA_HOME)
+if bare_metal_version < Version("11.0"):
     raise RuntimeError("--streamattn only supported on SM80+")
+# A fat binary for A100 (80), A10 / A40 (86), L4 / L40S (89) and H100 (90) by default, the archs
+# the CUDA version doesn't know are left out. STREAM_ATTN_CUDA_ARCHS=80,90 builds fewer. The newest
+# one also gets its PTX so that later GPUs can JIT it.
+min_cuda_version = {"80": Version("11.0"), "86": Version("11.1"), "89": Version("11.8"),
+                    "90": Version("11.8")}
+cuda_archs = os.environ.get("STREAM_ATTN_CUDA_ARCHS", "80,86,89,90")
+cuda_archs = [a.strip() for a in cuda_archs.replace(";", ",").split(",") if a.strip()]
+for arch in cuda_archs:
+    assert arch in min_cuda_version, f"Unsupported arch {arch} in STREAM_ATTN_CUDA_ARCHS"
+cuda_archs = sorted((a for a in cuda_archs if bare_metal_version >= min_cuda_version[a]), key=int)
+assert cuda_archs, "None of STREAM_ATTN_CUDA_ARCHS is supported by this CUDA version"
+for arch in cuda_archs:
+    cc_flag.append("-gencode")
+    cc_flag.append(f"arch=compute_{arch},code=sm_{arch}")
 cc_flag.append("-gencode")
-cc_flag.append("arch=compute_80,code=sm_80")
+cc_flag.append(f"arch=compute_{cuda_archs[-1]},code=compute_{cuda_archs[-1]}")
+
+# The instantiations can be limited to the configs that are deployed, which cuts the build time and
+# the size of the .so, e.g. STREAM_ATTN_HEADDIMS=64,128 STREAM_ATTN_NUM_V=1,2. Everything is built
+# by default. The configs left out raise an error at runtime, see csrc/stream_attn/src/static_switch.h.
+instantiation_flags = []
+headdims = os.environ.get("STREAM_ATTN_HEADDIMS", "")
+if headdims:
+    instantiation_flags.append("-DFMHA_HEADDIMS_SELECTED")
+    for d in headdims.split(","):
+        assert d.strip() in ["16", "32", "64", "128"], f"Unsupported head dim {d} in STREAM_ATTN_HEADDIMS"
+        instantiation_flags.append(f"-DFMHA_HDIM_{d.strip()}")
+num_vs = os.environ.get("STREAM_ATTN_NUM_V", "")
+if num_vs:
+    instantiation_flags.append("-DFMHA_NUM_V_SELECTED")
+    for v in num_vs.split(","):
+        assert v.strip() in ["1", "2", "3", "4"], f"Unsupported number of values {v} in STREAM_ATTN_NUM_V"
+        instantiation_flags.append(f"-DFMHA_NUM_V_{v.strip()}")
+for feature in ["BF16", "64BIT_INDEX", "DROPOUT", "RETURN_SOFTMAX", "AUTOTUNE", "NVTX"]:
+    if os.environ.get(f"STREAM_ATTN_DISABLE_{feature}", "0") == "1":
+        instantiation_flags.append(f"-DFMHA_DISABLE_{feature}")
+# The per-phase cycle counters of the fwd kernels (the phase_clocks argument of fwd), set
+# STREAM_ATTN_PROFILE_PHASES=1 to build them.
+if os.environ.get("STREAM_ATTN_PROFILE_PHASES", "0") == "1":
+    instantiation_flags.append("-DFMHA_PROFILE_PHASES")
+# The register / spill report of ptxas for every kernel, set STREAM_ATTN_PTXAS_VERBOSE=1 to get it.
+ptxas_flags = ["--ptxas-options=-v"] if os.environ.get("STREAM_ATTN_PTXAS_VERBOSE", "0") == "1" else []
 
 ext_modules.append(
     CUDAExtension(
         name="stream_attn_cuda",
         sources=[
             "fmha_api.cpp",
+            "src/fmha_autotune.cpp",
             "src/fmha_fprop_fp16_kernel.sm80.cu",
             "src/fmha_dgrad_fp16_kernel_loop.sm80.cu",
             "src/fmha_block_fprop_fp16_kernel.sm80.cu",
             "src/fmha_block_dgrad_fp16_kernel_loop.sm80.cu",
+            "src/fmha_decode_fp16_kernel.sm80.cu",
+            "src/fmha_blockmask_convert.cu",
+            "src/fmha_work_queue.cu",
+            "src/fmha_merge.cu",
         ],
         extra_compile_args={
-            "cxx": ["-O3"] + generator_flag,
+            "cxx": ["-O3"] + generator_flag + instantiation_flags,
             "nvcc": append_nvcc_threads(
                 [
                     "-O3",
                     "-U__CUDA_NO_HALF_OPERATORS__",
                     "-U__CUDA_NO_HALF_CONVERSIONS__",
+                    "-U__CUDA_NO_BFLOAT16_OPERATORS__",
+                    "-U__CUDA_NO_BFLOAT16_CONVERSIONS__",
+                    "-U__CUDA_NO_BFLOAT162_OPERATORS__",
+                    "-U__CUDA_NO_BFLOAT162_CONVERSIONS__",
                     "--expt-relaxed-constexpr",
                     "--expt-extended-lambda",
                     "--use_fast_math",
-                    "--ptxas-options=-v",
                     "-lineinfo"
                 ]
+                + ptxas_flags
                 + generator_flag
+                + instantiation_flags
                 + cc_flag
             ),
         },
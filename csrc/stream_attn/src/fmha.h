@@ -39,6 +39,7 @@
 #include <ATen/cuda/CUDAGraphsUtils.cuh>
 
 #include <fmha_utils.h>
+#include <static_switch.h>
 
 
 constexpr int TOTAL_DIM = 0;
@@ -46,19 +47,39 @@ constexpr int THREE_DIM = 1;
 constexpr int H_DIM = 2;
 constexpr int D_DIM = 3;
 
+// The maximum number of value tensors that can share one softmax(Q * K^T).
+constexpr int MAX_NUM_V = 4;
+
+// The maximum number of CTAs the keys of a (batch, head) are split over in the decode kernel.
+constexpr int MAX_DECODE_SPLITS = 128;
+
+// The maximum number of partial results merged by a launch of the merge kernel.
+constexpr int MAX_MERGE_PARTIALS = 8;
+
+// The phases of the fwd kernels timed with FMHA_PROFILE_PHASES, see fmha::Phase_clocks.
+enum Fmha_phase {
+    FMHA_PHASE_LOAD_QKV = 0,  // Q, K and the V_i from global memory to the fragments
+    FMHA_PHASE_GEMM_QK,       // P = Q * K^T
+    FMHA_PHASE_SOFTMAX,       // mask, max, exp, sum, dropout, and storing S
+    FMHA_PHASE_GEMM_PV,       // O_i += P^T * V_i^T for all the V_i
+    FMHA_PHASE_STORE_O,       // the reduction of the O_i and the sums across the warps, storing O and lse
+    FMHA_NUM_PHASES
+};
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 struct Qkv_params {
-    // The QKV matrices.
-    void * __restrict__ qkv_ptr;
+    // The Q, K and V_i matrices: qkv_ptrs[0] is Q, qkv_ptrs[1] is K and qkv_ptrs[2 + i] is V_i.
+    // They can be slices of a packed [total, 2 + num_v, h, d] tensor or separate tensors.
+    void * __restrict__ qkv_ptrs[2 + MAX_NUM_V];
 
-    // The stride between rows of the Q, K and V matrices.
+    // The stride between rows (tokens) and between heads of each of the matrices.
     // size_t qkv_stride_in_elts;
     // size_t qkv_stride_in_bytes;
     // TD [2022-04-16]: We're using 32-bit indexing to save registers.
-    // The code probably won't work for arrays larger than 2GB.
-    uint32_t qkv_stride_in_elts;
-    uint32_t qkv_stride_in_bytes;
+    // The strides stay 32-bit, arrays larger than 2GB use 64-bit offsets (see is_64bit_index).
+    uint32_t qkv_row_stride_in_elts[2 + MAX_NUM_V];
+    uint32_t qkv_head_stride_in_elts[2 + MAX_NUM_V];
 
     // The number of heads.
     int h;
@@ -68,17 +89,18 @@ struct Qkv_params {
 
 struct Fused_multihead_attention_fprop_params : public Qkv_params {
 
-    // The dQKV matrices.
-    void * __restrict__ dqkv_ptr;
+    // The dQ, dK and dV_i matrices, in the same order as qkv_ptrs.
+    void * __restrict__ dqkv_ptrs[2 + MAX_NUM_V];
+
+    // The stride between rows and between heads of each of the dQKV matrices.
+    uint32_t dqkv_row_stride_in_elts[2 + MAX_NUM_V];
+    uint32_t dqkv_head_stride_in_elts[2 + MAX_NUM_V];
 
     // Temporary for dKV.
     void * __restrict__ dkv_ptr;
 
-    // The O matrix (output).
-    void * __restrict__ o_ptr;
-
-    // The O2 matrix (output).
-    void * __restrict__ o2_ptr;
+    // The O matrices (outputs), one for each value tensor V_i.
+    void * __restrict__ o_ptrs[MAX_NUM_V];
 
     // The stride between rows of O.
     // size_t o_stride_in_elts;
@@ -86,16 +108,15 @@ struct Fused_multihead_attention_fprop_params : public Qkv_params {
     uint32_t o_stride_in_elts;
     uint32_t o_stride_in_bytes;
 
-    // The pointer to the O_tmp matrix, which holds O intermediate value during
+    // The pointers to the O_tmp matrices, which hold the O_i intermediate values during
     // the loop;
-    void *__restrict__ o_tmp_ptr;
+    void *__restrict__ o_tmp_ptrs[MAX_NUM_V];
 
-    // The pointer to the O2_tmp matrix, which holds O2 intermediate value during
-    // the loop;
-    void *__restrict__ o2_tmp_ptr;
+    // The pointer to the dQ_tmp matrix, which holds dQ intermediate value during the loop (bwd).
+    void *__restrict__ dq_tmp_ptr;
 
-    // The dO matrix .
-    void * __restrict__ do_ptr;
+    // The dO matrices, one for each output O_i.
+    void * __restrict__ do_ptrs[MAX_NUM_V];
 
     // The pointer to the S matrix, overwritten by the dP matrix (bwd).
     void * __restrict__ s_ptr;
@@ -109,18 +130,44 @@ struct Fused_multihead_attention_fprop_params : public Qkv_params {
     // The pointer to the softmax d sum.
     void * __restrict__ dsoftmax_sum;
 
-    // The dimensions.
-    int b, s, d;
+    // The fp32 entropy and largest probability of the softmax of each row, [2, h, total_q], or
+    // nullptr. Computed instead of returning S (see device_1xN_kv_inner_).
+    void * __restrict__ softmax_stats_ptr;
+
+    // The dimensions. seqlen_q and seqlen_k are the maximum lengths of the query and key
+    // sequences, rounded up to the tile sizes of the kernels.
+    int b, seqlen_q, seqlen_k, d;
+
+    // The number of query tokens of the batch. softmax_lse and dsoftmax_sum are [h, total_q].
+    int total_q;
+
+    // The number of value tensors sharing the softmax, there are 2 + num_v QKV matrices.
+    int num_v;
 
     // The scaling factors for the kernel.
     float scale_bmm1f;
     uint32_t scale_bmm1, scale_softmax, scale_bmm2;
 
-    // array of length b+1 holding starting offset of each sequence.
-    int * __restrict__ cu_seqlens;
+    // array of length b+1 holding starting offset of each query / key sequence.
+    int * __restrict__ cu_seqlens_q;
+    int * __restrict__ cu_seqlens_k;
+    // Padded batches have cu_seqlens_q == nullptr. The sequence b then takes the rows
+    // [b * padded_seqlen_q, (b + 1) * padded_seqlen_q) of Q and O and its length is seqlens_q[b],
+    // the same for K / V. The padding rows are not read or written.
+    int * __restrict__ seqlens_q;
+    int * __restrict__ seqlens_k;
+    int padded_seqlen_q, padded_seqlen_k;
 
     int *__restrict__ blockmask;
 
+    // The work queue of the persistent fwd kernel, or nullptr for the grid of (h, b) CTAs. The
+    // batches are in queue_order ([b]) by decreasing seqlen_k, the items of queue_order[r] are
+    // [queue_offsets[r], queue_offsets[r + 1]) ([b + 1]). The CTAs take the next item from
+    // queue_counter. See run_fmha_build_work_queue.
+    int * __restrict__ queue_counter;
+    int * __restrict__ queue_order;
+    int * __restrict__ queue_offsets;
+
     // The dropout probability (probability of keeping an activation).
     float p_dropout;
     uint32_t p_dropout_in_uint;
@@ -129,13 +176,134 @@ struct Fused_multihead_attention_fprop_params : public Qkv_params {
     // Scale factor of 1 / (1 - p_dropout).
     float rp_dropout;
 
-    // Scale factor of 1 / (1 - p_dropout), in half2.
+    // Scale factor of 1 / (1 - p_dropout), in half2 or bf162 (see is_bf16).
     uint32_t scale_dropout;
 
     // Random state.
     at::PhiloxCudaState philox_args;
 
+    // The kernels with Is_causal mask out the keys outside the band
+    // [i - window_left, i + window_right] of the query i. This covers the causal mask
+    // (window_right == 0) and sliding windows.
+    bool is_causal;
+    int window_left, window_right;
+
+    // The fp32 ALiBi slopes, [h] or [b, h] (batch stride 0 or h), or nullptr. The scores of the
+    // query i and the key j get -slope * |i - j|.
+    void * __restrict__ alibi_slopes_ptr;
+    int alibi_slopes_batch_stride;
+
+    // The fp32 rotary tables of Q and K, [seqlen_ro, rotary_dim / 2] each, or nullptr. The first
+    // rotary_dim columns of the rows of Q and K are rotated as they are loaded, by the position of
+    // the row in its sequence (see Gmem_tile_qkv::apply_rotary).
+    void * __restrict__ rotary_cos_ptr;
+    void * __restrict__ rotary_sin_ptr;
+    int rotary_dim;
+
+    // Q, K, V, O and their gradients are in bf16 instead of fp16.
+    bool is_bf16;
+
+    // Some tensor spans more than 2GB, so the kernels compute the offsets in 64 bits
+    // (see Kernel_traits::index_t).
+    bool is_64bit_index;
+
+    // The cycles spent in each Fmha_phase, [b, h, FMHA_NUM_PHASES], or nullptr. Only written by
+    // the builds with FMHA_PROFILE_PHASES.
+    long long * __restrict__ phase_clocks_ptr;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Attention of one new query token per sequence against a paged cache of K and the V_i.
+struct Fused_multihead_attention_decode_params {
+
+    // The query of the new token, [b, h, d].
+    void * __restrict__ q_ptr;
+
+    // The paged cache, [num_blocks, page_size, 1 + num_v, h, d] holding K | V_0 | ... | V_{num_v-1}.
+    void * __restrict__ kvv_cache_ptr;
+    // The stride between rows (tokens) of the cache, (1 + num_v) * h * d.
+    uint32_t kvv_stride_in_elts;
+    // The type of the cache: the type of q, or DATA_TYPE_INT8 / DATA_TYPE_FP8_E4M3 with the fp32
+    // scales of K and the V_i, [1 + num_v, h] (per head, block stride 0) or
+    // [num_blocks, 1 + num_v, h] (per cache block and head).
+    Data_type cache_type;
+    const float * __restrict__ kvv_scales_ptr;
+    int kvv_scales_block_stride;
+
+    // [b, block_table_stride]: entry j of a sequence is the cache block with its keys
+    // [j * page_size, (j + 1) * page_size).
+    int * __restrict__ block_table;
+    int block_table_stride;
+
+    // The number of keys in the cache of each sequence, [b].
+    int * __restrict__ seqlens_k;
+
+    // The O matrices, [b, h, d] each, and the log-sum-exp of the scores, [b, h].
+    void * __restrict__ o_ptrs[MAX_NUM_V];
+    void * __restrict__ softmax_lse_ptr;
+
+    // With num_splits > 1, the partial results of the splits in fp32 before they are merged:
+    // [num_splits, b, h, num_v, d] normalized outputs and [num_splits, b, h] log-sum-exp.
+    void * __restrict__ o_accum_ptr;
+    void * __restrict__ lse_accum_ptr;
+
+    // The dimensions. s is the longest sequence in the cache.
+    int b, h, d, s;
+    int num_v;
+    int page_size;
+
+    // The number of CTAs the keys of each (batch, head) are split over.
+    int num_splits;
+
+    float scale_bmm1f;
+
+    bool is_bf16;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Merge of the partial results of the same queries against different keys, e.g. the K/V shards of
+// the GPUs with sequence parallelism. The result goes to the first partial, in place.
+struct Fused_multihead_attention_merge_params {
+
+    // The normalized O matrices of each partial, [total_q, h, d] each.
+    void * __restrict__ o_ptrs[MAX_MERGE_PARTIALS][MAX_NUM_V];
+    // The fp32 log-sum-exp of the scores of each partial, [h, total_q].
+    float * __restrict__ lse_ptrs[MAX_MERGE_PARTIALS];
+
+    int num_partials;
+    int total_q, h, d;
+    int num_v;
+
+    // The type of the O matrices of the first partial and of the others, fp16, bf16 or fp32. The
+    // first one can be fp32 with 16-bit others.
+    Data_type out_type, partial_type;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Several independent fwd problems in one launch, see device_1xN_grouped. They share d, num_v, the
+// type, the 64-bit indexing and the causal mask, and have no dropout and no returned softmax. The
+// heads, batches, sequences and the tensors differ.
+struct Fused_multihead_attention_grouped_params {
+    // In device memory: the params of the problems [num_problems], the first CTA of each problem
+    // [num_problems + 1] and the number of CTAs each of their (batch, head) are split over
+    // [num_problems].
+    const Fused_multihead_attention_fprop_params * __restrict__ problems;
+    const int * __restrict__ cta_offsets;
+    const int * __restrict__ num_splits;
+    int num_problems;
+    int num_ctas;
+
+    // Common to the problems, on the host to pick the kernel. seqlen_k is the largest one.
+    int d, num_v, seqlen_k;
+    bool is_bf16;
+    bool is_64bit_index;
     bool is_causal;
+
+    // The occupancy of the kernel, set by the configure pass of run_fmha_fp16_sm80_grouped.
+    int ctas_per_sm;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -147,6 +315,7 @@ struct Launch_params{
                   bool is_dropout_,
                   bool return_softmax_)
         : elts_per_thread(0)
+        , num_splits(1)
         , props(props_)
         , stream(stream_)
         , is_dropout(is_dropout_)
@@ -155,6 +324,9 @@ struct Launch_params{
 
     size_t elts_per_thread;
 
+    // The number of CTAs along the query dimension for each (batch, head), see split-Q launch.
+    int num_splits;
+
     cudaDeviceProp * props;
 
     cudaStream_t stream;
@@ -174,8 +346,18 @@ struct Launch_params{
 
 void run_fmha_fp16_sm80(Launch_params<Fused_multihead_attention_fprop_params> &launch_params, const bool configure);
 
+void run_fmha_fp16_sm80_grouped(Launch_params<Fused_multihead_attention_grouped_params> &launch_params, const bool configure);
+
 void run_fmha_dgrad_fp16_sm80(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream);
 
 void run_fmha_block_fp16_sm80(Launch_params<Fused_multihead_attention_fprop_params> &launch_params, const bool configure);
 
-void run_fmha_block_dgrad_fp16_sm80(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream);
\ No newline at end of file
+void run_fmha_block_dgrad_fp16_sm80(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream);
+
+void run_fmha_decode_fp16_sm80(Launch_params<Fused_multihead_attention_decode_params> &launch_params, const bool configure);
+
+void run_fmha_build_work_queue(const Fused_multihead_attention_fprop_params &params, const int M, cudaStream_t stream);
+
+void run_fmha_merge(const Fused_multihead_attention_merge_params &params, cudaStream_t stream);
+
+void run_fmha_convert_blockmask(const uint8_t *blockmask, int *out, const int nrow, const int ncol, const bool causal, cudaStream_t stream);
\ No newline at end of file
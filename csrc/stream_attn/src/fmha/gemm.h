@@ -128,17 +128,19 @@ struct alignas(static_cast<int>(Base_::ALIGNMENT)) Fragment : public Base_ {
     }
 
     // Multiply by another fragment.
+    template<typename elem_type=__half>
     inline __device__ void hmul(const Fragment &other) {
         #pragma unroll
         for( int ii = 0; ii < Base_::NUM_REGS; ++ii ) {
-            this->reg(ii) = fmha::hmul2(this->reg(ii), other.reg(ii));
+            this->reg(ii) = fmha::hmul2<elem_type>(this->reg(ii), other.reg(ii));
         }
     }
 
+    template<typename elem_type=__half>
     inline __device__ void hrelu_() {
         #pragma unroll
         for( int ii = 0; ii < Base_::NUM_REGS; ++ii ) {
-            this->reg(ii) = fmha::hrelu2(this->reg(ii));
+            this->reg(ii) = fmha::hrelu2<elem_type>(this->reg(ii));
         }
     }
 };
@@ -176,10 +178,30 @@ struct Fragment_accumulator : public Fragment<float, 8> {
         }
     }
 
-    // Do the HMMA.
-    template< typename Layout_a, typename Layout_b >
+    // Do the HMMA. The elements of a and b are either __half or __nv_bfloat16.
+    template< typename elem_type=__half, typename Layout_a, typename Layout_b >
     inline __device__ void mma(const Fragment_a<Layout_a> &a,
                                const Fragment_b<Layout_b> &b) {
+        if constexpr( std::is_same<elem_type, __nv_bfloat16>::value ) {
+        asm volatile( \
+            "mma.sync.aligned.m16n8k16.row.col.f32.bf16.bf16.f32 \n" \
+            "    {%0, %1, %2, %3}, \n" \
+            "    {%4, %5, %6, %7}, \n" \
+            "    {%8, %9}, \n" \
+            "    {%0, %1, %2, %3}; \n" \
+                    : "+f"(  elt(0)), "+f"(  elt(1)), "+f"(  elt(2)), "+f"(  elt(3))
+                    :  "r"(a.reg(0)),  "r"(a.reg(1)),  "r"(a.reg(2)),  "r"(a.reg(3))
+                    ,  "r"(b.reg(0)),  "r"(b.reg(1)));
+        asm volatile( \
+            "mma.sync.aligned.m16n8k16.row.col.f32.bf16.bf16.f32 \n" \
+            "    {%0, %1, %2, %3}, \n" \
+            "    {%4, %5, %6, %7}, \n" \
+            "    {%8, %9}, \n" \
+            "    {%0, %1, %2, %3}; \n" \
+                    : "+f"(  elt(4)), "+f"(  elt(5)), "+f"(  elt(6)), "+f"(  elt(7))
+                    :  "r"(a.reg(0)),  "r"(a.reg(1)),  "r"(a.reg(2)),  "r"(a.reg(3))
+                    ,  "r"(b.reg(2)),  "r"(b.reg(3)));
+        } else {
         asm volatile( \
             "mma.sync.aligned.m16n8k16.row.col.f32.f16.f16.f32 \n" \
             "    {%0, %1, %2, %3}, \n" \
@@ -198,6 +220,7 @@ struct Fragment_accumulator : public Fragment<float, 8> {
                     : "+f"(  elt(4)), "+f"(  elt(5)), "+f"(  elt(6)), "+f"(  elt(7))
                     :  "r"(a.reg(0)),  "r"(a.reg(1)),  "r"(a.reg(2)),  "r"(a.reg(3))
                     ,  "r"(b.reg(2)),  "r"(b.reg(3)));
+        }
     }
 
 };
@@ -233,14 +256,14 @@ struct Clear_accumulator<float, WARPS_K> {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template<typename Acc, typename A, typename B, int M, int N>
+template<typename elem_type=__half, typename Acc, typename A, typename B, int M, int N>
 inline __device__ void gemm(Acc (&acc)[M][N], const A (&a)[M], const B (&b)[N]) {
 
     #pragma unroll
     for( int mi = 0; mi < M; ++mi ) {
         #pragma unroll
         for( int ni = 0; ni < N; ++ni ) {
-            acc[mi][ni].mma(a[mi], b[ni]);
+            acc[mi][ni].template mma<elem_type>(a[mi], b[ni]);
         }
     }
 }
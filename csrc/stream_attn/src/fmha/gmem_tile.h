@@ -41,14 +41,19 @@ template<
     // The number of columns.
     int COLS,
     // The number of matrics.
-    int NUM_MATS = 4
+    int NUM_MATS = 4,
+    // The type of the offsets from the base pointers: uint32_t, or uint64_t for tensors over 2GB.
+    typename index_t_ = uint32_t
 >
 struct Gmem_tile_qkv {
 
     using Cta_tile = Cta_tile_;
+    using index_t = index_t_;
 
     // The size of each LDG.
     static constexpr int BYTES_PER_LDG = 16;
+    // The size of an element.
+    static constexpr int BYTES_PER_ELEMENT = BITS_PER_ELEMENT / 8;
     // The size of a row in bytes.
     static constexpr int BYTES_PER_ROW = COLS * BITS_PER_ELEMENT / 8;
 
@@ -61,12 +66,24 @@ struct Gmem_tile_qkv {
     // The number of LDGs needed to load a chunk of the Q matrix.
     static constexpr int LDGS = DivUpConstexpr(ROWS, ROWS_PER_LDG);
 
-    // Ctor.
+    // Ctor. The matrix qkv_offset (0 for Q, 1 for K and 2 + i for V_i) has its own pointer and
+    // strides in params, so Q, K and V_i don't have to be packed into a single tensor.
     template< typename Params, typename BInfo >
     inline __device__ Gmem_tile_qkv(const Params &params, const int qkv_offset, const BInfo &binfo, const int tidx)
-        : params_qkv_stride_in_bytes_(params.qkv_stride_in_bytes)
-        , actual_seqlen(binfo.actual_seqlen)
-        , qkv_ptr_(reinterpret_cast<char *>(params.qkv_ptr))
+        : Gmem_tile_qkv(params.qkv_ptrs[qkv_offset], params.qkv_row_stride_in_elts[qkv_offset],
+                        params.qkv_head_stride_in_elts[qkv_offset], binfo, tidx, qkv_offset == 0, params.d) {
+    }
+
+    // Ctor. Q (and dQ, dO) follow the query sequence, K and V_i (and dK, dV_i) the key sequence.
+    // The head dimension can be smaller than COLS (e.g. 80 or 96 with the tiles of 128), the
+    // columns past it are not read (zeros in shared memory) nor written.
+    template< typename BInfo >
+    inline __device__ Gmem_tile_qkv(void *ptr, const uint32_t row_stride_in_elts,
+                                    const uint32_t head_stride_in_elts, const BInfo &binfo, const int tidx,
+                                    const bool use_seqlen_q, const int headdim = COLS)
+        : params_qkv_stride_in_bytes_(row_stride_in_elts * BITS_PER_ELEMENT / 8)
+        , actual_seqlen(use_seqlen_q ? binfo.actual_seqlen_q : binfo.actual_seqlen_k)
+        , qkv_ptr_(reinterpret_cast<char *>(ptr))
         , tidx_(tidx) {
 
         // Compute the position in the sequence (within the CTA for the moment).
@@ -74,16 +91,19 @@ struct Gmem_tile_qkv {
         // Compute the position of the thread in the row.
         int col = tidx % THREADS_PER_ROW;
 
+        col_predicate_ = col * BYTES_PER_LDG < headdim * BITS_PER_ELEMENT / 8;
+
         // Store the row as we need it to disable the loads.
         // TD [2022-04-16]: To minimize registers, we'll recompute row_ instead of storing it
         // row_ = row;
 
-        // The row offset in the batched GEMM. For each seq element, we store QKV in that order.
+        // The row offset in the batched GEMM.
         // int64_t row_offset = (int64_t)row * params.qkv_stride_in_bytes;
-        uint32_t row_offset = (uint32_t)row * params.qkv_stride_in_bytes;
-        // Add the block index.
+        index_t row_offset = (index_t)row * params_qkv_stride_in_bytes_;
+        // Add the offset of the sequence and of the head.
         // row_offset += (int64_t)((binfo.sum_s * NUM_MATS + qkv_offset) * binfo.h + binfo.bidh) * BYTES_PER_ROW;
-        row_offset += (uint32_t)((binfo.sum_s * NUM_MATS + qkv_offset) * binfo.h + binfo.bidh) * BYTES_PER_ROW;
+        row_offset += (index_t)(use_seqlen_q ? binfo.sum_s_q : binfo.sum_s_k) * params_qkv_stride_in_bytes_
+            + (index_t)binfo.bidh * head_stride_in_elts * BITS_PER_ELEMENT / 8;
 
         // Assemble the final pointer.
         qkv_ptr_ += row_offset + col * BYTES_PER_LDG;
@@ -103,7 +123,7 @@ struct Gmem_tile_qkv {
         for( int ii = 0; ii < LDGS; ++ii ) {
             // ptrs[ii] = qkv_ptr_ + (int64_t)ii * ROWS_PER_LDG * params_qkv_stride_in_bytes_;
             ptrs[ii] = qkv_ptr_ + (uint32_t)ii * ROWS_PER_LDG * params_qkv_stride_in_bytes_;
-            preds[ii] = ((row_ + ii * ROWS_PER_LDG) < min(ROWS, actual_seqlen));
+            preds[ii] = col_predicate_ && ((row_ + ii * ROWS_PER_LDG) < min(ROWS, actual_seqlen));
             fetch_[ii] = make_uint4(0, 0, 0, 0);
         }
 
@@ -115,6 +135,29 @@ struct Gmem_tile_qkv {
         }
     }
 
+    // Trigger the copies directly to shared memory (LDGSTS). No commit needed, but the caller has
+    // to close the group with ldgsts_commit and wait for it before reading the tile.
+    template< typename Smem_tile >
+    inline __device__ void load(Smem_tile &smem_tile) {
+        static_assert(Smem_tile::BYTES_PER_STS == BYTES_PER_LDG);
+        int row_ = tidx_ / THREADS_PER_ROW;
+        const void *ptrs[LDGS];
+        uint32_t preds[LDGS];
+        #pragma unroll
+        for( int ii = 0; ii < LDGS; ++ii ) {
+            ptrs[ii] = qkv_ptr_ + (uint32_t)ii * ROWS_PER_LDG * params_qkv_stride_in_bytes_;
+            preds[ii] = col_predicate_ && ((row_ + ii * ROWS_PER_LDG) < min(ROWS, actual_seqlen));
+        }
+        uint32_t smem_ptrs[LDGS];
+        smem_tile.compute_store_pointers(smem_ptrs);
+
+        Ldgsts_functor<LDGS> fct(smem_ptrs, ptrs);
+        #pragma unroll
+        for( int ii = 0; ii < LDGS; ++ii ) {
+            fct.load(ii, preds[ii]);
+        }
+    }
+
     // Store data to memory.
     inline __device__ void store(const uint4 (&data)[LDGS]) {
         int row_ = tidx_ / THREADS_PER_ROW;
@@ -122,12 +165,47 @@ struct Gmem_tile_qkv {
         for( int ii = 0; ii < LDGS; ++ii ) {
             // char *ptr = qkv_ptr_ + (int64_t)ii * ROWS_PER_LDG * params_qkv_stride_in_bytes_;
             char *ptr = qkv_ptr_ + (uint32_t)ii * ROWS_PER_LDG * params_qkv_stride_in_bytes_;
-            if( (row_ + ii * ROWS_PER_LDG) < min(ROWS, actual_seqlen) ) {
+            if( col_predicate_ && (row_ + ii * ROWS_PER_LDG) < min(ROWS, actual_seqlen) ) {
                 fmha::stg(ptr, data[ii]);
             }
         }
     }
 
+    // Rotate the rows held in data (fetch_ before the commit, or the rows given to store) by the
+    // rotary embedding: the interleaved pairs (x[2i], x[2i+1]) of the first rotary_dim columns
+    // become (x[2i] * cos - x[2i+1] * sin, x[2i] * sin + x[2i+1] * cos). cos and sin are
+    // [seqlen_ro, rotary_dim / 2], indexed by the position of the row in its sequence, of length
+    // seqlen. With CONJ, the rows are rotated back, for the gradients of Q and K.
+    template< typename elem_type, bool CONJ = false >
+    inline __device__ void apply_rotary(uint4 (&data)[LDGS], const float *cos, const float *sin,
+                                        const int rotary_dim, const int seqlen) {
+        static_assert(BITS_PER_ELEMENT == 16);
+        int row_ = tidx_ / THREADS_PER_ROW;
+        // The 8 elements of an LDG are 4 complete pairs, and rotary_dim is a multiple of 8.
+        const int col = (tidx_ % THREADS_PER_ROW) * 8;
+        if( col >= rotary_dim ) { return; }
+        #pragma unroll
+        for( int ii = 0; ii < LDGS; ++ii ) {
+            const int row = row_ + ii * ROWS_PER_LDG;
+            if( row >= min(ROWS, actual_seqlen) ) { continue; }
+            const int idx = (seqlen - actual_seqlen + row) * (rotary_dim / 2) + col / 2;
+            const float4 c = __ldg(reinterpret_cast<const float4 *>(&cos[idx]));
+            const float4 s = __ldg(reinterpret_cast<const float4 *>(&sin[idx]));
+            const float cos_[4] = { c.x, c.y, c.z, c.w };
+            const float sin_[4] = { s.x, s.y, s.z, s.w };
+            float x[8];
+            fmha::float8_unpack<elem_type>(x, data[ii]);
+            uint32_t out[4];
+            #pragma unroll
+            for( int jj = 0; jj < 4; ++jj ) {
+                const float sin_jj = CONJ ? -sin_[jj] : sin_[jj];
+                out[jj] = fmha::float2_pack<elem_type>(x[2 * jj] * cos_[jj] - x[2 * jj + 1] * sin_jj,
+                                                       x[2 * jj] * sin_jj + x[2 * jj + 1] * cos_[jj]);
+            }
+            data[ii] = make_uint4(out[0], out[1], out[2], out[3]);
+        }
+    }
+
     // Move the pointer to the next location.
     inline __device__ void move() {
         // qkv_ptr_ += (int64_t)ROWS * params_qkv_stride_in_bytes_;
@@ -137,7 +215,7 @@ struct Gmem_tile_qkv {
 
     inline __device__ void move(int steps) {
         // qkv_ptr_ += (int64_t)ROWS * params_qkv_stride_in_bytes_ * steps;
-        qkv_ptr_ += (uint32_t)ROWS * params_qkv_stride_in_bytes_ * steps;
+        qkv_ptr_ += (index_t)ROWS * params_qkv_stride_in_bytes_ * steps;
         actual_seqlen -= ROWS * steps;
     }
 
@@ -153,16 +231,22 @@ struct Gmem_tile_qkv {
     const int tidx_;
     // The length of the sequence loaded by that memory tile.
     int actual_seqlen;
+    // Are the columns of the thread within the head dimension.
+    bool col_predicate_;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<
     typename Cta_tile,
-    int BYTES_PER_ELEMENT = 2
+    int BYTES_PER_ELEMENT = 2,
+    // The type of the offsets from the base pointer, see Gmem_tile_qkv.
+    typename index_t_ = uint32_t
 >
 struct Gmem_tile_o {
 
+    using index_t = index_t_;
+
     static_assert(BYTES_PER_ELEMENT == 2 || BYTES_PER_ELEMENT == 4);
 
     // The mma tile.
@@ -194,13 +278,14 @@ struct Gmem_tile_o {
     // The number of STGs needed to store a chunk of the Q matrix in total.
     static constexpr int STGS = STGS_PER_LOOP * LOOPS;
 
-    // Ctor.
+    // Ctor. As for Gmem_tile_qkv, the columns past the head dimension are skipped.
     template<typename BInfo>
     // inline __device__ Gmem_tile_o(void *ptr, const size_t stride_in_elts, const BInfo &binfo, const int tidx)
-    inline __device__ Gmem_tile_o(void *ptr, const uint32_t stride_in_elts, const BInfo &binfo, const int tidx)
+    inline __device__ Gmem_tile_o(void *ptr, const uint32_t stride_in_elts, const BInfo &binfo, const int tidx,
+                                  const int headdim = COLS)
         : stride_in_bytes_(stride_in_elts * BYTES_PER_ELEMENT)
-        , actual_seqlen_(binfo.actual_seqlen)
-        , actual_seqlen(binfo.actual_seqlen)
+        , actual_seqlen_(binfo.actual_seqlen_q)
+        , actual_seqlen(binfo.actual_seqlen_q)
         , ptr_(reinterpret_cast<char *>(ptr))
         , tidx_(tidx) {
 
@@ -214,10 +299,12 @@ struct Gmem_tile_o {
 
         // The row offset in the batched GEMM.
         // int64_t row_offset = (int64_t)row * stride_in_bytes_ + binfo.bidx * BYTES_PER_ROW;
-        uint32_t row_offset = (uint32_t)row * stride_in_bytes_ + binfo.bidx * BYTES_PER_ROW;
+        index_t row_offset = (index_t)row * stride_in_bytes_ + (index_t)binfo.bidx * headdim * BYTES_PER_ELEMENT;
         // Assemble the final pointer.
         ptr_ += row_offset + col * BYTES_PER_STG;
 
+        col_predicate_ = col * BYTES_PER_STG < headdim * BYTES_PER_ELEMENT;
+
         // Is that thread active on the last STG?
         if( HAS_INCOMPLETE_STG ) {
             is_active_for_last_stg_ = row + (STGS - 1) * ROWS_PER_STG < Cta_tile::M;
@@ -226,9 +313,10 @@ struct Gmem_tile_o {
 
     template<typename Params, typename BInfo>
     inline __device__ Gmem_tile_o(const Params &params, const BInfo &binfo, const int tidx)
-        : Gmem_tile_o(params.o_ptr, params.o_stride_in_elts, binfo, tidx) {}
+        : Gmem_tile_o(params.o_ptrs[0], params.o_stride_in_elts, binfo, tidx, params.d) {}
 
-    // Store data to global memory.
+    // Store data to global memory. For 2-byte elements, src holds floats converted to elem_type.
+    template<typename elem_type=__half>
     inline __device__ void store(const uint4 (&src)[STGS_PER_LOOP], int mi) {
         int row_ = tidx_ / THREADS_PER_ROW;
         #pragma unroll
@@ -236,7 +324,7 @@ struct Gmem_tile_o {
             int jj = mi * STGS_PER_LOOP + ii;
             // if( this->row_ + jj * ROWS_PER_STG >= this->actual_seqlen_ ) {
             //     break;
-            if( row_ + jj * ROWS_PER_STG >= this->actual_seqlen ) {
+            if( row_ + jj * ROWS_PER_STG >= this->actual_seqlen || !this->col_predicate_ ) {
                 break;
             }
 
@@ -249,7 +337,7 @@ struct Gmem_tile_o {
                 float y = reinterpret_cast<const float &>(src[ii].y);
                 float z = reinterpret_cast<const float &>(src[ii].z);
                 float w = reinterpret_cast<const float &>(src[ii].w);
-                uint2 out = float4_to_half4(x, y, z, w);
+                uint2 out = fmha::float4_pack<elem_type>(x, y, z, w);
                 // uint2 out = float4_to_half4(0f, 0f, 2f, 0f);
                 if( !HAS_INCOMPLETE_STG || (jj < STGS - 1 || this->is_active_for_last_stg_) ) {
                     fmha::stg(this->ptr_ + jj * ROWS_PER_STG * this->stride_in_bytes_, out);
@@ -258,6 +346,37 @@ struct Gmem_tile_o {
         }
     }
 
+    // Rotate the fp32 rows src of the loop mi by the rotary embedding before they are stored, see
+    // Gmem_tile_qkv::apply_rotary. Used with CONJ for dQ.
+    template< bool CONJ = false >
+    inline __device__ void apply_rotary(uint4 (&src)[STGS_PER_LOOP], int mi, const float *cos,
+                                        const float *sin, const int rotary_dim) {
+        int row_ = tidx_ / THREADS_PER_ROW;
+        // The 4 elements of an STG are 2 complete pairs.
+        const int col = (tidx_ % THREADS_PER_ROW) * 4;
+        if( col >= rotary_dim ) { return; }
+        #pragma unroll
+        for( int ii = 0; ii < STGS_PER_LOOP; ++ii ) {
+            int jj = mi * STGS_PER_LOOP + ii;
+            const int row = row_ + jj * ROWS_PER_STG;
+            if( row >= this->actual_seqlen ) {
+                break;
+            }
+            const int idx = (this->actual_seqlen_ - this->actual_seqlen + row) * (rotary_dim / 2) + col / 2;
+            const float2 c = __ldg(reinterpret_cast<const float2 *>(&cos[idx]));
+            const float2 s = __ldg(reinterpret_cast<const float2 *>(&sin[idx]));
+            const float sin_x = CONJ ? -s.x : s.x;
+            const float sin_y = CONJ ? -s.y : s.y;
+            float4 x = reinterpret_cast<const float4 &>(src[ii]);
+            float4 out;
+            out.x = x.x * c.x - x.y * sin_x;
+            out.y = x.x * sin_x + x.y * c.x;
+            out.z = x.z * c.y - x.w * sin_y;
+            out.w = x.z * sin_y + x.w * c.y;
+            src[ii] = reinterpret_cast<const uint4 &>(out);
+        }
+    }
+
     // Store data to global memory.
     inline __device__ void load(uint4 (&dst)[STGS_PER_LOOP], int mi) {
         static_assert(BYTES_PER_ELEMENT == 4);
@@ -265,7 +384,7 @@ struct Gmem_tile_o {
         #pragma unroll
         for( int ii = 0; ii < STGS_PER_LOOP; ++ii ) {
             int jj = mi * STGS_PER_LOOP + ii;
-            if( row_ + jj * ROWS_PER_STG >= this->actual_seqlen ) {
+            if( row_ + jj * ROWS_PER_STG >= this->actual_seqlen || !this->col_predicate_ ) {
                 break;
             }
 
@@ -286,7 +405,7 @@ struct Gmem_tile_o {
     inline __device__ void move(const int steps) {
         // row_ += ROWS * steps;
         // ptr_ += (int64_t)ROWS * stride_in_bytes_ * steps;
-        ptr_ += (uint32_t)ROWS * stride_in_bytes_ * steps;
+        ptr_ += (index_t)ROWS * stride_in_bytes_ * steps;
         actual_seqlen -= ROWS * steps;
     }
 
@@ -303,11 +422,13 @@ struct Gmem_tile_o {
     const int actual_seqlen_;
     int actual_seqlen;
     const int tidx_;
+    // Are the columns of the thread within the head dimension.
+    bool col_predicate_;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template< typename Cta_tile, int BYTES_PER_ELEMENT >
+template< typename Cta_tile, int BYTES_PER_ELEMENT, typename index_t = uint32_t >
 struct Gmem_tile_mma_sd {
 
     // The mma tile.
@@ -344,9 +465,9 @@ struct Gmem_tile_mma_sd {
 
         // The distance between two blocks (in bytes).
         // const size_t block_stride_bytes = params.s * params.s * BYTES_PER_ELEMENT;
-        const uint32_t block_stride_bytes = params.s * params.s * BYTES_PER_ELEMENT;
+        const uint32_t block_stride_bytes = params.seqlen_q * params.seqlen_k * BYTES_PER_ELEMENT;
         // Set store location for each thread at the beginning of the loop
-        ptr_ += bidx * block_stride_bytes + tidx * BYTES_PER_STG;
+        ptr_ += (index_t)bidx * block_stride_bytes + tidx * BYTES_PER_STG;
     }
 
     // Store to global memory.
@@ -368,7 +489,7 @@ struct Gmem_tile_mma_sd {
         ptr_ += LOOP_STRIDE_BYTES;
     }
     inline __device__ void move(const int steps) {
-        ptr_ += LOOP_STRIDE_BYTES * steps;
+        ptr_ += (index_t)LOOP_STRIDE_BYTES * steps;
     }
 
     // The pointer in global memory.
@@ -377,7 +498,8 @@ struct Gmem_tile_mma_sd {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template< typename Cta_tile, typename Base = Gmem_tile_mma_sd<Cta_tile, sizeof(uint16_t)> >
+template< typename Cta_tile, typename index_t = uint32_t,
+          typename Base = Gmem_tile_mma_sd<Cta_tile, sizeof(uint16_t), index_t> >
 struct Gmem_tile_mma_s : public Base {
 
     // The number of mmas in the vertical dimension.
@@ -394,7 +516,7 @@ struct Gmem_tile_mma_s : public Base {
     }
 
     // Store to global memory.
-    template<typename Mask>
+    template<typename elem_type=__half, typename Mask>
     inline __device__ void store(const float (&softmax)[2 * M][4 * N], const Mask &mask) {
         #pragma unroll
         for( int mi = 0; mi < M; mi++ ) {
@@ -412,10 +534,10 @@ struct Gmem_tile_mma_s : public Base {
                 float tmp13 = softmax[2 * mi + 1][4 * ni + 3];
 
                 uint4 dst;
-                dst.x = fmha::float2_to_half2(tmp00, tmp01);
-                dst.y = fmha::float2_to_half2(tmp02, tmp03);
-                dst.z = fmha::float2_to_half2(tmp10, tmp11);
-                dst.w = fmha::float2_to_half2(tmp12, tmp13);
+                dst.x = fmha::float2_pack<elem_type>(tmp00, tmp01);
+                dst.y = fmha::float2_pack<elem_type>(tmp02, tmp03);
+                dst.z = fmha::float2_pack<elem_type>(tmp10, tmp11);
+                dst.w = fmha::float2_pack<elem_type>(tmp12, tmp13);
                 if( mask.is_valid(mi, ni, 0, 0) ) {
                     Base::store(dst, mi, ni);
                 }
@@ -485,7 +607,8 @@ struct Gmem_tile_dout : public Base {
         // The row offset in the batched GEMM. For each seq element, we store O in that order.
         // int64_t row_offset = (int64_t)this->row_ * params.o_stride_in_bytes + binfo.bidx * Base::BYTES_PER_ROW;
         // int64_t row_offset = (int64_t)row * params.o_stride_in_bytes + binfo.bidx * Base::BYTES_PER_ROW;
-        uint32_t row_offset = (uint32_t)row * params.o_stride_in_bytes + binfo.bidx * Base::BYTES_PER_ROW;
+        typename Base::index_t row_offset = (typename Base::index_t)row * params.o_stride_in_bytes
+            + (typename Base::index_t)binfo.bidx * params.d * Base::BYTES_PER_ELEMENT;
 
         // Assemble the final pointer.
         this->qkv_ptr_ += row_offset + col * Base::BYTES_PER_LDG;
@@ -494,14 +617,15 @@ struct Gmem_tile_dout : public Base {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template< typename Cta_tile, typename Base = fmha::Gmem_tile_o<Cta_tile> >
+template< typename Cta_tile, int NUM_MATS = 4, typename index_t = uint32_t,
+          typename Base = fmha::Gmem_tile_o<Cta_tile, 2, index_t> >
 struct Gmem_tile_dq : public Base {
 
     // Ctor.
     template<typename Params, typename BInfo>
     inline __device__ Gmem_tile_dq(const Params &params, const int qkv_offset, const BInfo &binfo, int tidx)
-        : Base(params.dqkv_ptr, params.qkv_stride_in_elts, binfo, tidx) {
-        this->ptr_ = reinterpret_cast<char *>(params.dqkv_ptr);
+        : Base(params.dqkv_ptrs[qkv_offset], params.dqkv_row_stride_in_elts[qkv_offset], binfo, tidx, params.d) {
+        this->ptr_ = reinterpret_cast<char *>(params.dqkv_ptrs[qkv_offset]);
 
         // Compute the position in the sequence (within the CTA for the moment).
         int row = tidx / Base::THREADS_PER_ROW;
@@ -513,8 +637,9 @@ struct Gmem_tile_dq : public Base {
         //     ((binfo.sum_s * 3 + qkv_offset) * binfo.h + binfo.bidh) * Base::BYTES_PER_ROW;
         // int64_t row_offset = (int64_t)row * this->stride_in_bytes_ +
         //     ((binfo.sum_s * 3 + qkv_offset) * binfo.h + binfo.bidh) * Base::BYTES_PER_ROW;
-        uint32_t row_offset = (uint32_t)row * this->stride_in_bytes_ +
-            ((binfo.sum_s * 3 + qkv_offset) * binfo.h + binfo.bidh) * Base::BYTES_PER_ROW;
+        // Like QKV, each matrix of dQKV has its own pointer and strides.
+        index_t row_offset = (index_t)(row + binfo.sum_s_q) * this->stride_in_bytes_ +
+            (index_t)binfo.bidh * params.dqkv_head_stride_in_elts[qkv_offset] * (Base::BYTES_PER_ROW / Base::COLS);
 
         // Assemble the final pointer.
         this->ptr_ += row_offset + col * Base::BYTES_PER_STG;
@@ -541,29 +666,28 @@ struct Gmem_summary_stats {
     static constexpr int ROWS = Cta_tile::M;
 
     // Ctor.
-    template<typename Params>
-    inline __device__ Gmem_summary_stats(void *ptr, const Params &params, const int tidx)
-        : ptr_(reinterpret_cast<char *>(ptr)), tidx_(tidx) {
-
-        // The block index for the batch.
-        const int bidb = blockIdx.y;
-        // The block index for the head.
-        const int bidh = blockIdx.x;
-        // The block index.
-        // size_t bidx = bidb * params.h + bidh;
-        uint32_t bidx = bidb * params.h + bidh;
+    template<typename Params, typename BInfo>
+    inline __device__ Gmem_summary_stats(void *ptr, const Params &params, const BInfo &binfo, const int tidx)
+        : ptr_(reinterpret_cast<char *>(ptr)), tidx_(tidx), row_(0), actual_seqlen_(binfo.actual_seqlen_q) {
 
         // Extract the position in the warp.
         int warp = tidx / Cta_tile::THREADS_PER_WARP;
         int lane = tidx % Cta_tile::THREADS_PER_WARP;
 
-        // The distance between two blocks (in bytes).
+        // The stats are [h, total_q]: the rows of a head are the tokens of all the sequences, without
+        // padding, so the rows past the end of the sequence are neither loaded nor stored.
         // size_t block_stride_bytes = params.s * BYTES_PER_ELEMENT;
-        uint32_t block_stride_bytes = params.s * BYTES_PER_ELEMENT;
+        // uint32_t bidx = bidb * params.h + bidh;
+        uint32_t row_offset = ((uint32_t)binfo.bidh * params.total_q + binfo.sum_s_q) * BYTES_PER_ELEMENT;
 
         // Set store location for each thread at the beginning of the loop
-        ptr_row_ = ptr_ + bidx * block_stride_bytes;
-        ptr_ += bidx * block_stride_bytes + (lane / 4) * BYTES_PER_ELEMENT;
+        ptr_row_ = ptr_ + row_offset;
+        ptr_ += row_offset + (lane / 4) * BYTES_PER_ELEMENT;
+    }
+
+    // The row of data[mi * 2 + ii] in the current block, for store / load.
+    inline __device__ int row_of(const int mi, const int ii) const {
+        return row_ + (tidx_ % Cta_tile::THREADS_PER_WARP) / 4 + mi * (BYTES_PER_MMA / BYTES_PER_ELEMENT) + ii * 8;
     }
 
     // Store data to global memory.
@@ -574,8 +698,12 @@ struct Gmem_summary_stats {
             #pragma unroll
             for (int mi = 0; mi < MMAS_M; ++mi) {
                 // TODO: Not sure if it's right for MMAS_M > 1
-                fmha::stg(ptr_ + mi * BYTES_PER_MMA + 0 * BYTES_PER_ELEMENT, data[mi * 2 + 0]);
-                fmha::stg(ptr_ + mi * BYTES_PER_MMA + 8 * BYTES_PER_ELEMENT, data[mi * 2 + 1]);
+                if (row_of(mi, 0) < actual_seqlen_) {
+                    fmha::stg(ptr_ + mi * BYTES_PER_MMA + 0 * BYTES_PER_ELEMENT, data[mi * 2 + 0]);
+                }
+                if (row_of(mi, 1) < actual_seqlen_) {
+                    fmha::stg(ptr_ + mi * BYTES_PER_MMA + 8 * BYTES_PER_ELEMENT, data[mi * 2 + 1]);
+                }
             }
         }
     }
@@ -585,18 +713,16 @@ struct Gmem_summary_stats {
         #pragma unroll
         for (int mi = 0; mi < MMAS_M; ++mi) {
             // TODO: Not sure if it's right for MMAS_M > 1
-            fmha::stg(ptr_row_ + mi * BYTES_PER_MMA + row * BYTES_PER_ELEMENT, data[mi]);
+            if (row_ + mi * (BYTES_PER_MMA / BYTES_PER_ELEMENT) + row < actual_seqlen_) {
+                fmha::stg(ptr_row_ + mi * BYTES_PER_MMA + row * BYTES_PER_ELEMENT, data[mi]);
+            }
         }
     }
 
-    // Load from global memory.
+    // Load from global memory. The rows past the end of the sequence are set to 0, which keeps the
+    // padded rows of P and dS finite (their Q and dO rows are 0).
     inline __device__ void load(uint32_t (&data)[MMAS_M * 2]) {
-        #pragma unroll
-        for (int mi = 0; mi < MMAS_M; ++mi) {
-            // TODO: Not sure if it's right for MMAS_M > 1
-            fmha::ldg(data[mi * 2 + 0], ptr_ + mi * BYTES_PER_MMA + 0 * BYTES_PER_ELEMENT);
-            fmha::ldg(data[mi * 2 + 1], ptr_ + mi * BYTES_PER_MMA + 8 * BYTES_PER_ELEMENT);
-        }
+        load_next(data, 0);
     }
 
     // Load from global memory.
@@ -605,8 +731,14 @@ struct Gmem_summary_stats {
         #pragma unroll
         for (int mi = 0; mi < MMAS_M; ++mi) {
             // TODO: Not sure if it's right for MMAS_M > 1
-            fmha::ldg(data[mi * 2 + 0], ptr_next + mi * BYTES_PER_MMA + 0 * BYTES_PER_ELEMENT);
-            fmha::ldg(data[mi * 2 + 1], ptr_next + mi * BYTES_PER_MMA + 8 * BYTES_PER_ELEMENT);
+            data[mi * 2 + 0] = 0u;
+            data[mi * 2 + 1] = 0u;
+            if (move_steps * ROWS + row_of(mi, 0) < actual_seqlen_) {
+                fmha::ldg(data[mi * 2 + 0], ptr_next + mi * BYTES_PER_MMA + 0 * BYTES_PER_ELEMENT);
+            }
+            if (move_steps * ROWS + row_of(mi, 1) < actual_seqlen_) {
+                fmha::ldg(data[mi * 2 + 1], ptr_next + mi * BYTES_PER_MMA + 8 * BYTES_PER_ELEMENT);
+            }
         }
     }
 
@@ -615,7 +747,10 @@ struct Gmem_summary_stats {
     inline __device__ void load_row(uint32_t (&data)[N], const int row[N]) {
         #pragma unroll
         for (int ni = 0; ni < N; ++ni) {
-            fmha::ldg(data[ni], ptr_row_ + row[ni] * BYTES_PER_ELEMENT);
+            data[ni] = 0u;
+            if (row_ + row[ni] < actual_seqlen_) {
+                fmha::ldg(data[ni], ptr_row_ + row[ni] * BYTES_PER_ELEMENT);
+            }
         }
     }
 
@@ -623,18 +758,23 @@ struct Gmem_summary_stats {
     inline __device__ void move() {
         ptr_ += ROWS * BYTES_PER_ELEMENT;
         ptr_row_ += ROWS * BYTES_PER_ELEMENT;
+        row_ += ROWS;
     }
 
     // Move the pointer to the next location.
     inline __device__ void move(const int steps) {
         ptr_ += ROWS * BYTES_PER_ELEMENT * steps;
         ptr_row_ += ROWS * BYTES_PER_ELEMENT * steps;
+        row_ += ROWS * steps;
     }
 
     // The pointer.
     char *ptr_;
     char *ptr_row_;
     const int tidx_;
+    // The first row of the current block, and the length of the sequence.
+    int row_;
+    const int actual_seqlen_;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
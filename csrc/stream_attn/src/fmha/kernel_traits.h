@@ -29,9 +29,25 @@
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template<int S, int D, int STEP, int WARPS_M, int WARPS_N, uint32_t FLAGS = 0x08u>
+template<int S, int D, int STEP, int WARPS_M, int WARPS_N, uint32_t FLAGS = 0x08u, int NUM_V_ = 2,
+         typename elem_type_=__half, typename index_t_=uint32_t>
 struct FMHA_kernel_traits {
 
+    // The element type of Q, K, V, O and their gradients: __half or __nv_bfloat16.
+    using elem_type = elem_type_;
+    static_assert(std::is_same<elem_type, __half>::value || std::is_same<elem_type, __nv_bfloat16>::value);
+
+    // The type of the offsets into the global memory tensors. The 32-bit offsets save registers,
+    // the 64-bit ones are only used when a tensor is larger than 2GB.
+    using index_t = index_t_;
+    static_assert(std::is_same<index_t, uint32_t>::value || std::is_same<index_t, uint64_t>::value);
+
+    // The number of value tensors sharing the softmax. The packed tensor is Q | K | V_0 | ... | V_{NUM_V-1}.
+    static constexpr int NUM_V = NUM_V_;
+    static_assert(NUM_V >= 1 && NUM_V <= MAX_NUM_V);
+    // The number of matrices in the packed QKV tensor.
+    static constexpr int NUM_MATS = NUM_V + 2;
+
     // The CTA description for the 1st GEMM.
     using Cta_tile_p = fmha::Cta_tile_extd<STEP, S, D, WARPS_M, WARPS_N, 1>;
     // The CTA description for the 2nd GEMM.
@@ -43,38 +59,43 @@ struct FMHA_kernel_traits {
     static constexpr bool K_IN_REGS = (FLAGS & 0x10u) == 0u;
     // Do we keep V in registers.
     static constexpr bool V_IN_REGS = (FLAGS & 0x100u) == 0u;
+    // Do we copy the next block of K and V to shared memory with LDGSTS while computing the current one.
+    // The fragments of K and V are taken to registers right away, so a single buffer in shared
+    // memory is enough but K and V need their own.
+    static constexpr bool ASYNC_KV = (FLAGS & 0x200u) != 0u;
+    static_assert(!ASYNC_KV || (K_IN_REGS && V_IN_REGS && !SHARE_SMEM_FOR_K_AND_V));
 
     // The global memory tile to load Q.
-    using Gmem_tile_q = fmha::Gmem_tile_qkv<Cta_tile_p, fmha::BITS_PER_ELEMENT_A, STEP, D>;
+    using Gmem_tile_q = fmha::Gmem_tile_qkv<Cta_tile_p, fmha::BITS_PER_ELEMENT_A, STEP, D, NUM_MATS, index_t>;
 
     // The shared memory tile to swizzle Q.
     // using Smem_tile_q = fmha::Smem_tile_a<Cta_tile_p, fmha::Row, Gmem_tile_q::BYTES_PER_LDG, 1>;
     using Smem_tile_q = fmha::Smem_tile_a<Cta_tile_p, fmha::Row, Gmem_tile_q::BYTES_PER_LDG, 2>;
 
     // The global memory tile to load K.
-    using Gmem_tile_k = fmha::Gmem_tile_qkv<Cta_tile_p, fmha::BITS_PER_ELEMENT_B, S, D>;
+    using Gmem_tile_k = fmha::Gmem_tile_qkv<Cta_tile_p, fmha::BITS_PER_ELEMENT_B, S, D, NUM_MATS, index_t>;
     // The shared memory tile to swizzle K.
     using Smem_tile_k = fmha::Smem_tile_b<Cta_tile_p, fmha::Col>;
 
     // The global memory tile to load V.
-    using Gmem_tile_v = fmha::Gmem_tile_qkv<Cta_tile_o, fmha::BITS_PER_ELEMENT_B, S, D>;
+    using Gmem_tile_v = fmha::Gmem_tile_qkv<Cta_tile_o, fmha::BITS_PER_ELEMENT_B, S, D, NUM_MATS, index_t>;
     // The shared memory tile to swizzle V.
     using Smem_tile_v = fmha::Smem_tile_v<Cta_tile_o>;
 
     // The global memory tile to store O.
-    using Gmem_tile_o = fmha::Gmem_tile_o<Cta_tile_o>;
+    using Gmem_tile_o = fmha::Gmem_tile_o<Cta_tile_o, 2, index_t>;
     // The shared memory tile for O.
     using Smem_tile_o = fmha::Smem_tile_o<Cta_tile_o>;;
 
     // The global memory tile to load/store S.
-    using Gmem_tile_s = fmha::Gmem_tile_mma_s<Cta_tile_p>;
+    using Gmem_tile_s = fmha::Gmem_tile_mma_s<Cta_tile_p, index_t>;
 
     // The shared memory tile to transpose S.
     using Smem_tile_st = fmha::Smem_tile_mma_transposed<Cta_tile_p>;
 
-    using Gmem_tile_do = fmha::Gmem_tile_dout<Cta_tile_p>;
+    using Gmem_tile_do = fmha::Gmem_tile_dout<Cta_tile_p, fmha::Gmem_tile_qkv<Cta_tile_p, fmha::BITS_PER_ELEMENT_A, STEP, D, 4, index_t> >;
 
-    using Gmem_tile_dot = fmha::Gmem_tile_dout<Cta_tile_p, fmha::Gmem_tile_qkv<Cta_tile_p, fmha::BITS_PER_ELEMENT_B, S, D> >;
+    using Gmem_tile_dot = fmha::Gmem_tile_dout<Cta_tile_p, fmha::Gmem_tile_qkv<Cta_tile_p, fmha::BITS_PER_ELEMENT_B, S, D, 4, index_t> >;
 
     // The global memory tile to store the softmax sum.
     using Gmem_softmax_sum = fmha::Gmem_summary_stats<Cta_tile_p>;
@@ -106,3 +127,36 @@ struct FMHA_kernel_traits {
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The decode kernel computes one query row against the cache, so it doesn't use the MMA tiles:
+// the THREADS_PER_KEY threads of a key each take ELTS_PER_LDG elements of the head dimension, and
+// the CTA goes over KEYS_PER_ITER keys at once. The cache holds elem_type, or int8_t / fmha::e4m3_t
+// with fp32 scales, dequantized in registers.
+template<int D_, int NUM_V_, typename elem_type_=__half, int THREADS_ = 128, typename cache_type_=elem_type_>
+struct FMHA_decode_kernel_traits {
+
+    static constexpr int D = D_;
+    static constexpr int NUM_V = NUM_V_;
+    static_assert(NUM_V >= 1 && NUM_V <= MAX_NUM_V);
+    using elem_type = elem_type_;
+    using cache_type = cache_type_;
+    static_assert(sizeof(cache_type) == 1 || std::is_same<cache_type, elem_type>::value);
+    // The 8 elements of a row of K / V_i loaded by a thread, 16B or 8B for an 8-bit cache.
+    using Cache_fetch = typename std::conditional<sizeof(cache_type) == 1, uint2, uint4>::type;
+
+    // The number of threads.
+    static constexpr int THREADS = THREADS_;
+
+    // Each thread loads 8 elements of a row of K / V_i with one LDG.128 (LDG.64 if 8-bit).
+    static constexpr int ELTS_PER_LDG = 8;
+    // The threads of a key are consecutive lanes of a warp, so the score is reduced with shuffles.
+    static constexpr int THREADS_PER_KEY = D / ELTS_PER_LDG;
+    static_assert(THREADS_PER_KEY <= 32 && 32 % THREADS_PER_KEY == 0);
+    // The number of keys computed per iteration.
+    static constexpr int KEYS_PER_ITER = THREADS / THREADS_PER_KEY;
+
+    // The combine kernel takes the weight of one split per thread.
+    static_assert(THREADS >= MAX_DECODE_SPLITS);
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
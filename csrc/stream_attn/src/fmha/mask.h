@@ -30,14 +30,19 @@
 namespace fmha {
 
 
+// With Is_causal, query i only sees the keys j of the band i - window_left <= j <= i + window_right.
+// The causal mask is window_right == 0, without a window the bounds are large enough to never
+// apply (see set_params).
 template<typename Cta_tile, bool Is_causal=false>
 struct Mask {
     using Mma_tile = fmha::Hmma_tile<Cta_tile>;
 
     template<typename BInfo>
     __device__ Mask(const BInfo &blockInfo, int tidx, const int loop_step_idx_ = 0)
-        : actual_seqlen(blockInfo.actual_seqlen - loop_step_idx_ * Cta_tile::N)
-        , loop_step_idx(loop_step_idx_) {
+        : actual_seqlen(blockInfo.actual_seqlen_k - loop_step_idx_ * Cta_tile::N)
+        , loop_step_idx(loop_step_idx_)
+        , window_left(blockInfo.window_left)
+        , window_right(blockInfo.window_right) {
 
         const int warp = tidx / Cta_tile::THREADS_PER_WARP;
         const int lane = tidx % Cta_tile::THREADS_PER_WARP;
@@ -63,14 +68,21 @@ struct Mask {
         const bool col_valid = current_col < actual_seqlen;
         // const bool col_valid = (ni * Mma_tile::N_PER_MMA_PER_CTA + col + (jj & 2) * 4 + (jj & 1)) < actual_seqlen;
         //&& (row + mi * Mma_tile::M_PER_MMA_PER_CTA + ii * 8) < actual_seqlen;
-        bool all_valid = Is_causal ? col_valid && (current_col + loop_step_idx * Cta_tile::N <= current_row) : col_valid;
-        // if ((threadIdx.x == 0) && (blockIdx.x == 0) && (blockIdx.y == 0)) {
-        //     printf("current_col=%d, current_row=%d, actual_seqlen=%d, col_valid=%d, all_valid=%d\n", current_col, current_row, actual_seqlen, col_valid, all_valid);
-        // }
-        return Is_causal ? col_valid && (current_col + loop_step_idx * Cta_tile::N <= current_row) : col_valid;
+        const int key = current_col + loop_step_idx * Cta_tile::N;
+        return Is_causal
+            ? col_valid && (key <= current_row + window_right) && (key >= current_row - window_left)
+            : col_valid;
         // return row_valid && col_valid;
     }
 
+    // The query and the key of the element (mi, ni, ii, jj), within their sequences.
+    inline __device__ int query(const int ii) const {
+        return row_offset + ii * 8;
+    }
+    inline __device__ int key(const int ni, const int jj) const {
+        return loop_step_idx * Cta_tile::N + ni * Mma_tile::N_PER_MMA_PER_CTA + col + (jj & 2) * 4 + (jj & 1);
+    }
+
     //BERT Mask: if upper left is invalid, none are valid
     inline __device__ bool any_valid(const int mi, const int ni) const {
         return is_valid(mi, ni, 0, 0) || is_valid(mi, ni, 1, 0);
@@ -85,6 +97,34 @@ struct Mask {
     int col;
     const int loop_step_idx;
     const int actual_seqlen;
+    const int window_left;
+    const int window_right;
 };
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The tiles touched by the band of a causal or sliding-window mask. The query blocks
+// [band_q_begin, band_q_end) hold all the queries that see a key of the K/V block j, and the K/V
+// blocks [band_kv_begin, band_kv_end) all the keys seen by the query block i. The other tiles are
+// fully masked out and are skipped.
+template<typename Cta_tile, typename BInfo>
+inline __device__ int band_q_begin(const BInfo &binfo, const int j) {
+    return max(0, j * Cta_tile::N - binfo.window_right) / Cta_tile::M;
+}
+
+template<typename Cta_tile, typename BInfo>
+inline __device__ int band_q_end(const BInfo &binfo, const int j) {
+    return ((j + 1) * Cta_tile::N - 1 + binfo.window_left) / Cta_tile::M + 1;
+}
+
+template<typename Cta_tile, typename BInfo>
+inline __device__ int band_kv_begin(const BInfo &binfo, const int i) {
+    return max(0, i * Cta_tile::M - binfo.window_left) / Cta_tile::N;
+}
+
+template<typename Cta_tile, typename BInfo>
+inline __device__ int band_kv_end(const BInfo &binfo, const int i) {
+    return ((i + 1) * Cta_tile::M - 1 + binfo.window_right) / Cta_tile::N + 1;
+}
+
 }  // namespace fmha
@@ -267,6 +267,26 @@ struct Softmax_base {
         }
     }
 
+    // Add the ALiBi bias -slope * |i - j| of the query i and the key j, the slope is in the units
+    // of the unscaled logits. The masked elements stay at -inf.
+    template<typename Mask>
+    inline __device__ void apply_alibi(const Mask &mask, const float slope) {
+        #pragma unroll
+        for( int mi = 0; mi < MMAS_M; ++mi ) {
+            #pragma unroll
+            for( int ii = 0; ii < 2; ++ii ) {
+                const int query = mask.query(ii);
+                #pragma unroll
+                for( int ni = 0; ni < MMAS_N; ++ni ) {
+                    #pragma unroll
+                    for( int jj = 0; jj < 4; ++jj ) {
+                        elt_[2 * mi + ii][4 * ni + jj] -= slope * float(abs(query - mask.key(ni, jj)));
+                    }
+                }
+            }
+        }
+    }
+
     // Apply the exp to all the elements.
     template <bool max_in_base2=false, bool elt_in_base2=false>
     inline __device__ void apply_exp(const float (&max)[MMAS_M * 2]) {
@@ -296,7 +316,8 @@ struct Softmax_base {
             // Instead of computing exp(x - max), we compute exp2(x * log_2(e) -
             // max * log_2(e)) This allows the compiler to use the ffma
             // instruction instead of fadd and fmul separately.
-            const float max_scaled = max[mi] * max_scale;
+            // A row can be fully masked out by a sliding window, its elements become 0 instead of NaN.
+            const float max_scaled = (max[mi] == -INFINITY ? 0.f : max[mi]) * max_scale;
             #pragma unroll
             for( int ni = 0; ni < MMAS_N * 4; ++ni ) {
                 elt_[mi][ni] = apply_exp2_(elt_[mi][ni] * scale, max_scaled);
@@ -569,6 +590,7 @@ struct Softmax : public Softmax_base<Cta_tile, Kernel_traits> {
     // Pack the data to a fragment for the next GEMM.
     template<int K, int M>
     inline __device__ void pack(Fragment_a (&dst)[K][M]) const {
+        using elem_type = typename Kernel_traits::elem_type;
         #pragma unroll
         for( int mi = 0; mi < M; ++mi ) {
             #pragma unroll
@@ -587,10 +609,10 @@ struct Softmax : public Softmax_base<Cta_tile, Kernel_traits> {
                 float tmp_13 = this->elt_[2 * mi + 1][4 * ki + 3];
 
                 // Pack to 4 registers.
-                dst[ki][mi].reg(0) = fmha::float2_to_half2(tmp_00, tmp_01);
-                dst[ki][mi].reg(1) = fmha::float2_to_half2(tmp_10, tmp_11);
-                dst[ki][mi].reg(2) = fmha::float2_to_half2(tmp_02, tmp_03);
-                dst[ki][mi].reg(3) = fmha::float2_to_half2(tmp_12, tmp_13);
+                dst[ki][mi].reg(0) = fmha::float2_pack<elem_type>(tmp_00, tmp_01);
+                dst[ki][mi].reg(1) = fmha::float2_pack<elem_type>(tmp_10, tmp_11);
+                dst[ki][mi].reg(2) = fmha::float2_pack<elem_type>(tmp_02, tmp_03);
+                dst[ki][mi].reg(3) = fmha::float2_pack<elem_type>(tmp_12, tmp_13);
             }
         }
     }
@@ -736,6 +758,14 @@ struct Softmax : public Softmax_base<Cta_tile, Kernel_traits> {
         smem_sum_.store(frag);
     }
 
+    // Same as reduce_sum_before_sync_, but for per-thread sums that were accumulated over several
+    // K/V blocks outside of elt_.
+    __device__ inline void store_sum_before_sync_(float (&frag)[2 * MMAS_M]){
+        SumOp<float> sum;
+        quad_reduce(frag, frag, sum);
+        smem_sum_.store(frag);
+    }
+
     template<int NROWS, typename Operator>
     __device__ inline void reduce_after_sync_(float (&frag)[NROWS][MMAS_M],
                                               const int (&rows)[NROWS],
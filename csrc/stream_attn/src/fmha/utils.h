@@ -30,8 +30,10 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <type_traits>
 
 #include <cuda_fp16.h>
+#include <cuda_bf16.h>
 
 extern "C" __device__ uint32_t __nvvm_get_smem_pointer(void *ptr);
 
@@ -310,6 +312,39 @@ static inline __device__ uint4 hmul8(uint32_t a, uint4 b) {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// The element-type aware versions. The uint32_t holds two elements of type T (__half or
+// __nv_bfloat16).
+template<typename T>
+static inline __device__ uint32_t hmul2(const uint32_t a, const uint32_t b);
+
+template<>
+inline __device__ uint32_t hmul2<__half>(const uint32_t a, const uint32_t b) {
+    return hmul2(a, b);
+}
+
+template<>
+inline __device__ uint32_t hmul2<__nv_bfloat16>(const uint32_t a, const uint32_t b) {
+    uint32_t c;
+    // There is no mul.bf16x2 on SM80, use an fma with a -0.0 addend.
+    const uint32_t zero = 0x80008000u;
+    asm volatile("fma.rn.bf16x2 %0, %1, %2, %3;\n" : "=r"(c) : "r"(a), "r"(b), "r"(zero));
+    return c;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+static inline __device__ uint4 hmul8(uint32_t a, uint4 b) {
+    uint4 c;
+    c.x = hmul2<T>(a, b.x);
+    c.y = hmul2<T>(a, b.y);
+    c.z = hmul2<T>(a, b.z);
+    c.w = hmul2<T>(a, b.w);
+    return c;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 static inline __device__ uint32_t hrelu2(uint32_t x, uint32_t lb = 0) {
     uint32_t res;
 #if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
@@ -325,6 +360,26 @@ static inline __device__ uint32_t hrelu2(uint32_t x, uint32_t lb = 0) {
 #endif
     return res;
 }
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+static inline __device__ uint32_t hrelu2(uint32_t x);
+
+template<>
+inline __device__ uint32_t hrelu2<__half>(uint32_t x) {
+    return hrelu2(x);
+}
+
+template<>
+inline __device__ uint32_t hrelu2<__nv_bfloat16>(uint32_t x) {
+    uint32_t res;
+    const uint32_t zero = 0u;
+    asm volatile( "max.bf16x2 %0, %1, %2;\n" : "=r"(res) : "r"(x), "r"(zero));
+    return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
 static inline __device__ uint32_t habs2(uint32_t x) {
     uint32_t res;
     asm volatile( "abs.f16x2 %0, %1;\n" : "=r"(res) : "r"(x));
@@ -391,6 +446,38 @@ static inline __device__ uint2 float4_to_half4(float x, float y, float z, float
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+template<typename T>
+static inline __device__ uint32_t float2_pack(float a, float b);
+
+template<>
+inline __device__ uint32_t float2_pack<__half>(float a, float b) {
+    return float2_to_half2(a, b);
+}
+
+template<>
+inline __device__ uint32_t float2_pack<__nv_bfloat16>(float a, float b) {
+    uint32_t c;
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
+    asm volatile("cvt.rn.bf16x2.f32 %0, %1, %2;\n" : "=r"(c) : "f"(b), "f"(a));
+#else
+    __nv_bfloat162 result = __floats2bfloat162_rn(a, b);
+    c = reinterpret_cast<uint32_t(&)>(result);
+#endif
+    return c;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template<typename T>
+static inline __device__ uint2 float4_pack(float x, float y, float z, float w) {
+    uint2 d;
+    d.x = float2_pack<T>(x, y);
+    d.y = float2_pack<T>(z, w);
+    return d;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 static inline __device__ uint32_t hfma2(uint32_t a, uint32_t b, uint32_t c) {
     uint32_t d;
     asm volatile("fma.rn.f16x2 %0, %1, %2, %3;\n" : "=r"(d) : "r"(a), "r"(b), "r"(c));
@@ -512,6 +599,76 @@ static inline __device__ float hmulsum8(const uint4 a, const uint4 b) {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+static inline __device__ float hfma2_to_float(const __nv_bfloat162 a, const __nv_bfloat162 b) {
+    float2 af = __bfloat1622float2(a);
+    float2 bf = __bfloat1622float2(b);
+    return af.x * bf.x + af.y * bf.y;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same as above for 8 elements of type T (__half or __nv_bfloat16).
+template<typename T>
+static inline __device__ float hmulsum8(const uint4 a, const uint4 b) {
+    using T2 = typename std::conditional<std::is_same<T, __half>::value,
+                                         __half2, __nv_bfloat162>::type;
+    float sum;
+    sum  = fmha::hfma2_to_float(reinterpret_cast<const T2&>(a.x), reinterpret_cast<const T2&>(b.x));
+    sum += fmha::hfma2_to_float(reinterpret_cast<const T2&>(a.y), reinterpret_cast<const T2&>(b.y));
+    sum += fmha::hfma2_to_float(reinterpret_cast<const T2&>(a.z), reinterpret_cast<const T2&>(b.z));
+    sum += fmha::hfma2_to_float(reinterpret_cast<const T2&>(a.w), reinterpret_cast<const T2&>(b.w));
+    return sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Convert a vector of 8 elements of type T (__half or __nv_bfloat16) to float.
+template<typename T>
+static inline __device__ void float8_unpack(float (&dst)[8], const uint4 src) {
+    const uint32_t regs[4] = { src.x, src.y, src.z, src.w };
+    #pragma unroll
+    for( int ii = 0; ii < 4; ++ii ) {
+        float2 f;
+        if constexpr( std::is_same<T, __half>::value ) {
+            f = __half22float2(reinterpret_cast<const __half2&>(regs[ii]));
+        } else {
+            f = __bfloat1622float2(reinterpret_cast<const __nv_bfloat162&>(regs[ii]));
+        }
+        dst[2 * ii + 0] = f.x;
+        dst[2 * ii + 1] = f.y;
+    }
+}
+
+// The raw bits of an fp8 e4m3 element (4 exponent bits with bias 7, 3 mantissa bits, no inf).
+struct e4m3_t { uint8_t bits; };
+
+// Convert a vector of 8 elements of type T (int8_t or e4m3_t) to float. An e4m3 element shifted
+// into the exponent and mantissa bits of a half is its value times 2^(7 - 15), subnormals included,
+// so the pairs are rebuilt as half2 and scaled back by 2^8.
+template<typename T>
+static inline __device__ void float8_unpack(float (&dst)[8], const uint2 src) {
+    const uint32_t regs[2] = { src.x, src.y };
+    #pragma unroll
+    for( int ii = 0; ii < 2; ++ii ) {
+        if constexpr( std::is_same<T, int8_t>::value ) {
+            #pragma unroll
+            for( int jj = 0; jj < 4; ++jj ) { dst[4 * ii + jj] = float(int8_t(regs[ii] >> (8 * jj))); }
+        } else {
+            // Bytes 0, 1 (resp. 2, 3) in the high byte of each half.
+            #pragma unroll
+            for( int jj = 0; jj < 2; ++jj ) {
+                const uint32_t x = __byte_perm(regs[ii], 0u, jj == 0 ? 0x1404 : 0x3424);
+                const uint32_t h = (x & 0x80008000u) | ((x & 0x7f007f00u) >> 1);
+                const float2 f = __half22float2(reinterpret_cast<const __half2&>(h));
+                dst[4 * ii + 2 * jj + 0] = f.x * 256.f;
+                dst[4 * ii + 2 * jj + 1] = f.y * 256.f;
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 static inline __device__ uint4 fadd4(uint4 a, uint4 b) {
     float4 c;
     c.x = reinterpret_cast<const float&>(a.x) + reinterpret_cast<const float&>(b.x);
@@ -769,6 +926,69 @@ struct Ldg_functor {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Copy 16B from global to shared memory without going through registers. If p is false, the
+// shared memory is zero-filled, like the fetch registers of the LDG path.
+inline __device__ void ldgsts(uint32_t dst, const void *ptr, bool p = true) {
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
+    const uint32_t src_size = p ? 16 : 0;
+    asm volatile("cp.async.cg.shared.global [%0], [%1], 16, %2;\n"
+        : : "r"(dst), "l"(ptr), "r"(src_size));
+#else
+    uint4 tmp = make_uint4(0, 0, 0, 0);
+    if( p ) {
+        ldg(tmp, ptr);
+    }
+    asm volatile("st.shared.v4.b32 [%0], {%1, %2, %3, %4};\n"
+        : : "r"(dst), "r"(tmp.x), "r"(tmp.y), "r"(tmp.z), "r"(tmp.w));
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Close the group of LDGSTS issued since the last commit.
+inline __device__ void ldgsts_commit() {
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
+    asm volatile("cp.async.commit_group;\n" ::);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Wait until at most N groups of LDGSTS are still in flight. The writes of the other groups are
+// only visible to the other threads of the CTA after a __syncthreads.
+template< int N >
+inline __device__ void ldgsts_wait() {
+#if defined(__CUDA_ARCH__) && __CUDA_ARCH__ >= 800
+    asm volatile("cp.async.wait_group %0;\n" :: "n"(N));
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+template< int N >
+struct Ldgsts_functor {
+    // Ctor.
+    inline __device__ Ldgsts_functor(uint32_t (&smem_ptrs)[N], const void* (&gmem_ptrs)[N])
+        : smem_ptrs_(smem_ptrs), gmem_ptrs_(gmem_ptrs) {
+    }
+
+    // Clear the element. Noop since the LDGSTS zero-fills the shared memory.
+    inline __device__ void clear(int ii) {
+    }
+
+    // Trigger the copies.
+    inline __device__ void load(int ii, bool p) {
+        ldgsts(smem_ptrs_[ii], gmem_ptrs_[ii], p);
+    }
+
+    // The shared memory pointers.
+    uint32_t (&smem_ptrs_)[N];
+    // The global memory pointers.
+    const void* (&gmem_ptrs_)[N];
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template< typename Data_type, int N, int M >
 inline __device__ void ldg_(Data_type (&fetch)[N], const void* (&ptrs)[N], uint32_t (&preds)[M]) {
     Ldg_functor<Data_type, N> fct(fetch, ptrs);
@@ -0,0 +1,166 @@
+/* Copyright (c) 2022, Tri Dao.
+ */
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "fmha_autotune.h"
+#include "fmha_nvtx.h"
+
+namespace fmha {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+std::mutex autotune_mutex;
+
+// The winners by key, from the cache file and from the tuning in this process.
+std::unordered_map<std::string, std::string> autotune_winners;
+bool autotune_loaded = false;
+
+const char *autotune_cache_path() { return std::getenv("STREAM_ATTN_AUTOTUNE_CACHE"); }
+
+bool autotune_enabled() {
+    const char *env = std::getenv("STREAM_ATTN_AUTOTUNE");
+    return env != nullptr && std::strcmp(env, "0") != 0;
+}
+
+// Each line of the cache file is "key\tname", the device names have spaces. Later lines win.
+void load_autotune_cache() {
+    if (autotune_loaded) { return; }
+    autotune_loaded = true;
+    const char *path = autotune_cache_path();
+    if (path == nullptr) { return; }
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        const size_t tab = line.find('\t');
+        if (tab == std::string::npos) { continue; }
+        autotune_winners[line.substr(0, tab)] = line.substr(tab + 1);
+    }
+}
+
+void save_autotune_winner(const std::string &key, const std::string &name) {
+    const char *path = autotune_cache_path();
+    if (path == nullptr) { return; }
+    std::ofstream file(path, std::ios::app);
+    file << key << '\t' << name << '\n';
+}
+
+// Has its own mutex since the launchers check the shared memory while autotune_select times them.
+const cudaDeviceProp &current_device_props() {
+    static std::mutex props_mutex;
+    static std::unordered_map<int, cudaDeviceProp> props;
+    int device;
+    FMHA_CHECK_CUDA(cudaGetDevice(&device));
+    std::lock_guard<std::mutex> lock(props_mutex);
+    auto it = props.find(device);
+    if (it == props.end()) {
+        it = props.emplace(device, cudaDeviceProp()).first;
+        FMHA_CHECK_CUDA(cudaGetDeviceProperties(&it->second, device));
+    }
+    return it->second;
+}
+
+float time_config(const std::function<void(int)> &launch, const int config, cudaStream_t stream) {
+    constexpr int ITERS = 5;
+    // The first launch also sets the shared memory attribute of the kernel.
+    launch(config);
+    cudaEvent_t start, stop;
+    FMHA_CHECK_CUDA(cudaEventCreate(&start));
+    FMHA_CHECK_CUDA(cudaEventCreate(&stop));
+    FMHA_CHECK_CUDA(cudaEventRecord(start, stream));
+    for (int it = 0; it < ITERS; ++it) { launch(config); }
+    FMHA_CHECK_CUDA(cudaEventRecord(stop, stream));
+    FMHA_CHECK_CUDA(cudaEventSynchronize(stop));
+    float ms;
+    FMHA_CHECK_CUDA(cudaEventElapsedTime(&ms, start, stop));
+    FMHA_CHECK_CUDA(cudaEventDestroy(start));
+    FMHA_CHECK_CUDA(cudaEventDestroy(stop));
+    return ms / ITERS;
+}
+
+}  // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::string autotune_key(const char *kernel, const Fused_multihead_attention_fprop_params &params) {
+    const cudaDeviceProp *props = &current_device_props();
+    const int seqlen_bucket = fmha_seqlen_bucket(params.seqlen_k);
+    return std::string(props->name)
+        + "|sm" + std::to_string(props->major * 10 + props->minor)
+        + "|" + kernel
+        + "|d" + std::to_string(params.d)
+        + "|s" + std::to_string(seqlen_bucket)
+        + "|v" + std::to_string(params.num_v)
+        + (params.is_bf16 ? "|bf16" : "|fp16")
+        + (params.is_64bit_index ? "|i64" : "|i32")
+        + (params.p_dropout < 1.f ? "|dropout" : "")
+        + (params.is_causal ? "|causal" : "");
+}
+
+int autotune_select(const std::string &key, const std::vector<Autotune_config> &configs,
+                    const std::function<void(int)> &launch, cudaStream_t stream) {
+    std::lock_guard<std::mutex> lock(autotune_mutex);
+    load_autotune_cache();
+    const size_t max_smem = current_device_props().sharedMemPerBlockOptin;
+    auto fits = [&](const int ci) { return configs[ci].smem_size <= max_smem; };
+    const int num_configs = configs.size();
+
+    auto it = autotune_winners.find(key);
+    if (it != autotune_winners.end()) {
+        for (int ci = 0; ci < num_configs; ++ci) {
+            if (configs[ci].name == it->second && fits(ci)) { return ci; }
+        }
+    }
+
+    int best = -1;
+    int num_fitting = 0;
+    for (int ci = 0; ci < num_configs; ++ci) {
+        if (fits(ci)) {
+            if (best < 0) { best = ci; }
+            ++num_fitting;
+        }
+    }
+    // Nothing fits, the default fails with the error of check_smem_size.
+    if (best < 0) { return 0; }
+    // Can't synchronize on the events while capturing a CUDA graph, the default is used until the
+    // problem is seen outside of a capture.
+    cudaStreamCaptureStatus capture_status;
+    FMHA_CHECK_CUDA(cudaStreamIsCapturing(stream, &capture_status));
+    if (!autotune_enabled() || num_fitting < 2 || capture_status != cudaStreamCaptureStatusNone) {
+        return best;
+    }
+
+    float best_ms = INFINITY;
+    for (int ci = 0; ci < num_configs; ++ci) {
+        if (!fits(ci)) { continue; }
+        const float ms = time_config(launch, ci, stream);
+        if (ms < best_ms) {
+            best_ms = ms;
+            best = ci;
+        }
+    }
+    autotune_winners[key] = configs[best].name;
+    save_autotune_winner(key, configs[best].name);
+    return best;
+}
+
+void check_smem_size(const char *kernel, const size_t smem_size) {
+    const size_t max_smem = current_device_props().sharedMemPerBlockOptin;
+    if (smem_size > max_smem) {
+        throw std::runtime_error(std::string("stream_attn: the ") + kernel + " kernel for this problem needs "
+                                 + std::to_string(smem_size) + " bytes of shared memory per block, the device has "
+                                 + std::to_string(max_smem));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace fmha
@@ -0,0 +1,52 @@
+/* Copyright (c) 2022, Tri Dao.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "fmha.h"
+
+// The launchers can pick between several FMHA_kernel_traits for the same problem, e.g. keeping V in
+// registers or in shared memory, which is fastest depends on the GPU. The first config of a list is
+// the default. With STREAM_ATTN_AUTOTUNE=1, the configs are timed on the device the first time a
+// problem is seen, and the winner is kept for the process and appended to the file
+// STREAM_ATTN_AUTOTUNE_CACHE if set. The winners in that file are used even without tuning.
+// Configs that need more shared memory than the device has are never picked.
+
+namespace fmha {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Autotune_config {
+    std::string name;
+    size_t smem_size;
+};
+
+template<typename Kernel_traits>
+std::string autotune_config_name() {
+    return "n" + std::to_string(Kernel_traits::Cta_tile_p::N)
+        + "_w" + std::to_string(Kernel_traits::THREADS / 32)
+        + (Kernel_traits::SHARE_SMEM_FOR_K_AND_V ? "_share_kv" : "")
+        + (Kernel_traits::V_IN_REGS ? "" : "_v_smem")
+        + (Kernel_traits::ASYNC_KV ? "_async_kv" : "");
+}
+
+// The problems are bucketed by the device, the kernel, the head dimension, seqlen_k rounded up to a
+// power of 2, the number of values, the types, dropout and causal.
+std::string autotune_key(const char *kernel, const Fused_multihead_attention_fprop_params &params);
+
+// Returns the index of the config to run. launch(i) runs the i-th config on stream, it has to
+// give the same results every time as the outputs are overwritten while timing.
+int autotune_select(const std::string &key, const std::vector<Autotune_config> &configs,
+                    const std::function<void(int)> &launch, cudaStream_t stream);
+
+// Throws if a CTA of the kernel can't get smem_size bytes of shared memory on the current device,
+// e.g. the GPUs other than A100 and H100 have about 100KB, instead of failing the launch.
+void check_smem_size(const char *kernel, const size_t smem_size);
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace fmha
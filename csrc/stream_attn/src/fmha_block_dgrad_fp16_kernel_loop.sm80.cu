@@ -2,6 +2,7 @@
  */
 
 #include "fmha.h"
+#include "fmha_autotune.h"
 #include "fmha_block_dgrad_kernel_1xN_loop.h"
 
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, int loop_steps=-1>
@@ -23,24 +24,21 @@ void run_fmha_block_dgrad_fp16_sm80_loop_(const Fused_multihead_attention_fprop_
     static_assert(smem_size_dq == 16 * Kernel_traits::Cta_tile_p::K * 4 * Kernel_traits::Cta_tile_p::WARPS_N);
     static_assert(smem_size_dp_sum == 16 * 4 * 2);
 
-    constexpr int smem_size_dq_dk_dv = smem_size_q * 2 + smem_size_v * (Kernel_traits::V_IN_REGS ? 1 : 2) + smem_size_dq + smem_size_s * 2 + smem_size_dp_sum;
+    constexpr int smem_size_dq_dk_dv = smem_size_q * 2 + smem_size_v * (Kernel_traits::V_IN_REGS ? 1 : 2) + smem_size_dq + smem_size_s * 2 + smem_size_dp_sum
+                                     + (Kernel_traits::NUM_V - 1) * (smem_size_q + smem_size_v);
 
     bool is_dropout = params.p_dropout < 1.f;  // params.p_dropout is the probability of "keeping"
-    bool is_causal = params.is_causal;
-    auto kernel = is_dropout
-        ? (is_causal ? &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, true> : &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, false>)
-        : (is_causal ? &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, true> : &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, false>);
     constexpr int N = Kernel_traits::Cta_tile_p::N;
-    if (params.s == N) {
-        kernel = is_dropout
-            ? (is_causal ? &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, true, /*loop_steps=*/1> : &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, false, /*loop_steps=*/1>)
-            : (is_causal ? &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, true, /*loop_steps=*/1> : &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, false, /*loop_steps=*/1>);
-    } else if (params.s == N * 2) {
-        kernel = is_dropout
-            ? (is_causal ? &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, true, /*loop_steps=*/2> : &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, false, /*loop_steps=*/2>)
-            : (is_causal ? &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, true, /*loop_steps=*/2> : &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, false, /*loop_steps=*/2>);
-    }
+    // The loops over one or two K/V blocks are unrolled.
+    auto kernel = DROPOUT_SWITCH(is_dropout, Is_dropout, [&] {
+        return BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            return params.seqlen_k == N ? &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, Is_dropout, Is_causal, /*loop_steps=*/1>
+                : (params.seqlen_k == N * 2 ? &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, Is_dropout, Is_causal, /*loop_steps=*/2>
+                   : &fmha_block_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, Is_dropout, Is_causal>);
+        });
+    });
 
+    fmha::check_smem_size("block dgrad", smem_size_dq_dk_dv);
     if( smem_size_dq_dk_dv >= 48 * 1024 ) {
         FMHA_CHECK_CUDA(cudaFuncSetAttribute(
             kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size_dq_dk_dv));
@@ -50,15 +48,46 @@ void run_fmha_block_dgrad_fp16_sm80_loop_(const Fused_multihead_attention_fprop_
     FMHA_CHECK_CUDA(cudaPeekAtLastError());
 }
 
-void run_fmha_block_dgrad_fp16_sm80(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+template<typename elem_type, int NUM_V>
+void run_fmha_block_dgrad_fp16_sm80_(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+#if FMHA_BUILD_HDIM_16
     if (params.d == 16) {
-        using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 8, 0x08u>;
+        using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 8, 0x08u, NUM_V, elem_type>;
         run_fmha_block_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
-    } else if (params.d == 32) {
-        using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 8, 0x08u>;
+    }
+#endif
+#if FMHA_BUILD_HDIM_32
+    if (params.d == 32) {
+        using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 8, 0x08u, NUM_V, elem_type>;
         run_fmha_block_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
-    } else if (params.d == 64) {
-        using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 8, 0x100u>;
+    }
+#endif
+#if FMHA_BUILD_HDIM_64
+    if (params.d == 64) {
+        using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 8, 0x100u, NUM_V, elem_type>;
         run_fmha_block_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
     }
-}
\ No newline at end of file
+#endif
+}
+
+template<typename elem_type>
+void run_fmha_block_dgrad_fp16_sm80_num_v_(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+    switch (params.num_v) {
+#if FMHA_BUILD_NUM_V_1
+        case 1: run_fmha_block_dgrad_fp16_sm80_<elem_type, 1>(params, stream); break;
+#endif
+#if FMHA_BUILD_NUM_V_2
+        case 2: run_fmha_block_dgrad_fp16_sm80_<elem_type, 2>(params, stream); break;
+#endif
+    }
+}
+
+void run_fmha_block_dgrad_fp16_sm80(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+    if (params.is_bf16) {
+#if FMHA_BUILD_BF16
+        run_fmha_block_dgrad_fp16_sm80_num_v_<__nv_bfloat16>(params, stream);
+#endif
+    } else {
+        run_fmha_block_dgrad_fp16_sm80_num_v_<__half>(params, stream);
+    }
+}
@@ -3,7 +3,7 @@
 
 #pragma once
 
-#include "fmha_fprop_kernel_1xN.h"
+#include "fmha_dgrad_kernel_1xN_loop.h"
 #include "fmha_kernel.h"
 #include "fmha_blockmask.h"
 #include <fmha/kernel_traits.h>
@@ -13,24 +13,12 @@ namespace fmha {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template <typename Smem_dp_sum, int M>
-inline __device__ void dot_do_o(float (&sum)[M], const uint4 (&do_)[M], const uint4 (&o)[M],
-                                Smem_dp_sum smem, const int buffer_idx) {
-    #pragma unroll
-    for (int mi = 0; mi < M; ++mi) {
-        sum[mi] = smem.reduce_warp(fmha::hmulsum8(do_[mi], o[mi]));
-    }
-    static_assert(M == 1);
-    smem.store(sum[0], buffer_idx);
-}
-
-////////////////////////////////////////////////////////////////////////////////////////////////////
-
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Is_first, bool Is_last, typename Params, typename Prng>
 inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params, Prng &ph,
                                                      const int loop_step_idx) {
 
     // The description of the CTA tile for the 1st batched GEMM.
+    using elem_type = typename Kernel_traits::elem_type;
     using Cta_tile_p = typename Kernel_traits::Cta_tile_p;
     // The description of the CTA tile for the 2nd batched GEMM.
     using Cta_tile_dq = typename Kernel_traits::Cta_tile_o;
@@ -78,8 +66,8 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
 
     // The global memory tile to store dQ.
     // using Gmem_tile_dq = typename Kernel_traits::Gmem_tile_dq;
-    using Gmem_tile_dq = fmha::Gmem_tile_dq<Cta_tile_dq>;
-    using Gmem_tile_dq_tmp = fmha::Gmem_tile_o<Cta_tile_dq, 4>;
+    using Gmem_tile_dq = fmha::Gmem_tile_dq<Cta_tile_dq, Kernel_traits::NUM_MATS, typename Kernel_traits::index_t>;
+    using Gmem_tile_dq_tmp = fmha::Gmem_tile_o<Cta_tile_dq, 4, typename Kernel_traits::index_t>;
     // The shared memory tile to swizzle dQ.
     using Smem_tile_dq = typename Kernel_traits::Smem_tile_o;
 
@@ -108,14 +96,25 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
 
     using Softmax = fmha::Softmax<Cta_tile_p, Kernel_traits>;
 
+    // The value tensors 1, ..., NUM_V - 1 are the "extra" ones, see compute_dq_dk_dv_1xN_one_iter.
+    constexpr int NUM_V_X = Kernel_traits::NUM_V - 1;
+    // The size of the register arrays for the extra values, zero-sized arrays are not allowed.
+    constexpr int NUM_V_X_REGS = NUM_V_X > 0 ? NUM_V_X : 1;
+
     // Shared memory.
     extern __shared__ char smem_[];
     // Shared memory layout if we keep V in registers:
-    //  dO | Q | K / V | dQ | S | dP | dP_sum
+    //  dO | Q | K / V | dQ | S | dP | dP_sum | dO_1 | V_1 | ... | dO_{NUM_V-1} | V_{NUM_V-1}
     //  dV | dK
     // Shared memory layout if we keep V shared memory:
-    //  dO | Q | K | V | dQ | S | dP | dP_sum
+    //  dO | Q | K | V | dQ | S | dP | dP_sum | dO_1 | V_1 | ... | dO_{NUM_V-1} | V_{NUM_V-1}
     //  dV | dK
+    constexpr int SMEM_OFFSET_X = Smem_tile_do::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_O + Smem_tile_dq::BYTES_PER_TILE
+                                + Smem_tile_st::BYTES_PER_TILE * 2 + Smem_dp_sum::BYTES_PER_TILE;
+    constexpr int SMEM_STRIDE_X = Smem_tile_do::BYTES_PER_TILE + Smem_tile_v::BYTES_PER_TILE;
+    // The offsets of dO_i and V_i within the part of an extra value.
+    constexpr int SMEM_OFFSET_X_DO = 0;
+    constexpr int SMEM_OFFSET_X_V = Smem_tile_do::BYTES_PER_TILE;
 
 
     // The block index for the batch.
@@ -142,11 +141,13 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
     Gmem_tile_q gmem_q(params, 0, binfo, tidx);
     // Allocate the global memory tile loader for dQ.
     Gmem_tile_dq gmem_dq(params, 0, binfo, tidx);
-    Gmem_tile_dq_tmp gmem_dq_tmp(params.o_tmp_ptr, params.o_stride_in_elts, binfo, tidx);
+    Gmem_tile_dq_tmp gmem_dq_tmp(params.dq_tmp_ptr, params.o_stride_in_elts, binfo, tidx, params.d);
     // Allocate the global memory tile loader for S.
     Gmem_tile_s gmem_s(params, binfo, tidx);
 
     fmha::Mask<Cta_tile_p, Is_causal> mask(binfo, tidx, loop_step_idx);
+    // The blocks below the diagonal only need the bounds of the sequence.
+    fmha::Mask<Cta_tile_p> mask_full(binfo, tidx, loop_step_idx);
 
     // Allocate the global memory tile loader for K.
     Gmem_tile_k gmem_k(params, 1, binfo, tidx);
@@ -161,7 +162,7 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
     Smem_tile_kt smem_kt(&smem_[Smem_tile_do::BYTES_PER_TILE + Gemm1::Smem_tile_q::BYTES_PER_TILE], tidx);
 
     // Allocate the global memory tile loader for dO.
-    Gmem_tile_do gmem_do(params.do_ptr, params, binfo, tidx);
+    Gmem_tile_do gmem_do(params.do_ptrs[0], params, binfo, tidx);
     // Allocate the shared memory tile loader for dO.
     Smem_tile_do smem_do(&smem_[0], tidx);
     Smem_tile_dot smem_dot(&smem_[0], tidx);
@@ -173,19 +174,19 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
     Smem_tile_st smem_dp(&smem_[Smem_tile_do::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_O + Smem_tile_dq::BYTES_PER_TILE + Smem_tile_st::BYTES_PER_TILE], tidx);
 
     // Allocate the global memory tile loader for O.
-    Gmem_tile_o gmem_o(params.o_ptr, params, binfo, tidx);
+    Gmem_tile_o gmem_o(params.o_ptrs[0], params, binfo, tidx);
 
     // Allocate the shared memory tile loader for O. We use the same as K so be careful!!!
     Smem_tile_dq smem_dq(&smem_[Smem_tile_do::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_O], tidx);
 
-    Gmem_softmax_sum gmem_softmax_lse(params.softmax_lse_ptr, params, tidx);
-    Gmem_softmax_sum gmem_softmax_d(params.dsoftmax_sum, params, tidx);
+    Gmem_softmax_sum gmem_softmax_lse(params.softmax_lse_ptr, params, binfo, tidx);
+    Gmem_softmax_sum gmem_softmax_d(params.dsoftmax_sum, params, binfo, tidx);
 
     static_assert(Cta_tile_p::N % Cta_tile_p::M == 0);
-    const int steps = params.s / Cta_tile_p::M;
+    const int steps = params.seqlen_q / Cta_tile_p::M;
 
     // Wind gmem tiles to the correct position.
-    int block_row_idx_next = mask_val / 4;
+    int block_row_idx_next = mask_val / 8;
     int block_row_idx_to_move = block_row_idx_next - block_row_idx;
     block_row_idx = block_row_idx_next;
     gmem_q.move(block_row_idx_to_move);
@@ -215,6 +216,24 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
     // if (Is_first) { gmem_o.load(); }
     // if (true) { gmem_o.load(); }
     if (Is_first || mask_val % 2 == 1) { gmem_o.load(); }
+    // Trigger the loads for the extra V_i, dO_i and O_i. V_i is matrix 2 + i of the packed QKV tensor.
+    uint4 fetch_v_x[NUM_V_X_REGS][Gmem_tile_v::LDGS];
+    uint4 fetch_do_x[NUM_V_X_REGS][Gmem_tile_do::LDGS];
+    uint4 fetch_o_x[NUM_V_X_REGS][Gmem_tile_o::LDGS];
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        Gmem_tile_v gmem_v_x(params, 3 + xi, binfo, tidx);
+        if (!Is_first) { gmem_v_x.move(loop_step_idx); }
+        gmem_v_x.load();
+        #pragma unroll
+        for( int ii = 0; ii < Gmem_tile_v::LDGS; ++ii ) {
+            fetch_v_x[xi][ii] = gmem_v_x.fetch_[ii];
+        }
+        load_dout<Gmem_tile_do>(fetch_do_x[xi], params.do_ptrs[1 + xi], params, binfo, tidx, block_row_idx);
+        if (Is_first || mask_val % 2 == 1) {
+            load_dout<Gmem_tile_o>(fetch_o_x[xi], params.o_ptrs[1 + xi], params, binfo, tidx, block_row_idx);
+        }
+    }
 
     float p_lse[Mma_tile_p::MMAS_M * 2];
     gmem_softmax_lse.load(reinterpret_cast<uint32_t(&)[Mma_tile_p::MMAS_M * 2]>(p_lse));
@@ -233,10 +252,15 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
     // Commit the data for Q, dO, and V to shared memory.
     gmem_q.commit(gemm_q_k.smem_q);
     gmem_do.commit(smem_do);
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        Smem_tile_do smem_do_x(&smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_DO], tidx);
+        smem_do_x.store(fetch_do_x[xi]);
+    }
     // if (Is_first) {
     // if (true) {
     if (Is_first || mask_val % 2 == 1) {
-        dot_do_o(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, smem_dp_sum, 0);
+        dot_do_o<NUM_V_X, elem_type>(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, fetch_do_x, fetch_o_x, smem_dp_sum, 0);
         const int dp_sum_row = tidx / Smem_dp_sum::THREADS_PER_ROW;
         if ((dp_sum_row < Smem_dp_sum::ROWS) && (tidx % Smem_dp_sum::THREADS_PER_ROW == 0)) {
             gmem_softmax_d.store_row(reinterpret_cast<uint32_t(&)[Gmem_tile_do::LDGS]>(dp_sum_regs), dp_sum_row);
@@ -248,11 +272,20 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
         const uint32_t scale_dropout = params.scale_dropout;
         #pragma unroll
         for(int it=0; it < Gmem_tile_v::LDGS; it++){
-            gmem_v.fetch_[it] = fmha::hmul8(scale_dropout, gmem_v.fetch_[it]);
+            gmem_v.fetch_[it] = fmha::hmul8<elem_type>(scale_dropout, gmem_v.fetch_[it]);
+            #pragma unroll
+            for( int xi = 0; xi < NUM_V_X; ++xi ) {
+                fetch_v_x[xi][it] = fmha::hmul8<elem_type>(scale_dropout, fetch_v_x[xi][it]);
+            }
         }
     }
 
     gmem_v.commit(smem_v);
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        Smem_tile_v smem_v_x(&smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_V], tidx);
+        smem_v_x.store(fetch_v_x[xi]);
+    }
 
     // const uint32_t scale_bmm1 = reinterpret_cast<const uint32_t&>(params.scale_bmm1);
     // #pragma unroll
@@ -311,13 +344,18 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
     fmha::Clear_accumulator<fmha::Accumulator_type, Cta_tile_dkv::WARPS_K>::apply(acc_dv);
     fmha::Fragment_accumulator acc_dk[Mma_tile_dkv::MMAS_M][Mma_tile_dkv::MMAS_N];
     fmha::Clear_accumulator<fmha::Accumulator_type, Cta_tile_dkv::WARPS_K>::apply(acc_dk);
+    fmha::Fragment_accumulator acc_dv_x[NUM_V_X_REGS][Mma_tile_dkv::MMAS_M][Mma_tile_dkv::MMAS_N];
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        fmha::Clear_accumulator<fmha::Accumulator_type, Cta_tile_dkv::WARPS_K>::apply(acc_dv_x[xi]);
+    }
 
     // Load over the entire sequence length.
     for( int l = 0; l < steps; l++ ) {
         // if ((threadIdx.x == 0) && (blockIdx.x == 0) && (blockIdx.y == 0)) {
         //     printf("block_row_idx = %d\n", block_row_idx);
         // }
-        if (block_row_idx * Cta_tile_p::M >= binfo.actual_seqlen) break;
+        if (block_row_idx * Cta_tile_p::M >= binfo.actual_seqlen_q) break;
 
         int mask_val_next = l < steps - 1 ? blockmask.mask_val(l + 1) : -1;
         // if ((threadIdx.x == 0) && (blockIdx.x == 0) && (blockIdx.y == 0)) {
@@ -341,11 +379,16 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
 
         // Load the mask for that iteration.
         mask.load(block_row_idx);
+        mask_full.load(block_row_idx);
 
         // Convert from the accumulator type to FP32 for Softmax.
         softmax.unpack_noscale(acc_p);
-        // Apply the mask.
-        softmax.apply_mask(mask);
+        // Apply the mask. Only the blocks on the diagonal need the causal mask, see convert_blockmask.
+        if (Is_causal && (mask_val & 0x4) != 0) {
+            softmax.apply_mask(mask);
+        } else {
+            softmax.apply_mask(mask_full);
+        }
         // Scale by log-sum-exp of the softmax
         // softmax.apply_exp(p_lse);
         softmax.template scale_apply_exp</*scale_max=*/false>(p_lse, params.scale_bmm1f);
@@ -366,7 +409,7 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
 
         // Trigger the load for the next Q values.
         bool not_last_iter = (l < steps - 1) && (mask_val_next != -1);
-        block_row_idx_next = mask_val_next / 4;
+        block_row_idx_next = mask_val_next / 8;
         int block_row_idx_to_move = block_row_idx_next - block_row_idx;
         if (not_last_iter) {
             gemm_q_k.smem_q.move_to_next_write_buffer();
@@ -408,9 +451,9 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
             smem_do.load(frag_do[ki & 1], ki);
             if (!Kernel_traits::V_IN_REGS) {
                 smem_v.load(frag_v[ki & 1], ki);
-                fmha::gemm(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1) & 1]);
+                fmha::gemm<elem_type>(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1) & 1]);
             } else {
-                fmha::gemm(acc_dp, frag_do[(ki - 1) & 1], frag_v[ki - 1]);
+                fmha::gemm<elem_type>(acc_dp, frag_do[(ki - 1) & 1], frag_v[ki - 1]);
             }
             // if ((threadIdx.x == 0) && (blockIdx.x == 0) && (blockIdx.y == 0) && (l < 4))  {
             //     float2 tmp = __half22float2(reinterpret_cast<__half2 &>(frag_do[(ki - 1) & 1]));
@@ -424,9 +467,31 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
         {
             int ki = Mma_tile_p::MMAS_K;
             if (!Kernel_traits::V_IN_REGS) {
-                fmha::gemm(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1) & 1]);
+                fmha::gemm<elem_type>(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1) & 1]);
             } else {
-                fmha::gemm(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1)]);
+                fmha::gemm<elem_type>(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1)]);
+            }
+        }
+
+        // Do this part of dP^T += (dO_i * V_i^T)^T for the extra values.
+        #pragma unroll
+        for( int xi = 0; xi < NUM_V_X; ++xi ) {
+            Smem_tile_v smem_v_x(&smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_V], tidx);
+            Smem_tile_do smem_do_x = make_smem_tile<Smem_tile_do>(
+                &smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_DO], tidx, l % 2, 0);
+            typename Smem_tile_v::Fragment frag_v_x[2][Mma_tile_p::MMAS_N];
+            smem_v_x.load(frag_v_x[0], 0);
+            typename Smem_tile_do::Fragment frag_do_x[2][Mma_tile_p::MMAS_M];
+            smem_do_x.load(frag_do_x[0], 0);
+            #pragma unroll
+            for( int ki = 1; ki < Mma_tile_p::MMAS_K; ++ki ) {
+                smem_do_x.load(frag_do_x[ki & 1], ki);
+                smem_v_x.load(frag_v_x[ki & 1], ki);
+                fmha::gemm<elem_type>(acc_dp, frag_do_x[(ki - 1) & 1], frag_v_x[(ki - 1) & 1]);
+            }
+            {
+                int ki = Mma_tile_p::MMAS_K;
+                fmha::gemm<elem_type>(acc_dp, frag_do_x[(ki - 1) & 1], frag_v_x[(ki - 1) & 1]);
             }
         }
 
@@ -453,6 +518,13 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
             if (Is_first || mask_val_next % 2 == 1) {
                 gmem_o.load();
             }
+            #pragma unroll
+            for( int xi = 0; xi < NUM_V_X; ++xi ) {
+                load_dout<Gmem_tile_do>(fetch_do_x[xi], params.do_ptrs[1 + xi], params, binfo, tidx, block_row_idx_next);
+                if (Is_first || mask_val_next % 2 == 1) {
+                    load_dout<Gmem_tile_o>(fetch_o_x[xi], params.o_ptrs[1 + xi], params, binfo, tidx, block_row_idx_next);
+                }
+            }
         }
 
         softmax.unpack_noscale(acc_dp);
@@ -471,29 +543,28 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
             for( int mi = 0; mi < Mma_tile_p::MMAS_M; mi++ ) {
                 #pragma unroll
                 for( int ni = 0; ni < Mma_tile_p::MMAS_N; ni++ ) {
-                    frag_p[mi][ni].hmul(frag_dp[mi][ni]);
+                    frag_p[mi][ni].template hmul<elem_type>(frag_dp[mi][ni]);
                 }
             }
         } else {
-            __half2 dp_sum_half[Mma_tile_p::MMAS_M * 2];
+            uint32_t dp_sum_packed[Mma_tile_p::MMAS_M * 2];
             for (int mi = 0; mi < Mma_tile_p::MMAS_M * 2; mi++) {
-                dp_sum_half[mi] = __float2half2_rn(dp_sum[mi]);
+                dp_sum_packed[mi] = fmha::float2_pack<elem_type>(dp_sum[mi], dp_sum[mi]);
             }
-            const __half zero_h = __half(0.f);
             #pragma unroll
             for( int mi = 0; mi < Mma_tile_p::MMAS_M; mi++ ) {
                 #pragma unroll
                 for( int ni = 0; ni < Mma_tile_p::MMAS_N; ni++ ) {
                     #pragma unroll
                     for (int ii = 0; ii < 4; ++ii) {
-                        const __half2 p = frag_p[mi][ni].template elt_as<__half2>(ii);
-                        const __half2 pdp = __hmul2(p, frag_dp[mi][ni].template elt_as<__half2>(ii));
+                        const uint32_t p = frag_p[mi][ni].reg(ii);
+                        const uint32_t pdp = fmha::hmul2<elem_type>(p, frag_dp[mi][ni].reg(ii));
                         // If this element is dropped, then frag_p stores -p instead of p.
                         // So pd holds -p * dp_sum in that case.
-                        const __half2 pd = __hmul2(p, dp_sum_half[mi * 2 + (ii % 2)]);
-                        const __half low = __low2half(p) >= zero_h ? __low2half(pdp) : __low2half(pd);
-                        const __half high = __high2half(p) >= zero_h ? __high2half(pdp) : __high2half(pd);
-                        frag_p[mi][ni].template elt_as<__half2>(ii) = __halves2half2(low, high);
+                        const uint32_t pd = fmha::hmul2<elem_type>(p, dp_sum_packed[mi * 2 + (ii % 2)]);
+                        // Both fp16 and bf16 keep the sign in the top bit, so select on the sign of p.
+                        const uint32_t dropped = ((p >> 15) & 0x00010001u) * 0xffffu;
+                        frag_p[mi][ni].reg(ii) = (pd & dropped) | (pdp & ~dropped);
                     }
                 }
             }
@@ -515,13 +586,13 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
             // Trigger the load from shared memory for the next series of Q values.
             smem_kt.load(frag_kt[ki & 1], ki);
             // Do the math for the values already in registers.
-            fmha::gemm(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1) & 1]);
             // fmha::gemm(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1)]);
         }
         // Do the final stage of math.
         {
             int ki = Mma_tile_dq::MMAS_K;
-            fmha::gemm(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1) & 1]);
             // fmha::gemm(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1)]);
         }
 
@@ -545,7 +616,7 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
             for( int ki = 0; ki < Mma_tile_dkv::MMAS_K; ki++ ) {
                 #pragma unroll
                 for( int mi = 0; mi < Mma_tile_dkv::MMAS_M; mi++ ) {
-                    frag_s[ki][mi].hrelu_();
+                    frag_s[ki][mi].template hrelu_<elem_type>();
                 }
             }
         }
@@ -555,13 +626,31 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
             // Trigger the load from shared memory for the next series of Q values.
             smem_dot.load(frag_dot[ki & 1], ki);
             // Do the math for the values already in registers.
-            fmha::gemm(acc_dv, frag_s[(ki - 1)], frag_dot[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dv, frag_s[(ki - 1)], frag_dot[(ki - 1) & 1]);
         }
 
         // Do the final stage of math.
         {
             int ki = Mma_tile_dkv::MMAS_K;
-            fmha::gemm(acc_dv, frag_s[(ki - 1)], frag_dot[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dv, frag_s[(ki - 1)], frag_dot[(ki - 1) & 1]);
+        }
+
+        // dV_i = P^T * dO_i for the extra values, reusing the same P as for dV.
+        #pragma unroll
+        for( int xi = 0; xi < NUM_V_X; ++xi ) {
+            Smem_tile_dot smem_dot_x = make_smem_tile<Smem_tile_dot>(
+                &smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_DO], tidx, l % 2, 0);
+            typename Smem_tile_dot::Fragment frag_dot_x[2][Mma_tile_dkv::MMAS_N];
+            smem_dot_x.load(frag_dot_x[0], 0);
+            #pragma unroll
+            for( int ki = 1; ki < Mma_tile_dkv::MMAS_K; ++ki ) {
+                smem_dot_x.load(frag_dot_x[ki & 1], ki);
+                fmha::gemm<elem_type>(acc_dv_x[xi], frag_s[(ki - 1)], frag_dot_x[(ki - 1) & 1]);
+            }
+            {
+                int ki = Mma_tile_dkv::MMAS_K;
+                fmha::gemm<elem_type>(acc_dv_x[xi], frag_s[(ki - 1)], frag_dot_x[(ki - 1) & 1]);
+            }
         }
 
         // __syncthreads();
@@ -578,13 +667,20 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
         // Commit the values for Q and dO into shared memory.
         if (not_last_iter) {
             gmem_do.commit(smem_do);
+            #pragma unroll
+            for( int xi = 0; xi < NUM_V_X; ++xi ) {
+                Smem_tile_do smem_do_x = make_smem_tile<Smem_tile_do>(
+                    &smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_DO], tidx, 0, (l + 1) % 2);
+                smem_do_x.store(fetch_do_x[xi]);
+            }
             // if (Is_first) {
             // if (true) {
             gmem_softmax_d.move(block_row_idx_to_move);
             if (Is_first || mask_val_next % 2 == 1) {
                 // dot_do_o(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, smem_dp_sum);
                 // smem_dp_sum.move_to_next_write_buffer();
-                dot_do_o(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, smem_dp_sum, (l + 1) % 2);
+                dot_do_o<NUM_V_X, elem_type>(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, fetch_do_x, fetch_o_x,
+                                  smem_dp_sum, (l + 1) % 2);
                 const int dp_sum_row_1 = tidx / Smem_dp_sum::THREADS_PER_ROW;
                 if ((dp_sum_row_1 < Smem_dp_sum::ROWS) && (tidx % Smem_dp_sum::THREADS_PER_ROW == 0)) {
                     gmem_softmax_d.store_row(reinterpret_cast<uint32_t(&)[Gmem_tile_do::LDGS]>(dp_sum_regs), dp_sum_row_1);
@@ -613,13 +709,13 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
             // Trigger the load from shared memory for the next series of Q values.
             smem_qt.load(frag_qt[ki & 1], ki);
             // Do the math for the values already in registers.
-            fmha::gemm(acc_dk, frag_dpt[(ki - 1)], frag_qt[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dk, frag_dpt[(ki - 1)], frag_qt[(ki - 1) & 1]);
         }
 
         // Do the final stage of math.
         {
             int ki = Mma_tile_dkv::MMAS_K;
-            fmha::gemm(acc_dk, frag_dpt[(ki - 1)], frag_qt[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dk, frag_dpt[(ki - 1)], frag_qt[(ki - 1) & 1]);
         }
 
         // Make sure dQ is in shared memory.
@@ -630,7 +726,7 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
 
         const bool is_final_write =
             Is_last
-            || ((loop_step_idx + 1) * Cta_tile_p::N >= binfo.actual_seqlen)
+            || ((loop_step_idx + 1) * Cta_tile_p::N >= binfo.actual_seqlen_k)
             || ((mask_val & 0x2) != 0)
             || ((Is_causal) && (block_row_idx * Cta_tile_p::M < (loop_step_idx + 1) * Cta_tile_p::N));
         if (is_final_write) {
@@ -639,7 +735,7 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
             // }
             dq_out[0] = fmha::fmul4(dq_out[0], params.scale_bmm1f);
             // Output the values.
-            gmem_dq.store(dq_out, 0);
+            gmem_dq.template store<elem_type>(dq_out, 0);
         } else  {
             // Output the values.
             gmem_dq_tmp.store(dq_out, 0);
@@ -673,6 +769,10 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
         for( int mi = 0; mi < Mma_tile_dkv::MMAS_M; mi++ ) {
             for( int ni = 0; ni < Mma_tile_dkv::MMAS_N; ni++ ) {
                 acc_dv[mi][ni].mul_(params.rp_dropout);
+                #pragma unroll
+                for( int xi = 0; xi < NUM_V_X; ++xi ) {
+                    acc_dv_x[xi][mi][ni].mul_(params.rp_dropout);
+                }
             }
         }
     }
@@ -694,20 +794,17 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
     // the total amount of shared mem?
     // Epilogue swizzle for dV
     Smem_tile_dv smem_dv(&smem_[0], tidx);
-    smem_dv.store(acc_dv);
+    smem_dv.template store<elem_type>(acc_dv);
 
     // Epilogue swizzle for dK
     Smem_tile_dk smem_dk(&smem_[Smem_tile_dv::BYTES_PER_TILE], tidx);
-    smem_dk.store(acc_dk);
+    smem_dk.template store<elem_type>(acc_dk);
 
     __syncthreads();
     uint4 dv_out[Smem_tile_dv::NUM_LDS];
     smem_dv.load(dv_out);
-    Qkv_params dv_params;
-    dv_params.qkv_ptr = params.dqkv_ptr;
-    dv_params.qkv_stride_in_bytes = params.qkv_stride_in_bytes;
-    dv_params.h = params.h;
-    Gmem_tile_dv gmem_dv(dv_params, 2, binfo, tidx);
+    Gmem_tile_dv gmem_dv(params.dqkv_ptrs[2], params.dqkv_row_stride_in_elts[2],
+                          params.dqkv_head_stride_in_elts[2], binfo, tidx, /*use_seqlen_q=*/false, params.d);
     if (!Is_first) {
         gmem_dv.move(loop_step_idx);
     }
@@ -718,20 +815,34 @@ inline __device__ void compute_block_dq_dk_dv_1xN_one_iter(const Params &params,
     // for (int ii = 0; ii < Smem_tile_dk::NUM_LDS; ++ii) {
     //     dk_out[ii] = fmha::fmul4(dk_out[ii], params.scale_bmm1f);
     // }
-    Qkv_params dk_params;
-    dk_params.qkv_ptr = params.dqkv_ptr;
-    dk_params.qkv_stride_in_bytes = params.qkv_stride_in_bytes;
-    dk_params.h = params.h;
-    Gmem_tile_dk gmem_dk(dk_params, 1, binfo, tidx);
+    Gmem_tile_dk gmem_dk(params.dqkv_ptrs[1], params.dqkv_row_stride_in_elts[1],
+                          params.dqkv_head_stride_in_elts[1], binfo, tidx, /*use_seqlen_q=*/false, params.d);
     if (!Is_first) {
         gmem_dk.move(loop_step_idx);
     }
     gmem_dk.store(dk_out);
+
+    // Epilogue for the extra dV_i, one after the other through the shared memory of dV.
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        // Make sure all threads are done reading the previous dV from shared memory.
+        __syncthreads();
+        smem_dv.template store<elem_type>(acc_dv_x[xi]);
+        __syncthreads();
+        uint4 dv_x_out[Smem_tile_dv::NUM_LDS];
+        smem_dv.load(dv_x_out);
+        Gmem_tile_dv gmem_dv_x(params.dqkv_ptrs[3 + xi], params.dqkv_row_stride_in_elts[3 + xi],
+                               params.dqkv_head_stride_in_elts[3 + xi], binfo, tidx, /*use_seqlen_q=*/false, params.d);
+        if (!Is_first) {
+            gmem_dv_x.move(loop_step_idx);
+        }
+        gmem_dv_x.store(dv_x_out);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-// loop_steps = -1 means the number of steps will be params.s / Kernel_traits::Cta_tile_p::N.
+// loop_steps = -1 means the number of steps will be params.seqlen_k / Kernel_traits::Cta_tile_p::N.
 // This template parameter is there so we can specialize with loop_steps == 1 and loop_steps == 2.
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, int loop_steps=-1, typename Params>
 inline __device__ void compute_block_dq_dk_dv_1xN(const Params &params) {
@@ -754,10 +865,10 @@ inline __device__ void compute_block_dq_dk_dv_1xN(const Params &params) {
         compute_block_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, true, false>(params, ph, 0);
         compute_block_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, false, true>(params, ph, 1);
     } else {
-        if (params.s == N_per_loop) {
+        if (params.seqlen_k == N_per_loop) {
             compute_block_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, true, true>(params, ph, 0);
         } else {
-            const int max_loop_steps = (params.s + N_per_loop - 1) / N_per_loop;
+            const int max_loop_steps = (params.seqlen_k + N_per_loop - 1) / N_per_loop;
             compute_block_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, true, false>(params, ph, 0);
             for (int loop_step_idx = 1; loop_step_idx < max_loop_steps - 1; loop_step_idx++) {
                 compute_block_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, false, false>(params, ph, loop_step_idx);
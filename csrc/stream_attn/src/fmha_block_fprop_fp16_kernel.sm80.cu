@@ -26,6 +26,7 @@
  ******************************************************************************/
 
 #include "fmha.h"
+#include "fmha_autotune.h"
 #include "fmha_block_fprop_kernel_1xN.h"
 
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Return_softmax>
@@ -36,22 +37,21 @@ __global__ void fmha_block_fprop_fp16_sm80_loop_kernel(Fused_multihead_attention
 template<typename Kernel_traits>
 void run_fmha_block_fp16_sm80_loop_(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
                             const bool configure) {
-    bool is_causal = launch_params.params.is_causal;
-    // TD [2022-04-27]: This case work is pretty ugly, maybe there's a better way?
-    auto kernel = launch_params.is_dropout
-        ? (is_causal
-           ? (launch_params.return_softmax ? &fmha_block_fprop_fp16_sm80_loop_kernel<Kernel_traits, true, true, true> : &fmha_block_fprop_fp16_sm80_loop_kernel<Kernel_traits, true, true, false>)
-           : (launch_params.return_softmax ? &fmha_block_fprop_fp16_sm80_loop_kernel<Kernel_traits, true, false, true> : &fmha_block_fprop_fp16_sm80_loop_kernel<Kernel_traits, true, false, false>))
-        : (is_causal
-           ? (launch_params.return_softmax ? &fmha_block_fprop_fp16_sm80_loop_kernel<Kernel_traits, false, true, true> : &fmha_block_fprop_fp16_sm80_loop_kernel<Kernel_traits, false, true, false>)
-           : (launch_params.return_softmax ? &fmha_block_fprop_fp16_sm80_loop_kernel<Kernel_traits, false, false, true> : &fmha_block_fprop_fp16_sm80_loop_kernel<Kernel_traits, false, false, false>));
+    auto kernel = DROPOUT_SWITCH(launch_params.is_dropout, Is_dropout, [&] {
+        return BOOL_SWITCH(launch_params.params.is_causal, Is_causal, [&] {
+            return RETURN_SOFTMAX_SWITCH(launch_params.return_softmax, Return_softmax, [&] {
+                return &fmha_block_fprop_fp16_sm80_loop_kernel<Kernel_traits, Is_dropout, Is_causal, Return_softmax>;
+            });
+        });
+    });
 
     constexpr int N = Kernel_traits::Cta_tile_p::N;
-    const int loop_steps = (launch_params.params.s + N - 1) / N;
+    const int loop_steps = (launch_params.params.seqlen_k + N - 1) / N;
     constexpr int smem_size_softmax_lse = Kernel_traits::Smem_dp_sum::BYTES_PER_TILE;
     // Don't need smem_size_softmax_lse if we're not looping
     const int smem_size = fmha::get_dynamic_smem_size<Kernel_traits>()
         + (loop_steps > 1 ? smem_size_softmax_lse : 0);
+    fmha::check_smem_size("block fprop", smem_size);
 
     if( smem_size >= 48 * 1024 ) {
         FMHA_CHECK_CUDA(cudaFuncSetAttribute(kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size));
@@ -60,7 +60,7 @@ void run_fmha_block_fp16_sm80_loop_(Launch_params<Fused_multihead_attention_fpro
     if (configure) {
         using Mma_tile_p = fmha::Hmma_tile<typename Kernel_traits::Cta_tile_p>;
         constexpr int M = Kernel_traits::Cta_tile_p::M;
-        size_t STEPS = (launch_params.params.s + M - 1) / M;
+        size_t STEPS = (launch_params.params.seqlen_q + M - 1) / M;
         constexpr size_t MMAS_M = Mma_tile_p::MMAS_M;
         constexpr size_t MMAS_N = Mma_tile_p::MMAS_N;
         size_t elts_per_head = STEPS * MMAS_M * MMAS_N * 8 * loop_steps;
@@ -75,16 +75,50 @@ void run_fmha_block_fp16_sm80_loop_(Launch_params<Fused_multihead_attention_fpro
     FMHA_CHECK_CUDA(cudaPeekAtLastError());
 }
 
-void run_fmha_block_fp16_sm80(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
-                             const bool configure) {
+template<typename elem_type, int NUM_V>
+void run_fmha_block_fp16_sm80_(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
+                               const bool configure) {
+#if FMHA_BUILD_HDIM_16
     if (launch_params.params.d == 16) {
-        using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 4, 0x08u>;
+        using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 4, 0x08u, NUM_V, elem_type>;
         run_fmha_block_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
-    } else if (launch_params.params.d == 32) {
-        using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 4, 0x08u>;
+    }
+#endif
+#if FMHA_BUILD_HDIM_32
+    if (launch_params.params.d == 32) {
+        using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 4, 0x08u, NUM_V, elem_type>;
         run_fmha_block_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
-    } else if (launch_params.params.d == 64) {
-        using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x08u>;
+    }
+#endif
+#if FMHA_BUILD_HDIM_64
+    if (launch_params.params.d == 64) {
+        using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x08u, NUM_V, elem_type>;
         run_fmha_block_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
     }
-}
\ No newline at end of file
+#endif
+}
+
+// The blockmask is laid out in blocks of 256 keys, so N=256 is fixed and at most two values fit.
+template<typename elem_type>
+void run_fmha_block_fp16_sm80_num_v_(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
+                                     const bool configure) {
+    switch (launch_params.params.num_v) {
+#if FMHA_BUILD_NUM_V_1
+        case 1: run_fmha_block_fp16_sm80_<elem_type, 1>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_2
+        case 2: run_fmha_block_fp16_sm80_<elem_type, 2>(launch_params, configure); break;
+#endif
+    }
+}
+
+void run_fmha_block_fp16_sm80(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
+                              const bool configure) {
+    if (launch_params.params.is_bf16) {
+#if FMHA_BUILD_BF16
+        run_fmha_block_fp16_sm80_num_v_<__nv_bfloat16>(launch_params, configure);
+#endif
+    } else {
+        run_fmha_block_fp16_sm80_num_v_<__half>(launch_params, configure);
+    }
+}
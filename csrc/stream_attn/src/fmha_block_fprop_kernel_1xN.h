@@ -41,6 +41,7 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
 
 
     // The description of the CTA tile for the 1st batched GEMM.
+    using elem_type = typename Kernel_traits::elem_type;
     using Cta_tile_p = typename Kernel_traits::Cta_tile_p;
     // The description of the CTA tile for the 2nd batched GEMM.
     using Cta_tile_o = typename Kernel_traits::Cta_tile_o;
@@ -63,7 +64,7 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
 
     // The global memory tile to store O.
     using Gmem_tile_o = typename Kernel_traits::Gmem_tile_o;
-    using Gmem_tile_o_tmp = fmha::Gmem_tile_o<Cta_tile_o, 4>;
+    using Gmem_tile_o_tmp = fmha::Gmem_tile_o<Cta_tile_o, 4, typename Kernel_traits::index_t>;
     // The shared memory tile to swizzle O.
     using Smem_tile_o = typename Kernel_traits::Smem_tile_o;
 
@@ -77,6 +78,9 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
 
     using Softmax = fmha::Softmax<Cta_tile_p, Kernel_traits>;
 
+    // The number of value tensors sharing the softmax.
+    constexpr int NUM_V = Kernel_traits::NUM_V;
+
     // Shared memory.
     extern __shared__ char smem_[];
 
@@ -98,20 +102,17 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
     Gemm1 gemm_q_k(smem_, tidx);
     // Allocate the global memory tile loader for Q.
     Gmem_tile_q gmem_q(params, 0, binfo, tidx);
-    // Allocate the global memory tile loader for O.
-    Gmem_tile_o gmem_o(params, binfo, tidx);
-    Gmem_tile_o_tmp gmem_o_tmp(params.o_tmp_ptr, params.o_stride_in_elts, binfo, tidx);
+    // The global memory tiles for O_i and O_tmp_i only differ by their base pointer, so they are
+    // created where they are used and moved to the current row block, see below.
     // Allocate the global memory tile loader for S.
     Gmem_tile_s gmem_s(params, binfo, tidx);
-    Gmem_softmax_sum gmem_softmax_lse(params.softmax_lse_ptr, params, tidx);
+    Gmem_softmax_sum gmem_softmax_lse(params.softmax_lse_ptr, params, binfo, tidx);
 
     // Wind gmem tiles to the correct position.
     static_assert(Cta_tile_p::N % Cta_tile_p::M == 0);
-    int block_row_idx_next = mask_val / 4;
+    int block_row_idx_next = mask_val / 8;
     int block_row_idx_to_move = block_row_idx_next - block_row_idx;
     gmem_q.move(block_row_idx_to_move);
-    gmem_o.move(block_row_idx_to_move);
-    gmem_o_tmp.move(block_row_idx_to_move);
     if (Return_softmax) { gmem_s.move(block_row_idx_to_move); }
     gmem_softmax_lse.move(block_row_idx_to_move);
     block_row_idx = block_row_idx_next;
@@ -120,23 +121,14 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
     // }
 
     fmha::Mask<Cta_tile_p, Is_causal> mask(binfo, tidx, loop_step_idx);
+    // The blocks below the diagonal only need the bounds of the sequence.
+    fmha::Mask<Cta_tile_p> mask_full(binfo, tidx, loop_step_idx);
 
     // Allocate the global memory tile loader for K.
     Gmem_tile_k gmem_k(params, 1, binfo, tidx);
-    // Allocate the global memory tile loader for V.
-    Gmem_tile_v gmem_v(params, 2, binfo, tidx);
-    // The base pointer of smem_v;
-    char *smem_v_ = &smem_[Gemm1::SMEM_OFFSET_V];
-    
-    // Allocate the shared memory tile loader for V. We use the same as K so be careful!!!
-    Smem_tile_v smem_v(smem_v_, tidx);
-
-    // Allocate the shared memory tile loader for O. We use the same as K so be careful!!!
-    Smem_tile_o smem_o(&smem_[Gemm1::SMEM_OFFSET_O], tidx);
 
     if (!Is_first) {
         gmem_k.move(loop_step_idx);
-        gmem_v.move(loop_step_idx);
         if (Return_softmax) { gmem_s.move(loop_step_idx * steps); }
     }
 
@@ -144,8 +136,18 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
     gmem_k.load();
     // Trigger the loads for Q.
     gmem_q.load();
-    // Trigger the loads for V.
-    gmem_v.load();
+    // Trigger the loads for the V_i. V_i is matrix 2 + i of the packed QKV tensor.
+    uint4 fetch_v[NUM_V][Gmem_tile_v::LDGS];
+    #pragma unroll
+    for( int vi = 0; vi < NUM_V; ++vi ) {
+        Gmem_tile_v gmem_v(params, 2 + vi, binfo, tidx);
+        if (!Is_first) { gmem_v.move(loop_step_idx); }
+        gmem_v.load();
+        #pragma unroll
+        for( int ii = 0; ii < Gmem_tile_v::LDGS; ++ii ) {
+            fetch_v[vi][ii] = gmem_v.fetch_[ii];
+        }
+    }
 
     if (!Is_first) { __syncthreads(); }
 
@@ -154,9 +156,13 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
         gmem_softmax_lse.load(reinterpret_cast<uint32_t(&)[Mma_tile_p::MMAS_M * 2]>(p_prev_lse));
     }
 
-    // Commit the data for Q and V to shared memory.
+    // Commit the data for Q and the V_i to shared memory. V_0 uses the same as K so be careful!!!
     gmem_q.commit(gemm_q_k.smem_q);
-    gmem_v.commit(smem_v);
+    #pragma unroll
+    for( int vi = 0; vi < NUM_V; ++vi ) {
+        Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+        smem_v.store(fetch_v[vi]);
+    }
 
     // const uint32_t scale_bmm1 = reinterpret_cast<const uint32_t&>(params.scale_bmm1);
     // #pragma unroll
@@ -174,11 +180,18 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
     // Load the fragments for Q.
     gemm_q_k.load_q();
 
-    // Load the fragments for V. We keep the data in registers during the entire kernel.
-    typename Smem_tile_v::Fragment frag_v[Mma_tile_o::MMAS_K][Mma_tile_o::MMAS_N];
-    #pragma unroll
-    for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
-        smem_v.load(frag_v[ki], ki);
+    // Load the fragments for the V_i. If V_IN_REGS, we keep the data in registers during the entire
+    // kernel. Otherwise the V_i stay in shared memory and frag_v[0] is used as a double buffer.
+    typename Smem_tile_v::Fragment frag_v[Kernel_traits::V_IN_REGS ? NUM_V : 1][Kernel_traits::V_IN_REGS ? Mma_tile_o::MMAS_K : 2][Mma_tile_o::MMAS_N];
+    if (Kernel_traits::V_IN_REGS) {
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+            #pragma unroll
+            for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                smem_v.load(frag_v[vi][ki], ki);
+            }
+        }
     }
 
     // Commit the data for V to shared memory if it has not been done already.
@@ -206,7 +219,7 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
         // if ((threadIdx.x == 0) && (blockIdx.x == 0) && (blockIdx.y == 0)) {
         //     printf("block_row_idx = %d\n", block_row_idx);
         // }
-        if (block_row_idx * Cta_tile_p::M >= binfo.actual_seqlen) break;
+        if (block_row_idx * Cta_tile_p::M >= binfo.actual_seqlen_q) break;
 
         int mask_val_next = l < steps - 1 ? blockmask.mask_val(l + 1) : -1;
         // if ((threadIdx.x == 0) && (blockIdx.x == 0) && (blockIdx.y == 0)) {
@@ -220,14 +233,21 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
         // Do this part of P = Q * K^T.
         gemm_q_k(acc_p);
 
-        uint4 out[Gmem_tile_o::STGS_PER_LOOP];
+        uint4 out[NUM_V][Gmem_tile_o::STGS_PER_LOOP];
         bool is_first_read = Is_first || mask_val % 2 == 1;
         // if (!Is_first) { gmem_o_tmp.load(out, 0); }
-        if (!is_first_read) { gmem_o_tmp.load(out, 0); }
+        if (!is_first_read) {
+            #pragma unroll
+            for( int vi = 0; vi < NUM_V; ++vi ) {
+                Gmem_tile_o_tmp gmem_o_tmp(params.o_tmp_ptrs[vi], params.o_stride_in_elts, binfo, tidx, params.d);
+                gmem_o_tmp.move(block_row_idx);
+                gmem_o_tmp.load(out[vi], 0);
+            }
+        }
 
         // Trigger the load for the next Q values.
         bool not_last_iter = (l < steps - 1) && (mask_val_next != -1);
-        block_row_idx_next = mask_val_next / 4;
+        block_row_idx_next = mask_val_next / 8;
         int block_row_idx_to_move = block_row_idx_next - block_row_idx;
         if (not_last_iter) {
             gemm_q_k.smem_q.move_to_next_write_buffer();
@@ -237,17 +257,23 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
 
         // Load the mask for that iteration.
         mask.load(block_row_idx);
+        mask_full.load(block_row_idx);
 
         // Convert from the accumulator type to FP32 for Softmax.
         softmax.unpack_noscale(acc_p);
 
-        // Apply the mask.
-        softmax.apply_mask(mask);
+        // Apply the mask. Only the blocks on the diagonal need the causal mask, see convert_blockmask.
+        if (Is_causal && (mask_val & 0x4) != 0) {
+            softmax.apply_mask(mask);
+        } else {
+            softmax.apply_mask(mask_full);
+        }
 
         // softmax.unpack_noscale_half_and_apply_mask(acc_p, mask);
 
-        if( Kernel_traits::SHARE_SMEM_FOR_K_AND_V && l == 0 ) {
+        if( (Kernel_traits::SHARE_SMEM_FOR_K_AND_V || !Kernel_traits::V_IN_REGS) && l == 0 ) {
             // if we share K and V, it could be that V was not fully read yet but we write into smem for reduction
+            // if V is not in registers, O reuses the shared memory of K which may not be fully read yet
             __syncthreads();
         }
         // if (!Is_first) {
@@ -337,7 +363,7 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
         static_assert(Mma_tile_o::MMAS_K == Mma_tile_p::MMAS_N);
         softmax.pack(frag_p);
         if (Return_softmax) {
-            gmem_s.store(frag_p, mask);
+            gmem_s.template store<elem_type>(frag_p, mask);
             if (not_last_iter) {
                 gmem_s.move(block_row_idx_to_move);
             }
@@ -353,19 +379,44 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
             for( int ki = 0; ki < Mma_tile_o::MMAS_K; ki++ ) {
                 #pragma unroll
                 for( int mi = 0; mi < Mma_tile_o::MMAS_M; mi++ ) {
-                    frag_p[ki][mi].hrelu_();
+                    frag_p[ki][mi].template hrelu_<elem_type>();
                 }
             }
         }
 
-        // Declare the accumulators for the 2nd gemm.
-        fmha::Fragment_accumulator acc_o[Mma_tile_o::MMAS_M][Mma_tile_o::MMAS_N];
-        fmha::Clear_accumulator<typename fmha::Accumulator_type, Cta_tile_o::WARPS_K>::apply(acc_o);
+        static_assert(Gmem_tile_o::LOOPS == 1);
 
-        // Do this part of O = P^T * V^T.
+        // Do this part of O_i = P^T * V_i^T for each value tensor and swizzle the elements for the
+        // final reduction, see device_1xN_.
         #pragma unroll
-        for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
-            fmha::gemm(acc_o, frag_p[ki], frag_v[ki]);
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            // Declare the accumulators for the 2nd gemm.
+            fmha::Fragment_accumulator acc_o[Mma_tile_o::MMAS_M][Mma_tile_o::MMAS_N];
+            fmha::Clear_accumulator<typename fmha::Accumulator_type, Cta_tile_o::WARPS_K>::apply(acc_o);
+
+            if (Kernel_traits::V_IN_REGS) {
+                #pragma unroll
+                for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                    fmha::gemm<elem_type>(acc_o, frag_p[ki], frag_v[vi][ki]);
+                }
+            } else {
+                Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+                smem_v.load(frag_v[0][0], 0);
+                #pragma unroll
+                for( int ki = 1; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                    // Trigger the load from shared memory for the next series of V values.
+                    smem_v.load(frag_v[0][ki & 1], ki);
+                    fmha::gemm<elem_type>(acc_o, frag_p[ki - 1], frag_v[0][(ki - 1) & 1]);
+                }
+                // Do the final stage of math.
+                {
+                    int ki = Mma_tile_o::MMAS_K;
+                    fmha::gemm<elem_type>(acc_o, frag_p[ki - 1], frag_v[0][(ki - 1) & 1]);
+                }
+            }
+
+            Smem_tile_o smem_o(&smem_[Gemm1::SMEM_OFFSET_O + vi * Gemm1::SMEM_STRIDE_O], tidx);
+            smem_o.store(acc_o, 0);
         }
 
         // The mapping from tidx to rows changes between the softmax and the O-reduction.
@@ -390,11 +441,6 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
         //     }
         // }
 
-        static_assert(Gmem_tile_o::LOOPS == 1);
-
-        // Swizzle the elements and do the final reduction.
-        smem_o.store(acc_o, 0);
-
         // Make sure the data is in shared memory.
         __syncthreads();
 
@@ -404,7 +450,8 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
         // if (!Is_first) {
         if (!is_first_read) {
             for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
-                p_prev_scale_o[jj] = expf(p_prev_scale_o[jj] - p_max_o[jj][0]);
+                // The rows fully masked out so far have nothing to rescale.
+                p_prev_scale_o[jj] = p_prev_scale_o[jj] == -INFINITY ? 0.f : expf(p_prev_scale_o[jj] - p_max_o[jj][0]);
                 p_sum_o[jj][0] += p_prev_scale_o[jj];
             }
         }
@@ -432,18 +479,22 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
         }
 
         // Load from shared memory.
-        // if (!Is_first) {
-        if (!is_first_read) {
-            for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
-                out[jj] = fmha::fmul4(out[jj], p_prev_scale_o[jj]);
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            // if (!Is_first) {
+            if (!is_first_read) {
+                for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
+                    out[vi][jj] = fmha::fmul4(out[vi][jj], p_prev_scale_o[jj]);
+                }
             }
+            Smem_tile_o smem_o(&smem_[Gemm1::SMEM_OFFSET_O + vi * Gemm1::SMEM_STRIDE_O], tidx);
+            // smem_o.template load</*zero_init=*/Is_first>(out);
+            is_first_read ? smem_o.template load</*zero_init=*/true>(out[vi]) : smem_o.template load</*zero_init=*/false>(out[vi]);
         }
-        // smem_o.template load</*zero_init=*/Is_first>(out);
-        is_first_read ? smem_o.template load</*zero_init=*/true>(out) : smem_o.template load</*zero_init=*/false>(out);
 
         const bool is_final_write =
             Is_last
-            || ((loop_step_idx + 1) * Cta_tile_p::N >= binfo.actual_seqlen)
+            || ((loop_step_idx + 1) * Cta_tile_p::N >= binfo.actual_seqlen_k)
             || ((mask_val & 0x2) != 0)
             || ((Is_causal) && (block_row_idx * Cta_tile_p::M < (loop_step_idx + 1) * Cta_tile_p::N));
         // if ((threadIdx.x == 0) && (blockIdx.x == 0) && (blockIdx.y == 0)) {
@@ -456,7 +507,10 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
             if (Is_dropout && is_final_write) {
                 inv_sum *= params.rp_dropout;
             }
-            out[jj] = fmha::fmul4(out[jj], inv_sum);
+            #pragma unroll
+            for( int vi = 0; vi < NUM_V; ++vi ) {
+                out[vi][jj] = fmha::fmul4(out[vi][jj], inv_sum);
+            }
         }
 
         // if (Is_dropout && Is_last) {
@@ -466,15 +520,19 @@ inline __device__ void device_block_1xN_(const Params &params, const int bidb, c
         // }
 
         // Output the values.
-        if (is_final_write) {
-            gmem_o.store(out, 0);
-        } else {
-            gmem_o_tmp.store(out, 0);
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            if (is_final_write) {
+                Gmem_tile_o gmem_o(params.o_ptrs[vi], params.o_stride_in_elts, binfo, tidx, params.d);
+                gmem_o.move(block_row_idx);
+                gmem_o.template store<elem_type>(out[vi], 0);
+            } else {
+                Gmem_tile_o_tmp gmem_o_tmp(params.o_tmp_ptrs[vi], params.o_stride_in_elts, binfo, tidx, params.d);
+                gmem_o_tmp.move(block_row_idx);
+                gmem_o_tmp.store(out[vi], 0);
+            }
         }
 
-        // Move to the next part of the output.
-        gmem_o.move(block_row_idx_to_move);
-        if (!(Is_first && Is_last)) { gmem_o_tmp.move(block_row_idx_to_move); }
         gemm_q_k.reload_k();
 
         // Make sure we are reading from the correct buffer.
@@ -507,13 +565,13 @@ inline __device__ void device_block_1xN_loop(const Params &params) {
     auto seeds = at::cuda::philox::unpack(params.philox_args);
     Philox ph0(std::get<0>(seeds), tidx_global, std::get<1>(seeds));
     Philox ph1(std::get<0>(seeds), tidx_global + blockDim.x, std::get<1>(seeds));
-    const int STEPS = params.s / Kernel_traits::Cta_tile_p::M;
+    const int STEPS = params.seqlen_q / Kernel_traits::Cta_tile_p::M;
 
     constexpr int N_per_loop = Kernel_traits::Cta_tile_p::N;
-    if (params.s == N_per_loop) {
+    if (params.seqlen_k == N_per_loop) {
         fmha::device_block_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, true, true>(params, bidb, bidh, STEPS, ph0, ph1, 0);
     } else {
-        const int max_loop_steps = (params.s + N_per_loop - 1) / N_per_loop;
+        const int max_loop_steps = (params.seqlen_k + N_per_loop - 1) / N_per_loop;
         fmha::device_block_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, true, false>(params, bidb, bidh, STEPS, ph0, ph1, 0);
         for (int loop_step_idx = 1; loop_step_idx < max_loop_steps - 1; loop_step_idx++) {
             fmha::device_block_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, false, false>(params, bidb, bidh, STEPS, ph0, ph1, loop_step_idx);
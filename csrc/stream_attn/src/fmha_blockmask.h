@@ -38,11 +38,15 @@ namespace fmha {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// For each K/V block, the query blocks it is seen by, in order and padded with -1. An entry is
+// row * 8 + (needs the causal mask ? 4 : 0) + (last block of its row ? 2 : 0) + (first block of its row ? 1 : 0),
+// see convert_blockmask. With causal, the blocks above the diagonal are dropped, the ones on it
+// are flagged and the ones below it are computed without the causal mask.
 struct Blockmask {
 
     template<typename Params>
     __device__ Blockmask(const Params &params, int loop_step_idx) :
-        blockmask_ptr(params.blockmask + loop_step_idx * params.s / 16) {
+        blockmask_ptr(params.blockmask + loop_step_idx * params.seqlen_q / 16) {
     }
 
     __device__ int mask_val(int block_row_idx) const {
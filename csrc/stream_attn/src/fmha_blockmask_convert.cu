@@ -0,0 +1,62 @@
+/* Copyright (c) 2022, Tri Dao.
+ */
+
+#include "fmha.h"
+
+// The blockmask has a row per 16 queries and a column per 256 keys.
+constexpr int BLOCKMASK_ROWS = 16;
+constexpr int BLOCKMASK_COLS = 256;
+
+// With causal, the blocks with all their keys after all their queries are skipped.
+inline __device__ bool is_above_diagonal(const int row, const int col) {
+    return col * BLOCKMASK_COLS > row * BLOCKMASK_ROWS + BLOCKMASK_ROWS - 1;
+}
+
+// The blocks with some key after some query need the elementwise causal mask.
+inline __device__ bool is_on_diagonal(const int row, const int col) {
+    return !is_above_diagonal(row, col) && col * BLOCKMASK_COLS + BLOCKMASK_COLS - 1 > row * BLOCKMASK_ROWS;
+}
+
+// One warp per column of the (nrow, ncol) 0-1 blockmask. The warp goes over the rows 32 at a time
+// and appends the nonzero ones to the column of the output in order, with a ballot to find the
+// position of each of them. The first / last nonzero of a row are found by each lane scanning its
+// row, ncol is small (the number of K/V blocks).
+__global__ void fmha_convert_blockmask_kernel(const uint8_t *blockmask, int *out, const int nrow,
+                                              const int ncol, const bool causal) {
+    const int col = blockIdx.x * (blockDim.x / 32) + threadIdx.x / 32;
+    const int lane = threadIdx.x % 32;
+    if (col >= ncol) { return; }
+
+    int *out_col = out + size_t(col) * nrow;
+    int count = 0;
+    for (int row_base = 0; row_base < nrow; row_base += 32) {
+        const int row = row_base + lane;
+        const uint8_t *mask_row = blockmask + size_t(row) * ncol;
+        const bool is_nonzero = row < nrow && mask_row[col] != 0 && !(causal && is_above_diagonal(row, col));
+        const uint32_t ballot = __ballot_sync(uint32_t(-1), is_nonzero);
+        if (is_nonzero) {
+            bool is_first = true, is_last = true;
+            for (int ci = 0; ci < ncol; ++ci) {
+                if (mask_row[ci] != 0 && !(causal && is_above_diagonal(row, ci))) {
+                    is_first = is_first && ci >= col;
+                    is_last = is_last && ci <= col;
+                }
+            }
+            const bool needs_mask = causal && is_on_diagonal(row, col);
+            const int idx = count + __popc(ballot & ((1u << lane) - 1u));
+            out_col[idx] = row * 8 + (needs_mask ? 4 : 0) + (is_last ? 2 : 0) + (is_first ? 1 : 0);
+        }
+        count += __popc(ballot);
+    }
+    // Pad the column with -1.
+    for (int idx = count + lane; idx < nrow; idx += 32) { out_col[idx] = -1; }
+}
+
+void run_fmha_convert_blockmask(const uint8_t *blockmask, int *out, const int nrow, const int ncol,
+                                const bool causal, cudaStream_t stream) {
+    constexpr int THREADS = 128;
+    constexpr int COLS_PER_CTA = THREADS / 32;
+    dim3 grid((ncol + COLS_PER_CTA - 1) / COLS_PER_CTA);
+    fmha_convert_blockmask_kernel<<<grid, THREADS, 0, stream>>>(blockmask, out, nrow, ncol, causal);
+    FMHA_CHECK_CUDA(cudaPeekAtLastError());
+}
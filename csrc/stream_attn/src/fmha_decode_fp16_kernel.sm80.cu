@@ -0,0 +1,117 @@
+/* Copyright (c) 2022, Tri Dao.
+ */
+
+#include "fmha.h"
+#include "fmha_decode_kernel.h"
+
+template<typename Kernel_traits>
+__global__ void fmha_decode_fp16_sm80_kernel(Fused_multihead_attention_decode_params params) {
+    fmha::device_decode_1xN<Kernel_traits>(params);
+}
+
+template<typename Kernel_traits>
+__global__ void fmha_decode_combine_fp16_sm80_kernel(Fused_multihead_attention_decode_params params) {
+    fmha::device_decode_combine<Kernel_traits>(params);
+}
+
+template<typename Kernel_traits>
+void run_fmha_decode_fp16_sm80_launch_(Launch_params<Fused_multihead_attention_decode_params> &launch_params,
+                                       const bool configure) {
+    auto kernel = &fmha_decode_fp16_sm80_kernel<Kernel_traits>;
+    auto &params = launch_params.params;
+
+    if (configure) {
+        // A single query row per (batch, head) only gives b * h CTAs, so the keys are split
+        // over several CTAs to fill the GPU. A split gets at least 64 keys, so the loads of the
+        // cache stay large enough to hide the cost of merging the splits.
+        constexpr int MIN_KEYS_PER_SPLIT = 64;
+        int ctas_per_sm;
+        FMHA_CHECK_CUDA(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+            &ctas_per_sm, kernel, Kernel_traits::THREADS, 0));
+        const int num_steps = (params.s + MIN_KEYS_PER_SPLIT - 1) / MIN_KEYS_PER_SPLIT;
+        launch_params.num_splits = std::min(fmha::num_splits_heuristic(
+            params.b * params.h, launch_params.props->multiProcessorCount,
+            std::max(ctas_per_sm, 1), std::max(num_steps, 1)), MAX_DECODE_SPLITS);
+        return;
+    }
+
+    dim3 grid(params.h, params.b, params.num_splits);
+    kernel<<<grid, Kernel_traits::THREADS, 0, launch_params.stream>>>(params);
+    FMHA_CHECK_CUDA(cudaPeekAtLastError());
+
+    if (params.num_splits > 1) {
+        dim3 grid_combine(params.h, params.b);
+        fmha_decode_combine_fp16_sm80_kernel<Kernel_traits>
+            <<<grid_combine, Kernel_traits::THREADS, 0, launch_params.stream>>>(params);
+        FMHA_CHECK_CUDA(cudaPeekAtLastError());
+    }
+}
+
+template<typename elem_type, typename cache_type, int NUM_V>
+void run_fmha_decode_fp16_sm80_(Launch_params<Fused_multihead_attention_decode_params> &launch_params,
+                                const bool configure) {
+#if FMHA_BUILD_HDIM_16
+    if (launch_params.params.d == 16) {
+        using Kernel_traits = FMHA_decode_kernel_traits<16, NUM_V, elem_type, 128, cache_type>;
+        run_fmha_decode_fp16_sm80_launch_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_32
+    if (launch_params.params.d == 32) {
+        using Kernel_traits = FMHA_decode_kernel_traits<32, NUM_V, elem_type, 128, cache_type>;
+        run_fmha_decode_fp16_sm80_launch_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_64
+    if (launch_params.params.d == 64) {
+        using Kernel_traits = FMHA_decode_kernel_traits<64, NUM_V, elem_type, 128, cache_type>;
+        run_fmha_decode_fp16_sm80_launch_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_128
+    if (launch_params.params.d == 128) {
+        using Kernel_traits = FMHA_decode_kernel_traits<128, NUM_V, elem_type, 128, cache_type>;
+        run_fmha_decode_fp16_sm80_launch_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+}
+
+template<typename elem_type, typename cache_type>
+void run_fmha_decode_fp16_sm80_num_v_(Launch_params<Fused_multihead_attention_decode_params> &launch_params,
+                                      const bool configure) {
+    switch (launch_params.params.num_v) {
+#if FMHA_BUILD_NUM_V_1
+        case 1: run_fmha_decode_fp16_sm80_<elem_type, cache_type, 1>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_2
+        case 2: run_fmha_decode_fp16_sm80_<elem_type, cache_type, 2>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_3
+        case 3: run_fmha_decode_fp16_sm80_<elem_type, cache_type, 3>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_4
+        case 4: run_fmha_decode_fp16_sm80_<elem_type, cache_type, 4>(launch_params, configure); break;
+#endif
+    }
+}
+
+template<typename elem_type>
+void run_fmha_decode_fp16_sm80_cache_(Launch_params<Fused_multihead_attention_decode_params> &launch_params,
+                                      const bool configure) {
+    switch (launch_params.params.cache_type) {
+        case DATA_TYPE_INT8: run_fmha_decode_fp16_sm80_num_v_<elem_type, int8_t>(launch_params, configure); break;
+        case DATA_TYPE_FP8_E4M3: run_fmha_decode_fp16_sm80_num_v_<elem_type, fmha::e4m3_t>(launch_params, configure); break;
+        default: run_fmha_decode_fp16_sm80_num_v_<elem_type, elem_type>(launch_params, configure); break;
+    }
+}
+
+void run_fmha_decode_fp16_sm80(Launch_params<Fused_multihead_attention_decode_params> &launch_params,
+                               const bool configure) {
+    if (launch_params.params.is_bf16) {
+#if FMHA_BUILD_BF16
+        run_fmha_decode_fp16_sm80_cache_<__nv_bfloat16>(launch_params, configure);
+#endif
+    } else {
+        run_fmha_decode_fp16_sm80_cache_<__half>(launch_params, configure);
+    }
+}
@@ -0,0 +1,254 @@
+/* Copyright (c) 2022, Tri Dao.
+ */
+
+#pragma once
+
+#include "fmha_kernel.h"
+#include <fmha/kernel_traits.h>
+#include <fmha/utils.h>
+
+namespace fmha {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// One CTA computes the keys [begin, end) of the split blockIdx.z for the (batch, head)
+// (blockIdx.y, blockIdx.x). The keys are read from the paged cache through the block table.
+// With a single split the result goes to O and softmax_lse directly, otherwise the normalized
+// partial output and its log-sum-exp go to o_accum / lse_accum and are merged by
+// device_decode_combine.
+template<typename Kernel_traits, typename Params>
+inline __device__ void device_decode_1xN(const Params &params) {
+
+    using elem_type = typename Kernel_traits::elem_type;
+    using cache_type = typename Kernel_traits::cache_type;
+    using Cache_fetch = typename Kernel_traits::Cache_fetch;
+    constexpr bool IS_QUANTIZED = sizeof(cache_type) == 1;
+    constexpr int D = Kernel_traits::D;
+    constexpr int NUM_V = Kernel_traits::NUM_V;
+    constexpr int ELTS = Kernel_traits::ELTS_PER_LDG;
+    constexpr int THREADS_PER_KEY = Kernel_traits::THREADS_PER_KEY;
+    constexpr int KEYS_PER_ITER = Kernel_traits::KEYS_PER_ITER;
+
+    // The block index for the head.
+    const int bidh = blockIdx.x;
+    // The block index for the batch.
+    const int bidb = blockIdx.y;
+    // The split of the keys.
+    const int split = blockIdx.z;
+    // The thread index.
+    const int tidx = threadIdx.x;
+
+    // The key of this thread within an iteration and the part of the head dimension it holds.
+    const int ki = tidx / THREADS_PER_KEY;
+    const int ci = tidx % THREADS_PER_KEY;
+
+    const int seqlen_k = params.seqlens_k[bidb];
+    const int keys_per_split = (seqlen_k + params.num_splits - 1) / params.num_splits;
+    const int begin = split * keys_per_split;
+    const int end = min(seqlen_k, begin + keys_per_split);
+
+    const int bh = bidb * params.h + bidh;
+    const char *q_ptr = reinterpret_cast<const char *>(params.q_ptr)
+        + (bh * D + ci * ELTS) * sizeof(elem_type);
+    uint4 q_raw;
+    fmha::ldg(q_raw, q_ptr);
+    float q[ELTS];
+    fmha::float8_unpack<elem_type>(q, q_raw);
+    // Fold the softmax scale and log2(e) into Q, so the scores are already in the exp2 domain.
+    const float scale = params.scale_bmm1f * float(M_LOG2E);
+    #pragma unroll
+    for( int ii = 0; ii < ELTS; ++ii ) { q[ii] *= scale; }
+
+    // The running max and sum of the keys seen by this thread, and the unnormalized outputs.
+    float p_max = -INFINITY;
+    float p_sum = 0.f;
+    float acc_o[NUM_V][ELTS];
+    #pragma unroll
+    for( int vi = 0; vi < NUM_V; ++vi ) {
+        #pragma unroll
+        for( int ii = 0; ii < ELTS; ++ii ) { acc_o[vi][ii] = 0.f; }
+    }
+
+    const int *block_table = params.block_table + bidb * params.block_table_stride;
+    const char *cache_ptr = reinterpret_cast<const char *>(params.kvv_cache_ptr);
+    // The offset of this thread in a row of the cache, and the distance between K and V_0, V_0 and
+    // V_1, ...
+    const size_t col_offset = (bidh * D + ci * ELTS) * sizeof(cache_type);
+    const size_t mat_stride_in_bytes = params.h * D * sizeof(cache_type);
+
+    // All the threads of the CTA go over the same number of iterations, as the scores are reduced
+    // with shuffles.
+    for( int key_base = begin; key_base < end; key_base += KEYS_PER_ITER ) {
+        const int key = key_base + ki;
+        const bool is_valid = key < end;
+
+        Cache_fetch k_raw = {};
+        Cache_fetch v_raw[NUM_V];
+        // The scales of the 8-bit cache are applied to the score and to the probability instead
+        // of to each element.
+        float k_scale = 1.f;
+        float v_scale[NUM_V];
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) { v_scale[vi] = 1.f; }
+        if( is_valid ) {
+            const int block = block_table[key / params.page_size];
+            const size_t row = size_t(block) * params.page_size + key % params.page_size;
+            const char *ptr = cache_ptr + row * params.kvv_stride_in_elts * sizeof(cache_type) + col_offset;
+            fmha::ldg(k_raw, ptr);
+            #pragma unroll
+            for( int vi = 0; vi < NUM_V; ++vi ) {
+                fmha::ldg(v_raw[vi], ptr + (vi + 1) * mat_stride_in_bytes);
+            }
+            if( IS_QUANTIZED ) {
+                const float *scales = params.kvv_scales_ptr + block * params.kvv_scales_block_stride + bidh;
+                k_scale = scales[0];
+                #pragma unroll
+                for( int vi = 0; vi < NUM_V; ++vi ) { v_scale[vi] = scales[(vi + 1) * params.h]; }
+            }
+        }
+
+        float k[ELTS];
+        fmha::float8_unpack<cache_type>(k, k_raw);
+        float s = 0.f;
+        #pragma unroll
+        for( int ii = 0; ii < ELTS; ++ii ) { s += q[ii] * k[ii]; }
+        #pragma unroll
+        for( int offset = THREADS_PER_KEY / 2; offset > 0; offset /= 2 ) {
+            s += __shfl_xor_sync(uint32_t(-1), s, offset);
+        }
+        s *= k_scale;
+
+        if( is_valid ) {
+            const float p_max_new = fmaxf(p_max, s);
+            // The first key of the thread zeroes out the (empty) running sum and outputs.
+            const float p_scale = exp2f(p_max - p_max_new);
+            const float p = exp2f(s - p_max_new);
+            p_sum = p_sum * p_scale + p;
+            #pragma unroll
+            for( int vi = 0; vi < NUM_V; ++vi ) {
+                float v[ELTS];
+                fmha::float8_unpack<cache_type>(v, v_raw[vi]);
+                const float p_v = p * v_scale[vi];
+                #pragma unroll
+                for( int ii = 0; ii < ELTS; ++ii ) {
+                    acc_o[vi][ii] = acc_o[vi][ii] * p_scale + p_v * v[ii];
+                }
+            }
+            p_max = p_max_new;
+        }
+    }
+
+    // Merge the results of the KEYS_PER_ITER keys of an iteration through shared memory.
+    __shared__ float smem_o[KEYS_PER_ITER][NUM_V * D];
+    __shared__ float smem_max[KEYS_PER_ITER];
+    __shared__ float smem_sum[KEYS_PER_ITER];
+    if( ci == 0 ) {
+        smem_max[ki] = p_max;
+        smem_sum[ki] = p_sum;
+    }
+    #pragma unroll
+    for( int vi = 0; vi < NUM_V; ++vi ) {
+        #pragma unroll
+        for( int ii = 0; ii < ELTS; ++ii ) { smem_o[ki][vi * D + ci * ELTS + ii] = acc_o[vi][ii]; }
+    }
+    __syncthreads();
+
+    float max_all = -INFINITY;
+    #pragma unroll
+    for( int gi = 0; gi < KEYS_PER_ITER; ++gi ) { max_all = fmaxf(max_all, smem_max[gi]); }
+    float sum_all = 0.f;
+    #pragma unroll
+    for( int gi = 0; gi < KEYS_PER_ITER; ++gi ) {
+        // Skip the keys without any valid element, their max is -inf.
+        if( smem_max[gi] != -INFINITY ) { sum_all += smem_sum[gi] * exp2f(smem_max[gi] - max_all); }
+    }
+    // An empty split (or sequence) has no keys, its output is 0 and its log-sum-exp -inf.
+    const float inv_sum = sum_all == 0.f ? 0.f : 1.f / sum_all;
+    const float lse = sum_all == 0.f ? -INFINITY : (max_all + log2f(sum_all)) * float(M_LN2);
+
+    const bool is_split = params.num_splits > 1;
+    for( int idx = tidx; idx < NUM_V * D / 2; idx += Kernel_traits::THREADS ) {
+        float o[2] = { 0.f, 0.f };
+        #pragma unroll
+        for( int gi = 0; gi < KEYS_PER_ITER; ++gi ) {
+            if( smem_max[gi] == -INFINITY ) { continue; }
+            const float scale_gi = exp2f(smem_max[gi] - max_all) * inv_sum;
+            o[0] += smem_o[gi][2 * idx + 0] * scale_gi;
+            o[1] += smem_o[gi][2 * idx + 1] * scale_gi;
+        }
+        if( !is_split ) {
+            const int vi = 2 * idx / D;
+            const int col = 2 * idx % D;
+            char *o_ptr = reinterpret_cast<char *>(params.o_ptrs[vi]) + (bh * D + col) * sizeof(elem_type);
+            fmha::stg(o_ptr, fmha::float2_pack<elem_type>(o[0], o[1]));
+        } else {
+            float *o_accum = reinterpret_cast<float *>(params.o_accum_ptr)
+                + (size_t(split) * params.b * params.h + bh) * NUM_V * D;
+            reinterpret_cast<float2 *>(o_accum)[idx] = make_float2(o[0], o[1]);
+        }
+    }
+    if( tidx == 0 ) {
+        if( !is_split ) {
+            reinterpret_cast<float *>(params.softmax_lse_ptr)[bh] = lse;
+        } else {
+            reinterpret_cast<float *>(params.lse_accum_ptr)[split * params.b * params.h + bh] = lse;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Merge the splits of the (batch, head) (blockIdx.y, blockIdx.x): each split is weighted by its
+// share exp(lse_i - lse) of the total softmax sum.
+template<typename Kernel_traits, typename Params>
+inline __device__ void device_decode_combine(const Params &params) {
+
+    using elem_type = typename Kernel_traits::elem_type;
+    constexpr int D = Kernel_traits::D;
+    constexpr int NUM_V = Kernel_traits::NUM_V;
+
+    const int bidh = blockIdx.x;
+    const int bidb = blockIdx.y;
+    const int tidx = threadIdx.x;
+
+    const int bh = bidb * params.h + bidh;
+    const int split_stride = params.b * params.h;
+    const float *lse_accum = reinterpret_cast<const float *>(params.lse_accum_ptr);
+
+    float lse_max = -INFINITY;
+    for( int si = 0; si < params.num_splits; ++si ) {
+        lse_max = fmaxf(lse_max, lse_accum[si * split_stride + bh]);
+    }
+    float sum = 0.f;
+    for( int si = 0; si < params.num_splits; ++si ) {
+        const float lse_si = lse_accum[si * split_stride + bh];
+        if( lse_si != -INFINITY ) { sum += expf(lse_si - lse_max); }
+    }
+    const float lse = sum == 0.f ? -INFINITY : lse_max + logf(sum);
+
+    __shared__ float smem_scale[MAX_DECODE_SPLITS];
+    if( tidx < params.num_splits ) {
+        const float lse_si = lse_accum[tidx * split_stride + bh];
+        smem_scale[tidx] = lse_si == -INFINITY ? 0.f : expf(lse_si - lse);
+    }
+    if( tidx == 0 ) { reinterpret_cast<float *>(params.softmax_lse_ptr)[bh] = lse; }
+    __syncthreads();
+
+    const float2 *o_accum = reinterpret_cast<const float2 *>(params.o_accum_ptr);
+    for( int idx = tidx; idx < NUM_V * D / 2; idx += Kernel_traits::THREADS ) {
+        float o[2] = { 0.f, 0.f };
+        for( int si = 0; si < params.num_splits; ++si ) {
+            const float2 o_si = o_accum[(size_t(si) * split_stride + bh) * NUM_V * D / 2 + idx];
+            o[0] += o_si.x * smem_scale[si];
+            o[1] += o_si.y * smem_scale[si];
+        }
+        const int vi = 2 * idx / D;
+        const int col = 2 * idx % D;
+        char *o_ptr = reinterpret_cast<char *>(params.o_ptrs[vi]) + (bh * D + col) * sizeof(elem_type);
+        fmha::stg(o_ptr, fmha::float2_pack<elem_type>(o[0], o[1]));
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+}  // namespace fmha
@@ -2,6 +2,7 @@
  */
 
 #include "fmha.h"
+#include "fmha_autotune.h"
 #include "fmha_dgrad_kernel_1xN_loop.h"
 
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, int loop_steps=-1>
@@ -10,7 +11,7 @@ __global__ void fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel(Fused_multihead_attent
 }
 
 template<typename Kernel_traits>
-void run_fmha_dgrad_fp16_sm80_loop_(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+constexpr int get_dgrad_smem_size() {
     constexpr int smem_size_softmax = Kernel_traits::Cta_tile_p::M * Kernel_traits::Cta_tile_p::WARPS_N * sizeof(float);
     constexpr int smem_size_q = Kernel_traits::Smem_tile_q::BYTES_PER_TILE;
     constexpr int smem_size_v = Kernel_traits::Smem_tile_v::BYTES_PER_TILE;
@@ -23,24 +24,28 @@ void run_fmha_dgrad_fp16_sm80_loop_(const Fused_multihead_attention_fprop_params
     static_assert(smem_size_dq == 16 * Kernel_traits::Cta_tile_p::K * 4 * Kernel_traits::Cta_tile_p::WARPS_N);
     static_assert(smem_size_dp_sum == 16 * 4 * 2);
 
-    constexpr int smem_size_dq_dk_dv = smem_size_q * 2 + smem_size_v * (Kernel_traits::V_IN_REGS ? 1 : 2) + smem_size_dq + smem_size_s * 2 + smem_size_dp_sum;
+    // dO_i and V_i of the extra values always live in shared memory, on top of the single-value layout.
+    constexpr int smem_size_dq_dk_dv = smem_size_q * 2 + smem_size_v * (Kernel_traits::V_IN_REGS ? 1 : 2) + smem_size_dq + smem_size_s * 2 + smem_size_dp_sum
+                                     + (Kernel_traits::NUM_V - 1) * (smem_size_q + smem_size_v);
+    return smem_size_dq_dk_dv;
+}
+
+template<typename Kernel_traits>
+void run_fmha_dgrad_fp16_sm80_loop_(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+    constexpr int smem_size_dq_dk_dv = get_dgrad_smem_size<Kernel_traits>();
 
     bool is_dropout = params.p_dropout < 1.f;  // params.p_dropout is the probability of "keeping"
-    bool is_causal = params.is_causal;
-    auto kernel = is_dropout
-        ? (is_causal ? &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, true> : &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, false>)
-        : (is_causal ? &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, true> : &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, false>);
     constexpr int N = Kernel_traits::Cta_tile_p::N;
-    if (params.s == N) {
-        kernel = is_dropout
-            ? (is_causal ? &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, true, /*loop_steps=*/1> : &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, false, /*loop_steps=*/1>)
-            : (is_causal ? &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, true, /*loop_steps=*/1> : &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, false, /*loop_steps=*/1>);
-    } else if (params.s == N * 2) {
-        kernel = is_dropout
-            ? (is_causal ? &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, true, /*loop_steps=*/2> : &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, true, false, /*loop_steps=*/2>)
-            : (is_causal ? &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, true, /*loop_steps=*/2> : &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, false, false, /*loop_steps=*/2>);
-    }
+    // The loops over one or two K/V blocks are unrolled.
+    auto kernel = DROPOUT_SWITCH(is_dropout, Is_dropout, [&] {
+        return BOOL_SWITCH(params.is_causal, Is_causal, [&] {
+            return params.seqlen_k == N ? &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, Is_dropout, Is_causal, /*loop_steps=*/1>
+                : (params.seqlen_k == N * 2 ? &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, Is_dropout, Is_causal, /*loop_steps=*/2>
+                   : &fmha_dgrad_fp16_sm80_dq_dk_dv_loop_kernel<Kernel_traits, Is_dropout, Is_causal>);
+        });
+    });
 
+    fmha::check_smem_size("dgrad", smem_size_dq_dk_dv);
     if( smem_size_dq_dk_dv >= 48 * 1024 ) {
         FMHA_CHECK_CUDA(cudaFuncSetAttribute(
             kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size_dq_dk_dv));
@@ -50,43 +55,156 @@ void run_fmha_dgrad_fp16_sm80_loop_(const Fused_multihead_attention_fprop_params
     FMHA_CHECK_CUDA(cudaPeekAtLastError());
 }
 
-void run_fmha_dgrad_fp16_sm80(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
-    if (params.d == 16) {
-        if( params.s == 128 ) {
-            using Kernel_traits = FMHA_kernel_traits<128, 16, 16, 1, 8, 0x08u>;
-            run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
-        } else if( params.s == 256 ) {
-            using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 8, 0x08u>;
-            run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
+// Runs Kernel_traits, or one of Alt_traits if the autotuner picked it (see fmha_autotune.h). They
+// all have the same N as the forward pass, otherwise the dropout masks differ.
+template<typename Kernel_traits, typename... Alt_traits>
+void run_fmha_dgrad_fp16_sm80_tuned_(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+    static_assert(((Alt_traits::Cta_tile_p::N == Kernel_traits::Cta_tile_p::N) && ...));
+#if !FMHA_BUILD_AUTOTUNE
+    run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
+#else
+    using Launcher = void (*)(const Fused_multihead_attention_fprop_params &, cudaStream_t);
+    const std::vector<Launcher> launchers = {&run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>,
+                                             &run_fmha_dgrad_fp16_sm80_loop_<Alt_traits>...};
+    const std::vector<fmha::Autotune_config> configs = {
+        {fmha::autotune_config_name<Kernel_traits>(), size_t(get_dgrad_smem_size<Kernel_traits>())},
+        {fmha::autotune_config_name<Alt_traits>(), size_t(get_dgrad_smem_size<Alt_traits>())}...};
+    const int ci = fmha::autotune_select(
+        fmha::autotune_key("dgrad", params), configs,
+        [&](const int i) { launchers[i](params, stream); }, stream);
+    launchers[ci](params, stream);
+#endif
+}
+
+// The autotuner can also pick V in registers (0x08u) or in shared memory (0x100u), the latter needs
+// more shared memory than the GPUs other than A100 have for d=64.
+template<typename elem_type, int NUM_V, typename index_t>
+void run_fmha_dgrad_fp16_sm80_(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+    const int d = fmha_round_head_dim(params.d);
+#if FMHA_BUILD_HDIM_16
+    if (d == 16) {
+        if( params.seqlen_k == 128 ) {
+            using Kernel_traits = FMHA_kernel_traits<128, 16, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<128, 16, 16, 1, 8, 0x100u, NUM_V, elem_type, index_t>;
+            run_fmha_dgrad_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(params, stream);
+        } else if( params.seqlen_k == 256 ) {
+            using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 16, 16, 1, 8, 0x100u, NUM_V, elem_type, index_t>;
+            run_fmha_dgrad_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(params, stream);
         } else {
             // TD [2022-05-15] 512 gives wrong results rn
             // using Kernel_traits = FMHA_kernel_traits<512, 16, 16, 1, 8, 0x08u>;
-            using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 8, 0x08u>;
-            run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
+            using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 16, 16, 1, 8, 0x100u, NUM_V, elem_type, index_t>;
+            run_fmha_dgrad_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(params, stream);
         }
-    } else if (params.d == 32) {
-        if( params.s == 128 ) {
-            using Kernel_traits = FMHA_kernel_traits<128, 32, 16, 1, 8, 0x08u>;
-            run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
-        } else if( params.s >= 256 ) {
-            using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 8, 0x08u>;
-            run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
+    }
+#endif
+#if FMHA_BUILD_HDIM_32
+    if (d == 32) {
+        if( params.seqlen_k == 128 ) {
+            using Kernel_traits = FMHA_kernel_traits<128, 32, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<128, 32, 16, 1, 8, 0x100u, NUM_V, elem_type, index_t>;
+            run_fmha_dgrad_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(params, stream);
+        } else if( params.seqlen_k >= 256 ) {
+            using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 32, 16, 1, 8, 0x100u, NUM_V, elem_type, index_t>;
+            run_fmha_dgrad_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(params, stream);
         }
-    } else if (params.d == 64) {
-        if( params.s == 128 ) {
-            using Kernel_traits = FMHA_kernel_traits<128, 64, 16, 1, 8, 0x08u>;
-            run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
-        } else if( params.s >= 256 ) {
+    }
+#endif
+#if FMHA_BUILD_HDIM_64
+    if (d == 64) {
+        if( params.seqlen_k == 128 ) {
+            using Kernel_traits = FMHA_kernel_traits<128, 64, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<128, 64, 16, 1, 8, 0x100u, NUM_V, elem_type, index_t>;
+            run_fmha_dgrad_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(params, stream);
+        } else if( params.seqlen_k >= 256 ) {
             // using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 8, 0x08u>;
             // Don't share smem for K & V, and don't keep V in registers
             // This speeds things up by 2-3% by avoiding register spills, but it
             // uses more shared memory, which is fine on A100 but not other GPUs.
             // For other GPUs, we should either use N=128 as the base, or keep V in registers.
-            using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 8, 0x100u>;
-            run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
+            // The autotuner falls back to V in registers when this doesn't fit.
+            using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 8, 0x100u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 64, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+            run_fmha_dgrad_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(params, stream);
         }
-    } else if (params.d == 128) {
-        using Kernel_traits = FMHA_kernel_traits<128, 128, 16, 1, 8, 0x100u>;
+    }
+#endif
+#if FMHA_BUILD_HDIM_128
+    if (d == 128) {
+        // With V2 and dO2 in shared memory, keeping V in shared memory as well (0x100u) no longer
+        // fits in the 163KB of an A100, so V goes back to registers here.
+        using Kernel_traits = FMHA_kernel_traits<128, 128, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+        run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
+    }
+#endif
+}
+
+// More than two values don't fit in shared memory with N=256, so they always use N=128 as the base.
+// This has to match the forward pass, otherwise the dropout masks differ.
+template<typename elem_type, int NUM_V, typename index_t>
+void run_fmha_dgrad_fp16_sm80_nv_(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+    static_assert(NUM_V > 2);
+    const int d = fmha_round_head_dim(params.d);
+#if FMHA_BUILD_HDIM_16
+    if (d == 16) {
+        using Kernel_traits = FMHA_kernel_traits<128, 16, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
         run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
     }
-}
\ No newline at end of file
+#endif
+#if FMHA_BUILD_HDIM_32
+    if (d == 32) {
+        using Kernel_traits = FMHA_kernel_traits<128, 32, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+        run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
+    }
+#endif
+#if FMHA_BUILD_HDIM_64
+    if (d == 64) {
+        using Kernel_traits = FMHA_kernel_traits<128, 64, 16, 1, 8, 0x08u, NUM_V, elem_type, index_t>;
+        run_fmha_dgrad_fp16_sm80_loop_<Kernel_traits>(params, stream);
+    }
+#endif
+}
+
+template<typename elem_type, typename index_t>
+void run_fmha_dgrad_fp16_sm80_num_v_(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+    switch (params.num_v) {
+#if FMHA_BUILD_NUM_V_1
+        case 1: run_fmha_dgrad_fp16_sm80_<elem_type, 1, index_t>(params, stream); break;
+#endif
+#if FMHA_BUILD_NUM_V_2
+        case 2: run_fmha_dgrad_fp16_sm80_<elem_type, 2, index_t>(params, stream); break;
+#endif
+#if FMHA_BUILD_NUM_V_3
+        case 3: run_fmha_dgrad_fp16_sm80_nv_<elem_type, 3, index_t>(params, stream); break;
+#endif
+#if FMHA_BUILD_NUM_V_4
+        case 4: run_fmha_dgrad_fp16_sm80_nv_<elem_type, 4, index_t>(params, stream); break;
+#endif
+    }
+}
+
+void run_fmha_dgrad_fp16_sm80(const Fused_multihead_attention_fprop_params &params, cudaStream_t stream) {
+    // The 64-bit offsets cost registers, so they are only used when some tensor is larger than 2GB.
+    if (params.is_64bit_index) {
+#if FMHA_BUILD_64BIT_INDEX
+        if (params.is_bf16) {
+#if FMHA_BUILD_BF16
+            run_fmha_dgrad_fp16_sm80_num_v_<__nv_bfloat16, uint64_t>(params, stream);
+#endif
+        } else {
+            run_fmha_dgrad_fp16_sm80_num_v_<__half, uint64_t>(params, stream);
+        }
+#endif
+    } else {
+        if (params.is_bf16) {
+#if FMHA_BUILD_BF16
+            run_fmha_dgrad_fp16_sm80_num_v_<__nv_bfloat16, uint32_t>(params, stream);
+#endif
+        } else {
+            run_fmha_dgrad_fp16_sm80_num_v_<__half, uint32_t>(params, stream);
+        }
+    }
+}
@@ -12,18 +12,63 @@ namespace fmha {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-template <typename Smem_dp_sum, int M>
+template <typename elem_type, typename Smem_dp_sum, int M>
 inline __device__ void dot_do_o(float (&sum)[M], const uint4 (&do_)[M], const uint4 (&o)[M],
                                 Smem_dp_sum smem, const int buffer_idx) {
     #pragma unroll
     for (int mi = 0; mi < M; ++mi) {
-        sum[mi] = smem.reduce_warp(fmha::hmulsum8(do_[mi], o[mi]));
+        sum[mi] = smem.reduce_warp(fmha::hmulsum8<elem_type>(do_[mi], o[mi]));
     }
     static_assert(M == 1);
     smem.store(sum[0], buffer_idx);
     // smem.store(sum, buffer_idx);
 }
 
+// All outputs share the same softmax, so the row sum of dP * P is the sum of dot(dO_i, O_i).
+// The first NUM_EXTRA entries of do_x / o_x hold dO_i and O_i of the value tensors 1, 2, ...
+template <int NUM_EXTRA, typename elem_type, typename Smem_dp_sum, int M, int N>
+inline __device__ void dot_do_o(float (&sum)[M], const uint4 (&do_)[M], const uint4 (&o)[M],
+                                const uint4 (&do_x)[N][M], const uint4 (&o_x)[N][M],
+                                Smem_dp_sum smem, const int buffer_idx) {
+    static_assert(NUM_EXTRA <= N);
+    #pragma unroll
+    for (int mi = 0; mi < M; ++mi) {
+        float dot = fmha::hmulsum8<elem_type>(do_[mi], o[mi]);
+        #pragma unroll
+        for (int xi = 0; xi < NUM_EXTRA; ++xi) {
+            dot += fmha::hmulsum8<elem_type>(do_x[xi][mi], o_x[xi][mi]);
+        }
+        sum[mi] = smem.reduce_warp(dot);
+    }
+    static_assert(M == 1);
+    smem.store(sum[0], buffer_idx);
+}
+
+// The double-buffered shared memory tiles of the extra value tensors are created where they are
+// used, so they have to be moved to the buffers the tiles of the first value tensor are at.
+template <typename Smem_tile>
+inline __device__ Smem_tile make_smem_tile(char *smem, const int tidx,
+                                           const int read_buffer, const int write_buffer) {
+    Smem_tile smem_tile(smem, tidx);
+    if (read_buffer) { smem_tile.move_to_next_read_buffer(); }
+    if (write_buffer) { smem_tile.move_to_next_write_buffer(); }
+    return smem_tile;
+}
+
+// Load the rows [step * ROWS, (step + 1) * ROWS) of dO_i or O_i into registers.
+template <typename Gmem_tile, typename Params, typename BInfo, int LDGS>
+inline __device__ void load_dout(uint4 (&fetch)[LDGS], void *ptr, const Params &params,
+                                 const BInfo &binfo, const int tidx, const int step) {
+    static_assert(LDGS == Gmem_tile::LDGS);
+    Gmem_tile gmem_tile(ptr, params, binfo, tidx);
+    gmem_tile.move(step);
+    gmem_tile.load();
+    #pragma unroll
+    for (int ii = 0; ii < LDGS; ++ii) {
+        fetch[ii] = gmem_tile.fetch_[ii];
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Is_first, bool Is_last, typename Params, typename Prng>
@@ -31,6 +76,7 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
                                                      const int loop_step_idx) {
 
     // The description of the CTA tile for the 1st batched GEMM.
+    using elem_type = typename Kernel_traits::elem_type;
     using Cta_tile_p = typename Kernel_traits::Cta_tile_p;
     // The description of the CTA tile for the 2nd batched GEMM.
     using Cta_tile_dq = typename Kernel_traits::Cta_tile_o;
@@ -78,8 +124,8 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
 
     // The global memory tile to store dQ.
     // using Gmem_tile_dq = typename Kernel_traits::Gmem_tile_dq;
-    using Gmem_tile_dq = fmha::Gmem_tile_dq<Cta_tile_dq>;
-    using Gmem_tile_dq_tmp = fmha::Gmem_tile_o<Cta_tile_dq, 4>;
+    using Gmem_tile_dq = fmha::Gmem_tile_dq<Cta_tile_dq, Kernel_traits::NUM_MATS, typename Kernel_traits::index_t>;
+    using Gmem_tile_dq_tmp = fmha::Gmem_tile_o<Cta_tile_dq, 4, typename Kernel_traits::index_t>;
     // The shared memory tile to swizzle dQ.
     using Smem_tile_dq = typename Kernel_traits::Smem_tile_o;
 
@@ -108,14 +154,28 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
 
     using Softmax = fmha::Softmax<Cta_tile_p, Kernel_traits>;
 
+    // The value tensors 1, ..., NUM_V - 1 are the "extra" ones. V_0 goes through the same path
+    // as the single-value kernel.
+    constexpr int NUM_V_X = Kernel_traits::NUM_V - 1;
+    // The size of the register arrays for the extra values, zero-sized arrays are not allowed.
+    constexpr int NUM_V_X_REGS = NUM_V_X > 0 ? NUM_V_X : 1;
+
     // Shared memory.
     extern __shared__ char smem_[];
     // Shared memory layout if we keep V in registers:
-    //  dO | Q | K / V | dQ | S | dP | dP_sum
+    //  dO | Q | K / V | dQ | S | dP | dP_sum | dO_1 | V_1 | ... | dO_{NUM_V-1} | V_{NUM_V-1}
     //  dV | dK
     // Shared memory layout if we keep V shared memory:
-    //  dO | Q | K | V | dQ | S | dP | dP_sum
+    //  dO | Q | K | V | dQ | S | dP | dP_sum | dO_1 | V_1 | ... | dO_{NUM_V-1} | V_{NUM_V-1}
     //  dV | dK
+    // The extra V_i always stay in shared memory, keeping them in registers costs too many registers.
+    // Their dV_i go through the epilogue one after the other, reusing the shared memory of dV.
+    constexpr int SMEM_OFFSET_X = Smem_tile_do::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_O + Smem_tile_dq::BYTES_PER_TILE
+                                + Smem_tile_st::BYTES_PER_TILE * 2 + Smem_dp_sum::BYTES_PER_TILE;
+    constexpr int SMEM_STRIDE_X = Smem_tile_do::BYTES_PER_TILE + Smem_tile_v::BYTES_PER_TILE;
+    // The offsets of dO_i and V_i within the part of an extra value.
+    constexpr int SMEM_OFFSET_X_DO = 0;
+    constexpr int SMEM_OFFSET_X_V = Smem_tile_do::BYTES_PER_TILE;
 
 
     // The block index for the batch.
@@ -134,11 +194,12 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
     Gmem_tile_q gmem_q(params, 0, binfo, tidx);
     // Allocate the global memory tile loader for dQ.
     Gmem_tile_dq gmem_dq(params, 0, binfo, tidx);
-    Gmem_tile_dq_tmp gmem_dq_tmp(params.o_tmp_ptr, params.o_stride_in_elts, binfo, tidx);
+    Gmem_tile_dq_tmp gmem_dq_tmp(params.dq_tmp_ptr, params.o_stride_in_elts, binfo, tidx, params.d);
     // Allocate the global memory tile loader for S.
     Gmem_tile_s gmem_s(params, binfo, tidx);
 
     fmha::Mask<Cta_tile_p, Is_causal> mask(binfo, tidx, loop_step_idx);
+    const float alibi_slope = fmha::get_alibi_slope(params, binfo);
 
     // Allocate the global memory tile loader for K.
     Gmem_tile_k gmem_k(params, 1, binfo, tidx);
@@ -153,7 +214,7 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
     Smem_tile_kt smem_kt(&smem_[Smem_tile_do::BYTES_PER_TILE + Gemm1::Smem_tile_q::BYTES_PER_TILE], tidx);
 
     // Allocate the global memory tile loader for dO.
-    Gmem_tile_do gmem_do(params.do_ptr, params, binfo, tidx);
+    Gmem_tile_do gmem_do(params.do_ptrs[0], params, binfo, tidx);
     // Allocate the shared memory tile loader for dO.
     Smem_tile_do smem_do(&smem_[0], tidx);
     Smem_tile_dot smem_dot(&smem_[0], tidx);
@@ -165,18 +226,22 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
     Smem_tile_st smem_dp(&smem_[Smem_tile_do::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_O + Smem_tile_dq::BYTES_PER_TILE + Smem_tile_st::BYTES_PER_TILE], tidx);
 
     // Allocate the global memory tile loader for O.
-    Gmem_tile_o gmem_o(params.o_ptr, params, binfo, tidx);
+    Gmem_tile_o gmem_o(params.o_ptrs[0], params, binfo, tidx);
 
     // Allocate the shared memory tile loader for O. We use the same as K so be careful!!!
     Smem_tile_dq smem_dq(&smem_[Smem_tile_do::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_O], tidx);
 
-    Gmem_softmax_sum gmem_softmax_lse(params.softmax_lse_ptr, params, tidx);
-    Gmem_softmax_sum gmem_softmax_d(params.dsoftmax_sum, params, tidx);
+    Gmem_softmax_sum gmem_softmax_lse(params.softmax_lse_ptr, params, binfo, tidx);
+    Gmem_softmax_sum gmem_softmax_d(params.dsoftmax_sum, params, binfo, tidx);
 
     static_assert(Cta_tile_p::N % Cta_tile_p::M == 0);
-    const int begin = Is_causal ? loop_step_idx * Cta_tile_p::N / Cta_tile_p::M : 0;
+    const int begin = Is_causal ? fmha::band_q_begin<Cta_tile_p>(binfo, loop_step_idx) : 0;
     // constexpr int steps = Cta_tile_p::N / Cta_tile_p::M;
-    const int steps = params.s / Cta_tile_p::M - begin;
+    const int steps = params.seqlen_q / Cta_tile_p::M - begin;
+    // The query blocks after the band (with a window_left) are skipped too, except for the first
+    // K/V block which computes dp_sum and initializes dq_tmp, and for the last one which writes dQ.
+    const int band_end = Is_causal && !Is_first && !Is_last
+        ? fmha::band_q_end<Cta_tile_p>(binfo, loop_step_idx) : begin + steps;
 
     // Wind gmem tiles to the correct position.
     gmem_q.move(begin);
@@ -203,6 +268,24 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
     gmem_do.load();
     // Trigger the loads for O.
     if (Is_first) { gmem_o.load(); }
+    // Trigger the loads for the extra V_i, dO_i and O_i. V_i is matrix 2 + i of the packed QKV tensor.
+    uint4 fetch_v_x[NUM_V_X_REGS][Gmem_tile_v::LDGS];
+    uint4 fetch_do_x[NUM_V_X_REGS][Gmem_tile_do::LDGS];
+    uint4 fetch_o_x[NUM_V_X_REGS][Gmem_tile_o::LDGS];
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        Gmem_tile_v gmem_v_x(params, 3 + xi, binfo, tidx);
+        if (!Is_first) { gmem_v_x.move(loop_step_idx); }
+        gmem_v_x.load();
+        #pragma unroll
+        for( int ii = 0; ii < Gmem_tile_v::LDGS; ++ii ) {
+            fetch_v_x[xi][ii] = gmem_v_x.fetch_[ii];
+        }
+        load_dout<Gmem_tile_do>(fetch_do_x[xi], params.do_ptrs[1 + xi], params, binfo, tidx, begin);
+        if (Is_first) {
+            load_dout<Gmem_tile_o>(fetch_o_x[xi], params.o_ptrs[1 + xi], params, binfo, tidx, begin);
+        }
+    }
 
     float p_lse[Mma_tile_p::MMAS_M * 2];
     gmem_softmax_lse.load(reinterpret_cast<uint32_t(&)[Mma_tile_p::MMAS_M * 2]>(p_lse));
@@ -217,12 +300,22 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
     float dp_sum_regs[Gmem_tile_do::LDGS];
     Smem_dp_sum smem_dp_sum(reinterpret_cast<float *>(&smem_[Smem_tile_do::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_O + Smem_tile_dq::BYTES_PER_TILE + Smem_tile_st::BYTES_PER_TILE * 2]), tidx);
 
+    // Apply the rotary embedding to Q and K in registers, if any. dQ and dK are computed for the
+    // rotated Q and K and rotated back when they are written.
+    fmha::apply_rotary_fetch<elem_type>(gmem_q, params, binfo, /*use_seqlen_q=*/true);
+    fmha::apply_rotary_fetch<elem_type>(gmem_k, params, binfo, /*use_seqlen_q=*/false);
+
     if (!Is_first) { __syncthreads(); }
     // Commit the data for Q, dO, and V to shared memory.
     gmem_q.commit(gemm_q_k.smem_q);
     gmem_do.commit(smem_do);
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        Smem_tile_do smem_do_x(&smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_DO], tidx);
+        smem_do_x.store(fetch_do_x[xi]);
+    }
     if (Is_first) {
-        dot_do_o(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, smem_dp_sum, 0);
+        dot_do_o<NUM_V_X, elem_type>(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, fetch_do_x, fetch_o_x, smem_dp_sum, 0);
         const int dp_sum_row = tidx / Smem_dp_sum::THREADS_PER_ROW;
         if ((dp_sum_row < Smem_dp_sum::ROWS) && (tidx % Smem_dp_sum::THREADS_PER_ROW == 0)) {
             gmem_softmax_d.store_row(reinterpret_cast<uint32_t(&)[Gmem_tile_do::LDGS]>(dp_sum_regs), dp_sum_row);
@@ -235,11 +328,20 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
         const uint32_t scale_dropout = params.scale_dropout;
         #pragma unroll
         for(int it=0; it < Gmem_tile_v::LDGS; it++){
-            gmem_v.fetch_[it] = fmha::hmul8(scale_dropout, gmem_v.fetch_[it]);
+            gmem_v.fetch_[it] = fmha::hmul8<elem_type>(scale_dropout, gmem_v.fetch_[it]);
+            #pragma unroll
+            for( int xi = 0; xi < NUM_V_X; ++xi ) {
+                fetch_v_x[xi][it] = fmha::hmul8<elem_type>(scale_dropout, fetch_v_x[xi][it]);
+            }
         }
     }
 
     gmem_v.commit(smem_v);
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        Smem_tile_v smem_v_x(&smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_V], tidx);
+        smem_v_x.store(fetch_v_x[xi]);
+    }
 
     // const uint32_t scale_bmm1 = reinterpret_cast<const uint32_t&>(params.scale_bmm1);
     // #pragma unroll
@@ -298,12 +400,25 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
     fmha::Clear_accumulator<fmha::Accumulator_type, Cta_tile_dkv::WARPS_K>::apply(acc_dv);
     fmha::Fragment_accumulator acc_dk[Mma_tile_dkv::MMAS_M][Mma_tile_dkv::MMAS_N];
     fmha::Clear_accumulator<fmha::Accumulator_type, Cta_tile_dkv::WARPS_K>::apply(acc_dk);
+    fmha::Fragment_accumulator acc_dv_x[NUM_V_X_REGS][Mma_tile_dkv::MMAS_M][Mma_tile_dkv::MMAS_N];
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        fmha::Clear_accumulator<fmha::Accumulator_type, Cta_tile_dkv::WARPS_K>::apply(acc_dv_x[xi]);
+    }
 
     // Load over the entire sequence length.
     for( int l = 0; l < steps; l++ ) {
         const int loop = (begin + l) * Cta_tile_p::M;
-        if( loop >= binfo.actual_seqlen )
+        if( loop >= binfo.actual_seqlen_q )
+            break;
+        if( begin + l >= band_end ) {
+            // The forward pass draws the dropout masks of these blocks, skip them.
+            if (Is_dropout) {
+                const int q_steps = std::min(steps, (binfo.actual_seqlen_q + Cta_tile_p::M - 1) / Cta_tile_p::M - begin);
+                ph.incr_n((unsigned long long)(q_steps - l) * Mma_tile_p::MMAS_M * Mma_tile_p::MMAS_N);
+            }
             break;
+        }
 
         // Load the fragments for V.
         // typename Smem_tile_v::Fragment frag_v[2][Mma_tile_p::MMAS_N];
@@ -327,6 +442,8 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
         softmax.unpack_noscale(acc_p);
         // Apply the mask.
         softmax.apply_mask(mask);
+        // The same bias as in the forward pass, dS does not depend on it.
+        if (alibi_slope != 0.f) { softmax.apply_alibi(mask, alibi_slope); }
         // Scale by log-sum-exp of the softmax
         // softmax.apply_exp(p_lse);
         softmax.template scale_apply_exp</*scale_max=*/false>(p_lse, params.scale_bmm1f);
@@ -383,9 +500,9 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
             smem_do.load(frag_do[ki & 1], ki);
             if (!Kernel_traits::V_IN_REGS) {
                 smem_v.load(frag_v[ki & 1], ki);
-                fmha::gemm(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1) & 1]);
+                fmha::gemm<elem_type>(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1) & 1]);
             } else {
-                fmha::gemm(acc_dp, frag_do[(ki - 1) & 1], frag_v[ki - 1]);
+                fmha::gemm<elem_type>(acc_dp, frag_do[(ki - 1) & 1], frag_v[ki - 1]);
             }
             // if ((threadIdx.x == 0) && (blockIdx.x == 0) && (blockIdx.y == 0) && (l < 4))  {
             //     float2 tmp = __half22float2(reinterpret_cast<__half2 &>(frag_do[(ki - 1) & 1]));
@@ -399,9 +516,31 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
         {
             int ki = Mma_tile_p::MMAS_K;
             if (!Kernel_traits::V_IN_REGS) {
-                fmha::gemm(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1) & 1]);
+                fmha::gemm<elem_type>(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1) & 1]);
             } else {
-                fmha::gemm(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1)]);
+                fmha::gemm<elem_type>(acc_dp, frag_do[(ki - 1) & 1], frag_v[(ki - 1)]);
+            }
+        }
+
+        // Do this part of dP^T += (dO_i * V_i^T)^T for the extra values.
+        #pragma unroll
+        for( int xi = 0; xi < NUM_V_X; ++xi ) {
+            Smem_tile_v smem_v_x(&smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_V], tidx);
+            Smem_tile_do smem_do_x = make_smem_tile<Smem_tile_do>(
+                &smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_DO], tidx, l % 2, 0);
+            typename Smem_tile_v::Fragment frag_v_x[2][Mma_tile_p::MMAS_N];
+            smem_v_x.load(frag_v_x[0], 0);
+            typename Smem_tile_do::Fragment frag_do_x[2][Mma_tile_p::MMAS_M];
+            smem_do_x.load(frag_do_x[0], 0);
+            #pragma unroll
+            for( int ki = 1; ki < Mma_tile_p::MMAS_K; ++ki ) {
+                smem_do_x.load(frag_do_x[ki & 1], ki);
+                smem_v_x.load(frag_v_x[ki & 1], ki);
+                fmha::gemm<elem_type>(acc_dp, frag_do_x[(ki - 1) & 1], frag_v_x[(ki - 1) & 1]);
+            }
+            {
+                int ki = Mma_tile_p::MMAS_K;
+                fmha::gemm<elem_type>(acc_dp, frag_do_x[(ki - 1) & 1], frag_v_x[(ki - 1) & 1]);
             }
         }
 
@@ -424,6 +563,13 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
                 gmem_o.move();
                 gmem_o.load();
             }
+            #pragma unroll
+            for( int xi = 0; xi < NUM_V_X; ++xi ) {
+                load_dout<Gmem_tile_do>(fetch_do_x[xi], params.do_ptrs[1 + xi], params, binfo, tidx, begin + l + 1);
+                if (Is_first) {
+                    load_dout<Gmem_tile_o>(fetch_o_x[xi], params.o_ptrs[1 + xi], params, binfo, tidx, begin + l + 1);
+                }
+            }
         }
 
         softmax.unpack_noscale(acc_dp);
@@ -440,29 +586,28 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
             for( int mi = 0; mi < Mma_tile_p::MMAS_M; mi++ ) {
                 #pragma unroll
                 for( int ni = 0; ni < Mma_tile_p::MMAS_N; ni++ ) {
-                    frag_p[mi][ni].hmul(frag_dp[mi][ni]);
+                    frag_p[mi][ni].template hmul<elem_type>(frag_dp[mi][ni]);
                 }
             }
         } else {
-            __half2 dp_sum_half[Mma_tile_p::MMAS_M * 2];
+            uint32_t dp_sum_packed[Mma_tile_p::MMAS_M * 2];
             for (int mi = 0; mi < Mma_tile_p::MMAS_M * 2; mi++) {
-                dp_sum_half[mi] = __float2half2_rn(dp_sum[mi]);
+                dp_sum_packed[mi] = fmha::float2_pack<elem_type>(dp_sum[mi], dp_sum[mi]);
             }
-            const __half zero_h = __half(0.f);
             #pragma unroll
             for( int mi = 0; mi < Mma_tile_p::MMAS_M; mi++ ) {
                 #pragma unroll
                 for( int ni = 0; ni < Mma_tile_p::MMAS_N; ni++ ) {
                     #pragma unroll
                     for (int ii = 0; ii < 4; ++ii) {
-                        const __half2 p = frag_p[mi][ni].template elt_as<__half2>(ii);
-                        const __half2 pdp = __hmul2(p, frag_dp[mi][ni].template elt_as<__half2>(ii));
+                        const uint32_t p = frag_p[mi][ni].reg(ii);
+                        const uint32_t pdp = fmha::hmul2<elem_type>(p, frag_dp[mi][ni].reg(ii));
                         // If this element is dropped, then frag_p stores -p instead of p.
                         // So pd holds -p * dp_sum in that case.
-                        const __half2 pd = __hmul2(p, dp_sum_half[mi * 2 + (ii % 2)]);
-                        const __half low = __low2half(p) >= zero_h ? __low2half(pdp) : __low2half(pd);
-                        const __half high = __high2half(p) >= zero_h ? __high2half(pdp) : __high2half(pd);
-                        frag_p[mi][ni].template elt_as<__half2>(ii) = __halves2half2(low, high);
+                        const uint32_t pd = fmha::hmul2<elem_type>(p, dp_sum_packed[mi * 2 + (ii % 2)]);
+                        // Both fp16 and bf16 keep the sign in the top bit, so select on the sign of p.
+                        const uint32_t dropped = ((p >> 15) & 0x00010001u) * 0xffffu;
+                        frag_p[mi][ni].reg(ii) = (pd & dropped) | (pdp & ~dropped);
                     }
                 }
             }
@@ -484,13 +629,13 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
             // Trigger the load from shared memory for the next series of Q values.
             smem_kt.load(frag_kt[ki & 1], ki);
             // Do the math for the values already in registers.
-            fmha::gemm(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1) & 1]);
             // fmha::gemm(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1)]);
         }
         // Do the final stage of math.
         {
             int ki = Mma_tile_dq::MMAS_K;
-            fmha::gemm(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1) & 1]);
             // fmha::gemm(acc_dq, frag_p[ki - 1], frag_kt[(ki - 1)]);
         }
 
@@ -514,7 +659,7 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
             for( int ki = 0; ki < Mma_tile_dkv::MMAS_K; ki++ ) {
                 #pragma unroll
                 for( int mi = 0; mi < Mma_tile_dkv::MMAS_M; mi++ ) {
-                    frag_s[ki][mi].hrelu_();
+                    frag_s[ki][mi].template hrelu_<elem_type>();
                 }
             }
         }
@@ -524,18 +669,37 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
             // Trigger the load from shared memory for the next series of Q values.
             smem_dot.load(frag_dot[ki & 1], ki);
             // Do the math for the values already in registers.
-            fmha::gemm(acc_dv, frag_s[(ki - 1)], frag_dot[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dv, frag_s[(ki - 1)], frag_dot[(ki - 1) & 1]);
         }
 
         // Do the final stage of math.
         {
             int ki = Mma_tile_dkv::MMAS_K;
-            fmha::gemm(acc_dv, frag_s[(ki - 1)], frag_dot[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dv, frag_s[(ki - 1)], frag_dot[(ki - 1) & 1]);
+        }
+
+        // dV_i = P^T * dO_i for the extra values, reusing the same P as for dV.
+        #pragma unroll
+        for( int xi = 0; xi < NUM_V_X; ++xi ) {
+            Smem_tile_dot smem_dot_x = make_smem_tile<Smem_tile_dot>(
+                &smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_DO], tidx, l % 2, 0);
+            typename Smem_tile_dot::Fragment frag_dot_x[2][Mma_tile_dkv::MMAS_N];
+            smem_dot_x.load(frag_dot_x[0], 0);
+            #pragma unroll
+            for( int ki = 1; ki < Mma_tile_dkv::MMAS_K; ++ki ) {
+                smem_dot_x.load(frag_dot_x[ki & 1], ki);
+                fmha::gemm<elem_type>(acc_dv_x[xi], frag_s[(ki - 1)], frag_dot_x[(ki - 1) & 1]);
+            }
+            {
+                int ki = Mma_tile_dkv::MMAS_K;
+                fmha::gemm<elem_type>(acc_dv_x[xi], frag_s[(ki - 1)], frag_dot_x[(ki - 1) & 1]);
+            }
         }
 
         // __syncthreads();
         // Commit the values for Q and dO into shared memory.
         if(l < steps - 1) {
+            fmha::apply_rotary_fetch<elem_type>(gmem_q, params, binfo, /*use_seqlen_q=*/true);
             gmem_q.commit(gemm_q_k.smem_q);
         }
 
@@ -546,10 +710,17 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
         // Commit the values for Q and dO into shared memory.
         if(l < steps - 1) {
             gmem_do.commit(smem_do);
+            #pragma unroll
+            for( int xi = 0; xi < NUM_V_X; ++xi ) {
+                Smem_tile_do smem_do_x = make_smem_tile<Smem_tile_do>(
+                    &smem_[SMEM_OFFSET_X + xi * SMEM_STRIDE_X + SMEM_OFFSET_X_DO], tidx, 0, (l + 1) % 2);
+                smem_do_x.store(fetch_do_x[xi]);
+            }
             if (Is_first) {
                 // dot_do_o(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, smem_dp_sum);
                 // smem_dp_sum.move_to_next_write_buffer();
-                dot_do_o(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, smem_dp_sum, (l + 1) % 2);
+                dot_do_o<NUM_V_X, elem_type>(dp_sum_regs, gmem_do.fetch_, gmem_o.fetch_, fetch_do_x, fetch_o_x,
+                                  smem_dp_sum, (l + 1) % 2);
                 const int dp_sum_row_1 = tidx / Smem_dp_sum::THREADS_PER_ROW;
                 if ((dp_sum_row_1 < Smem_dp_sum::ROWS) && (tidx % Smem_dp_sum::THREADS_PER_ROW == 0)) {
                     gmem_softmax_d.store_row(reinterpret_cast<uint32_t(&)[Gmem_tile_do::LDGS]>(dp_sum_regs), dp_sum_row_1);
@@ -579,13 +750,13 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
             // Trigger the load from shared memory for the next series of Q values.
             smem_qt.load(frag_qt[ki & 1], ki);
             // Do the math for the values already in registers.
-            fmha::gemm(acc_dk, frag_dpt[(ki - 1)], frag_qt[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dk, frag_dpt[(ki - 1)], frag_qt[(ki - 1) & 1]);
         }
 
         // Do the final stage of math.
         {
             int ki = Mma_tile_dkv::MMAS_K;
-            fmha::gemm(acc_dk, frag_dpt[(ki - 1)], frag_qt[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_dk, frag_dpt[(ki - 1)], frag_qt[(ki - 1) & 1]);
         }
 
         // Make sure dQ is in shared memory.
@@ -596,15 +767,20 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
 
         const bool is_final_write =
             Is_last
-            || ((loop_step_idx + 1) * Cta_tile_p::N >= binfo.actual_seqlen)
-            || ((Is_causal) && ((begin + l) * Cta_tile_p::M < (loop_step_idx + 1) * Cta_tile_p::N));
+            || ((loop_step_idx + 1) * Cta_tile_p::N >= binfo.actual_seqlen_k)
+            || ((Is_causal) && (loop_step_idx + 1 >= fmha::band_kv_end<Cta_tile_p>(binfo, begin + l)));
         if (is_final_write) {
             // if (Is_dropout) {
             //     dq_out[0] = fmha::fmul4(dq_out[0], params.rp_dropout);
             // }
             dq_out[0] = fmha::fmul4(dq_out[0], params.scale_bmm1f);
+            if (params.rotary_cos_ptr != nullptr) {
+                gmem_dq.template apply_rotary</*CONJ=*/true>(
+                    dq_out, 0, reinterpret_cast<const float *>(params.rotary_cos_ptr),
+                    reinterpret_cast<const float *>(params.rotary_sin_ptr), params.rotary_dim);
+            }
             // Output the values.
-            gmem_dq.store(dq_out, 0);
+            gmem_dq.template store<elem_type>(dq_out, 0);
             // Move to the next part of the output.
             gmem_dq.move();
         } else  {
@@ -635,6 +811,10 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
         for( int mi = 0; mi < Mma_tile_dkv::MMAS_M; mi++ ) {
             for( int ni = 0; ni < Mma_tile_dkv::MMAS_N; ni++ ) {
                 acc_dv[mi][ni].mul_(params.rp_dropout);
+                #pragma unroll
+                for( int xi = 0; xi < NUM_V_X; ++xi ) {
+                    acc_dv_x[xi][mi][ni].mul_(params.rp_dropout);
+                }
             }
         }
     }
@@ -656,20 +836,17 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
     // the total amount of shared mem?
     // Epilogue swizzle for dV
     Smem_tile_dv smem_dv(&smem_[0], tidx);
-    smem_dv.store(acc_dv);
+    smem_dv.template store<elem_type>(acc_dv);
 
     // Epilogue swizzle for dK
     Smem_tile_dk smem_dk(&smem_[Smem_tile_dv::BYTES_PER_TILE], tidx);
-    smem_dk.store(acc_dk);
+    smem_dk.template store<elem_type>(acc_dk);
 
     __syncthreads();
     uint4 dv_out[Smem_tile_dv::NUM_LDS];
     smem_dv.load(dv_out);
-    Qkv_params dv_params;
-    dv_params.qkv_ptr = params.dqkv_ptr;
-    dv_params.qkv_stride_in_bytes = params.qkv_stride_in_bytes;
-    dv_params.h = params.h;
-    Gmem_tile_dv gmem_dv(dv_params, 2, binfo, tidx);
+    Gmem_tile_dv gmem_dv(params.dqkv_ptrs[2], params.dqkv_row_stride_in_elts[2],
+                          params.dqkv_head_stride_in_elts[2], binfo, tidx, /*use_seqlen_q=*/false, params.d);
     if (!Is_first) {
         gmem_dv.move(loop_step_idx);
     }
@@ -680,20 +857,39 @@ inline __device__ void compute_dq_dk_dv_1xN_one_iter(const Params &params, Prng
     // for (int ii = 0; ii < Smem_tile_dk::NUM_LDS; ++ii) {
     //     dk_out[ii] = fmha::fmul4(dk_out[ii], params.scale_bmm1f);
     // }
-    Qkv_params dk_params;
-    dk_params.qkv_ptr = params.dqkv_ptr;
-    dk_params.qkv_stride_in_bytes = params.qkv_stride_in_bytes;
-    dk_params.h = params.h;
-    Gmem_tile_dk gmem_dk(dk_params, 1, binfo, tidx);
+    Gmem_tile_dk gmem_dk(params.dqkv_ptrs[1], params.dqkv_row_stride_in_elts[1],
+                          params.dqkv_head_stride_in_elts[1], binfo, tidx, /*use_seqlen_q=*/false, params.d);
     if (!Is_first) {
         gmem_dk.move(loop_step_idx);
     }
+    if (params.rotary_cos_ptr != nullptr) {
+        gmem_dk.template apply_rotary<elem_type, /*CONJ=*/true>(
+            dk_out, reinterpret_cast<const float *>(params.rotary_cos_ptr),
+            reinterpret_cast<const float *>(params.rotary_sin_ptr), params.rotary_dim, binfo.actual_seqlen_k);
+    }
     gmem_dk.store(dk_out);
+
+    // Epilogue for the extra dV_i, one after the other through the shared memory of dV.
+    #pragma unroll
+    for( int xi = 0; xi < NUM_V_X; ++xi ) {
+        // Make sure all threads are done reading the previous dV from shared memory.
+        __syncthreads();
+        smem_dv.template store<elem_type>(acc_dv_x[xi]);
+        __syncthreads();
+        uint4 dv_x_out[Smem_tile_dv::NUM_LDS];
+        smem_dv.load(dv_x_out);
+        Gmem_tile_dv gmem_dv_x(params.dqkv_ptrs[3 + xi], params.dqkv_row_stride_in_elts[3 + xi],
+                               params.dqkv_head_stride_in_elts[3 + xi], binfo, tidx, /*use_seqlen_q=*/false, params.d);
+        if (!Is_first) {
+            gmem_dv_x.move(loop_step_idx);
+        }
+        gmem_dv_x.store(dv_x_out);
+    }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-// loop_steps = -1 means the number of steps will be params.s / Kernel_traits::Cta_tile_p::N.
+// loop_steps = -1 means the number of steps will be params.seqlen_k / Kernel_traits::Cta_tile_p::N.
 // This template parameter is there so we can specialize with loop_steps == 1 and loop_steps == 2.
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, int loop_steps=-1, typename Params>
 inline __device__ void compute_dq_dk_dv_1xN(const Params &params) {
@@ -716,10 +912,10 @@ inline __device__ void compute_dq_dk_dv_1xN(const Params &params) {
         compute_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, true, false>(params, ph, 0);
         compute_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, false, true>(params, ph, 1);
     } else {
-        if (params.s == N_per_loop) {
+        if (params.seqlen_k == N_per_loop) {
             compute_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, true, true>(params, ph, 0);
         } else {
-            const int max_loop_steps = (params.s + N_per_loop - 1) / N_per_loop;
+            const int max_loop_steps = (params.seqlen_k + N_per_loop - 1) / N_per_loop;
             compute_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, true, false>(params, ph, 0);
             for (int loop_step_idx = 1; loop_step_idx < max_loop_steps - 1; loop_step_idx++) {
                 compute_dq_dk_dv_1xN_one_iter<Kernel_traits, Is_dropout, Is_causal, false, false>(params, ph, loop_step_idx);
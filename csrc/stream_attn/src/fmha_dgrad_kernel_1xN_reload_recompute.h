@@ -124,12 +124,12 @@ inline __device__ void compute_dp_dq_1xN(const Params &params) {
     Smem_tile_kt smem_kt(&smem_[Smem_tile_do::BYTES_PER_TILE + Smem_tile_o::BYTES_PER_TILE + Gemm1::Smem_tile_q::BYTES_PER_TILE], tidx);
 
     // Allocate the global memory tile loader for dO.
-    Gmem_tile_do gmem_do(params.do_ptr, params, binfo, tidx);
+    Gmem_tile_do gmem_do(params.do_ptrs[0], params, binfo, tidx);
     // Allocate the shared memory tile loader for dO.
     Smem_tile_do smem_do(&smem_[0], tidx);
 
     // Allocate the global memory tile loader for O.
-    Gmem_tile_o gmem_o(params.o_ptr, params, binfo, tidx);
+    Gmem_tile_o gmem_o(params.o_ptrs[0], params, binfo, tidx);
     // Allocate the shared memory tile loader for O.
     Smem_tile_o smem_o(&smem_[Smem_tile_do::BYTES_PER_TILE], tidx);
 
@@ -212,8 +212,8 @@ inline __device__ void compute_dp_dq_1xN(const Params &params) {
     // Softmax softmax(params, &smem_[Smem_tile_do::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_O + Smem_tile_dq::BYTES_PER_TILE], bidb, tidx);
     Softmax softmax(params, smem_, tidx);
     // Softmax softmax_dp(params, &smem_[Smem_tile_do::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_O + Smem_tile_dq::BYTES_PER_TILE], bidb, tidx);
-    Gmem_softmax_sum gmem_softmax_sum(params.softmax_lse_ptr, params, tidx);
-    Gmem_softmax_sum gmem_softmax_d(params.dsoftmax_sum, params, tidx);
+    Gmem_softmax_sum gmem_softmax_sum(params.softmax_lse_ptr, params, binfo, tidx);
+    Gmem_softmax_sum gmem_softmax_d(params.dsoftmax_sum, params, binfo, tidx);
 
     constexpr int STEPS = Cta_tile_p::N / Cta_tile_p::M;
     // Load over the entire sequence length.
@@ -535,7 +535,7 @@ inline __device__ void compute_dv_dk_1xN(const Params &params) {
     Smem_tile_qt smem_qt(&smem_[Smem_tile_v::BYTES_PER_TILE + Gemm1::Smem_tile_q::BYTES_PER_TILE], tidx);
 
     // Allocate the global memory tile loader for dO.
-    Gmem_tile_do gmem_do(params.do_ptr, params, binfo, tidx);
+    Gmem_tile_do gmem_do(params.do_ptrs[0], params, binfo, tidx);
     // The base pointer of smem_do;
     char *smem_do_ = &smem_[Smem_tile_v::BYTES_PER_TILE + Gemm1::SMEM_OFFSET_V];
     // Allocate the shared memory tile loader for V. We use the same as K so be careful!!!
@@ -617,8 +617,8 @@ inline __device__ void compute_dv_dk_1xN(const Params &params) {
     // We won't be using the shared memory for either of the softmax at all
     Softmax softmax(params, smem_, tidx);
     Softmax softmax_dp(params, smem_, tidx);
-    Gmem_softmax_sum gmem_softmax_sum(params.softmax_lse_ptr, params, tidx);
-    Gmem_softmax_sum gmem_softmax_d(params.dsoftmax_sum, params, tidx);
+    Gmem_softmax_sum gmem_softmax_sum(params.softmax_lse_ptr, params, binfo, tidx);
+    Gmem_softmax_sum gmem_softmax_d(params.dsoftmax_sum, params, binfo, tidx);
 
     int warp = tidx / Cta_tile_p::THREADS_PER_WARP;
     int lane = tidx % Cta_tile_p::THREADS_PER_WARP;
@@ -26,32 +26,73 @@
  ******************************************************************************/
 
 #include "fmha.h"
+#include "fmha_autotune.h"
 #include "fmha_fprop_kernel_1xN.h"
+#include "fmha_nvtx.h"
 
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Return_softmax>
 __global__ void fmha_fprop_fp16_sm80_loop_kernel(Fused_multihead_attention_fprop_params params) {
     fmha::device_1xN_loop<Kernel_traits, Is_dropout, Is_causal, Return_softmax>(params);
 }
 
+template<typename Kernel_traits, bool Is_dropout, bool Is_causal>
+__global__ void fmha_fprop_fp16_sm80_persistent_kernel(Fused_multihead_attention_fprop_params params) {
+    fmha::device_1xN_persistent<Kernel_traits, Is_dropout, Is_causal>(params);
+}
+
+template<typename Kernel_traits, bool Is_causal>
+__global__ void fmha_fprop_fp16_sm80_grouped_kernel(Fused_multihead_attention_grouped_params group) {
+    fmha::device_1xN_grouped<Kernel_traits, Is_causal>(group);
+}
+
+template<typename Kernel_traits>
+int get_fprop_smem_size(const Fused_multihead_attention_fprop_params &params) {
+    constexpr int N = Kernel_traits::Cta_tile_p::N;
+    const int loop_steps = (params.seqlen_k + N - 1) / N;
+    constexpr int smem_size_softmax_lse = Kernel_traits::Smem_dp_sum::BYTES_PER_TILE;
+    // Don't need smem_size_softmax_lse if we're not looping
+    return fmha::get_dynamic_smem_size<Kernel_traits>() + (loop_steps > 1 ? smem_size_softmax_lse : 0);
+}
+
+// About one CTA per SM takes the items of the work queue, see device_1xN_persistent.
+template<typename Kernel_traits>
+void run_fmha_fp16_sm80_persistent_(Launch_params<Fused_multihead_attention_fprop_params> &launch_params) {
+    auto kernel = DROPOUT_SWITCH(launch_params.is_dropout, Is_dropout, [&] {
+        return BOOL_SWITCH(launch_params.params.is_causal, Is_causal, [&] {
+            return &fmha_fprop_fp16_sm80_persistent_kernel<Kernel_traits, Is_dropout, Is_causal>;
+        });
+    });
+    const int smem_size = get_fprop_smem_size<Kernel_traits>(launch_params.params);
+    fmha::check_smem_size("fprop", smem_size);
+    if( smem_size >= 48 * 1024 ) {
+        FMHA_CHECK_CUDA(cudaFuncSetAttribute(kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size));
+    }
+    int ctas_per_sm;
+    FMHA_CHECK_CUDA(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+        &ctas_per_sm, kernel, Kernel_traits::THREADS, smem_size));
+    launch_params.num_splits = 1;
+    run_fmha_build_work_queue(launch_params.params, Kernel_traits::Cta_tile_p::M, launch_params.stream);
+    dim3 grid(launch_params.props->multiProcessorCount * std::max(ctas_per_sm, 1));
+    kernel<<<grid, Kernel_traits::THREADS, smem_size, launch_params.stream>>>(
+        launch_params.params);
+    FMHA_CHECK_CUDA(cudaPeekAtLastError());
+}
+
 template<typename Kernel_traits>
 void run_fmha_fp16_sm80_loop_(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
                             const bool configure) {
-    bool is_causal = launch_params.params.is_causal;
-    // TD [2022-04-27]: This case work is pretty ugly, maybe there's a better way?
-    auto kernel = launch_params.is_dropout
-        ? (is_causal
-           ? (launch_params.return_softmax ? &fmha_fprop_fp16_sm80_loop_kernel<Kernel_traits, true, true, true> : &fmha_fprop_fp16_sm80_loop_kernel<Kernel_traits, true, true, false>)
-           : (launch_params.return_softmax ? &fmha_fprop_fp16_sm80_loop_kernel<Kernel_traits, true, false, true> : &fmha_fprop_fp16_sm80_loop_kernel<Kernel_traits, true, false, false>))
-        : (is_causal
-           ? (launch_params.return_softmax ? &fmha_fprop_fp16_sm80_loop_kernel<Kernel_traits, false, true, true> : &fmha_fprop_fp16_sm80_loop_kernel<Kernel_traits, false, true, false>)
-           : (launch_params.return_softmax ? &fmha_fprop_fp16_sm80_loop_kernel<Kernel_traits, false, false, true> : &fmha_fprop_fp16_sm80_loop_kernel<Kernel_traits, false, false, false>));
+    auto kernel = DROPOUT_SWITCH(launch_params.is_dropout, Is_dropout, [&] {
+        return BOOL_SWITCH(launch_params.params.is_causal, Is_causal, [&] {
+            return RETURN_SOFTMAX_SWITCH(launch_params.return_softmax, Return_softmax, [&] {
+                return &fmha_fprop_fp16_sm80_loop_kernel<Kernel_traits, Is_dropout, Is_causal, Return_softmax>;
+            });
+        });
+    });
 
     constexpr int N = Kernel_traits::Cta_tile_p::N;
-    const int loop_steps = (launch_params.params.s + N - 1) / N;
-    constexpr int smem_size_softmax_lse = Kernel_traits::Smem_dp_sum::BYTES_PER_TILE;
-    // Don't need smem_size_softmax_lse if we're not looping
-    const int smem_size = fmha::get_dynamic_smem_size<Kernel_traits>()
-        + (loop_steps > 1 ? smem_size_softmax_lse : 0);
+    const int loop_steps = (launch_params.params.seqlen_k + N - 1) / N;
+    const int smem_size = get_fprop_smem_size<Kernel_traits>(launch_params.params);
+    fmha::check_smem_size("fprop", smem_size);
 
     if( smem_size >= 48 * 1024 ) {
         FMHA_CHECK_CUDA(cudaFuncSetAttribute(kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size));
@@ -60,7 +101,7 @@ void run_fmha_fp16_sm80_loop_(Launch_params<Fused_multihead_attention_fprop_para
     if (configure) {
         using Mma_tile_p = fmha::Hmma_tile<typename Kernel_traits::Cta_tile_p>;
         constexpr int M = Kernel_traits::Cta_tile_p::M;
-        size_t STEPS = (launch_params.params.s + M - 1) / M;
+        size_t STEPS = (launch_params.params.seqlen_q + M - 1) / M;
         constexpr size_t MMAS_M = Mma_tile_p::MMAS_M;
         constexpr size_t MMAS_N = Mma_tile_p::MMAS_N;
         size_t elts_per_head = STEPS * MMAS_M * MMAS_N * 8 * loop_steps;
@@ -68,54 +109,151 @@ void run_fmha_fp16_sm80_loop_(Launch_params<Fused_multihead_attention_fprop_para
         return;
     }
 
-    dim3 grid(launch_params.params.h, launch_params.params.b);
+    const bool multi_block = launch_params.params.seqlen_k > Kernel_traits::Cta_tile_p::N;
+    // device_1xN_kv_inner_ runs the multiple K/V blocks and the softmax stats, see device_1xN_loop_.
+    const bool kv_inner = !launch_params.return_softmax
+        && (multi_block || launch_params.params.softmax_stats_ptr != nullptr);
+    const bool persistent = launch_params.params.queue_counter != nullptr && kv_inner;
+
+    // e.g. "fprop n256_w4_async_kv d64 kv_inner s1024" in the traces, s is the bucket of seqlen_k
+    // used by the autotuner.
+#if FMHA_BUILD_NVTX
+    static const std::string traits_name = "fprop " + fmha::autotune_config_name<Kernel_traits>()
+        + " d" + std::to_string(Kernel_traits::Cta_tile_p::K);
+    const Fmha_nvtx_range nvtx_range(
+        traits_name + (persistent ? " persistent" : (kv_inner ? " kv_inner" : (multi_block ? " loop" : " single")))
+        + " s" + std::to_string(fmha_seqlen_bucket(launch_params.params.seqlen_k)));
+#endif
+
+    // fmha_api.cpp allocates the work queue for the variable-length batches.
+    if (persistent) {
+        run_fmha_fp16_sm80_persistent_<Kernel_traits>(launch_params);
+        return;
+    }
+
+    // Split the query blocks of each (batch, head) over several CTAs if b * h CTAs don't fill the
+    // GPU. The returned softmax assumes one CTA per (batch, head), and so does the dropout mask
+    // unless the sequence takes several K/V blocks (see device_1xN_loop).
+    launch_params.num_splits = 1;
+    if (!launch_params.return_softmax && (!launch_params.is_dropout || kv_inner)) {
+        int ctas_per_sm;
+        FMHA_CHECK_CUDA(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+            &ctas_per_sm, kernel, Kernel_traits::THREADS, smem_size));
+        constexpr int M = Kernel_traits::Cta_tile_p::M;
+        launch_params.num_splits = fmha::num_splits_heuristic(
+            launch_params.params.b * launch_params.params.h, launch_params.props->multiProcessorCount,
+            std::max(ctas_per_sm, 1), launch_params.params.seqlen_q / M);
+    }
+
+    dim3 grid(launch_params.params.h, launch_params.params.b, launch_params.num_splits);
     kernel<<<grid, Kernel_traits::THREADS, smem_size, launch_params.stream>>>(
         launch_params.params);
 
     FMHA_CHECK_CUDA(cudaPeekAtLastError());
 }
 
-void run_fmha_fp16_sm80(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
-                        const bool configure) {
-    if (launch_params.params.d == 16) {
-        if( launch_params.params.s == 128 ) {
-            using Kernel_traits = FMHA_kernel_traits<128, 16, 16, 1, 4, 0x08u>;
-            run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
-        } else if( launch_params.params.s == 256 ) {
-            using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 4, 0x08u>;
-            run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+// Runs Kernel_traits, or one of Alt_traits if the autotuner picked it (see fmha_autotune.h). They
+// all have the same N and number of warps, so elts_per_thread and the dropout masks don't depend on
+// the choice and the backward pass doesn't need to know it.
+template<typename Kernel_traits, typename... Alt_traits>
+void run_fmha_fp16_sm80_tuned_(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
+                               const bool configure) {
+    static_assert(((Alt_traits::Cta_tile_p::N == Kernel_traits::Cta_tile_p::N
+                    && Alt_traits::THREADS == Kernel_traits::THREADS) && ...));
+#if !FMHA_BUILD_AUTOTUNE
+    run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+#else
+    if (configure) {
+        run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+        return;
+    }
+    using Launcher = void (*)(Launch_params<Fused_multihead_attention_fprop_params> &, const bool);
+    const std::vector<Launcher> launchers = {&run_fmha_fp16_sm80_loop_<Kernel_traits>,
+                                             &run_fmha_fp16_sm80_loop_<Alt_traits>...};
+    const auto &params = launch_params.params;
+    const std::vector<fmha::Autotune_config> configs = {
+        {fmha::autotune_config_name<Kernel_traits>(), size_t(get_fprop_smem_size<Kernel_traits>(params))},
+        {fmha::autotune_config_name<Alt_traits>(), size_t(get_fprop_smem_size<Alt_traits>(params))}...};
+    const int ci = fmha::autotune_select(
+        fmha::autotune_key("fprop", params), configs,
+        [&](const int i) { launchers[i](launch_params, /*configure=*/false); }, launch_params.stream);
+    launchers[ci](launch_params, /*configure=*/false);
+#endif
+}
+
+// When looping over several K/V blocks, the next block of K and the V_i is copied to shared
+// memory with LDGSTS while the current one is computed (0x200u). The autotuner can also pick K and
+// V in separate buffers (0x00u) for a single block, or the synchronous loads (0x08u) for the loop.
+template<typename elem_type, int NUM_V, typename index_t>
+void run_fmha_fp16_sm80_(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
+                         const bool configure) {
+    const int d = fmha_round_head_dim(launch_params.params.d);
+#if FMHA_BUILD_HDIM_16
+    if (d == 16) {
+        if( launch_params.params.seqlen_k == 128 ) {
+            using Kernel_traits = FMHA_kernel_traits<128, 16, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<128, 16, 16, 1, 4, 0x00u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
+        } else if( launch_params.params.seqlen_k == 256 ) {
+            using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 16, 16, 1, 4, 0x00u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
         } else {
             // TD [2022-05-15] 512 gives wrong results rn
             // using Kernel_traits = FMHA_kernel_traits<512, 16, 16, 1, 4, 0x08u>;
-            using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 4, 0x08u>;
-            run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+            using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 4, 0x200u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 16, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
+        }
+    }
+#endif
+#if FMHA_BUILD_HDIM_32
+    if (d == 32) {
+        if( launch_params.params.seqlen_k == 128 ) {
+            using Kernel_traits = FMHA_kernel_traits<128, 32, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<128, 32, 16, 1, 4, 0x00u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
+        } else if( launch_params.params.seqlen_k == 256 ) {
+            using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 32, 16, 1, 4, 0x00u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
+        } else {
+            using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 4, 0x200u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 32, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
         }
-    } else if (launch_params.params.d == 32) {
-        if( launch_params.params.s == 128 ) {
-            using Kernel_traits = FMHA_kernel_traits<128, 32, 16, 1, 4, 0x08u>;
-            run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
-        } else if( launch_params.params.s == 256 ) {
-            using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 4, 0x08u>;
-            run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_64
+    if (d == 64) {
+        if( launch_params.params.seqlen_k == 128 ) {
+            using Kernel_traits = FMHA_kernel_traits<128, 64, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<128, 64, 16, 1, 4, 0x00u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
+        } else if( launch_params.params.seqlen_k == 256 ) {
+            using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x00u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
         } else {
-            using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 4, 0x08u>;
-            run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+            using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x200u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
         }
-    } else if (launch_params.params.d == 64) {
-        if( launch_params.params.s == 128 ) {
-            using Kernel_traits = FMHA_kernel_traits<128, 64, 16, 1, 4, 0x08u>;
-            run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
-        } else if( launch_params.params.s == 256 ) {
-            using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x08u>;
-            run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_128
+    if (d == 128) {
+        if( launch_params.params.seqlen_k == 128 ) {
+            using Kernel_traits = FMHA_kernel_traits<128, 128, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<128, 128, 16, 1, 4, 0x00u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
         } else {
-            using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x08u>;
-            run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+            using Kernel_traits = FMHA_kernel_traits<128, 128, 16, 1, 4, 0x200u, NUM_V, elem_type, index_t>;
+            using Alt_traits = FMHA_kernel_traits<128, 128, 16, 1, 4, 0x08u, NUM_V, elem_type, index_t>;
+            run_fmha_fp16_sm80_tuned_<Kernel_traits, Alt_traits>(launch_params, configure);
         }
-    } else if (launch_params.params.d == 128) {
-        using Kernel_traits = FMHA_kernel_traits<128, 128, 16, 1, 4, 0x08u>;
-        run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
     }
+#endif
     // if (launch_params.params.d == 64) {
         // using Kernel_traits = FMHA_kernel_traits<128, 64, 16, 1, 4, 0x08u>;
         // using Kernel_traits = FMHA_kernel_traits<64, 64, 16, 1, 4, 0x08u>;
@@ -123,4 +261,212 @@ void run_fmha_fp16_sm80(Launch_params<Fused_multihead_attention_fprop_params> &l
         // using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x08u>;
         // run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
     // }
-}
\ No newline at end of file
+}
+// More than two values don't fit in registers, so the V_i stay in shared memory (0x100u) and
+// N=128 is used as the base. The backward pass uses the same N so that the dropout masks match.
+template<typename elem_type, int NUM_V, typename index_t>
+void run_fmha_fp16_sm80_nv_(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
+                            const bool configure) {
+    static_assert(NUM_V > 2);
+    const int d = fmha_round_head_dim(launch_params.params.d);
+#if FMHA_BUILD_HDIM_16
+    if (d == 16) {
+        using Kernel_traits = FMHA_kernel_traits<128, 16, 16, 1, 4, 0x100u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_32
+    if (d == 32) {
+        using Kernel_traits = FMHA_kernel_traits<128, 32, 16, 1, 4, 0x100u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_64
+    if (d == 64) {
+        using Kernel_traits = FMHA_kernel_traits<128, 64, 16, 1, 4, 0x100u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_loop_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+}
+
+template<typename elem_type, typename index_t>
+void run_fmha_fp16_sm80_num_v_(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
+                               const bool configure) {
+    switch (launch_params.params.num_v) {
+#if FMHA_BUILD_NUM_V_1
+        case 1: run_fmha_fp16_sm80_<elem_type, 1, index_t>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_2
+        case 2: run_fmha_fp16_sm80_<elem_type, 2, index_t>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_3
+        case 3: run_fmha_fp16_sm80_nv_<elem_type, 3, index_t>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_4
+        case 4: run_fmha_fp16_sm80_nv_<elem_type, 4, index_t>(launch_params, configure); break;
+#endif
+    }
+}
+
+void run_fmha_fp16_sm80(Launch_params<Fused_multihead_attention_fprop_params> &launch_params,
+                        const bool configure) {
+    // The 64-bit offsets cost registers, so they are only used when some tensor is larger than 2GB.
+    if (launch_params.params.is_64bit_index) {
+#if FMHA_BUILD_64BIT_INDEX
+        if (launch_params.params.is_bf16) {
+#if FMHA_BUILD_BF16
+            run_fmha_fp16_sm80_num_v_<__nv_bfloat16, uint64_t>(launch_params, configure);
+#endif
+        } else {
+            run_fmha_fp16_sm80_num_v_<__half, uint64_t>(launch_params, configure);
+        }
+#endif
+    } else {
+        if (launch_params.params.is_bf16) {
+#if FMHA_BUILD_BF16
+            run_fmha_fp16_sm80_num_v_<__nv_bfloat16, uint32_t>(launch_params, configure);
+#endif
+        } else {
+            run_fmha_fp16_sm80_num_v_<__half, uint32_t>(launch_params, configure);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The configure pass only sets the shared memory and gets the occupancy, fmha_api.cpp then splits
+// the problems over the CTAs, see mha_fwd_grouped.
+template<typename Kernel_traits>
+void run_fmha_fp16_sm80_grouped_(Launch_params<Fused_multihead_attention_grouped_params> &launch_params,
+                                 const bool configure) {
+    auto kernel = BOOL_SWITCH(launch_params.params.is_causal, Is_causal, [&] {
+        return &fmha_fprop_fp16_sm80_grouped_kernel<Kernel_traits, Is_causal>;
+    });
+    // As get_fprop_smem_size with several K/V blocks, for the longest problem.
+    constexpr int N = Kernel_traits::Cta_tile_p::N;
+    const int smem_size = fmha::get_dynamic_smem_size<Kernel_traits>()
+        + (launch_params.params.seqlen_k > N ? Kernel_traits::Smem_dp_sum::BYTES_PER_TILE : 0);
+    fmha::check_smem_size("grouped fprop", smem_size);
+
+    if( smem_size >= 48 * 1024 ) {
+        FMHA_CHECK_CUDA(cudaFuncSetAttribute(kernel, cudaFuncAttributeMaxDynamicSharedMemorySize, smem_size));
+    }
+
+    if (configure) {
+        int ctas_per_sm;
+        FMHA_CHECK_CUDA(cudaOccupancyMaxActiveBlocksPerMultiprocessor(
+            &ctas_per_sm, kernel, Kernel_traits::THREADS, smem_size));
+        launch_params.params.ctas_per_sm = std::max(ctas_per_sm, 1);
+        return;
+    }
+
+#if FMHA_BUILD_NVTX
+    static const std::string traits_name = "fprop grouped " + fmha::autotune_config_name<Kernel_traits>()
+        + " d" + std::to_string(Kernel_traits::Cta_tile_p::K);
+    const Fmha_nvtx_range nvtx_range(traits_name + " g" + std::to_string(launch_params.params.num_problems));
+#endif
+
+    kernel<<<launch_params.params.num_ctas, Kernel_traits::THREADS, smem_size, launch_params.stream>>>(
+        launch_params.params);
+    FMHA_CHECK_CUDA(cudaPeekAtLastError());
+}
+
+// The problems can have any seqlen_k, so they use the traits of run_fmha_fp16_sm80_ for several K/V
+// blocks. No autotuning, the default config is run.
+template<typename elem_type, int NUM_V, typename index_t>
+void run_fmha_fp16_sm80_grouped_d_(Launch_params<Fused_multihead_attention_grouped_params> &launch_params,
+                                   const bool configure) {
+    const int d = fmha_round_head_dim(launch_params.params.d);
+#if FMHA_BUILD_HDIM_16
+    if (d == 16) {
+        using Kernel_traits = FMHA_kernel_traits<256, 16, 16, 1, 4, 0x200u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_grouped_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_32
+    if (d == 32) {
+        using Kernel_traits = FMHA_kernel_traits<256, 32, 16, 1, 4, 0x200u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_grouped_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_64
+    if (d == 64) {
+        using Kernel_traits = FMHA_kernel_traits<256, 64, 16, 1, 4, 0x200u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_grouped_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_128
+    if (d == 128) {
+        using Kernel_traits = FMHA_kernel_traits<128, 128, 16, 1, 4, 0x200u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_grouped_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+}
+
+// The traits of run_fmha_fp16_sm80_nv_.
+template<typename elem_type, int NUM_V, typename index_t>
+void run_fmha_fp16_sm80_grouped_nv_(Launch_params<Fused_multihead_attention_grouped_params> &launch_params,
+                                    const bool configure) {
+    static_assert(NUM_V > 2);
+    const int d = fmha_round_head_dim(launch_params.params.d);
+#if FMHA_BUILD_HDIM_16
+    if (d == 16) {
+        using Kernel_traits = FMHA_kernel_traits<128, 16, 16, 1, 4, 0x100u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_grouped_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_32
+    if (d == 32) {
+        using Kernel_traits = FMHA_kernel_traits<128, 32, 16, 1, 4, 0x100u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_grouped_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+#if FMHA_BUILD_HDIM_64
+    if (d == 64) {
+        using Kernel_traits = FMHA_kernel_traits<128, 64, 16, 1, 4, 0x100u, NUM_V, elem_type, index_t>;
+        run_fmha_fp16_sm80_grouped_<Kernel_traits>(launch_params, configure);
+    }
+#endif
+}
+
+template<typename elem_type, typename index_t>
+void run_fmha_fp16_sm80_grouped_num_v_(Launch_params<Fused_multihead_attention_grouped_params> &launch_params,
+                                       const bool configure) {
+    switch (launch_params.params.num_v) {
+#if FMHA_BUILD_NUM_V_1
+        case 1: run_fmha_fp16_sm80_grouped_d_<elem_type, 1, index_t>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_2
+        case 2: run_fmha_fp16_sm80_grouped_d_<elem_type, 2, index_t>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_3
+        case 3: run_fmha_fp16_sm80_grouped_nv_<elem_type, 3, index_t>(launch_params, configure); break;
+#endif
+#if FMHA_BUILD_NUM_V_4
+        case 4: run_fmha_fp16_sm80_grouped_nv_<elem_type, 4, index_t>(launch_params, configure); break;
+#endif
+    }
+}
+
+void run_fmha_fp16_sm80_grouped(Launch_params<Fused_multihead_attention_grouped_params> &launch_params,
+                                const bool configure) {
+    if (launch_params.params.is_64bit_index) {
+#if FMHA_BUILD_64BIT_INDEX
+        if (launch_params.params.is_bf16) {
+#if FMHA_BUILD_BF16
+            run_fmha_fp16_sm80_grouped_num_v_<__nv_bfloat16, uint64_t>(launch_params, configure);
+#endif
+        } else {
+            run_fmha_fp16_sm80_grouped_num_v_<__half, uint64_t>(launch_params, configure);
+        }
+#endif
+    } else {
+        if (launch_params.params.is_bf16) {
+#if FMHA_BUILD_BF16
+            run_fmha_fp16_sm80_grouped_num_v_<__nv_bfloat16, uint32_t>(launch_params, configure);
+#endif
+        } else {
+            run_fmha_fp16_sm80_grouped_num_v_<__half, uint32_t>(launch_params, configure);
+        }
+    }
+}
@@ -39,6 +39,7 @@ namespace fmha {
 
 template<typename Kernel_traits>
 struct Gemm_Q_K_base {
+    using elem_type = typename Kernel_traits::elem_type;
     using Smem_tile_o = typename Kernel_traits::Smem_tile_o;
     using Smem_tile_q = typename Kernel_traits::Smem_tile_q;
     using Smem_tile_k = typename Kernel_traits::Smem_tile_k;
@@ -76,6 +77,7 @@ template<typename Kernel_traits, bool K_in_regs>
 struct Gemm_Q_K : public Gemm_Q_K_base<Kernel_traits> {
 
     using Base = Gemm_Q_K_base<Kernel_traits>;
+    using elem_type = typename Base::elem_type;
     using Smem_tile_o = typename Base::Smem_tile_o;
     using Smem_tile_q = typename Base::Smem_tile_q;
     using Smem_tile_k = typename Base::Smem_tile_k;
@@ -83,33 +85,44 @@ struct Gemm_Q_K : public Gemm_Q_K_base<Kernel_traits> {
     using Mma_tile_p = typename Base::Mma_tile_p;
 
     static constexpr bool SHARE_SMEM_FOR_K_AND_V = Kernel_traits::SHARE_SMEM_FOR_K_AND_V;
+    static constexpr bool V_IN_REGS = Kernel_traits::V_IN_REGS;
     // If V is stored in shared memory, we can't load K using the same shared memory.
-    static_assert(Kernel_traits::V_IN_REGS);
-
-    static constexpr int SMEM_OFFSET_O = Smem_tile_q::BYTES_PER_TILE;
-    // static constexpr int SMEM_OFFSET_SOFTMAX = SMEM_OFFSET_O + Smem_tile_o::BYTES_PER_TILE;
-    static constexpr int SMEM_OFFSET_V = Smem_tile_q::BYTES_PER_TILE + (SHARE_SMEM_FOR_K_AND_V ? 0 : Smem_tile_k::BYTES_PER_TILE);
+    static_assert(V_IN_REGS || !SHARE_SMEM_FOR_K_AND_V);
+    static constexpr int NUM_V = Kernel_traits::NUM_V;
 
     // // Q | K / V
     // //   | O | SOFTMAX
     // static constexpr int SMEM_BYTES = Smem_tile_q::BYTES_PER_TILE 
     //                                 + std::max((SHARE_SMEM_FOR_K_AND_V ? 1 : 2) * Smem_tile_k::BYTES_PER_TILE,
     //                                            Smem_tile_o::BYTES_PER_TILE + Base::SMEM_BYTES_SOFTMAX);
-   
-    // TODO: not sharing right now
-    // Q | K / V | V2 
-    //   | O     | O2 | Softmax
-    static constexpr int SMEM_OFFSET_O2 = SMEM_OFFSET_O + Smem_tile_o::BYTES_PER_TILE;
-    static constexpr int SMEM_OFFSET_V2 = SMEM_OFFSET_V + Smem_tile_k::BYTES_PER_TILE;
-    static constexpr int SMEM_OFFSET_SOFTMAX = SMEM_OFFSET_O2 + Smem_tile_o::BYTES_PER_TILE;
-    
-    static constexpr int SMEM_BYTES = Smem_tile_q::BYTES_PER_TILE 
-                                    + std::max((SHARE_SMEM_FOR_K_AND_V ? 2 : 3) * Smem_tile_k::BYTES_PER_TILE,
-                                               Smem_tile_o::BYTES_PER_TILE*2 + Base::SMEM_BYTES_SOFTMAX);
 
+    // If V_IN_REGS:  Q | K / V_0 | V_1 | ... | V_{NUM_V-1}
+    //                  | O_0 | ... | O_{NUM_V-1} | SOFTMAX
+    // If !V_IN_REGS: Q | V_0 | ... | V_{NUM_V-1} | K / O_0 | ... | O_{NUM_V-1} | SOFTMAX
+    // The V_i have to stay in shared memory for the entire kernel if they are not kept in registers,
+    // while K is kept in registers so O can reuse its shared memory.
+    static constexpr int SMEM_OFFSET_K = Smem_tile_q::BYTES_PER_TILE + (V_IN_REGS ? 0 : NUM_V * Smem_tile_k::BYTES_PER_TILE);
+    static constexpr int SMEM_OFFSET_V = Smem_tile_q::BYTES_PER_TILE + (V_IN_REGS && !SHARE_SMEM_FOR_K_AND_V ? Smem_tile_k::BYTES_PER_TILE : 0);
+    static constexpr int SMEM_STRIDE_V = Smem_tile_k::BYTES_PER_TILE;
+    static constexpr int SMEM_OFFSET_O = SMEM_OFFSET_K;
+    static constexpr int SMEM_STRIDE_O = Smem_tile_o::BYTES_PER_TILE;
+    // With ASYNC_KV, the next K / V_i land in shared memory while the softmax is computed, so the
+    // softmax goes after them: Q | K | V_0 | ... | V_{NUM_V-1} | SOFTMAX.
+    static constexpr int SMEM_BYTES_KV = (SHARE_SMEM_FOR_K_AND_V ? NUM_V : NUM_V + 1) * Smem_tile_k::BYTES_PER_TILE;
+    static constexpr int SMEM_OFFSET_SOFTMAX = Kernel_traits::ASYNC_KV
+        ? SMEM_OFFSET_K + std::max(SMEM_BYTES_KV, NUM_V * Smem_tile_o::BYTES_PER_TILE)
+        : SMEM_OFFSET_O + NUM_V * Smem_tile_o::BYTES_PER_TILE;
+
+    static constexpr int SMEM_BYTES = Kernel_traits::ASYNC_KV
+        ? SMEM_OFFSET_SOFTMAX + Base::SMEM_BYTES_SOFTMAX
+        : V_IN_REGS
+        ? Smem_tile_q::BYTES_PER_TILE
+          + std::max(SMEM_BYTES_KV, NUM_V * Smem_tile_o::BYTES_PER_TILE + Base::SMEM_BYTES_SOFTMAX)
+        : SMEM_OFFSET_K
+          + std::max((int)Smem_tile_k::BYTES_PER_TILE, NUM_V * Smem_tile_o::BYTES_PER_TILE + Base::SMEM_BYTES_SOFTMAX);
 
     __device__ inline Gemm_Q_K(char * smem_, const int tidx) 
-        : Base(smem_, smem_ + Smem_tile_q::BYTES_PER_TILE, tidx) {
+        : Base(smem_, smem_ + SMEM_OFFSET_K, tidx) {
     }
 
     __device__ inline void load_k(){
@@ -127,12 +140,12 @@ struct Gemm_Q_K : public Gemm_Q_K_base<Kernel_traits> {
             // Trigger the load from shared memory for the next series of Q values.
             Base::smem_q.load(Base::frag_q[ki & 1], ki);
             // Do the math for the values already in registers.
-            fmha::gemm(acc_p, Base::frag_q[(ki - 1) & 1], frag_k[(ki - 1)]);
+            fmha::gemm<elem_type>(acc_p, Base::frag_q[(ki - 1) & 1], frag_k[(ki - 1)]);
         }
         // Do the final stage of math.
         {
             int ki = Mma_tile_p::MMAS_K;
-            fmha::gemm(acc_p, Base::frag_q[(ki - 1) & 1], frag_k[(ki - 1)]);
+            fmha::gemm<elem_type>(acc_p, Base::frag_q[(ki - 1) & 1], frag_k[(ki - 1)]);
         }
     }
 
@@ -147,6 +160,7 @@ struct Gemm_Q_K : public Gemm_Q_K_base<Kernel_traits> {
 template<typename Kernel_traits>
 struct Gemm_Q_K<Kernel_traits, false> : public Gemm_Q_K_base<Kernel_traits> {
     using Base = Gemm_Q_K_base<Kernel_traits>;
+    using elem_type = typename Base::elem_type;
     using Smem_tile_o = typename Base::Smem_tile_o;
     using Smem_tile_q = typename Base::Smem_tile_q;
     using Smem_tile_k = typename Base::Smem_tile_k;
@@ -159,6 +173,8 @@ struct Gemm_Q_K<Kernel_traits, false> : public Gemm_Q_K_base<Kernel_traits> {
     static constexpr bool V_IN_REGS = Kernel_traits::V_IN_REGS;
     static_assert(V_IN_REGS || !SHARE_SMEM_FOR_K_AND_V);
 
+    static constexpr int NUM_V = Kernel_traits::NUM_V;
+
     static constexpr int SMEM_OFFSET_V = Smem_tile_q::BYTES_PER_TILE + (SHARE_SMEM_FOR_K_AND_V ? 0 : Smem_tile_k::BYTES_PER_TILE);
     static_assert(Smem_tile_v::BYTES_PER_TILE == (int) Smem_tile_k::BYTES_PER_TILE);
     static constexpr int SMEM_OFFSET_O = SMEM_OFFSET_V + Smem_tile_v::BYTES_PER_TILE;
@@ -169,15 +185,13 @@ struct Gemm_Q_K<Kernel_traits, false> : public Gemm_Q_K_base<Kernel_traits> {
     // static constexpr int SMEM_BYTES = Smem_tile_q::BYTES_PER_TILE
     //                                 + (SHARE_SMEM_FOR_K_AND_V ? 1 : 2) * Smem_tile_k::BYTES_PER_TILE 
     //                                 + Smem_tile_o::BYTES_PER_TILE + Base::SMEM_BYTES_SOFTMAX;
-    
-    // If V_IN_REGS and SHARE_SMEM_FOR_K_AND_V:      Q | K/V | O | V2 | O2 | SOFTMAX
-    // If !V_IN_REGS (then !SHARE_SMEM_FOR_K_AND_V): Q | K   | V | O | V2 | O2 |SOFTMAX
-    static constexpr int SMEM_OFFSET_V2 = SMEM_OFFSET_O + Smem_tile_o::BYTES_PER_TILE;
-    static constexpr int SMEM_OFFSET_O2 = SMEM_OFFSET_V2 + Smem_tile_v::BYTES_PER_TILE;
-    static constexpr int SMEM_OFFSET_SOFTMAX = SMEM_OFFSET_O2 + Smem_tile_o::BYTES_PER_TILE;
-    static constexpr int SMEM_BYTES = Smem_tile_q::BYTES_PER_TILE
-                                    + (SHARE_SMEM_FOR_K_AND_V ? 2 : 3) * Smem_tile_k::BYTES_PER_TILE 
-                                    + Smem_tile_o::BYTES_PER_TILE*2 + Base::SMEM_BYTES_SOFTMAX;
+
+    // If V_IN_REGS and SHARE_SMEM_FOR_K_AND_V:      Q | K/V_0 | O_0 | V_1 | O_1 | ... | SOFTMAX
+    // If !V_IN_REGS (then !SHARE_SMEM_FOR_K_AND_V): Q | K | V_0 | O_0 | V_1 | O_1 | ... | SOFTMAX
+    static constexpr int SMEM_STRIDE_V = Smem_tile_v::BYTES_PER_TILE + Smem_tile_o::BYTES_PER_TILE;
+    static constexpr int SMEM_STRIDE_O = SMEM_STRIDE_V;
+    static constexpr int SMEM_OFFSET_SOFTMAX = SMEM_OFFSET_V + NUM_V * SMEM_STRIDE_V;
+    static constexpr int SMEM_BYTES = SMEM_OFFSET_SOFTMAX + Base::SMEM_BYTES_SOFTMAX;
 
     __device__ inline Gemm_Q_K(char * smem_, const int tidx) 
       : Base(smem_, smem_ + Smem_tile_q::BYTES_PER_TILE, tidx) {
@@ -196,12 +210,12 @@ struct Gemm_Q_K<Kernel_traits, false> : public Gemm_Q_K_base<Kernel_traits> {
             Base::smem_q.load(Base::frag_q[ki & 1], ki);
             Base::smem_k.load(frag_k[ki & 1], ki);
             // Do the math for the values already in registers.
-            fmha::gemm(acc_p, Base::frag_q[(ki - 1) & 1], frag_k[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_p, Base::frag_q[(ki - 1) & 1], frag_k[(ki - 1) & 1]);
         }
         // Do the final stage of math.
         {
             int ki = Mma_tile_p::MMAS_K;
-            fmha::gemm(acc_p, Base::frag_q[(ki - 1) & 1], frag_k[(ki - 1) & 1]);
+            fmha::gemm<elem_type>(acc_p, Base::frag_q[(ki - 1) & 1], frag_k[(ki - 1) & 1]);
         }
     }
 
@@ -220,6 +234,7 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
 
 
     // The description of the CTA tile for the 1st batched GEMM.
+    using elem_type = typename Kernel_traits::elem_type;
     using Cta_tile_p = typename Kernel_traits::Cta_tile_p;
     // The description of the CTA tile for the 2nd batched GEMM.
     using Cta_tile_o = typename Kernel_traits::Cta_tile_o;
@@ -242,7 +257,7 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
 
     // The global memory tile to store O.
     using Gmem_tile_o = typename Kernel_traits::Gmem_tile_o;
-    using Gmem_tile_o_tmp = fmha::Gmem_tile_o<Cta_tile_o, 4>;
+    using Gmem_tile_o_tmp = fmha::Gmem_tile_o<Cta_tile_o, 4, typename Kernel_traits::index_t>;
     // The shared memory tile to swizzle O.
     using Smem_tile_o = typename Kernel_traits::Smem_tile_o;
 
@@ -256,6 +271,9 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
 
     using Softmax = fmha::Softmax<Cta_tile_p, Kernel_traits>;
 
+    // The number of value tensors sharing the softmax.
+    constexpr int NUM_V = Kernel_traits::NUM_V;
+
     // Shared memory.
     extern __shared__ char smem_[];
 
@@ -266,30 +284,26 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
     // if( binfo.stop_early() ) return;
     if( binfo.stop_early(loop_step_idx * Cta_tile_p::N) ) return;
 
+    Phase_clocks phase_clocks(params, bidb, bidh, tidx);
+
     Gemm1 gemm_q_k(smem_, tidx);
     // Allocate the global memory tile loader for Q.
     Gmem_tile_q gmem_q(params, 0, binfo, tidx);
-    // Allocate the global memory tile loader for O.
-    Gmem_tile_o gmem_o(params, binfo, tidx);
-    Gmem_tile_o_tmp gmem_o_tmp(params.o_tmp_ptr, params.o_stride_in_elts, binfo, tidx);
-    // Allocate the global memory tile loader for O2.
-    Gmem_tile_o gmem_o2(params.o2_ptr, params.o_stride_in_elts, binfo, tidx);
-    Gmem_tile_o_tmp gmem_o2_tmp(params.o2_tmp_ptr, params.o_stride_in_elts, binfo, tidx);
+    // The global memory tiles for O_i and O_tmp_i only differ by their base pointer, so they are
+    // created where they are used and moved to the current row, see below.
     // Allocate the global memory tile loader for S.
     Gmem_tile_s gmem_s(params, binfo, tidx);
-    Gmem_softmax_sum gmem_softmax_lse(params.softmax_lse_ptr, params, tidx);
+    Gmem_softmax_sum gmem_softmax_lse(params.softmax_lse_ptr, params, binfo, tidx);
 
     // Wind gmem tiles to the correct position.
     static_assert(Cta_tile_p::N % Cta_tile_p::M == 0);
     const int begin_og = begin;
-    begin = Is_causal ? std::max(begin, loop_step_idx * Cta_tile_p::N / Cta_tile_p::M) : begin;
+    // Skip the query blocks before the band. The ones after it (with a window_left) still go
+    // through the loop, the first K/V block of a query block has to be the one with Is_first.
+    begin = Is_causal ? std::max(begin, fmha::band_q_begin<Cta_tile_p>(binfo, loop_step_idx)) : begin;
     const int steps_og = steps;
     steps -= begin - begin_og;
     gmem_q.move(begin);
-    gmem_o.move(begin);
-    gmem_o_tmp.move(begin);
-    gmem_o2.move(begin);
-    gmem_o2_tmp.move(begin);
     if (Return_softmax) { gmem_s.move(begin); }
     gmem_softmax_lse.move(begin);
     // if ((threadIdx.x == 0) && (blockIdx.x == 0) && (blockIdx.y == 0)) {
@@ -297,32 +311,13 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
     // }
 
     fmha::Mask<Cta_tile_p, Is_causal> mask(binfo, tidx, loop_step_idx);
+    const float alibi_slope = fmha::get_alibi_slope(params, binfo);
 
     // Allocate the global memory tile loader for K.
     Gmem_tile_k gmem_k(params, 1, binfo, tidx);
-    // Allocate the global memory tile loader for V.
-    Gmem_tile_v gmem_v(params, 2, binfo, tidx);
-    // The base pointer of smem_v;
-    char *smem_v_ = &smem_[Gemm1::SMEM_OFFSET_V];
-    // Allocate the global memory tile loader for V2.
-    Gmem_tile_v gmem_v2(params, 3, binfo, tidx);
-    // The base pointer of smem_v;
-    char *smem_v2_ = &smem_[Gemm1::SMEM_OFFSET_V2];
-    
-    // Allocate the shared memory tile loader for V. We use the same as K so be careful!!!
-    Smem_tile_v smem_v(smem_v_, tidx);
-    // Allocate the shared memory tile loader for V. MAYBE SHARED BE CAREFUL IDK LOL
-    Smem_tile_v smem_v2(smem_v2_, tidx);
-
-    // Allocate the shared memory tile loader for O. We use the same as K so be careful!!!
-    Smem_tile_o smem_o(&smem_[Gemm1::SMEM_OFFSET_O], tidx);
-    // Allocate the shared memory tile loader for O2. MAYBE SHARED BE CAREFUL IDK LOL
-    Smem_tile_o smem_o2(&smem_[Gemm1::SMEM_OFFSET_O2], tidx);
 
     if (!Is_first) {
         gmem_k.move(loop_step_idx);
-        gmem_v.move(loop_step_idx);
-        gmem_v2.move(loop_step_idx);
         if (Return_softmax) { gmem_s.move(loop_step_idx * steps_og); }
     }
 
@@ -330,10 +325,18 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
     gmem_k.load();
     // Trigger the loads for Q.
     gmem_q.load();
-    // Trigger the loads for V.
-    gmem_v.load();
-    // Trigger the loads for V2.
-    gmem_v2.load();
+    // Trigger the loads for the V_i. V_i is matrix 2 + i of the packed QKV tensor.
+    uint4 fetch_v[NUM_V][Gmem_tile_v::LDGS];
+    #pragma unroll
+    for( int vi = 0; vi < NUM_V; ++vi ) {
+        Gmem_tile_v gmem_v(params, 2 + vi, binfo, tidx);
+        if (!Is_first) { gmem_v.move(loop_step_idx); }
+        gmem_v.load();
+        #pragma unroll
+        for( int ii = 0; ii < Gmem_tile_v::LDGS; ++ii ) {
+            fetch_v[vi][ii] = gmem_v.fetch_[ii];
+        }
+    }
 
     if (!Is_first) { __syncthreads(); }
 
@@ -342,10 +345,17 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
         gmem_softmax_lse.load(reinterpret_cast<uint32_t(&)[Mma_tile_p::MMAS_M * 2]>(p_prev_lse));
     }
 
-    // Commit the data for Q and V to shared memory.
+    // Apply the rotary embedding to Q and K in registers, if any.
+    fmha::apply_rotary_fetch<elem_type>(gmem_q, params, binfo, /*use_seqlen_q=*/true);
+    fmha::apply_rotary_fetch<elem_type>(gmem_k, params, binfo, /*use_seqlen_q=*/false);
+
+    // Commit the data for Q and the V_i to shared memory. V_0 uses the same as K so be careful!!!
     gmem_q.commit(gemm_q_k.smem_q);
-    gmem_v.commit(smem_v);
-    gmem_v2.commit(smem_v2);
+    #pragma unroll
+    for( int vi = 0; vi < NUM_V; ++vi ) {
+        Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+        smem_v.store(fetch_v[vi]);
+    }
 
     // const uint32_t scale_bmm1 = reinterpret_cast<const uint32_t&>(params.scale_bmm1);
     // #pragma unroll
@@ -363,13 +373,18 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
     // Load the fragments for Q.
     gemm_q_k.load_q();
 
-    // Load the fragments for V. We keep the data in registers during the entire kernel.
-    typename Smem_tile_v::Fragment frag_v[Mma_tile_o::MMAS_K][Mma_tile_o::MMAS_N];
-    typename Smem_tile_v::Fragment frag_v2[Mma_tile_o::MMAS_K][Mma_tile_o::MMAS_N];
-    #pragma unroll
-    for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
-        smem_v.load(frag_v[ki], ki);
-        smem_v2.load(frag_v2[ki], ki);
+    // Load the fragments for the V_i. If V_IN_REGS, we keep the data in registers during the entire
+    // kernel. Otherwise the V_i stay in shared memory and frag_v[0] is used as a double buffer.
+    typename Smem_tile_v::Fragment frag_v[Kernel_traits::V_IN_REGS ? NUM_V : 1][Kernel_traits::V_IN_REGS ? Mma_tile_o::MMAS_K : 2][Mma_tile_o::MMAS_N];
+    if (Kernel_traits::V_IN_REGS) {
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+            #pragma unroll
+            for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                smem_v.load(frag_v[vi][ki], ki);
+            }
+        }
     }
 
     // Commit the data for V to shared memory if it has not been done already.
@@ -386,6 +401,7 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
 
     // Load the fragments for K. 
     gemm_q_k.load_k();
+    phase_clocks.mark(FMHA_PHASE_LOAD_QKV);
 
     // Create the object to do the softmax.
     Softmax softmax(params, &smem_[Gemm1::SMEM_OFFSET_SOFTMAX], tidx);
@@ -394,7 +410,7 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
 
     // Load over the entire sequence length.
     for( int l = 0; l < steps; l++ ) {
-        if((begin + l) * Cta_tile_p::M >= binfo.actual_seqlen) break;
+        if((begin + l) * Cta_tile_p::M >= binfo.actual_seqlen_q) break;
 
         // Declare the accumulators for the 1st gemm.
         fmha::Fragment_accumulator acc_p[Mma_tile_p::MMAS_M][Mma_tile_p::MMAS_N];
@@ -402,10 +418,17 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
 
         // Do this part of P = Q * K^T.
         gemm_q_k(acc_p);
+        phase_clocks.mark(FMHA_PHASE_GEMM_QK);
 
-        uint4 out[Gmem_tile_o::STGS_PER_LOOP];
-        uint4 out2[Gmem_tile_o::STGS_PER_LOOP];
-        if (!Is_first) { gmem_o_tmp.load(out, 0); gmem_o2_tmp.load(out2, 0); }
+        uint4 out[NUM_V][Gmem_tile_o::STGS_PER_LOOP];
+        if (!Is_first) {
+            #pragma unroll
+            for( int vi = 0; vi < NUM_V; ++vi ) {
+                Gmem_tile_o_tmp gmem_o_tmp(params.o_tmp_ptrs[vi], params.o_stride_in_elts, binfo, tidx, params.d);
+                gmem_o_tmp.move(begin + l);
+                gmem_o_tmp.load(out[vi], 0);
+            }
+        }
 
         // Trigger the load for the next Q values.
         if( l < steps - 1) {
@@ -422,11 +445,13 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
 
         // Apply the mask.
         softmax.apply_mask(mask);
+        if (alibi_slope != 0.f) { softmax.apply_alibi(mask, alibi_slope); }
 
         // softmax.unpack_noscale_half_and_apply_mask(acc_p, mask);
 
-        if( Kernel_traits::SHARE_SMEM_FOR_K_AND_V && l == 0 ) {
+        if( (Kernel_traits::SHARE_SMEM_FOR_K_AND_V || !Kernel_traits::V_IN_REGS) && l == 0 ) {
             // if we share K and V, it could be that V was not fully read yet but we write into smem for reduction
+            // if V is not in registers, O reuses the shared memory of K which may not be fully read yet
             __syncthreads();
         }
         // if (!Is_first) {
@@ -512,38 +537,63 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
         static_assert(Mma_tile_o::MMAS_K == Mma_tile_p::MMAS_N);
         softmax.pack(frag_p);
         if (Return_softmax) {
-            gmem_s.store(frag_p, mask);
+            gmem_s.template store<elem_type>(frag_p, mask);
             gmem_s.move();
         }
+        phase_clocks.mark(FMHA_PHASE_SOFTMAX);
 
         // Commit the values for Q into shared memory.
         if(l < steps - 1) {
+            fmha::apply_rotary_fetch<elem_type>(gmem_q, params, binfo, /*use_seqlen_q=*/true);
             gmem_q.commit(gemm_q_k.smem_q);
         }
+        phase_clocks.mark(FMHA_PHASE_LOAD_QKV);
 
         if (Is_dropout && encode_dropout_in_sign_bit) {
             #pragma unroll
             for( int ki = 0; ki < Mma_tile_o::MMAS_K; ki++ ) {
                 #pragma unroll
                 for( int mi = 0; mi < Mma_tile_o::MMAS_M; mi++ ) {
-                    frag_p[ki][mi].hrelu_();
+                    frag_p[ki][mi].template hrelu_<elem_type>();
                 }
             }
         }
 
-        // Declare the accumulators for the 2nd gemm.
-        fmha::Fragment_accumulator acc_o[Mma_tile_o::MMAS_M][Mma_tile_o::MMAS_N];
-        fmha::Fragment_accumulator acc_o2[Mma_tile_o::MMAS_M][Mma_tile_o::MMAS_N];
-        fmha::Clear_accumulator<typename fmha::Accumulator_type, Cta_tile_o::WARPS_K>::apply(acc_o);
-        fmha::Clear_accumulator<typename fmha::Accumulator_type, Cta_tile_o::WARPS_K>::apply(acc_o2);
+        static_assert(Gmem_tile_o::LOOPS == 1);
 
-        // Do this part of O = P^T * V^T.
-        // Do this part of O2 = P^T * V2^T.
+        // Do this part of O_i = P^T * V_i^T for each value tensor and swizzle the elements for the
+        // final reduction. Each O_i has its own shared memory tile so we only need one accumulator.
         #pragma unroll
-        for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
-            fmha::gemm(acc_o, frag_p[ki], frag_v[ki]);
-            fmha::gemm(acc_o2, frag_p[ki], frag_v2[ki]);
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            // Declare the accumulators for the 2nd gemm.
+            fmha::Fragment_accumulator acc_o[Mma_tile_o::MMAS_M][Mma_tile_o::MMAS_N];
+            fmha::Clear_accumulator<typename fmha::Accumulator_type, Cta_tile_o::WARPS_K>::apply(acc_o);
+
+            if (Kernel_traits::V_IN_REGS) {
+                #pragma unroll
+                for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                    fmha::gemm<elem_type>(acc_o, frag_p[ki], frag_v[vi][ki]);
+                }
+            } else {
+                Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+                smem_v.load(frag_v[0][0], 0);
+                #pragma unroll
+                for( int ki = 1; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                    // Trigger the load from shared memory for the next series of V values.
+                    smem_v.load(frag_v[0][ki & 1], ki);
+                    fmha::gemm<elem_type>(acc_o, frag_p[ki - 1], frag_v[0][(ki - 1) & 1]);
+                }
+                // Do the final stage of math.
+                {
+                    int ki = Mma_tile_o::MMAS_K;
+                    fmha::gemm<elem_type>(acc_o, frag_p[ki - 1], frag_v[0][(ki - 1) & 1]);
+                }
+            }
+
+            Smem_tile_o smem_o(&smem_[Gemm1::SMEM_OFFSET_O + vi * Gemm1::SMEM_STRIDE_O], tidx);
+            smem_o.store(acc_o, 0);
         }
+        phase_clocks.mark(FMHA_PHASE_GEMM_PV);
 
         // The mapping from tidx to rows changes between the softmax and the O-reduction.
         // So we recalculate the max.
@@ -566,12 +616,6 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
         //     }
         // }
 
-        static_assert(Gmem_tile_o::LOOPS == 1);
-
-        // Swizzle the elements and do the final reduction.
-        smem_o.store(acc_o, 0);
-        smem_o2.store(acc_o2, 0);
-
         // Make sure the data is in shared memory.
         __syncthreads();
 
@@ -580,7 +624,8 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
         softmax.reduce_sum_after_sync_(p_sum_o, rows);
         if (!Is_first) {
             for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
-                p_prev_scale_o[jj] = expf(p_prev_scale_o[jj] - p_max_o[jj][0]);
+                // The rows fully masked out so far have nothing to rescale.
+                p_prev_scale_o[jj] = p_prev_scale_o[jj] == -INFINITY ? 0.f : expf(p_prev_scale_o[jj] - p_max_o[jj][0]);
                 p_sum_o[jj][0] += p_prev_scale_o[jj];
             }
         }
@@ -606,19 +651,21 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
         gmem_softmax_lse.move();
 
         // Load from shared memory.
-        if (!Is_first) {
-            for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
-                out[jj] = fmha::fmul4(out[jj], p_prev_scale_o[jj]);
-                out2[jj] = fmha::fmul4(out2[jj], p_prev_scale_o[jj]);
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            if (!Is_first) {
+                for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
+                    out[vi][jj] = fmha::fmul4(out[vi][jj], p_prev_scale_o[jj]);
+                }
             }
+            Smem_tile_o smem_o(&smem_[Gemm1::SMEM_OFFSET_O + vi * Gemm1::SMEM_STRIDE_O], tidx);
+            smem_o.template load</*zero_init=*/Is_first>(out[vi]);
         }
-        smem_o.template load</*zero_init=*/Is_first>(out);
-        smem_o2.template load</*zero_init=*/Is_first>(out2);
 
         const bool is_final_write =
             Is_last
-            || ((loop_step_idx + 1) * Cta_tile_p::N >= binfo.actual_seqlen)
-            || ((Is_causal) && ((begin + l) * Cta_tile_p::M < (loop_step_idx + 1) * Cta_tile_p::N));
+            || ((loop_step_idx + 1) * Cta_tile_p::N >= binfo.actual_seqlen_k)
+            || ((Is_causal) && (loop_step_idx + 1 >= fmha::band_kv_end<Cta_tile_p>(binfo, begin + l)));
         #pragma unroll
         for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
             float sum = p_sum_o[jj][0];
@@ -626,10 +673,10 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
             if (Is_dropout && is_final_write) {
                 inv_sum *= params.rp_dropout;
             }
-            out[jj] = fmha::fmul4(out[jj], inv_sum);
-            out2[jj] = fmha::fmul4(out2[jj], inv_sum);
-            // uint4 test = 2;
-            // out2[jj] = fmha::fmul4(test, test)
+            #pragma unroll
+            for( int vi = 0; vi < NUM_V; ++vi ) {
+                out[vi][jj] = fmha::fmul4(out[vi][jj], inv_sum);
+            }
         }
 
         // if (Is_dropout && Is_last) {
@@ -637,21 +684,23 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
         //         out[jj] = fmha::fmul4(out[jj], params.rp_dropout);
         //     }
         // }
-        // printf("The numbers in out2 are (v2): %u, %u, %u, %u\n", out2[0].w, out2[0].x, out2[0].y, out2[0].z);
-
-        // Output the values.
-        if (is_final_write) {
-            gmem_o.store(out, 0);
-            gmem_o.move();
-            gmem_o2.store(out2, 0);
-            gmem_o2.move();
-        } else {
-            gmem_o_tmp.store(out, 0);
-            gmem_o2_tmp.store(out2, 0);
+
+        // Output the values. The final writes always form a prefix of the rows, so both the output
+        // and the tmp tiles are at row begin + l.
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            if (is_final_write) {
+                Gmem_tile_o gmem_o(params.o_ptrs[vi], params.o_stride_in_elts, binfo, tidx, params.d);
+                gmem_o.move(begin + l);
+                gmem_o.template store<elem_type>(out[vi], 0);
+            } else {
+                Gmem_tile_o_tmp gmem_o_tmp(params.o_tmp_ptrs[vi], params.o_stride_in_elts, binfo, tidx, params.d);
+                gmem_o_tmp.move(begin + l);
+                gmem_o_tmp.store(out[vi], 0);
+            }
         }
+        phase_clocks.mark(FMHA_PHASE_STORE_O);
 
-        // Move to the next part of the output.
-        if (!(Is_first && Is_last)) { gmem_o_tmp.move(); gmem_o2_tmp.move();}
         gemm_q_k.reload_k();
 
         // Make sure we are reading from the correct buffer.
@@ -660,19 +709,495 @@ inline __device__ void device_1xN_(const Params &params, const int bidb, const i
         if(l < steps - 1) {
             gemm_q_k.reload_q();
         }
+        phase_clocks.mark(FMHA_PHASE_LOAD_QKV);
 
     }  // Outer loop over the sequence length.
+    phase_clocks.flush();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Same math as the sequence of device_1xN_ calls in device_1xN_loop, but with the loops swapped:
+// the outer loop goes over the Q blocks and the inner loop streams the blocks of K and the V_i.
+// The O_i accumulators and the running max / sum of each Q block stay in registers, so there is no
+// round-trip through o_tmp. K and the V_i are re-read for every Q block instead (mostly from L2).
+// The softmax is not returned by this variant. With Kernel_traits::ASYNC_KV, the next K/V block
+// is copied to shared memory with LDGSTS while the current one is computed.
+template<typename Kernel_traits, bool Is_dropout, bool Is_causal, typename Params>
+inline __device__ void device_1xN_kv_inner_(const Params &params, const int bidb, const int bidh,
+                                            const int begin, const int steps, const int tidx_global,
+                                            const unsigned long long seed, const unsigned long long offset) {
+
+    // The description of the CTA tile for the 1st batched GEMM.
+    using elem_type = typename Kernel_traits::elem_type;
+    using Cta_tile_p = typename Kernel_traits::Cta_tile_p;
+    // The description of the CTA tile for the 2nd batched GEMM.
+    using Cta_tile_o = typename Kernel_traits::Cta_tile_o;
+
+    // The MMA tile for the 1st GEMM.
+    using Mma_tile_p = fmha::Hmma_tile<Cta_tile_p>;
+    // The MMA tile for the 2nd GEMM.
+    using Mma_tile_o = fmha::Hmma_tile<Cta_tile_o>;
+
+    // The global memory tile to load Q.
+    using Gmem_tile_q = typename Kernel_traits::Gmem_tile_q;
+
+    // The global memory tile to load K.
+    using Gmem_tile_k = typename Kernel_traits::Gmem_tile_k;
+
+    // The global memory tile to load V.
+    using Gmem_tile_v = typename Kernel_traits::Gmem_tile_v;
+    // The shared memory tile to swizzle V.
+    using Smem_tile_v = typename Kernel_traits::Smem_tile_v;
+
+    // The global memory tile to store O.
+    using Gmem_tile_o = typename Kernel_traits::Gmem_tile_o;
+    // The shared memory tile to swizzle O.
+    using Smem_tile_o = typename Kernel_traits::Smem_tile_o;
+
+    using Gmem_softmax_sum = typename Kernel_traits::Gmem_softmax_sum;
+
+    using Gemm1 = Gemm_Q_K<Kernel_traits, Kernel_traits::K_IN_REGS>;
+
+    using Softmax = fmha::Softmax<Cta_tile_p, Kernel_traits>;
+
+    // The number of value tensors sharing the softmax.
+    constexpr int NUM_V = Kernel_traits::NUM_V;
+
+    static_assert(Mma_tile_o::MMAS_M == Mma_tile_p::MMAS_M);
+    static_assert(Mma_tile_o::MMAS_K == Mma_tile_p::MMAS_N);
+    static_assert(Cta_tile_p::N % Cta_tile_p::M == 0);
+    static_assert(Gmem_tile_o::LOOPS == 1);
+    static_assert(Mma_tile_o::MMAS_M == 1);
+
+    // Shared memory.
+    extern __shared__ char smem_[];
+
+    // The thread index.
+    const int tidx = threadIdx.x;
+
+    const BlockInfoPadded<Kernel_traits::THREADS> binfo(params, bidb, bidh, tidx);
+    if( binfo.stop_early() ) return;
+
+    Phase_clocks phase_clocks(params, bidb, bidh, tidx);
+
+    Gemm1 gemm_q_k(smem_, tidx);
+    // Allocate the global memory tile loader for Q.
+    Gmem_tile_q gmem_q(params, 0, binfo, tidx);
+    Gmem_softmax_sum gmem_softmax_lse(params.softmax_lse_ptr, params, binfo, tidx);
+
+    // Wind gmem tiles to the correct position.
+    gmem_q.move(begin);
+    gmem_softmax_lse.move(begin);
+
+    // Create the object to do the softmax.
+    Softmax softmax(params, &smem_[Gemm1::SMEM_OFFSET_SOFTMAX], tidx);
+
+    const float alibi_slope = fmha::get_alibi_slope(params, binfo);
+
+    // The number of K/V blocks of this sequence.
+    const int kv_steps = (binfo.actual_seqlen_k + Cta_tile_p::N - 1) / Cta_tile_p::N;
+
+    // The dropout masks have to be the same as the ones of device_1xN_loop with a single split,
+    // since the backward pass regenerates them in that order: there, K/V block j walks over the Q
+    // blocks begin_j = (causal ? band_q_begin(j) : 0), ..., q_steps - 1 and each Q block draws
+    // DROPOUT_CALLS numbers from ph0 and ph1. We compute the position of (j, row_block) directly.
+    constexpr int DROPOUT_CALLS = Mma_tile_p::MMAS_M * Mma_tile_p::MMAS_N / 2;
+    const int q_steps = std::min(params.seqlen_q / Cta_tile_p::M,
+                                 (binfo.actual_seqlen_q + Cta_tile_p::M - 1) / Cta_tile_p::M);
+
+    // The copies with ASYNC_KV bypass the registers, so the rotary embedding (applied to the
+    // fetched Q and K) goes through the synchronous loads. Their shared memory layout fits in the
+    // one of ASYNC_KV.
+    const bool async_kv = Kernel_traits::ASYNC_KV && params.rotary_cos_ptr == nullptr;
+
+    // With ASYNC_KV, trigger the copies of K and the V_i of the K/V block j to shared memory.
+    auto load_kv_async = [&](const int j) {
+        Gmem_tile_k gmem_k(params, 1, binfo, tidx);
+        gmem_k.move(j);
+        gmem_k.load(gemm_q_k.smem_k);
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            Gmem_tile_v gmem_v(params, 2 + vi, binfo, tidx);
+            gmem_v.move(j);
+            Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+            gmem_v.load(smem_v);
+        }
+    };
+
+    // Load over the Q blocks of this split.
+    for( int l = 0; l < steps; l++ ) {
+        const int row_block = begin + l;
+        if( row_block * Cta_tile_p::M >= binfo.actual_seqlen_q ) break;
+
+        // With a causal or sliding-window mask, the K/V blocks outside the band are fully masked out.
+        const int kv_begin = Is_causal ? fmha::band_kv_begin<Cta_tile_p>(binfo, row_block) : 0;
+        const int kv_end = Is_causal
+            ? std::min(kv_steps, fmha::band_kv_end<Cta_tile_p>(binfo, row_block))
+            : kv_steps;
+
+        // Trigger the loads for Q. It stays in the same shared memory buffer for all the K/V blocks.
+        if (async_kv) {
+            // Make sure we are done reading the O_i of the previous Q block, they reuse the shared
+            // memory of K and the V_i.
+            __syncthreads();
+            if( kv_begin < kv_end ) {
+                gmem_q.load(gemm_q_k.smem_q);
+                load_kv_async(kv_begin);
+                fmha::ldgsts_commit();
+            }
+        } else {
+            gmem_q.load();
+        }
+
+        // The accumulators for the O_i and the running max / sum of the rows. The sums are only
+        // reduced across the threads at the end.
+        fmha::Fragment_accumulator acc_o[NUM_V][Mma_tile_o::MMAS_M][Mma_tile_o::MMAS_N];
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            fmha::Clear_accumulator<typename fmha::Accumulator_type, Cta_tile_o::WARPS_K>::apply(acc_o[vi]);
+        }
+        float p_max[Mma_tile_p::MMAS_M * 2];
+        float p_sum[Mma_tile_p::MMAS_M * 2];
+        // With softmax_stats_ptr, the running sum of exp(z - max) * z where z are the scaled logits,
+        // for the entropy of the rows.
+        float p_dot[Mma_tile_p::MMAS_M * 2];
+        #pragma unroll
+        for( int mi = 0; mi < Mma_tile_p::MMAS_M * 2; ++mi ) {
+            p_max[mi] = -INFINITY;
+            p_sum[mi] = 0.f;
+            p_dot[mi] = 0.f;
+        }
+
+        // The position of the dropout masks of the K/V block j, see below.
+        unsigned long long dropout_idx_j = 0;
+        if (Is_dropout && Is_causal) {
+            for( int j = 0; j < kv_begin; ++j ) {
+                dropout_idx_j += q_steps - fmha::band_q_begin<Cta_tile_p>(binfo, j);
+            }
+        }
+
+        for( int j = kv_begin; j < kv_end; ++j ) {
+            typename Smem_tile_v::Fragment frag_v[Kernel_traits::V_IN_REGS ? NUM_V : 1][Kernel_traits::V_IN_REGS ? Mma_tile_o::MMAS_K : 2][Mma_tile_o::MMAS_N];
+            if (async_kv) {
+                // Wait for K and the V_i of this block.
+                fmha::ldgsts_wait<0>();
+                __syncthreads();
+
+                // Load the fragments for Q, K and the V_i.
+                gemm_q_k.load_q();
+                #pragma unroll
+                for( int vi = 0; vi < NUM_V; ++vi ) {
+                    Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+                    #pragma unroll
+                    for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                        smem_v.load(frag_v[vi][ki], ki);
+                    }
+                }
+                gemm_q_k.load_k();
+
+                // Make sure all the fragments are in registers, then copy the next block to shared
+                // memory while we compute this one.
+                __syncthreads();
+                if( j + 1 < kv_end ) {
+                    load_kv_async(j + 1);
+                    fmha::ldgsts_commit();
+                }
+            } else {
+                // Trigger the loads for K and the V_i. V_i is matrix 2 + i of the packed QKV tensor.
+                Gmem_tile_k gmem_k(params, 1, binfo, tidx);
+                gmem_k.move(j);
+                gmem_k.load();
+                uint4 fetch_v[NUM_V][Gmem_tile_v::LDGS];
+                #pragma unroll
+                for( int vi = 0; vi < NUM_V; ++vi ) {
+                    Gmem_tile_v gmem_v(params, 2 + vi, binfo, tidx);
+                    gmem_v.move(j);
+                    gmem_v.load();
+                    #pragma unroll
+                    for( int ii = 0; ii < Gmem_tile_v::LDGS; ++ii ) {
+                        fetch_v[vi][ii] = gmem_v.fetch_[ii];
+                    }
+                }
+
+                // Make sure we are done reading the previous K/V block and the O_i of the previous
+                // Q block before we overwrite them.
+                __syncthreads();
+
+                // Apply the rotary embedding to Q and K in registers, if any.
+                if( j == kv_begin ) {
+                    fmha::apply_rotary_fetch<elem_type>(gmem_q, params, binfo, /*use_seqlen_q=*/true);
+                }
+                fmha::apply_rotary_fetch<elem_type>(gmem_k, params, binfo, /*use_seqlen_q=*/false);
+
+                // Commit the data for Q and the V_i to shared memory. V_0 uses the same as K so be careful!!!
+                if( j == kv_begin ) {
+                    gmem_q.commit(gemm_q_k.smem_q);
+                }
+                #pragma unroll
+                for( int vi = 0; vi < NUM_V; ++vi ) {
+                    Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+                    smem_v.store(fetch_v[vi]);
+                }
+
+                // Commit the data for K to shared memory.
+                if( !Kernel_traits::SHARE_SMEM_FOR_K_AND_V ) {
+                    gmem_k.commit(gemm_q_k.smem_k);
+                }
+
+                __syncthreads();
+
+                // Load the fragments for Q.
+                gemm_q_k.load_q();
+
+                // Load the fragments for the V_i, see device_1xN_.
+                if (Kernel_traits::V_IN_REGS) {
+                    #pragma unroll
+                    for( int vi = 0; vi < NUM_V; ++vi ) {
+                        Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+                        #pragma unroll
+                        for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                            smem_v.load(frag_v[vi][ki], ki);
+                        }
+                    }
+                }
+
+                // Commit the data for V to shared memory if it has not been done already.
+                if( Kernel_traits::SHARE_SMEM_FOR_K_AND_V ) {
+                    // Make sure we are done loading the fragments for K.
+                    __syncthreads();
+
+                    // Commit the data to shared memory for V.
+                    gmem_k.commit(gemm_q_k.smem_k);
+
+                    // Make sure the data is in shared memory.
+                    __syncthreads();
+                }
+
+                // Load the fragments for K.
+                gemm_q_k.load_k();
+            }
+            phase_clocks.mark(FMHA_PHASE_LOAD_QKV);
+
+            // Declare the accumulators for the 1st gemm.
+            fmha::Fragment_accumulator acc_p[Mma_tile_p::MMAS_M][Mma_tile_p::MMAS_N];
+            fmha::Clear_accumulator<typename fmha::Accumulator_type, Cta_tile_p::WARPS_K>::apply(acc_p);
+
+            // Do this part of P = Q * K^T.
+            gemm_q_k(acc_p);
+            phase_clocks.mark(FMHA_PHASE_GEMM_QK);
+
+            // Load the mask for that iteration.
+            fmha::Mask<Cta_tile_p, Is_causal> mask(binfo, tidx, j);
+            mask.load(row_block);
+
+            // Convert from the accumulator type to FP32 for Softmax.
+            softmax.unpack_noscale(acc_p);
+
+            // Apply the mask.
+            softmax.apply_mask(mask);
+            if (alibi_slope != 0.f) { softmax.apply_alibi(mask, alibi_slope); }
+
+            if( Kernel_traits::SHARE_SMEM_FOR_K_AND_V || !Kernel_traits::V_IN_REGS ) {
+                // The softmax reduction may reuse shared memory that is still being read, see device_1xN_.
+                __syncthreads();
+            }
+
+            // Compute the new running max. It is still in units of the unscaled logits.
+            float p_max_prev[Mma_tile_p::MMAS_M * 2];
+            #pragma unroll
+            for( int mi = 0; mi < Mma_tile_p::MMAS_M * 2; ++mi ) { p_max_prev[mi] = p_max[mi]; }
+            softmax.template reduce_max</*zero_init=*/false>(p_max);
+
+            // The correction for what has been accumulated with the previous max.
+            float p_scale[Mma_tile_p::MMAS_M * 2];
+            #pragma unroll
+            for( int mi = 0; mi < Mma_tile_p::MMAS_M * 2; ++mi ) {
+                p_scale[mi] = p_max_prev[mi] == -INFINITY
+                    ? 0.f : exp2f((p_max_prev[mi] - p_max[mi]) * params.scale_bmm1f * float(M_LOG2E));
+            }
+
+            // Compute the exponential value.
+            softmax.scale_apply_exp(p_max, params.scale_bmm1f);
+
+            // Update the running sum of this thread. It includes the elements that are dropped below,
+            // as in device_1xN_.
+            float p_sum_j[Mma_tile_p::MMAS_M * 2];
+            SumOp<float> sum_op;
+            softmax.thread_reduce_(p_sum_j, sum_op);
+            #pragma unroll
+            for( int mi = 0; mi < Mma_tile_p::MMAS_M * 2; ++mi ) {
+                p_sum[mi] = p_sum[mi] * p_scale[mi] + p_sum_j[mi];
+            }
+            // z = max * scale + log(e) for the exponentials e, so the sum of e * z only needs the
+            // exponentials. Rescaled like p_sum, and before the dropout.
+            if (params.softmax_stats_ptr != nullptr) {
+                #pragma unroll
+                for( int mi = 0; mi < Mma_tile_p::MMAS_M * 2; ++mi ) {
+                    float e_log_e = 0.f;
+                    #pragma unroll
+                    for( int ni = 0; ni < Mma_tile_p::MMAS_N * 4; ++ni ) {
+                        const float e = softmax.elt_[mi][ni];
+                        e_log_e += e > 0.f ? e * __logf(e) : 0.f;
+                    }
+                    const float max_scaled = p_max[mi] == -INFINITY ? 0.f : p_max[mi] * params.scale_bmm1f;
+                    p_dot[mi] = p_dot[mi] * p_scale[mi] + max_scaled * p_sum_j[mi] + e_log_e;
+                }
+            }
+
+            if (Is_dropout) {
+                const int begin_j = Is_causal ? fmha::band_q_begin<Cta_tile_p>(binfo, j) : 0;
+                const unsigned long long idx = (Is_causal ? dropout_idx_j : (unsigned long long)j * q_steps)
+                    + (row_block - begin_j);
+                dropout_idx_j += q_steps - begin_j;
+                const unsigned long long offset_j = offset + 4ull * DROPOUT_CALLS * idx;
+                Philox ph0(seed, tidx_global, offset_j);
+                Philox ph1(seed, tidx_global + blockDim.x, offset_j);
+                softmax.template apply_dropout_16bits</*encode_dropout_in_sign_bit=*/false>(ph0, ph1, params.p_dropout_in_uint16_t);
+            }
+
+            using Frag_p = fmha::Fragment_a<fmha::Row>;
+            Frag_p frag_p[Mma_tile_o::MMAS_K][Mma_tile_o::MMAS_M];
+            softmax.pack(frag_p);
+            phase_clocks.mark(FMHA_PHASE_SOFTMAX);
+
+            // Rescale the O_i and do this part of O_i += P^T * V_i^T.
+            #pragma unroll
+            for( int vi = 0; vi < NUM_V; ++vi ) {
+                #pragma unroll
+                for( int mi = 0; mi < Mma_tile_o::MMAS_M; ++mi ) {
+                    #pragma unroll
+                    for( int ni = 0; ni < Mma_tile_o::MMAS_N; ++ni ) {
+                        #pragma unroll
+                        for( int ii = 0; ii < fmha::Fragment_accumulator::NUM_ELTS; ++ii ) {
+                            acc_o[vi][mi][ni].elt(ii) *= p_scale[mi * 2 + ((ii / 2) % 2)];
+                        }
+                    }
+                }
+
+                if (Kernel_traits::V_IN_REGS) {
+                    #pragma unroll
+                    for( int ki = 0; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                        fmha::gemm<elem_type>(acc_o[vi], frag_p[ki], frag_v[vi][ki]);
+                    }
+                } else {
+                    Smem_tile_v smem_v(&smem_[Gemm1::SMEM_OFFSET_V + vi * Gemm1::SMEM_STRIDE_V], tidx);
+                    smem_v.load(frag_v[0][0], 0);
+                    #pragma unroll
+                    for( int ki = 1; ki < Mma_tile_o::MMAS_K; ++ki ) {
+                        // Trigger the load from shared memory for the next series of V values.
+                        smem_v.load(frag_v[0][ki & 1], ki);
+                        fmha::gemm<elem_type>(acc_o[vi], frag_p[ki - 1], frag_v[0][(ki - 1) & 1]);
+                    }
+                    // Do the final stage of math.
+                    {
+                        int ki = Mma_tile_o::MMAS_K;
+                        fmha::gemm<elem_type>(acc_o[vi], frag_p[ki - 1], frag_v[0][(ki - 1) & 1]);
+                    }
+                }
+            }
+            phase_clocks.mark(FMHA_PHASE_GEMM_PV);
+        }  // Inner loop over the K/V blocks.
+
+        // The O_i reuse the shared memory of K and the V_i.
+        __syncthreads();
+
+        // Swizzle the elements of the O_i for the final reduction across the warps.
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            Smem_tile_o smem_o(&smem_[Gemm1::SMEM_OFFSET_O + vi * Gemm1::SMEM_STRIDE_O], tidx);
+            smem_o.store(acc_o[vi], 0);
+        }
+        softmax.store_sum_before_sync_(p_sum);
+
+        // Make sure the data is in shared memory.
+        __syncthreads();
+
+        // The mapping from tidx to rows changes between the softmax and the O-reduction. The max
+        // of the last K/V block is still in shared memory and it is the max of the whole row.
+        int rows[Gmem_tile_o::STGS_PER_LOOP];
+        for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
+            rows[jj] = tidx / Gmem_tile_o::THREADS_PER_ROW + jj * Gmem_tile_o::ROWS_PER_STG;
+        }
+        float p_max_o[Gmem_tile_o::STGS_PER_LOOP][Mma_tile_o::MMAS_M];
+        softmax.reduce_max_after_sync_(p_max_o, rows);
+        float p_sum_o[Gmem_tile_o::STGS_PER_LOOP][Mma_tile_o::MMAS_M];
+        softmax.reduce_sum_after_sync_(p_sum_o, rows);
+
+        #pragma unroll
+        for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
+            float sum = p_sum_o[jj][0];
+            float p_sum_log[Mma_tile_o::MMAS_M];
+            p_sum_log[0] = (sum == 0.f || sum != sum) ? -INFINITY : p_max_o[jj][0] * params.scale_bmm1f + __logf(sum);
+            if ((tidx % Gmem_tile_o::THREADS_PER_ROW == 0) && (tidx / Gmem_tile_o::THREADS_PER_ROW < Gmem_tile_o::ROWS)) {
+                gmem_softmax_lse.store_row(reinterpret_cast<uint32_t(&)[Mma_tile_p::MMAS_M]>(p_sum_log), rows[jj]);
+            }
+        }
+        gmem_softmax_lse.move();
+
+        // The entropy -sum(p * log(p)) = lse - sum(p * z) and the largest probability 1 / sum of the
+        // rows (the sums are relative to the max), [2, h, total_q].
+        if (params.softmax_stats_ptr != nullptr) {
+            // Everyone has read the sums before they are overwritten.
+            __syncthreads();
+            softmax.store_sum_before_sync_(p_dot);
+            __syncthreads();
+            float p_dot_o[Gmem_tile_o::STGS_PER_LOOP][Mma_tile_o::MMAS_M];
+            softmax.reduce_sum_after_sync_(p_dot_o, rows);
+            Gmem_softmax_sum gmem_entropy(params.softmax_stats_ptr, params, binfo, tidx);
+            Gmem_softmax_sum gmem_max_prob(reinterpret_cast<float *>(params.softmax_stats_ptr) + size_t(params.h) * params.total_q,
+                                           params, binfo, tidx);
+            gmem_entropy.move(row_block);
+            gmem_max_prob.move(row_block);
+            #pragma unroll
+            for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
+                const float sum = p_sum_o[jj][0];
+                const bool is_empty = sum == 0.f || sum != sum;
+                const float lse = is_empty ? 0.f : p_max_o[jj][0] * params.scale_bmm1f + __logf(sum);
+                float entropy[Mma_tile_o::MMAS_M], max_prob[Mma_tile_o::MMAS_M];
+                entropy[0] = is_empty ? 0.f : lse - p_dot_o[jj][0] / sum;
+                max_prob[0] = is_empty ? 0.f : 1.f / sum;
+                if ((tidx % Gmem_tile_o::THREADS_PER_ROW == 0) && (tidx / Gmem_tile_o::THREADS_PER_ROW < Gmem_tile_o::ROWS)) {
+                    gmem_entropy.store_row(reinterpret_cast<uint32_t(&)[Mma_tile_p::MMAS_M]>(entropy), rows[jj]);
+                    gmem_max_prob.store_row(reinterpret_cast<uint32_t(&)[Mma_tile_p::MMAS_M]>(max_prob), rows[jj]);
+                }
+            }
+        }
+
+        // Load from shared memory, normalize and output the values.
+        #pragma unroll
+        for( int vi = 0; vi < NUM_V; ++vi ) {
+            uint4 out[Gmem_tile_o::STGS_PER_LOOP];
+            Smem_tile_o smem_o(&smem_[Gemm1::SMEM_OFFSET_O + vi * Gemm1::SMEM_STRIDE_O], tidx);
+            smem_o.template load</*zero_init=*/true>(out);
+            #pragma unroll
+            for (int jj = 0; jj < Gmem_tile_o::STGS_PER_LOOP; jj++) {
+                float sum = p_sum_o[jj][0];
+                float inv_sum = (sum == 0.f || sum != sum) ? 1.f : 1.f / sum;
+                if (Is_dropout) {
+                    inv_sum *= params.rp_dropout;
+                }
+                out[jj] = fmha::fmul4(out[jj], inv_sum);
+            }
+            Gmem_tile_o gmem_o(params.o_ptrs[vi], params.o_stride_in_elts, binfo, tidx, params.d);
+            gmem_o.move(row_block);
+            gmem_o.template store<elem_type>(out, 0);
+        }
+        phase_clocks.mark(FMHA_PHASE_STORE_O);
+
+        // Move to the next Q block.
+        gmem_q.move();
+    }  // Outer loop over the Q blocks.
+    phase_clocks.flush();
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Runs the query blocks [begin, begin + steps) of the head bidh of the sequence bidb.
 template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Return_softmax, typename Params>
-inline __device__ void device_1xN_loop(const Params &params) {
+inline __device__ void device_1xN_loop_(const Params &params, const int bidb, const int bidh,
+                                        const int begin, const int steps) {
 
-    // The block index for the batch.
-    const int bidb = blockIdx.y;
-    // The block index for the head.
-    const int bidh = blockIdx.x;
     // The thread index.
     const int tidx = threadIdx.x;
 
@@ -680,22 +1205,124 @@ inline __device__ void device_1xN_loop(const Params &params) {
     auto seeds = at::cuda::philox::unpack(params.philox_args);
     Philox ph0(std::get<0>(seeds), tidx_global, std::get<1>(seeds));
     Philox ph1(std::get<0>(seeds), tidx_global + blockDim.x, std::get<1>(seeds));
-    const int STEPS = params.s / Kernel_traits::Cta_tile_p::M;
 
     constexpr int N_per_loop = Kernel_traits::Cta_tile_p::N;
-    if (params.s == N_per_loop) {
-        fmha::device_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, true, true>(params, bidb, bidh, 0, STEPS, ph0, ph1, 0);
+    // The softmax stats are only computed by device_1xN_kv_inner_, which also runs a single K/V block.
+    if (!Return_softmax && (params.seqlen_k > N_per_loop || params.softmax_stats_ptr != nullptr)) {
+        fmha::device_1xN_kv_inner_<Kernel_traits, Is_dropout, Is_causal>(params, bidb, bidh, begin, steps, tidx_global, std::get<0>(seeds), std::get<1>(seeds));
+    } else if (params.seqlen_k == N_per_loop) {
+        fmha::device_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, true, true>(params, bidb, bidh, begin, steps, ph0, ph1, 0);
     } else {
-        const int max_loop_steps = (params.s + N_per_loop - 1) / N_per_loop;
-        fmha::device_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, true, false>(params, bidb, bidh, 0, STEPS, ph0, ph1, 0);
+        const int max_loop_steps = (params.seqlen_k + N_per_loop - 1) / N_per_loop;
+        fmha::device_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, true, false>(params, bidb, bidh, begin, steps, ph0, ph1, 0);
         for (int loop_step_idx = 1; loop_step_idx < max_loop_steps - 1; loop_step_idx++) {
-            fmha::device_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, false, false>(params, bidb, bidh, 0, STEPS, ph0, ph1, loop_step_idx);
+            fmha::device_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, false, false>(params, bidb, bidh, begin, steps, ph0, ph1, loop_step_idx);
         }
-        fmha::device_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, false, true>(params, bidb, bidh, 0, STEPS, ph0, ph1, max_loop_steps - 1);
+        fmha::device_1xN_<Kernel_traits, Is_dropout, Is_causal, Return_softmax, false, true>(params, bidb, bidh, begin, steps, ph0, ph1, max_loop_steps - 1);
     }
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+template<typename Kernel_traits, bool Is_dropout, bool Is_causal, bool Return_softmax, typename Params>
+inline __device__ void device_1xN_loop(const Params &params) {
+
+    // The block index for the batch.
+    const int bidb = blockIdx.y;
+    // The block index for the head.
+    const int bidh = blockIdx.x;
+
+    // Only the query blocks holding tokens of this sequence are scheduled, so the padding up to
+    // params.seqlen_q costs nothing. The returned softmax is laid out with the padded number of
+    // blocks though (see gmem_s.move in device_1xN_).
+    constexpr int M = Kernel_traits::Cta_tile_p::M;
+    const int actual_seqlen_q = fmha::actual_seqlen_q(params, bidb);
+    const int STEPS = Return_softmax ? params.seqlen_q / M : (actual_seqlen_q + M - 1) / M;
+
+    // Split-Q launch: blockIdx.z picks a contiguous range of query blocks. Each CTA still walks
+    // over all of K and V for its rows, so the o_tmp / softmax_lse round-trips stay per CTA.
+    // The split is never used when returning the softmax. device_1xN_ also assumes that a single
+    // CTA walks over all the query blocks of a head to place the dropout masks, while
+    // device_1xN_kv_inner_ computes their position directly.
+    const int steps_per_split = (STEPS + gridDim.z - 1) / gridDim.z;
+    const int begin = blockIdx.z * steps_per_split;
+    const int steps = std::min(steps_per_split, STEPS - begin);
+    if (steps <= 0) return;
+
+    device_1xN_loop_<Kernel_traits, Is_dropout, Is_causal, Return_softmax>(params, bidb, bidh, begin, steps);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Persistent launch: about one CTA per SM, each taking (query block, head, batch) items from the
+// queue of run_fmha_build_work_queue until it is empty. A long sequence is then spread over all
+// the SMs instead of the CTAs of its heads. Only for device_1xN_kv_inner_ (!Return_softmax and
+// several K/V blocks), which places the dropout masks of any range of query blocks.
+template<typename Kernel_traits, bool Is_dropout, bool Is_causal, typename Params>
+inline __device__ void device_1xN_persistent(const Params &params) {
+    constexpr int M = Kernel_traits::Cta_tile_p::M;
+    const int num_items = params.queue_offsets[params.b];
+    __shared__ int smem_item;
+    while (true) {
+        if (threadIdx.x == 0) { smem_item = atomicAdd(params.queue_counter, 1); }
+        __syncthreads();
+        const int item = smem_item;
+        // Everyone has the item before thread 0 takes the next one.
+        __syncthreads();
+        if (item >= num_items) { return; }
+
+        // The last rank whose items start at or before item, the empty batches are skipped.
+        int lo = 0, hi = params.b - 1;
+        while (lo < hi) {
+            const int mid = (lo + hi + 1) / 2;
+            if (params.queue_offsets[mid] <= item) { lo = mid; } else { hi = mid - 1; }
+        }
+        const int bidb = params.queue_order[lo];
+        const int local = item - params.queue_offsets[lo];
+        const int bidh = local % params.h;
+        // With causal, the last query blocks see the most keys, so they go first.
+        const int num_steps = (fmha::actual_seqlen_q(params, bidb) + M - 1) / M;
+        const int begin = Is_causal ? num_steps - 1 - local / params.h : local / params.h;
+        device_1xN_loop_<Kernel_traits, Is_dropout, Is_causal, /*Return_softmax=*/false>(params, bidb, bidh, begin, 1);
+        // The shared memory is reused by the next item.
+        __syncthreads();
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Grouped launch: the CTAs of all the problems of group in one 1D grid, the problem g taking the
+// CTAs [cta_offsets[g], cta_offsets[g + 1]) as (head, batch, split) with the head fastest, like the
+// grid of device_1xN_loop. Each (batch, head) splits its query blocks over num_splits[g] CTAs.
+// Always runs device_1xN_kv_inner_, which takes any number of K/V blocks, without dropout.
+template<typename Kernel_traits, bool Is_causal, typename Group_params>
+inline __device__ void device_1xN_grouped(const Group_params &group) {
+    // There are a few dozen problems at most, the first CTAs of the next ones are in L1 / L2.
+    const int cta = blockIdx.x;
+    int g = 0;
+    while( g + 1 < group.num_problems && group.cta_offsets[g + 1] <= cta ) { ++g; }
+    // The params stay in global memory, they are too large to go through the kernel arguments.
+    const auto &params = group.problems[g];
+    const int num_splits = group.num_splits[g];
+
+    const int cta_in_problem = cta - group.cta_offsets[g];
+    const int bidh = cta_in_problem % params.h;
+    const int bidb = (cta_in_problem / params.h) % params.b;
+    const int split = cta_in_problem / (params.h * params.b);
+
+    constexpr int M = Kernel_traits::Cta_tile_p::M;
+    const int STEPS = (fmha::actual_seqlen_q(params, bidb) + M - 1) / M;
+    const int steps_per_split = (STEPS + num_splits - 1) / num_splits;
+    const int begin = split * steps_per_split;
+    const int steps = std::min(steps_per_split, STEPS - begin);
+    if (steps <= 0) return;
+
+    const int tidx_global = (bidb * params.h + bidh) * blockDim.x * 2 + threadIdx.x;
+    fmha::device_1xN_kv_inner_<Kernel_traits, /*Is_dropout=*/false, Is_causal>(
+        params, bidb, bidh, begin, steps, tidx_global, /*seed=*/0, /*offset=*/0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 } // namespace fmha
 
@@ -40,6 +40,23 @@ namespace fmha {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// The number of queries / keys of the sequence bidb, packed or padded (see the params).
+template<typename Params>
+inline __device__ int actual_seqlen_q(const Params &params, const int bidb) {
+    return params.cu_seqlens_q != nullptr
+        ? params.cu_seqlens_q[bidb + 1] - params.cu_seqlens_q[bidb]
+        : params.seqlens_q[bidb];
+}
+
+template<typename Params>
+inline __device__ int actual_seqlen_k(const Params &params, const int bidb) {
+    return params.cu_seqlens_k != nullptr
+        ? params.cu_seqlens_k[bidb + 1] - params.cu_seqlens_k[bidb]
+        : params.seqlens_k[bidb];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template<int THREADS_PER_CTA>
 struct BlockInfoPadded {
 
@@ -48,31 +65,119 @@ struct BlockInfoPadded {
                                const int bidb,
                                const int bidh,
                                const int tidx)
-        : bidb(bidb), bidh(bidh), h(params.h) {
-
-        // The block index.
-        sum_s = params.cu_seqlens[bidb];
-        actual_seqlen = params.cu_seqlens[bidb + 1] - sum_s;
-        bidx = sum_s * params.h + bidh;
+        : bidb(bidb), bidh(bidh), h(params.h)
+        , window_left(params.window_left), window_right(params.window_right) {
+
+        // The block index. The queries and the keys of a sequence can have different lengths.
+        if( params.cu_seqlens_q != nullptr ) {
+            sum_s_q = params.cu_seqlens_q[bidb];
+            actual_seqlen_q = params.cu_seqlens_q[bidb + 1] - sum_s_q;
+            sum_s_k = params.cu_seqlens_k[bidb];
+            actual_seqlen_k = params.cu_seqlens_k[bidb + 1] - sum_s_k;
+        } else {
+            sum_s_q = bidb * params.padded_seqlen_q;
+            actual_seqlen_q = params.seqlens_q[bidb];
+            sum_s_k = bidb * params.padded_seqlen_k;
+            actual_seqlen_k = params.seqlens_k[bidb];
+        }
+        bidx = sum_s_q * params.h + bidh;
 
         tidx_global = (bidb * params.h + bidh) * THREADS_PER_CTA + tidx;
     }
 
     __device__ bool stop_early(const int start_col = 0) const {
-        return actual_seqlen <= start_col;
+        return actual_seqlen_k <= start_col;
     }
 
-    int actual_seqlen;
+    int actual_seqlen_q;
+    int actual_seqlen_k;
     int bidx;
-    int sum_s;
+    int sum_s_q;
+    int sum_s_k;
     int bidh;
     int bidb;
     int tidx_global;
     int h;
+    // The band of keys seen by a query with a causal or sliding-window mask (see fmha::Mask).
+    int window_left;
+    int window_right;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The ALiBi slope of the (batch, head) of binfo, divided by the softmax scale since the bias is
+// added to the unscaled scores. 0 without ALiBi.
+template<typename Params, typename BInfo>
+inline __device__ float get_alibi_slope(const Params &params, const BInfo &binfo) {
+    if (params.alibi_slopes_ptr == nullptr) { return 0.f; }
+    const float *slopes = reinterpret_cast<const float *>(params.alibi_slopes_ptr);
+    return slopes[binfo.bidb * params.alibi_slopes_batch_stride + binfo.bidh] / params.scale_bmm1f;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Adds the clock64() cycles of thread 0 between the marks to the phase ending at each mark, and
+// flushes them to params.phase_clocks_ptr[bidb][bidh] at the end, so the CTAs of a (batch, head)
+// and the calls for its K/V blocks sum up. The other warps run ahead or behind between the
+// __syncthreads, so the split is the one seen by warp 0. Does nothing unless FMHA_PROFILE_PHASES.
+struct Phase_clocks {
+
+    template<typename Params>
+    inline __device__ Phase_clocks(const Params &params, const int bidb, const int bidh, const int tidx) {
+#if FMHA_BUILD_PROFILE_PHASES
+        ptr_ = params.phase_clocks_ptr != nullptr && tidx == 0
+            ? params.phase_clocks_ptr + (size_t(bidb) * params.h + bidh) * FMHA_NUM_PHASES : nullptr;
+        #pragma unroll
+        for( int pi = 0; pi < FMHA_NUM_PHASES; ++pi ) { cycles_[pi] = 0; }
+        last_ = clock64();
+#endif
+    }
+
+    inline __device__ void mark(const int phase) {
+#if FMHA_BUILD_PROFILE_PHASES
+        if( ptr_ != nullptr ) {
+            const long long now = clock64();
+            cycles_[phase] += now - last_;
+            last_ = now;
+        }
+#endif
+    }
+
+    inline __device__ void flush() {
+#if FMHA_BUILD_PROFILE_PHASES
+        if( ptr_ != nullptr ) {
+            #pragma unroll
+            for( int pi = 0; pi < FMHA_NUM_PHASES; ++pi ) {
+                atomicAdd(reinterpret_cast<unsigned long long *>(&ptr_[pi]), (unsigned long long)cycles_[pi]);
+            }
+        }
+#endif
+    }
+
+#if FMHA_BUILD_PROFILE_PHASES
+    long long *ptr_;
+    long long cycles_[FMHA_NUM_PHASES];
+    long long last_;
+#endif
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Rotate the rows of Q (use_seqlen_q) or K fetched by gmem_tile before they are committed to
+// shared memory, if the rotary embedding is used. The rotated Q and K never go to global memory.
+template<typename elem_type, typename Gmem_tile, typename Params, typename BInfo>
+inline __device__ void apply_rotary_fetch(Gmem_tile &gmem_tile, const Params &params, const BInfo &binfo,
+                                          const bool use_seqlen_q) {
+    if (params.rotary_cos_ptr == nullptr) { return; }
+    gmem_tile.template apply_rotary<elem_type>(gmem_tile.fetch_,
+                                               reinterpret_cast<const float *>(params.rotary_cos_ptr),
+                                               reinterpret_cast<const float *>(params.rotary_sin_ptr),
+                                               params.rotary_dim,
+                                               use_seqlen_q ? binfo.actual_seqlen_q : binfo.actual_seqlen_k);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 template<int CHUNKS, typename Cta_tile> 
 struct Noloop_traits{
     // Interpretation of Cta_tile dims, i.e. Cta_tile_p:
@@ -82,7 +187,7 @@ struct Noloop_traits{
     template<typename Block_info>
     inline __device__ Noloop_traits(const int bidc, const Block_info& binfo) 
         : bidc_(bidc) {
-        const int seqlen = binfo.actual_seqlen;
+        const int seqlen = binfo.actual_seqlen_q;
         const int steps = (seqlen  + STEP - 1) / STEP;
         const int steps_per_chunk = (steps + CHUNKS - 1) / CHUNKS;
 
@@ -176,4 +281,20 @@ std::tuple<int , int, int, int, int, int> work_dist(const int total_ctas, const
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// The number of CTAs the query blocks of each (batch, head) are split over, so that small batches
+// with long sequences still fill the GPU. Every split reloads K and V, so we only split as much as
+// needed to fill one wave of ctas_per_sm * num_SMs CTAs.
+inline int num_splits_heuristic(const int batch_nheads, const int num_SMs, const int ctas_per_sm,
+                                const int num_steps) {
+    const int ctas_per_wave = num_SMs * ctas_per_sm;
+    if( batch_nheads >= ctas_per_wave ) { return 1; }
+    int num_splits = std::min((ctas_per_wave + batch_nheads - 1) / batch_nheads, num_steps);
+    // Avoid empty splits, e.g. 8 steps over 7 splits needs only 4 splits of 2 steps.
+    const int steps_per_split = (num_steps + num_splits - 1) / num_splits;
+    num_splits = (num_steps + steps_per_split - 1) / steps_per_split;
+    return std::max(num_splits, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 }  // namespace fmha
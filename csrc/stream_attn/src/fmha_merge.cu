@@ -0,0 +1,80 @@
+/* Copyright (c) 2022, Tri Dao.
+ */
+
+#include "fmha.h"
+
+template<typename T> inline __device__ float merge_load(const T *ptr) { return float(*ptr); }
+template<typename T> inline __device__ void merge_store(T *ptr, const float x);
+template<> inline __device__ void merge_store<__half>(__half *ptr, const float x) { *ptr = __float2half_rn(x); }
+template<> inline __device__ void merge_store<__nv_bfloat16>(__nv_bfloat16 *ptr, const float x) { *ptr = __float2bfloat16_rn(x); }
+template<> inline __device__ void merge_store<float>(float *ptr, const float x) { *ptr = x; }
+
+// One warp per (query, head). Each partial is weighted by its share exp(lse_i - lse) of the total
+// softmax sum, as in device_decode_combine. The partials with lse_i = -inf (no keys) are skipped.
+// The lanes read all the partials of an element before it is overwritten by the same lane, and the
+// log-sum-exp is written after all the lanes have read it.
+template<typename T_out, typename T_partial, int THREADS>
+__global__ void fmha_merge_kernel(Fused_multihead_attention_merge_params params) {
+    constexpr int WARPS = THREADS / 32;
+    const int lane = threadIdx.x % 32;
+    const int row_head = blockIdx.x * WARPS + threadIdx.x / 32;
+    if (row_head >= params.total_q * params.h) { return; }
+    const int row = row_head / params.h;
+    const int bidh = row_head % params.h;
+    const size_t lse_idx = size_t(bidh) * params.total_q + row;
+
+    float lse_max = -INFINITY;
+    for (int pi = 0; pi < params.num_partials; ++pi) {
+        lse_max = fmaxf(lse_max, params.lse_ptrs[pi][lse_idx]);
+    }
+    float scale[MAX_MERGE_PARTIALS];
+    float sum = 0.f;
+    #pragma unroll
+    for (int pi = 0; pi < MAX_MERGE_PARTIALS; ++pi) {
+        const float lse_pi = pi < params.num_partials ? params.lse_ptrs[pi][lse_idx] : -INFINITY;
+        scale[pi] = lse_pi == -INFINITY ? 0.f : expf(lse_pi - lse_max);
+        sum += scale[pi];
+    }
+    const float lse = sum == 0.f ? -INFINITY : lse_max + logf(sum);
+    #pragma unroll
+    for (int pi = 0; pi < MAX_MERGE_PARTIALS; ++pi) { scale[pi] = sum == 0.f ? 0.f : scale[pi] / sum; }
+    __syncwarp();
+    if (lane == 0) { params.lse_ptrs[0][lse_idx] = lse; }
+
+    const size_t o_offset = size_t(row_head) * params.d;
+    for (int vi = 0; vi < params.num_v; ++vi) {
+        for (int col = lane; col < params.d; col += 32) {
+            T_out *out = static_cast<T_out *>(params.o_ptrs[0][vi]) + o_offset + col;
+            float o = scale[0] == 0.f ? 0.f : scale[0] * merge_load(out);
+            #pragma unroll
+            for (int pi = 1; pi < MAX_MERGE_PARTIALS; ++pi) {
+                if (pi < params.num_partials && scale[pi] != 0.f) {
+                    o += scale[pi] * merge_load(static_cast<const T_partial *>(params.o_ptrs[pi][vi]) + o_offset + col);
+                }
+            }
+            merge_store(out, o);
+        }
+    }
+}
+
+void run_fmha_merge(const Fused_multihead_attention_merge_params &params, cudaStream_t stream) {
+    constexpr int THREADS = 128;
+    constexpr int WARPS = THREADS / 32;
+    dim3 grid((size_t(params.total_q) * params.h + WARPS - 1) / WARPS);
+    if (params.partial_type == DATA_TYPE_FP16) {
+        if (params.out_type == DATA_TYPE_FP32) {
+            fmha_merge_kernel<float, __half, THREADS><<<grid, THREADS, 0, stream>>>(params);
+        } else {
+            fmha_merge_kernel<__half, __half, THREADS><<<grid, THREADS, 0, stream>>>(params);
+        }
+    } else if (params.partial_type == DATA_TYPE_BF16) {
+        if (params.out_type == DATA_TYPE_FP32) {
+            fmha_merge_kernel<float, __nv_bfloat16, THREADS><<<grid, THREADS, 0, stream>>>(params);
+        } else {
+            fmha_merge_kernel<__nv_bfloat16, __nv_bfloat16, THREADS><<<grid, THREADS, 0, stream>>>(params);
+        }
+    } else {
+        fmha_merge_kernel<float, float, THREADS><<<grid, THREADS, 0, stream>>>(params);
+    }
+    FMHA_CHECK_CUDA(cudaPeekAtLastError());
+}
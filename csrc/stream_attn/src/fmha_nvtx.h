@@ -0,0 +1,39 @@
+/* Copyright (c) 2022, Tri Dao.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <static_switch.h>
+
+#if FMHA_BUILD_NVTX
+#include <nvtx3/nvToolsExt.h>
+#endif
+
+// Names a host-side scope in the Nsight Systems timeline, e.g. which traits a launch picked. The
+// header-only NVTX 3 costs a few ns per range when no tool is attached. STREAM_ATTN_DISABLE_NVTX=1
+// compiles the ranges out.
+struct Fmha_nvtx_range {
+    explicit Fmha_nvtx_range(const std::string &name) {
+#if FMHA_BUILD_NVTX
+        nvtxRangePushA(name.c_str());
+#endif
+    }
+
+    ~Fmha_nvtx_range() {
+#if FMHA_BUILD_NVTX
+        nvtxRangePop();
+#endif
+    }
+
+    Fmha_nvtx_range(const Fmha_nvtx_range &) = delete;
+    Fmha_nvtx_range &operator=(const Fmha_nvtx_range &) = delete;
+};
+
+// seqlen rounded up to a power of 2, at least 128, as in the keys of the autotuner.
+inline int fmha_seqlen_bucket(const int seqlen) {
+    int bucket = 128;
+    while (bucket < seqlen) { bucket *= 2; }
+    return bucket;
+}
@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <cuda_runtime_api.h>
 #include <cuda_fp16.h>
+#include <cuda_bf16.h>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -50,7 +51,7 @@
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-enum Data_type { DATA_TYPE_FP16, DATA_TYPE_FP32, DATA_TYPE_INT32, DATA_TYPE_INT8 };
+enum Data_type { DATA_TYPE_FP16, DATA_TYPE_BF16, DATA_TYPE_FP32, DATA_TYPE_INT32, DATA_TYPE_INT8, DATA_TYPE_FP8_E4M3 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
@@ -60,6 +61,11 @@ static inline void set_alpha( uint32_t &alpha, float norm, Data_type dtype ) {
         uint16_t h = reinterpret_cast<const uint16_t &>( x );
         ushort2 h2 = { h, h };
         alpha = reinterpret_cast<const uint32_t &>( h2 );
+    } else if( dtype == DATA_TYPE_BF16 ) {
+        __nv_bfloat16 x = __float2bfloat16_rn( norm );
+        uint16_t h = reinterpret_cast<const uint16_t &>( x );
+        ushort2 h2 = { h, h };
+        alpha = reinterpret_cast<const uint32_t &>( h2 );
     } else if( dtype == DATA_TYPE_FP32 ) {
         alpha = reinterpret_cast<const uint32_t &>( norm );
     } else if( dtype == DATA_TYPE_INT32 ) {
@@ -78,10 +84,14 @@ static inline size_t get_size_in_bytes( size_t n, Data_type dtype ) {
         return n * 4;
     case DATA_TYPE_FP16:
         return n * 2;
+    case DATA_TYPE_BF16:
+        return n * 2;
     case DATA_TYPE_INT32:
         return n * 4;
     case DATA_TYPE_INT8:
         return n;
+    case DATA_TYPE_FP8_E4M3:
+        return n;
     default:
         assert( false );
         return 0;
@@ -0,0 +1,39 @@
+/* Copyright (c) 2022, Tri Dao.
+ */
+
+#include "fmha.h"
+#include "fmha_kernel.h"
+
+// The items of the sequence b are its (query block, head) pairs, h * ceil(seqlen_q / M) of them.
+// Every query block walks over all the keys of its sequence, so the items of the longest key
+// sequences go first and the short ones fill in the tail. A single CTA finds the rank of each
+// batch and the offset of its items by comparing it with all the others, b is small.
+__global__ void fmha_build_work_queue_kernel(Fused_multihead_attention_fprop_params params,
+                                             const int M) {
+    const int b = params.b;
+    auto num_items = [&](const int bi) {
+        return params.h * ((fmha::actual_seqlen_q(params, bi) + M - 1) / M);
+    };
+    for (int bi = threadIdx.x; bi < b; bi += blockDim.x) {
+        const int seqlen_k = fmha::actual_seqlen_k(params, bi);
+        int rank = 0, offset = 0;
+        for (int bj = 0; bj < b; ++bj) {
+            const int seqlen_k_j = fmha::actual_seqlen_k(params, bj);
+            if (seqlen_k_j > seqlen_k || (seqlen_k_j == seqlen_k && bj < bi)) {
+                ++rank;
+                offset += num_items(bj);
+            }
+        }
+        params.queue_order[rank] = bi;
+        params.queue_offsets[rank] = offset;
+        if (rank == b - 1) { params.queue_offsets[b] = offset + num_items(bi); }
+    }
+    if (threadIdx.x == 0) { *params.queue_counter = 0; }
+}
+
+void run_fmha_build_work_queue(const Fused_multihead_attention_fprop_params &params, const int M,
+                               cudaStream_t stream) {
+    constexpr int THREADS = 256;
+    fmha_build_work_queue_kernel<<<1, THREADS, 0, stream>>>(params, M);
+    FMHA_CHECK_CUDA(cudaPeekAtLastError());
+}
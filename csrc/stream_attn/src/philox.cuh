@@ -67,6 +67,8 @@ private:
   // uint4 output;
   const uint2 key;
   unsigned int STATE;
+public:
+  // Skips n outputs, e.g. the dropout masks of the tiles that are not computed.
   __device__ inline void incr_n(unsigned long long n) {
     unsigned int nlo = (unsigned int)(n);
     unsigned int nhi = (unsigned int)(n >> 32);
@@ -81,6 +83,7 @@ private:
     ++counter.w;
   }
 
+private:
   __device__ uint4 incr128 (uint4 ctr)
   {
     uint4 res;
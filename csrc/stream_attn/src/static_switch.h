@@ -0,0 +1,144 @@
+/* Copyright (c) 2022, Tri Dao.
+ */
+
+#pragma once
+
+// Turns a runtime bool into the constexpr CONST_NAME inside the lambda, so the kernel for each
+// value is instantiated from a single line. The macro returns what the lambda returns, e.g.
+//
+// auto kernel = BOOL_SWITCH(is_causal, Is_causal, [&] {
+//     return &some_kernel<Kernel_traits, Is_causal>;
+// });
+#define BOOL_SWITCH(COND, CONST_NAME, ...)                                                         \
+    [&] {                                                                                          \
+        if( COND ) {                                                                               \
+            constexpr static bool CONST_NAME = true;                                               \
+            return __VA_ARGS__();                                                                  \
+        } else {                                                                                   \
+            constexpr static bool CONST_NAME = false;                                              \
+            return __VA_ARGS__();                                                                  \
+        }                                                                                          \
+    }()
+
+// Only instantiates the false case, for the features left out of the build.
+#define FALSE_SWITCH(COND, CONST_NAME, ...)                                                        \
+    [&] {                                                                                          \
+        constexpr static bool CONST_NAME = false;                                                  \
+        return __VA_ARGS__();                                                                      \
+    }()
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// setup.py can limit the instantiations to the configs that are deployed, see the STREAM_ATTN_*
+// variables there. Everything is built by default. fmha_api.cpp checks the FMHA_BUILD_* values so
+// the configs left out fail with an error instead of doing nothing.
+
+#if !defined(FMHA_HEADDIMS_SELECTED) || defined(FMHA_HDIM_16)
+#define FMHA_BUILD_HDIM_16 1
+#else
+#define FMHA_BUILD_HDIM_16 0
+#endif
+#if !defined(FMHA_HEADDIMS_SELECTED) || defined(FMHA_HDIM_32)
+#define FMHA_BUILD_HDIM_32 1
+#else
+#define FMHA_BUILD_HDIM_32 0
+#endif
+#if !defined(FMHA_HEADDIMS_SELECTED) || defined(FMHA_HDIM_64)
+#define FMHA_BUILD_HDIM_64 1
+#else
+#define FMHA_BUILD_HDIM_64 0
+#endif
+#if !defined(FMHA_HEADDIMS_SELECTED) || defined(FMHA_HDIM_128)
+#define FMHA_BUILD_HDIM_128 1
+#else
+#define FMHA_BUILD_HDIM_128 0
+#endif
+
+#if !defined(FMHA_NUM_V_SELECTED) || defined(FMHA_NUM_V_1)
+#define FMHA_BUILD_NUM_V_1 1
+#else
+#define FMHA_BUILD_NUM_V_1 0
+#endif
+#if !defined(FMHA_NUM_V_SELECTED) || defined(FMHA_NUM_V_2)
+#define FMHA_BUILD_NUM_V_2 1
+#else
+#define FMHA_BUILD_NUM_V_2 0
+#endif
+#if !defined(FMHA_NUM_V_SELECTED) || defined(FMHA_NUM_V_3)
+#define FMHA_BUILD_NUM_V_3 1
+#else
+#define FMHA_BUILD_NUM_V_3 0
+#endif
+#if !defined(FMHA_NUM_V_SELECTED) || defined(FMHA_NUM_V_4)
+#define FMHA_BUILD_NUM_V_4 1
+#else
+#define FMHA_BUILD_NUM_V_4 0
+#endif
+
+#ifdef FMHA_DISABLE_BF16
+#define FMHA_BUILD_BF16 0
+#else
+#define FMHA_BUILD_BF16 1
+#endif
+
+#ifdef FMHA_DISABLE_64BIT_INDEX
+#define FMHA_BUILD_64BIT_INDEX 0
+#else
+#define FMHA_BUILD_64BIT_INDEX 1
+#endif
+
+#ifdef FMHA_DISABLE_DROPOUT
+#define FMHA_BUILD_DROPOUT 0
+#define DROPOUT_SWITCH FALSE_SWITCH
+#else
+#define FMHA_BUILD_DROPOUT 1
+#define DROPOUT_SWITCH BOOL_SWITCH
+#endif
+
+#ifdef FMHA_DISABLE_RETURN_SOFTMAX
+#define FMHA_BUILD_RETURN_SOFTMAX 0
+#define RETURN_SOFTMAX_SWITCH FALSE_SWITCH
+#else
+#define FMHA_BUILD_RETURN_SOFTMAX 1
+#define RETURN_SOFTMAX_SWITCH BOOL_SWITCH
+#endif
+
+// Only the default config of the launchers is built, see fmha_autotune.h. The defaults are tuned for
+// A100, so on the GPUs with about 100KB of shared memory some of them fail with an error instead of
+// falling back to a config that fits. Keep the autotuner for those.
+#ifdef FMHA_DISABLE_AUTOTUNE
+#define FMHA_BUILD_AUTOTUNE 0
+#else
+#define FMHA_BUILD_AUTOTUNE 1
+#endif
+
+// The NVTX ranges of the fwd launches, see fmha_nvtx.h.
+#ifdef FMHA_DISABLE_NVTX
+#define FMHA_BUILD_NVTX 0
+#else
+#define FMHA_BUILD_NVTX 1
+#endif
+
+// The clock64() counters of the fwd kernels, see fmha::Phase_clocks. Off by default as they cost
+// registers and a few instructions per phase even when they are not requested.
+#ifdef FMHA_PROFILE_PHASES
+#define FMHA_BUILD_PROFILE_PHASES 1
+#else
+#define FMHA_BUILD_PROFILE_PHASES 0
+#endif
+
+// The other head dimensions (multiples of 8 up to 128, e.g. 80 or 96) run the kernels of the next
+// power of 2, the global memory tiles skip the columns past d.
+inline constexpr int fmha_round_head_dim(const int d) {
+    return d <= 16 ? 16 : (d <= 32 ? 32 : (d <= 64 ? 64 : 128));
+}
+
+inline constexpr bool fmha_build_head_dim(const int d) {
+    return (d == 16 && FMHA_BUILD_HDIM_16) || (d == 32 && FMHA_BUILD_HDIM_32)
+        || (d == 64 && FMHA_BUILD_HDIM_64) || (d == 128 && FMHA_BUILD_HDIM_128);
+}
+
+inline constexpr bool fmha_build_num_v(const int num_v) {
+    return (num_v == 1 && FMHA_BUILD_NUM_V_1) || (num_v == 2 && FMHA_BUILD_NUM_V_2)
+        || (num_v == 3 && FMHA_BUILD_NUM_V_3) || (num_v == 4 && FMHA_BUILD_NUM_V_4);
+}
@@ -2,59 +2,102 @@
 import torch
 import torch.nn as nn
 
+from einops import rearrange
+
 import stream_attn_cuda
 
 
-def _stream_attn_forward(qkv, cu_seqlens, dropout_p, max_s, softmax_scale, causal, return_softmax):
-    context, softmax_lse, *rest = stream_attn_cuda.fwd(qkv, cu_seqlens, dropout_p, max_s, softmax_scale,
-                                                       False, causal, return_softmax, None)
-    # if context.isnan().any() or softmax_lse.isnan().any():
+def _stream_attn_forward(qkvv, cu_seqlens_q, cu_seqlens_k, dropout_p, max_seqlen_q, max_seqlen_k,
+                         softmax_scale, causal, return_softmax, window_size=(-1, -1),
+                         alibi_slopes=None, rotary_cos=None, rotary_sin=None, seqlens_q=None,
+                         seqlens_k=None, zero_tensors=False, return_softmax_stats=False, out=None,
+                         softmax_lse=None, workspace=None, phase_clocks=None):
+    """qkvv: list of Q, K, V_0, ..., V_{num_v - 1} with any row and head strides. Q is
+    (total_q, nheads, headdim), K and the V_i are (total_k, nheads, headdim).
+    The last result is S_dmask with return_softmax, or the softmax stats of shape
+    (2, nheads, total_q) with return_softmax_stats, see stream_attn_func.
+    For padded batches, cu_seqlens_q and cu_seqlens_k are None and seqlens_q, seqlens_k hold the
+    lengths of the sequences, the sequence i taking the rows [i * total_q / batch_size, ...).
+    out, softmax_lse and workspace are written instead of allocating them, see
+    stream_attn_workspace_size. The kernels add their cycles per phase to phase_clocks, see
+    stream_attn_phase_clocks.
+    """
+    num_v = len(qkvv) - 2
+    out = stream_attn_cuda.fwd(list(qkvv), cu_seqlens_q, cu_seqlens_k, dropout_p, max_seqlen_q,
+                               max_seqlen_k, softmax_scale, zero_tensors, causal, window_size[0],
+                               window_size[1], alibi_slopes, rotary_cos, rotary_sin,
+                               seqlens_q, seqlens_k, return_softmax, return_softmax_stats,
+                               None if out is None else list(out), softmax_lse, workspace,
+                               phase_clocks, None)
+    contexts, softmax_lse, rest = out[:num_v], out[num_v], out[num_v + 1:]
+    # if any(c.isnan().any() for c in contexts) or softmax_lse.isnan().any():
     #     breakpoint()
-    S_dmask = rest[0] if return_softmax else None
-    return context, softmax_lse, S_dmask
+    S_dmask = rest[0] if return_softmax or return_softmax_stats else None
+    return contexts, softmax_lse, S_dmask
 
 
-def _stream_attn_backward(dout, qkv, out, S_dmask, softmax_lse, cu_seqlens, dropout_p, max_s,
-                   softmax_scale, causal):
-    dqkv, dp, softmax_d = stream_attn_cuda.bwd(dout, qkv, out, S_dmask, softmax_lse, cu_seqlens, dropout_p,
-                                               softmax_scale, max_s, False, causal, None)
-    # if dqkv.isnan().any() or softmax_d.isnan().any():
+def _stream_attn_backward(douts, qkvv, outs, dqkvv, softmax_lse, cu_seqlens_q, cu_seqlens_k,
+                          dropout_p, max_seqlen_q, max_seqlen_k, softmax_scale, causal,
+                          window_size=(-1, -1), alibi_slopes=None, rotary_cos=None,
+                          rotary_sin=None, seqlens_q=None, seqlens_k=None):
+    """dqkvv: list of dQ, dK, dV_0, ..., dV_{num_v - 1}, written in place. The padding rows of
+    padded batches are zeroed."""
+    softmax_d, = stream_attn_cuda.bwd([dout.contiguous() for dout in douts], list(qkvv), list(outs),
+                                      list(dqkvv), softmax_lse, cu_seqlens_q, cu_seqlens_k, dropout_p,
+                                      softmax_scale, max_seqlen_q, max_seqlen_k, False, causal,
+                                      window_size[0], window_size[1], alibi_slopes, rotary_cos,
+                                      rotary_sin, seqlens_q, seqlens_k, None)
+    # if any(d.isnan().any() for d in dqkvv) or softmax_d.isnan().any():
     #     breakpoint()
-    return dqkv
+    return dqkvv
 
 
 class StreamAttnFun(torch.autograd.Function):
 
     @staticmethod
-    def forward(ctx, qkv, cu_seqlens, dropout_p, max_s, softmax_scale, causal):
+    def forward(ctx, qkvv, cu_seqlens, dropout_p, max_s, softmax_scale, causal, window_size,
+                alibi_slopes, rotary_cos, rotary_sin, return_softmax_stats=False):
         # Save rng_state because the backward pass will regenerate the dropout mask
         rng_state = torch.cuda.get_rng_state() if dropout_p > 0 else None
         if softmax_scale is None:
-            softmax_scale = qkv.shape[-1] ** (-0.5)
-        context, softmax_lse, S_dmask = _stream_attn_forward(
-            qkv, cu_seqlens, dropout_p, max_s, softmax_scale, causal=causal, return_softmax=False
+            softmax_scale = qkvv.shape[-1] ** (-0.5)
+        contexts, softmax_lse, softmax_stats = _stream_attn_forward(
+            qkvv.unbind(1), cu_seqlens, cu_seqlens, dropout_p, max_s, max_s, softmax_scale,
+            causal=causal, return_softmax=False, window_size=window_size,
+            alibi_slopes=alibi_slopes, rotary_cos=rotary_cos, rotary_sin=rotary_sin,
+            return_softmax_stats=return_softmax_stats
         )
-        ctx.save_for_backward(qkv, context, S_dmask, softmax_lse, cu_seqlens, rng_state)
+        ctx.save_for_backward(qkvv, softmax_lse, cu_seqlens, rng_state, *contexts)
         ctx.dropout_p = dropout_p
         ctx.max_s = max_s
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
-        return context
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.rotary_cos, ctx.rotary_sin = rotary_cos, rotary_sin
+        ctx.return_softmax_stats = return_softmax_stats
+        if return_softmax_stats:
+            ctx.mark_non_differentiable(softmax_stats)
+            return (*contexts, softmax_stats)
+        return tuple(contexts)
 
     @staticmethod
-    def backward(ctx, dout):
-        qkv, context, S_dmask, softmax_lse, cu_seqlens, rng_state = ctx.saved_tensors
+    def backward(ctx, *douts):
+        if ctx.return_softmax_stats:
+            douts = douts[:-1]
+        qkvv, softmax_lse, cu_seqlens, rng_state, *contexts = ctx.saved_tensors
         if rng_state is not None:
             cur_rng_state = torch.cuda.get_rng_state()
             torch.cuda.set_rng_state(rng_state)
-        # S_dmask is None, temporarily use another tensor just to get it running
-        dqkv = _stream_attn_backward(
-            dout, qkv, context, context, softmax_lse, cu_seqlens, ctx.dropout_p,
-            ctx.max_s, ctx.softmax_scale, ctx.causal
+        dqkvv = torch.empty_like(qkvv)
+        _stream_attn_backward(
+            douts, qkvv.unbind(1), contexts, dqkvv.unbind(1), softmax_lse, cu_seqlens, cu_seqlens,
+            ctx.dropout_p, ctx.max_s, ctx.max_s, ctx.softmax_scale, ctx.causal, ctx.window_size,
+            ctx.alibi_slopes, ctx.rotary_cos, ctx.rotary_sin
         )
         if rng_state is not None:
             torch.cuda.set_rng_state(cur_rng_state)
-        return dqkv, None, None, None, None, None, None
+        return dqkvv, None, None, None, None, None, None, None, None, None, None
 
 
 # We duplicate code to return both the output and the softmax for testing
@@ -62,39 +105,324 @@ class StreamAttnFun(torch.autograd.Function):
 class StreamAttnFunWithS(torch.autograd.Function):
 
     @staticmethod
-    def forward(ctx, qkv, cu_seqlens, dropout_p, max_s, softmax_scale, causal):
+    def forward(ctx, qkvv, cu_seqlens, dropout_p, max_s, softmax_scale, causal, window_size,
+                alibi_slopes, rotary_cos, rotary_sin):
         # Save rng_state because the backward pass is gonna regenerate the dropout mask
         rng_state = torch.cuda.get_rng_state() if dropout_p > 0 else None
         if softmax_scale is None:
-            softmax_scale = qkv.shape[-1] ** (-0.5)
-        context, softmax_lse, S_dmask = _stream_attn_forward(
-            qkv, cu_seqlens, dropout_p, max_s, softmax_scale, causal=causal, return_softmax=True
+            softmax_scale = qkvv.shape[-1] ** (-0.5)
+        contexts, softmax_lse, S_dmask = _stream_attn_forward(
+            qkvv.unbind(1), cu_seqlens, cu_seqlens, dropout_p, max_s, max_s, softmax_scale,
+            causal=causal, return_softmax=True, window_size=window_size,
+            alibi_slopes=alibi_slopes, rotary_cos=rotary_cos, rotary_sin=rotary_sin
         )
-        ctx.save_for_backward(qkv, context, S_dmask, softmax_lse, cu_seqlens, rng_state)
+        ctx.save_for_backward(qkvv, softmax_lse, cu_seqlens, rng_state, *contexts)
         ctx.dropout_p = dropout_p
         ctx.max_s = max_s
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
-        return context, S_dmask, softmax_lse
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.rotary_cos, ctx.rotary_sin = rotary_cos, rotary_sin
+        return (*contexts, S_dmask, softmax_lse)
+
+    @staticmethod
+    def backward(ctx, *grads):
+        # The last two grads are for S_dmask and softmax_lse, which are ignored.
+        douts = grads[:-2]
+        qkvv, softmax_lse, cu_seqlens, rng_state, *contexts = ctx.saved_tensors
+        if rng_state is not None:
+            cur_rng_state = torch.cuda.get_rng_state()
+            torch.cuda.set_rng_state(rng_state)
+        dqkvv = torch.empty_like(qkvv)
+        _stream_attn_backward(
+            douts, qkvv.unbind(1), contexts, dqkvv.unbind(1), softmax_lse, cu_seqlens, cu_seqlens,
+            ctx.dropout_p, ctx.max_s, ctx.max_s, ctx.softmax_scale, ctx.causal, ctx.window_size,
+            ctx.alibi_slopes, ctx.rotary_cos, ctx.rotary_sin
+        )
+        if rng_state is not None:
+            torch.cuda.set_rng_state(cur_rng_state)
+        return dqkvv, None, None, None, None, None, None, None, None, None
+
+
+class StreamAttnSeparateFun(torch.autograd.Function):
+
+    @staticmethod
+    def forward(ctx, cu_seqlens_q, cu_seqlens_k, dropout_p, max_seqlen_q, max_seqlen_k,
+                softmax_scale, causal, window_size, alibi_slopes, rotary_cos, rotary_sin, *qkvv):
+        # Save rng_state because the backward pass will regenerate the dropout mask
+        rng_state = torch.cuda.get_rng_state() if dropout_p > 0 else None
+        if softmax_scale is None:
+            softmax_scale = qkvv[0].shape[-1] ** (-0.5)
+        contexts, softmax_lse, _ = _stream_attn_forward(
+            qkvv, cu_seqlens_q, cu_seqlens_k, dropout_p, max_seqlen_q, max_seqlen_k, softmax_scale,
+            causal=causal, return_softmax=False, window_size=window_size,
+            alibi_slopes=alibi_slopes, rotary_cos=rotary_cos, rotary_sin=rotary_sin
+        )
+        ctx.save_for_backward(softmax_lse, cu_seqlens_q, cu_seqlens_k, rng_state, *qkvv, *contexts)
+        ctx.num_v = len(qkvv) - 2
+        ctx.dropout_p = dropout_p
+        ctx.max_seqlen_q = max_seqlen_q
+        ctx.max_seqlen_k = max_seqlen_k
+        ctx.softmax_scale = softmax_scale
+        ctx.causal = causal
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.rotary_cos, ctx.rotary_sin = rotary_cos, rotary_sin
+        return tuple(contexts)
 
     @staticmethod
-    def backward(ctx, dout, _dS_dmask_ignored, _dsoftmax_sum_ignored):
-        qkv, context, S_dmask, softmax_lse, cu_seqlens, rng_state = ctx.saved_tensors
+    def backward(ctx, *douts):
+        softmax_lse, cu_seqlens_q, cu_seqlens_k, rng_state, *rest = ctx.saved_tensors
+        qkvv, contexts = rest[:ctx.num_v + 2], rest[ctx.num_v + 2:]
         if rng_state is not None:
             cur_rng_state = torch.cuda.get_rng_state()
             torch.cuda.set_rng_state(rng_state)
-        dqkv = _stream_attn_backward(
-            dout, qkv, context, S_dmask, softmax_lse, cu_seqlens, ctx.dropout_p,
-            ctx.max_s, ctx.softmax_scale, ctx.causal
+        dqkvv = [torch.empty_like(t) for t in qkvv]
+        _stream_attn_backward(
+            douts, qkvv, contexts, dqkvv, softmax_lse, cu_seqlens_q, cu_seqlens_k, ctx.dropout_p,
+            ctx.max_seqlen_q, ctx.max_seqlen_k, ctx.softmax_scale, ctx.causal, ctx.window_size,
+            ctx.alibi_slopes, ctx.rotary_cos, ctx.rotary_sin
         )
         if rng_state is not None:
             torch.cuda.set_rng_state(cur_rng_state)
-        return dqkv, None, None, None, None, None
+        return (None, None, None, None, None, None, None, None, None, None, None, *dqkvv)
+
 
+class StreamAttnPaddedFun(torch.autograd.Function):
 
-def stream_attn_func(qkv, cu_seqlens, dropout_p, max_s, softmax_scale=None, causal=False,
-                     return_attn_probs=False):
-    """dropout_p should be set to 0.0 during evaluation
+    @staticmethod
+    def forward(ctx, qkvv, seqlens, dropout_p, softmax_scale, causal, window_size, alibi_slopes,
+                rotary_cos, rotary_sin):
+        # Save rng_state because the backward pass will regenerate the dropout mask
+        rng_state = torch.cuda.get_rng_state() if dropout_p > 0 else None
+        if softmax_scale is None:
+            softmax_scale = qkvv.shape[-1] ** (-0.5)
+        batch_size, seqlen = qkvv.shape[:2]
+        contexts, softmax_lse, _ = _stream_attn_forward(
+            rearrange(qkvv, 'b s ... -> (b s) ...').unbind(1), None, None, dropout_p, seqlen,
+            seqlen, softmax_scale, causal=causal, return_softmax=False, window_size=window_size,
+            alibi_slopes=alibi_slopes, rotary_cos=rotary_cos, rotary_sin=rotary_sin,
+            seqlens_q=seqlens, seqlens_k=seqlens
+        )
+        ctx.save_for_backward(qkvv, softmax_lse, seqlens, rng_state, *contexts)
+        ctx.dropout_p = dropout_p
+        ctx.softmax_scale = softmax_scale
+        ctx.causal = causal
+        ctx.window_size = window_size
+        ctx.alibi_slopes = alibi_slopes
+        ctx.rotary_cos, ctx.rotary_sin = rotary_cos, rotary_sin
+        return tuple(rearrange(c, '(b s) ... -> b s ...', b=batch_size) for c in contexts)
+
+    @staticmethod
+    def backward(ctx, *douts):
+        qkvv, softmax_lse, seqlens, rng_state, *contexts = ctx.saved_tensors
+        if rng_state is not None:
+            cur_rng_state = torch.cuda.get_rng_state()
+            torch.cuda.set_rng_state(rng_state)
+        seqlen = qkvv.shape[1]
+        dqkvv = torch.empty_like(qkvv)
+        _stream_attn_backward(
+            [rearrange(dout, 'b s ... -> (b s) ...') for dout in douts],
+            rearrange(qkvv, 'b s ... -> (b s) ...').unbind(1), contexts,
+            rearrange(dqkvv, 'b s ... -> (b s) ...').unbind(1), softmax_lse, None, None,
+            ctx.dropout_p, seqlen, seqlen, ctx.softmax_scale, ctx.causal, ctx.window_size,
+            ctx.alibi_slopes, ctx.rotary_cos, ctx.rotary_sin, seqlens_q=seqlens, seqlens_k=seqlens
+        )
+        if rng_state is not None:
+            torch.cuda.set_rng_state(cur_rng_state)
+        return dqkvv, None, None, None, None, None, None, None, None
+
+
+def stream_attn_func(qkvv, cu_seqlens, dropout_p, max_s, softmax_scale=None, causal=False,
+                     return_attn_probs=False, window_size=(-1, -1), alibi_slopes=None,
+                     rotary_cos=None, rotary_sin=None, return_softmax_stats=False):
+    """qkvv: (total, 2 + num_v, nheads, headdim), packed Q, K, V_0, ..., V_{num_v - 1}, with
+    1 <= num_v <= 4 (num_v <= 2 for headdim 128). Returns a tuple of num_v outputs, all of which
+    share the same softmax(Q K^T). With return_attn_probs=True, S_dmask and the softmax_lse of
+    shape (nheads, total) follow the outputs.
+    window_size: (left, right), query i only attends to the keys i - left, ..., i + right of its
+    sequence (sliding-window attention), -1 for no bound. With causal=True, right is 0. The work
+    grows linearly with the sequence length instead of quadratically.
+    alibi_slopes: (nheads,) or (batch_size, nheads), fp32, adds -slope * |i - j| to the score of
+    query i and key j, computed on the fly.
+    rotary_cos, rotary_sin: (seqlen_ro, rotary_dim / 2), fp32, with seqlen_ro >= max_s and
+    rotary_dim a multiple of 8. Q and K are rotated by the rotary embedding (interleaved pairs, as
+    in rotary.py) of the position of each token in its sequence while they are loaded, so the
+    rotated Q and K never go to memory. The gradients are for the unrotated Q and K. E.g.
+    freqs = torch.outer(t, inv_freq), rotary_cos = freqs.cos(), rotary_sin = freqs.sin().
+    return_softmax_stats: instead of the (nheads, seqlen, seqlen) probabilities of return_attn_probs,
+    returns a tensor of shape (2, nheads, total) in fp32 after the outputs, computed on the fly: the
+    entropy -sum_j p_ij log(p_ij) of each row of the softmax and its largest probability max_j p_ij
+    (before the dropout). The queries without keys get 0. No gradient flows through them.
+    dropout_p should be set to 0.0 during evaluation
     """
+    if return_softmax_stats:
+        assert not return_attn_probs, 'Either the softmax or its stats can be returned'
+        return StreamAttnFun.apply(qkvv, cu_seqlens, dropout_p, max_s, softmax_scale, causal,
+                                   window_size, alibi_slopes, rotary_cos, rotary_sin, True)
     func = StreamAttnFun if not return_attn_probs else StreamAttnFunWithS
-    return func.apply(qkv, cu_seqlens, dropout_p, max_s, softmax_scale, causal)
+    return func.apply(qkvv, cu_seqlens, dropout_p, max_s, softmax_scale, causal, window_size,
+                      alibi_slopes, rotary_cos, rotary_sin)
+
+
+def stream_attn_padded_func(qkvv, seqlens, dropout_p, softmax_scale=None, causal=False,
+                            window_size=(-1, -1), alibi_slopes=None, rotary_cos=None,
+                            rotary_sin=None):
+    """Same as stream_attn_func, for a padded batch. The kernels read the padded inputs and write
+    the padded outputs directly, without unpad_input / pad_input around them.
+    qkvv: (batch_size, seqlen, 2 + num_v, nheads, headdim), the tokens of the sequence i first.
+    seqlens: (batch_size,), int32, the number of tokens of each sequence, at most seqlen. E.g.
+    key_padding_mask.sum(-1, dtype=torch.int32) for a mask with the padding at the end.
+    Returns a tuple of num_v outputs of shape (batch_size, seqlen, nheads, headdim). The outputs
+    and the gradients of the padding tokens are 0.
+    dropout_p should be set to 0.0 during evaluation
+    """
+    return StreamAttnPaddedFun.apply(qkvv, seqlens, dropout_p, softmax_scale, causal, window_size,
+                                     alibi_slopes, rotary_cos, rotary_sin)
+
+
+def stream_attn_decode_func(q, kvv_cache, block_table, seqlens_k, max_seqlen_k, softmax_scale=None,
+                            num_splits=0, kvv_scales=None):
+    """Attention of one new query token per sequence against a paged cache, for inference.
+    q: (batch_size, nheads, headdim).
+    kvv_cache: (num_blocks, page_size, 1 + num_v, nheads, headdim), packed K, V_0, ..., V_{num_v - 1}.
+    block_table: (batch_size, max_num_blocks_per_seq), int32. Entry j of a sequence is the block of
+        kvv_cache holding its keys [j * page_size, (j + 1) * page_size).
+    seqlens_k: (batch_size,), int32, the number of keys in the cache of each sequence (including
+        the new token if it has been appended already). max_seqlen_k bounds seqlens_k.
+    num_splits: the number of CTAs the keys are split over, 0 picks it with a heuristic.
+    kvv_scales: fp32, (1 + num_v, nheads) or (num_blocks, 1 + num_v, nheads), for a kvv_cache in
+        int8 or fp8 e4m3 (torch.float8_e4m3fn, or its bits as uint8). The cache is dequantized
+        as kvv_cache * kvv_scales in the kernel.
+    Returns a tuple of num_v outputs of shape (batch_size, nheads, headdim) and the softmax_lse of
+    shape (batch_size, nheads).
+    """
+    if softmax_scale is None:
+        softmax_scale = q.shape[-1] ** (-0.5)
+    num_v = kvv_cache.shape[2] - 1
+    if kvv_cache.dtype == getattr(torch, 'float8_e4m3fn', None):
+        kvv_cache = kvv_cache.view(torch.uint8)
+    out = stream_attn_cuda.fwd_decode(q, kvv_cache, block_table, seqlens_k, max_seqlen_k,
+                                      softmax_scale, num_splits, kvv_scales)
+    return tuple(out[:num_v]), out[num_v]
+
+
+def stream_attn_separate_func(q, k, vs, cu_seqlens_q, cu_seqlens_k, dropout_p, max_seqlen_q,
+                              max_seqlen_k, softmax_scale=None, causal=False, window_size=(-1, -1),
+                              alibi_slopes=None, rotary_cos=None, rotary_sin=None):
+    """Same as stream_attn_func, but Q, K and the V_i are separate tensors, so they can be read in
+    place from the outputs of the projections without packing them first, and the queries and keys
+    can have different lengths (e.g. cross-attention).
+    q: (total_q, nheads, headdim), k and each V_i of vs: (total_k, nheads, headdim). The last
+    dimension has to be contiguous, the row and head strides can be anything (multiples of 8
+    elements).
+    cu_seqlens_q, cu_seqlens_k: (batch_size + 1,), int32, the offsets of the query and the key
+    sequences. max_seqlen_q and max_seqlen_k bound their lengths. With causal=True, query i attends
+    to the keys 0, ..., i of its sequence. window_size, alibi_slopes, rotary_cos and rotary_sin
+    are the same as for stream_attn_func.
+    dropout_p should be set to 0.0 during evaluation
+    """
+    return StreamAttnSeparateFun.apply(cu_seqlens_q, cu_seqlens_k, dropout_p, max_seqlen_q,
+                                       max_seqlen_k, softmax_scale, causal, window_size, alibi_slopes,
+                                       rotary_cos, rotary_sin, q, k, *vs)
+
+
+@torch.no_grad()
+def stream_attn_partial_func(q, k, vs, cu_seqlens_q, cu_seqlens_k, max_seqlen_q, max_seqlen_k,
+                             softmax_scale=None, causal=False, window_size=(-1, -1),
+                             alibi_slopes=None, rotary_cos=None, rotary_sin=None):
+    """Forward pass of the queries q against one shard of the keys k and values vs, e.g. the K/V of
+    another GPU with sequence parallelism / ring attention. The arguments are the same as for
+    stream_attn_separate_func, cu_seqlens_k and max_seqlen_k describe the shard. Returns a tuple
+    of num_v outputs, each normalized by the softmax sum of the shard, and the softmax_lse of shape
+    (nheads, total_q) in fp32. The queries without keys in the shard get 0 and -inf, so the
+    partials of all the shards can be merged with stream_attn_merge_. No gradients.
+    """
+    if softmax_scale is None:
+        softmax_scale = q.shape[-1] ** (-0.5)
+    contexts, softmax_lse, _ = _stream_attn_forward(
+        [q, k, *vs], cu_seqlens_q, cu_seqlens_k, 0.0, max_seqlen_q, max_seqlen_k, softmax_scale,
+        causal=causal, return_softmax=False, window_size=window_size, alibi_slopes=alibi_slopes,
+        rotary_cos=rotary_cos, rotary_sin=rotary_sin, zero_tensors=True
+    )
+    return tuple(contexts), softmax_lse
+
+
+def stream_attn_workspace_size(batch_size, total_q, nheads, headdim, num_v, max_seqlen_k,
+                               return_softmax=False):
+    """The size in bytes of the uint8 workspace of the forward pass for these sizes, 0 if it needs
+    none. It only depends on the sizes, so a buffer of that size can be allocated once and reused,
+    e.g. across the replays of a CUDA graph.
+    """
+    return stream_attn_cuda.fwd_workspace_size(batch_size, total_q, nheads, headdim, num_v,
+                                               max_seqlen_k, return_softmax)
+
+
+@torch.no_grad()
+def stream_attn_out_func(q, k, vs, cu_seqlens_q, cu_seqlens_k, max_seqlen_q, max_seqlen_k, out,
+                         softmax_lse, workspace=None, softmax_scale=None, causal=False,
+                         window_size=(-1, -1), alibi_slopes=None, rotary_cos=None,
+                         rotary_sin=None, phase_clocks=None):
+    """Forward pass into preallocated buffers, for inference. Nothing is allocated when workspace
+    has stream_attn_workspace_size bytes (or it needs none), so the call can be captured in a CUDA
+    graph and replayed with new contents of the same tensors. The arguments are the same as for
+    stream_attn_separate_func, without dropout.
+    out: tuple of num_v contiguous tensors (total_q, nheads, headdim), the type of q.
+    softmax_lse: contiguous (nheads, total_q), fp32.
+    workspace: contiguous uint8 of at least stream_attn_workspace_size bytes.
+    phase_clocks: optional, see stream_attn_phase_clocks.
+    No gradients. Returns out and softmax_lse.
+    """
+    if softmax_scale is None:
+        softmax_scale = q.shape[-1] ** (-0.5)
+    _stream_attn_forward(
+        [q, k, *vs], cu_seqlens_q, cu_seqlens_k, 0.0, max_seqlen_q, max_seqlen_k, softmax_scale,
+        causal=causal, return_softmax=False, window_size=window_size, alibi_slopes=alibi_slopes,
+        rotary_cos=rotary_cos, rotary_sin=rotary_sin, out=out, softmax_lse=softmax_lse,
+        workspace=workspace, phase_clocks=phase_clocks
+    )
+    return out, softmax_lse
+
+
+def stream_attn_phase_clocks(batch_size, nheads, device=None):
+    """Zeroed int64 counters (batch_size, nheads, len(stream_attn_cuda.fwd_phases)) for the
+    phase_clocks argument of stream_attn_out_func. Each forward pass adds the clock64() cycles of
+    warp 0 of the CTAs of a (batch, head) spent in each phase, in the order of the names in
+    stream_attn_cuda.fwd_phases. Only for the extension built with STREAM_ATTN_PROFILE_PHASES=1,
+    see stream_attn_cuda.profile_phases_built.
+    """
+    return torch.zeros(batch_size, nheads, len(stream_attn_cuda.fwd_phases), dtype=torch.int64,
+                       device=device)
+
+
+@torch.no_grad()
+def stream_attn_grouped_func(qs, ks, vss, cu_seqlens_qs, cu_seqlens_ks, max_seqlens_q,
+                             max_seqlens_k, softmax_scales=None, causal=False):
+    """Forward pass of several independent problems in one kernel launch, e.g. the experts of a
+    mixture-of-experts layer. Each argument is a list with one entry per problem, as for
+    stream_attn_separate_func: q (total_q, nheads, headdim), k (total_k, nheads, headdim), vs a
+    tuple of num_v tensors like k, the cu_seqlens and the max lengths. The number of heads, the
+    batches and the sequences can differ, the type, headdim and num_v must be the same.
+    No dropout, ALiBi, rotary or sliding windows, and no gradients.
+    Returns a list with the tuple of num_v outputs and the softmax_lse of each problem.
+    """
+    if softmax_scales is None:
+        softmax_scales = [q.shape[-1] ** (-0.5) for q in qs]
+    out = stream_attn_cuda.fwd_grouped([[q, k, *vs] for q, k, vs in zip(qs, ks, vss)],
+                                       list(cu_seqlens_qs), list(cu_seqlens_ks), list(max_seqlens_q),
+                                       list(max_seqlens_k), list(softmax_scales), causal)
+    return [(tuple(o[:-1]), o[-1]) for o in out]
+
+
+def stream_attn_merge_(outs, softmax_lses):
+    """Merges the partial results of stream_attn_partial_func for the same queries and different
+    keys into the first partial, in place, in fp32.
+    outs: list of num_partials tuples of num_v outputs (total_q, nheads, headdim), contiguous. The
+        outputs of the first partial can be fp32 to accumulate over several merges, e.g. one per
+        step of ring attention, without rounding to fp16 / bf16 in between.
+    softmax_lses: list of num_partials softmax_lse of shape (nheads, total_q), fp32.
+    Returns the first partial, which is then the attention over all the keys.
+    """
+    stream_attn_cuda.fwd_merge([o for out in outs for o in out], list(softmax_lses))
+    return outs[0], softmax_lses[0]
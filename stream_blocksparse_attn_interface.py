@@ -1,4 +1,6 @@
 # Adapted from https://github.com/mlcommons/training_results_v1.1/blob/main/NVIDIA/benchmarks/bert/implementations/pytorch/fmha.py
+import hashlib
+
 import torch
 import torch.nn as nn
 
@@ -14,15 +16,24 @@ def convert_blockmask(blockmask, causal):
     Return:
         blockmask_converted: (col, row), dtype torch.int32: for each column, it contains the row
             indices of the nonzero blocks, padded with -1 to reach length @row.
-            The indices are multiplied by 4, with the smallest bit used to encode whether
-            it is the first nonzero in its row, and the 2nd smallest bit to encode whether it is
-            the last nonzero in its row..
+            The indices are multiplied by 8, with the smallest bit used to encode whether
+            it is the first nonzero in its row, the 2nd smallest bit to encode whether it is
+            the last nonzero in its row, and the 3rd smallest bit to encode whether it is on the
+            diagonal and needs the causal mask.
+            With causal, the blocks above the diagonal are dropped.
+    CUDA tensors are converted by a kernel of the extension, see also convert_blockmask_cached.
     """
-    assert not causal
+    if blockmask.is_cuda:
+        return stream_attn_cuda.convert_blockmask(blockmask, causal)
     # TD [2022-05-13]: The indexing and sorting is very tricky
     nrow, ncol = blockmask.shape
     # Sort does not support bool on CUDA
     blockmask = blockmask.to(dtype=torch.uint8)
+    # A row of the blockmask is 16 queries and a column 256 keys.
+    row_idx = torch.arange(nrow, device=blockmask.device)[:, None]
+    col_idx = torch.arange(ncol, device=blockmask.device)[None, :]
+    if causal:
+        blockmask = blockmask.masked_fill(col_idx * 256 > row_idx * 16 + 15, 0)
     nonzero_val, nonzero_sorted_rowidx = blockmask.sort(dim=0, stable=True, descending=True)
     nonzero_unsorted_rowidx = nonzero_sorted_rowidx.argsort(dim=0)
     last_nonzero_col_per_row = blockmask.sort(dim=-1, stable=True).indices[:, -1]
@@ -33,67 +44,102 @@ def convert_blockmask(blockmask, causal):
     first_nonzero_col_per_row_after_sort = nonzero_unsorted_rowidx[
         torch.arange(nrow, device=blockmask.device), first_nonzero_col_per_row
     ]
-    nonzero_idx = nonzero_sorted_rowidx * 4
+    nonzero_idx = nonzero_sorted_rowidx * 8
+    if causal:
+        nonzero_idx[(col_idx * 256 + 255 > nonzero_sorted_rowidx * 16) & (nonzero_val != 0)] += 4
     nonzero_idx[last_nonzero_col_per_row_after_sort, last_nonzero_col_per_row] += 2
     nonzero_idx[first_nonzero_col_per_row_after_sort, first_nonzero_col_per_row] += 1
     nonzero_idx[nonzero_val == 0] = -1
     return nonzero_idx.T.contiguous().to(dtype=torch.int32)
 
 
-def _stream_blocksparse_attn_forward(qkv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale,
+# The converted blockmasks, keyed by (layout_key, device, nrow, ncol, causal).
+_blockmask_cache = {}
+
+
+def layout_key(layout):
+    """A key for the content of a 0-1 layout, so that the layers built from the same sparsity config
+    share their converted blockmasks in convert_blockmask_cached. Reads the layout on the host, so
+    it should be computed once (e.g. when the layout is made).
+    """
+    return (tuple(layout.shape), hashlib.sha1(layout.to(torch.uint8).cpu().numpy().tobytes()).hexdigest())
+
+
+def convert_blockmask_cached(layout, key, seqlen, causal):
+    """Convert the top-left (seqlen_rounded / 16, seqlen_rounded / 256) part of layout, where
+    seqlen_rounded is seqlen rounded up to 256, and reuse the result across layers and steps.
+    key: layout_key(layout). The layout must not be modified in place afterwards.
+    """
+    seqlen_rounded = ((seqlen + 256 - 1) // 256) * 256
+    nrow, ncol = seqlen_rounded // 16, seqlen_rounded // 256
+    assert nrow <= layout.shape[0] and ncol <= layout.shape[1]
+    cache_key = (key, layout.device, nrow, ncol, causal)
+    blockmask = _blockmask_cache.get(cache_key)
+    if blockmask is None:
+        blockmask = convert_blockmask(layout[:nrow, :ncol], causal=causal)
+        _blockmask_cache[cache_key] = blockmask
+    return blockmask
+
+
+def _stream_blocksparse_attn_forward(qkvv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale,
                                      causal, return_softmax):
-    context, softmax_lse, *rest = stream_attn_cuda.fwd_block(qkv, cu_seqlens, blockmask, dropout_p,
-                                                             max_s, softmax_scale, causal,
-                                                             return_softmax, None)
-    # if context.isnan().any() or softmax_lse.isnan().any():
+    """qkvv: list of Q, K, V_0, ..., V_{num_v - 1}, each (total, nheads, headdim)."""
+    num_v = len(qkvv) - 2
+    out = stream_attn_cuda.fwd_block(list(qkvv), cu_seqlens, blockmask, dropout_p, max_s,
+                                     softmax_scale, False, causal, return_softmax, None)
+    contexts, softmax_lse, rest = out[:num_v], out[num_v], out[num_v + 1:]
+    # if any(c.isnan().any() for c in contexts) or softmax_lse.isnan().any():
     #     breakpoint()
     S_dmask = rest[0] if return_softmax else None
-    return context, softmax_lse, S_dmask
+    return contexts, softmax_lse, S_dmask
 
 
-def _stream_blocksparse_attn_backward(dout, qkv, out, S_dmask, softmax_lse, cu_seqlens, blockmask,
+def _stream_blocksparse_attn_backward(douts, qkvv, outs, dqkvv, softmax_lse, cu_seqlens, blockmask,
                                       dropout_p, max_s, softmax_scale, causal):
-    dqkv, dp, softmax_d = stream_attn_cuda.bwd_block(dout, qkv, out, S_dmask, softmax_lse, cu_seqlens,
-                                                     blockmask, dropout_p, softmax_scale, max_s,
-                                                     causal, None)
-    # if dqkv.isnan().any() or softmax_d.isnan().any():
+    """dqkvv: list of dQ, dK, dV_0, ..., dV_{num_v - 1}, written in place."""
+    # The blocks that are skipped are not written, so the gradients have to start at zero.
+    softmax_d, = stream_attn_cuda.bwd_block([dout.contiguous() for dout in douts], list(qkvv),
+                                            list(outs), list(dqkvv), softmax_lse, cu_seqlens,
+                                            blockmask, dropout_p, softmax_scale, max_s, True,
+                                            causal, None)
+    # if any(d.isnan().any() for d in dqkvv) or softmax_d.isnan().any():
     #     breakpoint()
-    return dqkv
+    return dqkvv
 
 
 class StreamBlocksparseAttnFun(torch.autograd.Function):
 
     @staticmethod
-    def forward(ctx, qkv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal):
+    def forward(ctx, qkvv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal):
         # Save rng_state because the backward pass will regenerate the dropout mask
         rng_state = torch.cuda.get_rng_state() if dropout_p > 0 else None
         if softmax_scale is None:
-            softmax_scale = qkv.shape[-1] ** (-0.5)
-        context, softmax_lse, S_dmask = _stream_blocksparse_attn_forward(
-            qkv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal=causal,
+            softmax_scale = qkvv.shape[-1] ** (-0.5)
+        contexts, softmax_lse, _ = _stream_blocksparse_attn_forward(
+            qkvv.unbind(1), cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal=causal,
             return_softmax=False
         )
-        ctx.save_for_backward(qkv, context, S_dmask, softmax_lse, cu_seqlens, blockmask, rng_state)
+        ctx.save_for_backward(qkvv, softmax_lse, cu_seqlens, blockmask, rng_state, *contexts)
         ctx.dropout_p = dropout_p
         ctx.max_s = max_s
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
-        return context
+        return tuple(contexts)
 
     @staticmethod
-    def backward(ctx, dout):
-        qkv, context, S_dmask, softmax_lse, cu_seqlens, blockmask, rng_state = ctx.saved_tensors
+    def backward(ctx, *douts):
+        qkvv, softmax_lse, cu_seqlens, blockmask, rng_state, *contexts = ctx.saved_tensors
         if rng_state is not None:
             cur_rng_state = torch.cuda.get_rng_state()
             torch.cuda.set_rng_state(rng_state)
-        # S_dmask is None, temporarily use another tensor just to get it running
-        dqkv = _stream_blocksparse_attn_backward(
-            dout, qkv, context, context, softmax_lse, cu_seqlens, blockmask, ctx.dropout_p,
-            ctx.max_s, ctx.softmax_scale, ctx.causal
+        dqkvv = torch.empty_like(qkvv)
+        _stream_blocksparse_attn_backward(
+            douts, qkvv.unbind(1), contexts, dqkvv.unbind(1), softmax_lse, cu_seqlens, blockmask,
+            ctx.dropout_p, ctx.max_s, ctx.softmax_scale, ctx.causal
         )
         if rng_state is not None:
             torch.cuda.set_rng_state(cur_rng_state)
-        return dqkv, None, None, None, None, None, None, None
+        return dqkvv, None, None, None, None, None, None
 
 
 # We duplicate code to return both the output and the softmax for testing
@@ -101,42 +147,52 @@ class StreamBlocksparseAttnFun(torch.autograd.Function):
 class StreamBlocksparseAttnFunWithS(torch.autograd.Function):
 
     @staticmethod
-    def forward(ctx, qkv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal):
+    def forward(ctx, qkvv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal):
         # Save rng_state because the backward pass is gonna regenerate the dropout mask
         rng_state = torch.cuda.get_rng_state() if dropout_p > 0 else None
         if softmax_scale is None:
-            softmax_scale = qkv.shape[-1] ** (-0.5)
-        context, softmax_lse, S_dmask = _stream_blocksparse_attn_forward(
-            qkv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal=causal,
+            softmax_scale = qkvv.shape[-1] ** (-0.5)
+        contexts, softmax_lse, S_dmask = _stream_blocksparse_attn_forward(
+            qkvv.unbind(1), cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal=causal,
             return_softmax=True
         )
-        ctx.save_for_backward(qkv, context, S_dmask, softmax_lse, cu_seqlens, blockmask, rng_state)
+        ctx.save_for_backward(qkvv, softmax_lse, cu_seqlens, blockmask, rng_state, *contexts)
         ctx.dropout_p = dropout_p
         ctx.max_s = max_s
         ctx.softmax_scale = softmax_scale
         ctx.causal = causal
-        return context, S_dmask, softmax_lse
+        return (*contexts, S_dmask, softmax_lse)
 
     @staticmethod
-    def backward(ctx, dout, _dS_dmask_ignored, _dsoftmax_sum_ignored):
-        qkv, context, S_dmask, softmax_lse, cu_seqlens, blockmask, rng_state = ctx.saved_tensors
+    def backward(ctx, *grads):
+        # The last two grads are for S_dmask and softmax_lse, which are ignored.
+        douts = grads[:-2]
+        qkvv, softmax_lse, cu_seqlens, blockmask, rng_state, *contexts = ctx.saved_tensors
         if rng_state is not None:
             cur_rng_state = torch.cuda.get_rng_state()
             torch.cuda.set_rng_state(rng_state)
-        dqkv = _stream_blocksparse_attn_backward(
-            dout, qkv, context, S_dmask, softmax_lse, cu_seqlens, blockmask, ctx.dropout_p,
-            ctx.max_s, ctx.softmax_scale, ctx.causal
+        dqkvv = torch.empty_like(qkvv)
+        _stream_blocksparse_attn_backward(
+            douts, qkvv.unbind(1), contexts, dqkvv.unbind(1), softmax_lse, cu_seqlens, blockmask,
+            ctx.dropout_p, ctx.max_s, ctx.softmax_scale, ctx.causal
         )
         if rng_state is not None:
             torch.cuda.set_rng_state(cur_rng_state)
-        return dqkv, None, None, None, None, None, None
+        return dqkvv, None, None, None, None, None, None
 
 
-def stream_blocksparse_attn_func(qkv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale=None,
+def stream_blocksparse_attn_func(qkvv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale=None,
                                  causal=False, return_attn_probs=False, convert_mask=True):
-    """dropout_p should be set to 0.0 during evaluation
+    """qkvv: (total, 2 + num_v, nheads, headdim), packed Q, K, V_0, ..., V_{num_v - 1}, with
+    1 <= num_v <= 2 and headdim 16, 32 or 64. Returns a tuple of num_v outputs, all of which share
+    the same block-sparse softmax(Q K^T). With return_attn_probs=True, S_dmask and the softmax_lse
+    of shape (nheads, total) follow the outputs.
+    blockmask: (seqlen_rounded / 16, seqlen_rounded / 256) 0-1 tensor, or the result of
+    convert_blockmask with convert_mask=False, where seqlen_rounded is max_s rounded up to 256.
+    A converted blockmask must have been converted with the same causal.
+    dropout_p should be set to 0.0 during evaluation
     """
     func = StreamBlocksparseAttnFun if not return_attn_probs else StreamBlocksparseAttnFunWithS
     if convert_mask:
         blockmask = convert_blockmask(blockmask, causal=causal)
-    return func.apply(qkv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal)
+    return func.apply(qkvv, cu_seqlens, blockmask, dropout_p, max_s, softmax_scale, causal)
@@ -5,7 +5,7 @@ import torch.nn as nn
 from einops import rearrange
 
 from rotary import RotaryEmbedding, RotaryEmbedding2D
-from stream_attn_interface import stream_attn_func
+from stream_attn_interface import stream_attn_func, stream_attn_padded_func
 from bert_padding import unpad_input, pad_input, index_first_axis
 
 
@@ -38,7 +38,7 @@ class StreamingAttention(nn.Module):
         """
         assert not need_weights
         assert attn_mask is None
-        assert qkv.dtype == torch.float16
+        assert qkv.dtype in [torch.float16, torch.bfloat16]
         assert qkv.is_cuda
 
         if cu_seqlens is None:
@@ -54,16 +54,21 @@ class StreamingAttention(nn.Module):
                 output = rearrange(output, '(b s) ... -> b s ...', b=batch_size)
             else:
                 key_padding_mask_bool = key_padding_mask.bool_matrix
-                nheads = qkv.shape[-2]
-                x = rearrange(qkv, 'b s three h d -> b s (three h d)')
-                x_unpad, indices, cu_seqlens, max_s = unpad_input(x, key_padding_mask_bool)
-                x_unpad = rearrange(x_unpad, 'nnz (three h d) -> nnz three h d', three=3, h=nheads)
-                output_unpad = stream_attn_func(x_unpad, cu_seqlens,
-                                                self.dropout_p if self.training else 0.0,
-                                                max_s, softmax_scale=self.softmax_temp, causal=causal)
-                output = rearrange(pad_input(rearrange(output_unpad, 'nnz h d -> nnz (h d)'),
-                                            indices, batch_size, seqlen),
-                                'b s (h d) -> b s h d', h=nheads)
+                # nheads = qkv.shape[-2]
+                # x = rearrange(qkv, 'b s three h d -> b s (three h d)')
+                # x_unpad, indices, cu_seqlens, max_s = unpad_input(x, key_padding_mask_bool)
+                # x_unpad = rearrange(x_unpad, 'nnz (three h d) -> nnz three h d', three=3, h=nheads)
+                # output_unpad = stream_attn_func(x_unpad, cu_seqlens,
+                #                                 self.dropout_p if self.training else 0.0,
+                #                                 max_s, softmax_scale=self.softmax_temp, causal=causal)
+                # output = rearrange(pad_input(rearrange(output_unpad, 'nnz h d -> nnz (h d)'),
+                #                             indices, batch_size, seqlen),
+                #                 'b s (h d) -> b s h d', h=nheads)
+                # The kernel reads the padded qkv in place, the tokens of each sequence come first.
+                seqlens = key_padding_mask_bool.sum(-1, dtype=torch.int32)
+                output, = stream_attn_padded_func(qkv, seqlens,
+                                                  self.dropout_p if self.training else 0.0,
+                                                  softmax_scale=self.softmax_temp, causal=causal)
         else:
             assert max_s is not None
             output = stream_attn_func(qkv, cu_seqlens,
@@ -86,7 +91,8 @@ class StreamingMHA(nn.Module):
         self.num_heads = num_heads
         assert self.embed_dim % num_heads == 0, "self.kdim must be divisible by num_heads"
         self.head_dim = self.embed_dim // num_heads
-        assert self.head_dim in [16, 32, 64], "Only support head_dim == 16, 32, or 64"
+        assert self.head_dim % 8 == 0 and self.head_dim <= 128, \
+            "Only support head_dim a multiple of 8 and at most 128"
 
         assert use_rotary_emb in [None, '1d', '2d']
         self.use_rotary_emb = use_rotary_emb
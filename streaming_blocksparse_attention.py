@@ -8,6 +8,7 @@ import hydra
 
 from stream_blocksparse_attn_interface import stream_blocksparse_attn_func
 from stream_blocksparse_attn_interface import convert_blockmask
+from stream_blocksparse_attn_interface import convert_blockmask_cached, layout_key
 from bert_padding import unpad_input, pad_input, index_first_axis
 
 class StreamingBlocksparseAttention(nn.Module):
@@ -33,6 +34,8 @@ class StreamingBlocksparseAttention(nn.Module):
         self.register_buffer("layout", layout)
         blockmask_converted = convert_blockmask(self.layout, causal=False)
         self.register_buffer("blockmask_converted", blockmask_converted)
+        # The converted blockmasks for each seqlen are shared with the other layers of the same layout.
+        self.layout_key = layout_key(layout)
         # logger.info(f'Attention class {self.__class__}: saving={self.layout.float().mean()}')
 
     def forward(self, qkv, attn_mask=None, key_padding_mask=None, causal=False, cu_seqlens=None,
@@ -48,24 +51,22 @@ class StreamingBlocksparseAttention(nn.Module):
         """
         assert not need_weights
         assert attn_mask is None
-        assert qkv.dtype == torch.float16
+        assert qkv.dtype in [torch.float16, torch.bfloat16]
         assert qkv.is_cuda
 
         if cu_seqlens is None:
             batch_size = qkv.shape[0]
             seqlen = qkv.shape[1]
             # Convert mask to take a subset
-            seqlen_rounded = ((seqlen + 256 - 1) // 256) * 256
-            assert seqlen_rounded // 16 <= self.layout.shape[0], seqlen_rounded // 256 <= self.layout.shape[1]
-            blockmask = self.layout[:seqlen_rounded // 16, :seqlen_rounded // 256]
+            blockmask = convert_blockmask_cached(self.layout, self.layout_key, seqlen, causal)
             if key_padding_mask is None:
                 qkv = rearrange(qkv, 'b s ... -> (b s) ...')
                 max_s = seqlen
                 cu_seqlens = torch.arange(0, (batch_size + 1) * seqlen, step=seqlen, dtype=torch.int32,
                                         device=qkv.device)
-                output = stream_blocksparse_attn_func(
+                output, = stream_blocksparse_attn_func(
                     qkv, cu_seqlens, blockmask, self.dropout_p if self.training else 0.0,
-                    max_s, softmax_scale=self.softmax_temp, causal=causal
+                    max_s, softmax_scale=self.softmax_temp, causal=causal, convert_mask=False
                 )
                 output = rearrange(output, '(b s) ... -> b s ...', b=batch_size)
             else:
@@ -74,9 +75,9 @@ class StreamingBlocksparseAttention(nn.Module):
                 x = rearrange(qkv, 'b s three h d -> b s (three h d)')
                 x_unpad, indices, cu_seqlens, max_s = unpad_input(x, key_padding_mask_bool)
                 x_unpad = rearrange(x_unpad, 'nnz (three h d) -> nnz three h d', three=3, h=nheads)
-                output_unpad = stream_blocksparse_attn_func(
+                output_unpad, = stream_blocksparse_attn_func(
                     x_unpad, cu_seqlens, blockmask, self.dropout_p if self.training else 0.0,
-                    max_s, softmax_scale=self.softmax_temp, causal=causal
+                    max_s, softmax_scale=self.softmax_temp, causal=causal, convert_mask=False
                 )
                 output = rearrange(pad_input(rearrange(output_unpad, 'nnz h d -> nnz (h d)'),
                                             indices, batch_size, seqlen),
@@ -84,17 +85,15 @@ class StreamingBlocksparseAttention(nn.Module):
         else:
             assert max_s is not None
             seqlen = max_s
-            # Convert mask to take a subset
-            seqlen_rounded = ((seqlen + 256 - 1) // 256) * 256
-            assert seqlen_rounded // 16 <= self.layout.shape[0], seqlen_rounded // 256 <= self.layout.shape[1]
-            blockmask = self.layout[:seqlen_rounded // 16, :seqlen_rounded // 256]
-            if convert_mask:
-                output = stream_blocksparse_attn_func(
+            # The precomputed blockmask_converted is only for causal=False.
+            if convert_mask or causal:
+                blockmask = convert_blockmask_cached(self.layout, self.layout_key, seqlen, causal)
+                output, = stream_blocksparse_attn_func(
                     qkv, cu_seqlens, blockmask, self.dropout_p if self.training else 0.0,
-                    max_s, softmax_scale=self.softmax_temp, causal=causal
+                    max_s, softmax_scale=self.softmax_temp, causal=causal, convert_mask=False
                 )
             else:
-                output = stream_blocksparse_attn_func(
+                output, = stream_blocksparse_attn_func(
                     qkv, cu_seqlens, self.blockmask_converted, self.dropout_p if self.training else 0.0,
                     max_s, softmax_scale=self.softmax_temp, causal=causal,
                     convert_mask=False,
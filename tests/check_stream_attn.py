@@ -0,0 +1,449 @@
+"""Correctness checks of the kernels against a PyTorch reference.
+
+    python tests/check_stream_attn.py --headdim 64 128 --dtype fp16
+
+Each check prints one JSON line with the largest errors and whether it passes: within twice the
+error of the same computation in fp16 / bf16 with PyTorch, both measured against the reference in
+fp32, unless the check says otherwise. The exit status is 1 if a check fails.
+"""
+
+import argparse
+import contextlib
+import itertools
+import json
+import os
+import sys
+
+import torch
+import torch.nn.functional as F
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+
+def cu_seqlens_of(seqlens, device='cuda'):
+    cu_seqlens = torch.zeros(len(seqlens) + 1, device=device, dtype=torch.int32)
+    cu_seqlens[1:] = torch.cumsum(torch.tensor(seqlens, device=device, dtype=torch.int32), 0)
+    return cu_seqlens
+
+
+def attention_ref(q, k, vs, window_size=(-1, -1), keep=None, dropout_p=0.0, upcast=True):
+    """The reference for one sequence, q: (seqlen_q, nheads, headdim), k and each V_i of vs:
+    (seqlen_k, nheads, headdim). Query i sees the keys i - left, ..., i + right as in
+    fmha/mask.h, the queries without keys get 0. keep: (nheads, seqlen_q, seqlen_k), the
+    probabilities kept by the dropout. Returns the outputs and the softmax before the dropout."""
+    dtype = q.dtype
+    if upcast:
+        q, k, vs = q.float(), k.float(), [v.float() for v in vs]
+    scores = torch.einsum('thd,shd->hts', q * q.shape[-1] ** (-0.5), k)
+    rows = torch.arange(q.shape[0], device=q.device)[:, None]
+    cols = torch.arange(k.shape[0], device=q.device)[None, :]
+    visible = torch.ones(q.shape[0], k.shape[0], dtype=torch.bool, device=q.device)
+    if window_size[0] >= 0:
+        visible &= cols >= rows - window_size[0]
+    if window_size[1] >= 0:
+        visible &= cols <= rows + window_size[1]
+    # A finite fill, the rows without keys would be NaNs and their gradients too.
+    scores = scores.masked_fill(~visible, torch.finfo(scores.dtype).min)
+    attn = torch.softmax(scores, dim=-1).masked_fill(~visible, 0.0).to(vs[0].dtype)
+    attn_drop = attn if keep is None else attn.masked_fill(~keep, 0.0) / (1 - dropout_p)
+    outs = [torch.einsum('hts,shd->thd', attn_drop, v).to(dtype) for v in vs]
+    return outs, attn
+
+
+def attention_ref_varlen(q, k, vs, seqlens_q, seqlens_k, keeps=None, **kwargs):
+    """attention_ref of each sequence of the packed q, k and vs, the outputs are packed again."""
+    cu_q, cu_k = [0, *itertools.accumulate(seqlens_q)], [0, *itertools.accumulate(seqlens_k)]
+    outs, attns = [], []
+    for b in range(len(seqlens_q)):
+        o, a = attention_ref(q[cu_q[b]:cu_q[b + 1]], k[cu_k[b]:cu_k[b + 1]],
+                             [v[cu_k[b]:cu_k[b + 1]] for v in vs],
+                             keep=None if keeps is None else keeps[b], **kwargs)
+        outs.append(o)
+        attns.append(a)
+    return [torch.cat(o) for o in zip(*outs)], attns
+
+
+def max_error(out, out_ref, out_pt):
+    """The error of the kernel and whether it is within twice that of PyTorch in fp16 / bf16."""
+    err = (out.float() - out_ref.float()).abs().max().item()
+    err_pt = (out_pt.float() - out_ref.float()).abs().max().item()
+    return err, err <= 2 * err_pt + 1e-5
+
+
+
+def max_diff(a, b):
+    """The largest difference of two results, the equal entries (e.g. two -inf) count as 0."""
+    diff = (a.float() - b.float()).abs()
+    return diff.masked_fill(a == b, 0.0).max().item()
+
+
+@contextlib.contextmanager
+def env_var(name, value):
+    old = os.environ.get(name)
+    os.environ[name] = value
+    try:
+        yield
+    finally:
+        if old is None:
+            del os.environ[name]
+        else:
+            os.environ[name] = old
+
+
+def dropout_keep_masks(fwd, q, k, num_v, seqlens_q, seqlens_k, rng_state):
+    """The masks (nheads, seqlen_q, seqlen_k) of the probabilities kept by the dropout of
+    fwd(vs) for the RNG state rng_state, one per sequence. Instead of decoding the layout of
+    S_dmask, the values are one-hot rows: the outputs are then the columns of the softmax after the
+    dropout, headdim * num_v keys per call."""
+    total_k, nheads, headdim = k.shape
+    keys = torch.cat([torch.arange(s, device=k.device) for s in seqlens_k])
+    cu_q = [0, *itertools.accumulate(seqlens_q)]
+    dropped = [torch.zeros(nheads, sq, sk, device=q.device) for sq, sk in zip(seqlens_q, seqlens_k)]
+    for start in range(0, max(seqlens_k), headdim * num_v):
+        begins = [start + vi * headdim for vi in range(num_v)]
+        vs = []
+        for begin in begins:
+            col = keys - begin
+            onehot = F.one_hot(col.clamp(0, headdim - 1), headdim)
+            onehot *= ((col >= 0) & (col < headdim))[:, None]
+            vs.append(onehot[:, None].expand(total_k, nheads, headdim).to(q.dtype).contiguous())
+        torch.cuda.set_rng_state(rng_state)
+        outs = fwd(vs)
+        for b, sk in enumerate(seqlens_k):
+            for out, begin in zip(outs, begins):
+                if begin < sk:
+                    end = min(begin + headdim, sk)
+                    dropped[b][:, :, begin:end] = (
+                        out[cu_q[b]:cu_q[b + 1], :, :end - begin].permute(1, 0, 2).float())
+    return [d > 0 for d in dropped]
+
+
+def check_window_dropout(args, dtype, headdim):
+    """Sliding windows with dropout, fwd and bwd, through the fwd paths: the multiple K/V blocks
+    in the CTA (kv_inner), its persistent version for the variable-length batches, and the loop
+    over the K/V blocks of return_softmax (kv_outer). All of them and the bwd have to drop the
+    same probabilities, and the bwd writes dQ after the last K/V block of the band of each query
+    block. The windows narrower than a block leave rows of the tiles without keys, and keys
+    shorter than the queries whole queries, which have to stay 0 instead of NaN. The dropout mask
+    of kv_inner is read with dropout_keep_masks."""
+    from stream_attn_interface import _stream_attn_backward, _stream_attn_forward
+
+    dropout_p, num_v, nheads = 0.17, args.num_v, args.nheads
+    for seqlens_q, seqlens_k, window_size in [([1024], [1024], (8, 0)),
+                                              ([1024, 777], [1024, 777], (40, 24)),
+                                              ([1024, 777], [1024, 777], (-1, 0)),
+                                              ([1024, 500], [600, 333], (8, 0))]:
+        q = torch.randn(sum(seqlens_q), nheads, headdim, device='cuda', dtype=dtype)
+        k = torch.randn(sum(seqlens_k), nheads, headdim, device='cuda', dtype=dtype)
+        vs = [torch.randn_like(k) for _ in range(num_v)]
+        douts = [torch.randn_like(q) for _ in range(num_v)]
+        cu_q, cu_k = cu_seqlens_of(seqlens_q), cu_seqlens_of(seqlens_k)
+        max_q, max_k, scale = max(seqlens_q), max(seqlens_k), headdim ** (-0.5)
+        rng_state = torch.cuda.get_rng_state()
+
+        def fwd(vs, return_softmax=False):
+            torch.cuda.set_rng_state(rng_state)
+            return _stream_attn_forward([q, k, *vs], cu_q, cu_k, dropout_p, max_q, max_k, scale,
+                                        causal=False, return_softmax=return_softmax,
+                                        window_size=window_size)[:2]
+
+        with env_var('STREAM_ATTN_PERSISTENT', '0'):
+            keeps = dropout_keep_masks(lambda vs: fwd(vs)[0], q, k, num_v, seqlens_q, seqlens_k,
+                                       rng_state)
+        ref_inputs = [t.detach().clone().requires_grad_() for t in (q, k, *vs)]
+        pt_inputs = [t.detach().clone().requires_grad_() for t in (q, k, *vs)]
+        outs_ref, attns = attention_ref_varlen(*ref_inputs[:2], ref_inputs[2:], seqlens_q,
+                                               seqlens_k, keeps, window_size=window_size,
+                                               dropout_p=dropout_p)
+        outs_pt, _ = attention_ref_varlen(*pt_inputs[:2], pt_inputs[2:], seqlens_q, seqlens_k,
+                                          keeps, window_size=window_size, dropout_p=dropout_p,
+                                          upcast=False)
+        grads_ref = torch.autograd.grad(outs_ref, ref_inputs, douts)
+        grads_pt = torch.autograd.grad(outs_pt, pt_inputs, douts)
+        kept = sum(keep[attn > 0].sum().item() for keep, attn in zip(keeps, attns))
+        keep_rate = kept / sum((attn > 0).sum().item() for attn in attns)
+
+        for path in ['kv_inner', 'persistent', 'kv_outer']:
+            # The persistent kernel only runs the batches of several sequences.
+            if path == 'persistent' and len(seqlens_q) == 1:
+                continue
+            result = {'check': 'window_dropout', 'path': path, 'dtype': args.dtype,
+                      'seqlens_q': seqlens_q, 'seqlens_k': seqlens_k, 'nheads': nheads,
+                      'headdim': headdim, 'num_v': num_v, 'window_size': window_size,
+                      'dropout_p': dropout_p, 'keep_rate': keep_rate}
+            with env_var('STREAM_ATTN_PERSISTENT', '0' if path == 'kv_inner' else '1'):
+                outs, lse = fwd(vs, return_softmax=path == 'kv_outer')
+            errors = [max_error(o, o_ref, o_pt) for o, o_ref, o_pt in zip(outs, outs_ref, outs_pt)]
+            result['max_diff'] = {'out': max(e for e, _ in errors)}
+            passed = all(p for _, p in errors) and abs(keep_rate - (1 - dropout_p)) < 0.01
+            if path == 'kv_inner':
+                dqkvv = [torch.empty_like(t) for t in (q, k, *vs)]
+                torch.cuda.set_rng_state(rng_state)
+                _stream_attn_backward(douts, [q, k, *vs], outs, dqkvv, lse, cu_q, cu_k, dropout_p,
+                                      max_q, max_k, scale, False, window_size)
+                for name, d, d_ref, d_pt in zip(['dq', 'dk'] + [f'dv{i}' for i in range(num_v)],
+                                                dqkvv, grads_ref, grads_pt):
+                    err, ok = max_error(d, d_ref, d_pt)
+                    result['max_diff'][name] = err
+                    passed = passed and ok
+            result['passed'] = passed
+            yield result
+
+
+def check_persistent(args, dtype, headdim):
+    """The persistent fwd (STREAM_ATTN_PERSISTENT=1) against the grid launch (=0) on a skewed
+    variable-length batch, with dropout and causal. Both run the same kv_inner tiles and place the
+    dropout masks of each query block directly, so the outputs, the softmax_lse and the gradients
+    of the bwd from them have to be the same, bit for bit."""
+    from stream_attn_interface import _stream_attn_backward, _stream_attn_forward
+
+    dropout_p, num_v, nheads = 0.17, args.num_v, args.nheads
+    seqlens = [2048, 1500, 700, 129, 17, 1]
+    max_s, scale = max(seqlens), headdim ** (-0.5)
+    cu_seqlens = cu_seqlens_of(seqlens)
+    names = ([f'out{i}' for i in range(num_v)] + ['lse', 'dq', 'dk']
+             + [f'dv{i}' for i in range(num_v)])
+    for causal in [False, True]:
+        q, k = [torch.randn(sum(seqlens), nheads, headdim, device='cuda', dtype=dtype)
+                for _ in range(2)]
+        vs = [torch.randn_like(k) for _ in range(num_v)]
+        douts = [torch.randn_like(q) for _ in range(num_v)]
+        rng_state = torch.cuda.get_rng_state()
+        results = []
+        for persistent in ['0', '1']:
+            with env_var('STREAM_ATTN_PERSISTENT', persistent):
+                torch.cuda.set_rng_state(rng_state)
+                outs, lse, _ = _stream_attn_forward(
+                    [q, k, *vs], cu_seqlens, cu_seqlens, dropout_p, max_s, max_s, scale,
+                    causal=causal, return_softmax=False)
+            dqkvv = [torch.empty_like(t) for t in (q, k, *vs)]
+            torch.cuda.set_rng_state(rng_state)
+            _stream_attn_backward(douts, [q, k, *vs], outs, dqkvv, lse, cu_seqlens, cu_seqlens,
+                                  dropout_p, max_s, max_s, scale, causal)
+            results.append([*outs, lse, *dqkvv])
+        diffs = {name: max_diff(a, b) for name, a, b in zip(names, *results)}
+        yield {'check': 'persistent', 'dtype': args.dtype, 'seqlens': seqlens, 'nheads': nheads,
+               'headdim': headdim, 'num_v': num_v, 'causal': causal, 'dropout_p': dropout_p,
+               'max_diff': diffs, 'passed': all(d == 0 for d in diffs.values())}
+
+
+def check_merge(args, dtype, headdim):
+    """Split-K: the partials of stream_attn_partial_func over the two halves of the keys, merged by
+    stream_attn_merge_ into the type of the inputs or into fp32, against a single pass over all the
+    keys. The second sequence has no keys in the first half, a partial of 0 and -inf."""
+    from stream_attn_interface import stream_attn_merge_, stream_attn_partial_func
+
+    num_v, nheads = args.num_v, args.nheads
+    seqlens_q, seqlens_k = [512, 64], [1024, 1]
+    q = torch.randn(sum(seqlens_q), nheads, headdim, device='cuda', dtype=dtype)
+    k = torch.randn(sum(seqlens_k), nheads, headdim, device='cuda', dtype=dtype)
+    vs = [torch.randn_like(k) for _ in range(num_v)]
+    cu_q, cu_k = cu_seqlens_of(seqlens_q), [0, *itertools.accumulate(seqlens_k)]
+    max_q = max(seqlens_q)
+    split = [sk // 2 for sk in seqlens_k]
+    partials = []
+    for begins, ends in [([0] * len(seqlens_k), split), (split, seqlens_k)]:
+        rows = torch.cat([torch.arange(cu_k[b] + begin, cu_k[b] + end, device='cuda')
+                          for b, (begin, end) in enumerate(zip(begins, ends))])
+        lens = [end - begin for begin, end in zip(begins, ends)]
+        partials.append(stream_attn_partial_func(q, k[rows], [v[rows] for v in vs], cu_q,
+                                                 cu_seqlens_of(lens), max_q, max(lens)))
+    outs_single, lse_single = stream_attn_partial_func(q, k, vs, cu_q, cu_seqlens_of(seqlens_k),
+                                                       max_q, max(seqlens_k))
+
+    outs_ref, _ = attention_ref_varlen(q, k, vs, seqlens_q, seqlens_k)
+    outs_pt, _ = attention_ref_varlen(q, k, vs, seqlens_q, seqlens_k, upcast=False)
+    cu_q_list = [0, *itertools.accumulate(seqlens_q)]
+    lse_ref = torch.cat([torch.logsumexp(torch.einsum(
+        'thd,shd->hts', q[cu_q_list[b]:cu_q_list[b + 1]].float() * headdim ** (-0.5),
+        k[cu_k[b]:cu_k[b + 1]].float()), dim=-1) for b in range(len(seqlens_q))], dim=1)
+    lse_err_single = (lse_single - lse_ref).abs().max().item()
+
+    for accum in [dtype, torch.float32]:
+        # The merge is in place, into copies of the first partial.
+        outs = [tuple(o.to(accum, copy=True) for o in partials[0][0]), partials[1][0]]
+        merged, merged_lse = stream_attn_merge_(outs, [partials[0][1].clone(), partials[1][1]])
+        errors = [max_error(o, o_ref, o_pt) for o, o_ref, o_pt in zip(merged, outs_ref, outs_pt)]
+        lse_err = (merged_lse - lse_ref).abs().max().item()
+        yield {'check': 'merge', 'accum': str(accum).split('.')[-1], 'dtype': args.dtype,
+               'seqlens_q': seqlens_q, 'seqlens_k': seqlens_k, 'nheads': nheads,
+               'headdim': headdim, 'num_v': num_v,
+               'max_diff': {'out': max(e for e, _ in errors), 'lse': lse_err,
+                            'out_vs_single': max(max_diff(o, o_single)
+                                                 for o, o_single in zip(merged, outs_single))},
+               'passed': all(p for _, p in errors) and lse_err <= 2 * lse_err_single + 1e-4}
+
+
+def check_softmax_stats(args, dtype, headdim):
+    """The entropy and the largest probability of the rows of the softmax of return_softmax_stats
+    against the softmax computed by PyTorch, with the windows and with queries without keys."""
+    from stream_attn_interface import _stream_attn_forward
+
+    num_v, nheads = args.num_v, args.nheads
+    for seqlens_q, seqlens_k, window_size in [([1024, 777], [1024, 777], (-1, -1)),
+                                              ([1024, 777], [1024, 777], (-1, 0)),
+                                              ([1024, 300], [1024, 200], (40, 24))]:
+        q = torch.randn(sum(seqlens_q), nheads, headdim, device='cuda', dtype=dtype)
+        k = torch.randn(sum(seqlens_k), nheads, headdim, device='cuda', dtype=dtype)
+        vs = [torch.randn_like(k) for _ in range(num_v)]
+        _, _, stats = _stream_attn_forward(
+            [q, k, *vs], cu_seqlens_of(seqlens_q), cu_seqlens_of(seqlens_k), 0.0, max(seqlens_q),
+            max(seqlens_k), headdim ** (-0.5), causal=False, return_softmax=False,
+            window_size=window_size, return_softmax_stats=True)
+
+        def stats_of(attns):
+            attns = [a.float() for a in attns]
+            return torch.stack([torch.cat([torch.special.entr(a).sum(-1) for a in attns], dim=1),
+                                torch.cat([a.amax(-1) for a in attns], dim=1)])
+
+        _, attns_ref = attention_ref_varlen(q, k, vs, seqlens_q, seqlens_k, window_size=window_size)
+        _, attns_pt = attention_ref_varlen(q, k, vs, seqlens_q, seqlens_k, window_size=window_size,
+                                           upcast=False)
+        stats_ref, stats_pt = stats_of(attns_ref), stats_of(attns_pt)
+        errors = [max_error(stats[i], stats_ref[i], stats_pt[i]) for i in range(2)]
+        yield {'check': 'softmax_stats', 'dtype': args.dtype, 'seqlens_q': seqlens_q,
+               'seqlens_k': seqlens_k, 'nheads': nheads, 'headdim': headdim, 'num_v': num_v,
+               'window_size': window_size,
+               'max_diff': {'entropy': errors[0][0], 'max_prob': errors[1][0]},
+               'passed': errors[0][1] and errors[1][1]}
+
+
+def check_quantized_decode(args, dtype, headdim):
+    """stream_attn_decode_func on an int8 or fp8 e4m3 paged cache, with a scale per block or per
+    head, against the attention of the query over the dequantized cache."""
+    from stream_attn_interface import stream_attn_decode_func
+
+    num_v, nheads, page_size = args.num_v, args.nheads, 16
+    seqlens_k = [1000, 517, 1, 64]
+    batch_size, max_k = len(seqlens_k), max(seqlens_k)
+    max_blocks = (max_k + page_size - 1) // page_size
+    num_blocks = batch_size * max_blocks
+    # The blocks of the sequences are scattered over the cache.
+    block_table = torch.randperm(num_blocks, device='cuda', dtype=torch.int32).view(batch_size, -1)
+    seqlens_k_t = torch.tensor(seqlens_k, device='cuda', dtype=torch.int32)
+    q = torch.randn(batch_size, nheads, headdim, device='cuda', dtype=dtype)
+    kvv = torch.randn(num_blocks, page_size, 1 + num_v, nheads, headdim, device='cuda')
+
+    formats = [('int8', torch.int8, 127.0)]
+    if hasattr(torch, 'float8_e4m3fn'):
+        formats.append(('fp8_e4m3', torch.float8_e4m3fn, 448.0))
+    for (name, qdtype, qmax), per_block in itertools.product(formats, [True, False]):
+        amax = kvv.abs().amax(dim=(1, 4)) if per_block else kvv.abs().amax(dim=(0, 1, 4))
+        kvv_scales = (amax / qmax).contiguous()
+        scales = kvv_scales[:, None, ..., None] if per_block else kvv_scales[None, None, ..., None]
+        kvv_q = kvv / scales
+        if qdtype == torch.int8:
+            kvv_q = kvv_q.round().clamp(-qmax, qmax)
+        kvv_q = kvv_q.to(qdtype)
+        kvv_deq = kvv_q.float() * scales
+        outs, _ = stream_attn_decode_func(q, kvv_q, block_table, seqlens_k_t, max_k,
+                                          kvv_scales=kvv_scales)
+
+        outs_ref, outs_pt = [], []
+        for b, sk in enumerate(seqlens_k):
+            pos = torch.arange(sk, device='cuda')
+            kvv_seq = kvv_deq[block_table[b, pos // page_size].long(), pos % page_size]
+            for upcast, results in [(True, outs_ref), (False, outs_pt)]:
+                kvv_b = kvv_seq if upcast else kvv_seq.to(dtype)
+                o, _ = attention_ref(q[b][None], kvv_b[:, 0], kvv_b[:, 1:].unbind(1), upcast=upcast)
+                results.append(o)
+        errors = [max_error(outs[vi], torch.cat([o[vi] for o in outs_ref]),
+                            torch.cat([o[vi] for o in outs_pt])) for vi in range(num_v)]
+        yield {'check': 'quantized_decode', 'format': name,
+               'scales': 'per_block' if per_block else 'per_head', 'dtype': args.dtype,
+               'seqlens_k': seqlens_k, 'page_size': page_size, 'nheads': nheads,
+               'headdim': headdim, 'num_v': num_v,
+               'max_diff': {'out': max(e for e, _ in errors)},
+               'passed': all(p for _, p in errors)}
+
+
+def check_grouped(args, dtype, headdim):
+    """stream_attn_grouped_func on problems with different numbers of heads, batches and lengths
+    against one fwd per problem and the reference. The few (batch, head) pairs are split over
+    several CTAs, and the last problem is shorter than 16 query rows per split, so it gets fewer
+    splits than the others and some of its CTAs have no query block."""
+    from stream_attn_interface import _stream_attn_forward, stream_attn_grouped_func
+
+    num_v = args.num_v
+    problems = [(4, [300, 129], [512, 77]), (2, [1000, 64, 513], [1000, 64, 513]),
+                (6, [40, 7], [700, 33])]
+    for causal in [False, True]:
+        inputs = []
+        for nheads, seqlens_q, seqlens_k in problems:
+            q = torch.randn(sum(seqlens_q), nheads, headdim, device='cuda', dtype=dtype)
+            k = torch.randn(sum(seqlens_k), nheads, headdim, device='cuda', dtype=dtype)
+            inputs.append((q, k, [torch.randn_like(k) for _ in range(num_v)],
+                           cu_seqlens_of(seqlens_q), cu_seqlens_of(seqlens_k)))
+        grouped = stream_attn_grouped_func(
+            [i[0] for i in inputs], [i[1] for i in inputs], [i[2] for i in inputs],
+            [i[3] for i in inputs], [i[4] for i in inputs], [max(p[1]) for p in problems],
+            [max(p[2]) for p in problems], causal=causal)
+        for g, ((nheads, seqlens_q, seqlens_k), (q, k, vs, cu_q, cu_k)) in enumerate(
+                zip(problems, inputs)):
+            outs, lse = grouped[g]
+            outs_fwd, lse_fwd, _ = _stream_attn_forward(
+                [q, k, *vs], cu_q, cu_k, 0.0, max(seqlens_q), max(seqlens_k), headdim ** (-0.5),
+                causal=causal, return_softmax=False)
+            window_size = (-1, 0) if causal else (-1, -1)
+            outs_ref, _ = attention_ref_varlen(q, k, vs, seqlens_q, seqlens_k,
+                                               window_size=window_size)
+            outs_pt, _ = attention_ref_varlen(q, k, vs, seqlens_q, seqlens_k,
+                                              window_size=window_size, upcast=False)
+            errors = [max_error(o, o_ref, o_pt) for o, o_ref, o_pt in zip(outs, outs_ref, outs_pt)]
+            # The fwd of short keys can take another path than the kv_inner tiles of the grouped
+            # kernel, so it only has to agree within the same tolerance.
+            tolerance = max(max_diff(o_pt, o_ref) for o_pt, o_ref in zip(outs_pt, outs_ref))
+            out_vs_fwd = max(max_diff(o, o_fwd) for o, o_fwd in zip(outs, outs_fwd))
+            lse_vs_fwd = max_diff(lse, lse_fwd)
+            yield {'check': 'grouped', 'problem': g, 'dtype': args.dtype, 'seqlens_q': seqlens_q,
+                   'seqlens_k': seqlens_k, 'nheads': nheads, 'headdim': headdim, 'num_v': num_v,
+                   'causal': causal,
+                   'max_diff': {'out': max(e for e, _ in errors), 'out_vs_fwd': out_vs_fwd,
+                                'lse_vs_fwd': lse_vs_fwd},
+                   'passed': (all(p for _, p in errors) and out_vs_fwd <= 2 * tolerance + 1e-5
+                              and lse_vs_fwd < 1e-3)}
+
+
+# Each check yields the JSON results for a type and a head dimension.
+CHECKS = [check_window_dropout,
+          check_persistent,
+          check_merge,
+          check_softmax_stats,
+          check_quantized_decode,
+          check_grouped]
+
+
+def run_checks(args, checks):
+    dtype = torch.bfloat16 if args.dtype == 'bf16' else torch.float16
+    for check, headdim in itertools.product(checks, args.headdim):
+        try:
+            yield from check(args, dtype, headdim)
+        except (RuntimeError, AssertionError) as e:
+            # E.g. the features not built, see setup.py.
+            yield {'check': check.__name__[len('check_'):], 'dtype': args.dtype,
+                   'headdim': headdim, 'error': str(e).split('\n')[0], 'passed': False}
+            torch.cuda.empty_cache()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--check', nargs='+', default=None,
+                        choices=[c.__name__[len('check_'):] for c in CHECKS],
+                        help='the checks to run, all of them by default')
+    parser.add_argument('--headdim', nargs='+', type=int, default=[64, 128])
+    parser.add_argument('--nheads', type=int, default=8)
+    parser.add_argument('--num-v', type=int, default=2)
+    parser.add_argument('--dtype', default='fp16', choices=['fp16', 'bf16'])
+    args = parser.parse_args()
+
+    checks = [c for c in CHECKS if args.check is None or c.__name__[len('check_'):] in args.check]
+    torch.manual_seed(0)
+    passed = True
+    for result in run_checks(args, checks):
+        print(json.dumps(result), flush=True)
+        passed = passed and result['passed']
+    sys.exit(0 if passed else 1)
+
+
+if __name__ == '__main__':
+    main()